@@ -27,6 +27,7 @@
 #include "FP.h"
 #include "MQTTPacket.h"
 #include <stdio.h>
+#include <string.h>
 #include "MQTTLogging.h"
 
 #if !defined(MQTTCLIENT_QOS1)
@@ -35,6 +36,15 @@
 #if !defined(MQTTCLIENT_QOS2)
     #define MQTTCLIENT_QOS2 0
 #endif
+#if !defined(MAX_TOPIC_ALIASES)
+    #define MAX_TOPIC_ALIASES 10
+#endif
+#if !defined(MAX_TOPIC_ALIAS_LEN)
+    #define MAX_TOPIC_ALIAS_LEN 64
+#endif
+#if !defined(MAX_PREPARED_TOPIC_LEN)
+    #define MAX_PREPARED_TOPIC_LEN 128
+#endif
 
 namespace MQTT
 {
@@ -67,6 +77,48 @@ struct MessageData
 };
 
 
+/**
+ * @class NoRouter
+ * @brief the Client's router when it has none, which takes nothing.  MQTTRouter.h has the others
+ */
+class NoRouter
+{
+public:
+    bool dispatch(MQTTString&, Message&)
+    {
+        return false;
+    }
+};
+
+
+// whether a topic name of len bytes, which needn't be NUL terminated, matches a topic filter
+// # can only be at end
+// + and # can only be next to separator
+inline bool topicMatches(const char* filter, const char* topic, int len)
+{
+    const char* end = topic + len;
+
+    while (*filter && topic < end)
+    {
+        if (*topic == '/' && *filter != '/')
+            break;
+        if (*filter != '+' && *filter != '#' && *filter != *topic)
+            break;
+        if (*filter == '+')
+        {   // skip until we meet the next separator, or end of string
+            while (topic + 1 < end && topic[1] != '/')
+                topic++;
+        }
+        else if (*filter == '#')
+            topic = end - 1;    // skip until end of string
+        filter++;
+        topic++;
+    }
+
+    return (topic == end) && (*filter == '\0');
+}
+
+
 struct connackData
 {
     int rc;
@@ -93,22 +145,331 @@ public:
         return next = (next == MAX_PACKET_ID) ? 1 : next + 1;
     }
 
+    int get()
+    {
+        return next;
+    }
+
+    void set(int value)
+    {
+        next = (value < 0 || value > MAX_PACKET_ID) ? 0 : value;
+    }
+
 private:
     static const int MAX_PACKET_ID = 65535;
     int next;
 };
 
 
+/**
+ * @class PreparedTopic
+ * @brief a topic name encoded once, for publishing to over and over
+ *
+ * A publish to a PreparedTopic copies the encoded topic into the packet as it is, and only works out
+ * the header flags, remaining length and packet id, rather than measuring and encoding the name
+ * each time.
+ */
+class PreparedTopic
+{
+public:
+    PreparedTopic()
+    {
+        set("");
+    }
+
+    /** Encode the topic name
+     *  @return false if it is longer than MAX_PREPARED_TOPIC_LEN, and the topic is left empty
+     */
+    bool set(const char* topicName)
+    {
+        size_t len = strlen(topicName);
+        bool fits = len <= MAX_PREPARED_TOPIC_LEN;
+
+        if (!fits)
+            len = 0;
+        encoded[0] = (unsigned char)(len >> 8);
+        encoded[1] = (unsigned char)(len & 0xFF);
+        memcpy(&encoded[2], topicName, len);
+        encoded[2 + len] = '\0';
+        return fits;
+    }
+
+    const char* name() const
+    {
+        return (const char*)&encoded[2];
+    }
+
+    /** Serialize a publish to this topic
+     *  @param mqttVersion - 5 to write the properties, with alias as the topic alias if it isn't 0
+     *  @param aliasKnown - the server already has the alias, so the topic name is left out
+     *  @return the length of the packet, or MQTTPACKET_BUFFER_TOO_SHORT
+     */
+    int serialize(unsigned char* buf, int buflen, enum QoS qos, bool retained, unsigned short id,
+        const void* payload, size_t payloadlen, int mqttVersion = 4, unsigned short alias = 0, bool aliasKnown = false) const
+    {
+        int topiclen = aliasKnown ? 2 : 2 + (encoded[0] << 8) + encoded[1];
+        int proplen = (mqttVersion != 5) ? 0 : (alias != 0) ? 4 : 1;
+        int rem_len = topiclen + ((qos > QOS0) ? 2 : 0) + proplen + (int)payloadlen;
+        unsigned char* ptr = buf;
+        MQTTHeader header = {0};
+
+        if (MQTTPacket_len(rem_len) > buflen)
+            return MQTTPACKET_BUFFER_TOO_SHORT;
+
+        header.bits.type = PUBLISH;
+        header.bits.qos = qos;
+        header.bits.retain = retained;
+        *ptr++ = header.byte;
+        ptr += MQTTPacket_encode(ptr, rem_len);
+
+        if (aliasKnown)
+        {
+            *ptr++ = 0;
+            *ptr++ = 0;
+        }
+        else
+        {
+            memcpy(ptr, encoded, topiclen);
+            ptr += topiclen;
+        }
+
+        if (qos > QOS0)
+        {
+            *ptr++ = (unsigned char)(id >> 8);
+            *ptr++ = (unsigned char)(id & 0xFF);
+        }
+
+        if (proplen == 1)
+            *ptr++ = 0;
+        else if (proplen == 4)
+        {
+            *ptr++ = 3;
+            *ptr++ = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+            *ptr++ = (unsigned char)(alias >> 8);
+            *ptr++ = (unsigned char)(alias & 0xFF);
+        }
+
+        memcpy(ptr, payload, payloadlen);
+        return (ptr - buf) + (int)payloadlen;
+    }
+
+private:
+    unsigned char encoded[2 + MAX_PREPARED_TOPIC_LEN + 1];  // the length, the name, and a NUL for name()
+};
+
+
+/*
+ * The packets as Client and CoClient write and read them, so that the two differ only in how they
+ * wait.  Each returns what the MQTTPacket function it wraps does: a length, or 1 for a packet read,
+ * and 0 or less for a failure.
+ */
+
+// the limits an MQTT 5 server can set in its CONNACK, each left as it was if the server doesn't
+struct serverLimits
+{
+    unsigned short receiveMaximum;
+    unsigned short topicAliasMaximum;
+    unsigned int keepAliveInterval;
+};
+
+
+// a CONNECT, asking an MQTT 5 server to keep the session for sessionExpiryInterval seconds and to
+// send nothing longer than buflen
+inline int serializeConnect(unsigned char* buf, int buflen, MQTTPacket_connectData& options, unsigned int sessionExpiryInterval)
+{
+    MQTTProperty props[2];
+    MQTTProperties properties = MQTTProperties_initializer;
+
+    if (options.MQTTVersion != 5)
+        return MQTTSerialize_connect(buf, buflen, &options);
+
+    properties.array = props;
+    properties.max_count = 2;
+    props[0].identifier = MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL;
+    props[0].value.integer4 = sessionExpiryInterval;
+    MQTTProperties_add(&properties, &props[0]);
+    props[1].identifier = MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE; // don't let the server send what we can't read
+    props[1].value.integer4 = buflen;
+    MQTTProperties_add(&properties, &props[1]);
+    return MQTTV5Serialize_connect(buf, buflen, &options, &properties, NULL);
+}
+
+
+inline int deserializeConnack(connackData& data, serverLimits& limits, unsigned char mqttVersion, unsigned char* buf, int buflen)
+{
+    MQTTProperty props[10];
+    MQTTProperties properties = MQTTProperties_initializer;
+    unsigned char sessionPresent = 0, rc = 0;
+
+    properties.array = props;
+    properties.max_count = 10;
+    if (MQTTV5Deserialize_connack((mqttVersion == 5) ? &properties : NULL, &sessionPresent, &rc, buf, buflen) != 1)
+        return 0;
+    data.rc = rc;
+    data.sessionPresent = sessionPresent != 0;
+
+    for (int i = 0; i < properties.count; ++i)
+    {
+        if (props[i].identifier == MQTTPROPERTY_CODE_RECEIVE_MAXIMUM)
+            limits.receiveMaximum = props[i].value.integer2;
+        else if (props[i].identifier == MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM)
+            limits.topicAliasMaximum = props[i].value.integer2;
+        else if (props[i].identifier == MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE)
+            limits.keepAliveInterval = props[i].value.integer2;
+    }
+    return 1;
+}
+
+
+// a PUBLISH to a topic name, with alias as its MQTT 5 topic alias if that isn't 0, and without the
+// name once the server knows the alias
+inline int serializePublish(unsigned char* buf, int buflen, const char* topicName, enum QoS qos, bool retained,
+    unsigned short id, const void* payload, size_t payloadlen, unsigned char mqttVersion, int alias = 0, bool aliasKnown = false)
+{
+    MQTTString topic = MQTTString_initializer;
+    MQTTProperty aliasProperty;
+    MQTTProperties properties = MQTTProperties_initializer;
+
+    if (!aliasKnown)
+        topic.cstring = (char*)topicName;
+    properties.array = &aliasProperty;
+    properties.max_count = 1;
+    if (alias > 0)
+    {
+        aliasProperty.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+        aliasProperty.value.integer2 = alias;
+        MQTTProperties_add(&properties, &aliasProperty);
+    }
+    return MQTTV5Serialize_publish(buf, buflen, 0, qos, retained, id, topic,
+              (mqttVersion == 5) ? &properties : NULL, (unsigned char*)payload, payloadlen);
+}
+
+
+// MQTT 5 properties are skipped
+inline int deserializePublish(MQTTString& topicName, Message& msg, unsigned char mqttVersion, unsigned char* buf, int buflen)
+{
+    MQTTProperties properties = MQTTProperties_initializer;
+    int intQoS = 0;
+    int rc;
+
+    msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
+    rc = MQTTV5Deserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
+                  (mqttVersion == 5) ? &properties : NULL, (unsigned char**)&msg.payload, (int*)&msg.payloadlen, buf, buflen);
+    msg.qos = (enum QoS)intQoS;
+    return rc;
+}
+
+
+// a PUBACK, PUBREC or PUBCOMP, with the MQTT 5 reason code if there is one, 0x80 and above failures
+inline int deserializeAck(unsigned short& id, int& reasonCode, unsigned char* buf, int buflen)
+{
+    unsigned char dup, type;
+
+    reasonCode = 0;
+    return MQTTV5Deserialize_ack(&type, &dup, &id, &reasonCode, NULL, buf, buflen);
+}
+
+
+// what is owed for a packet received: PUBACK or PUBREC for a PUBLISH of QoS 1 or 2, PUBREL for a
+// PUBREC and PUBCOMP for a PUBREL.  0 if nothing is
+inline int serializeReply(unsigned char* buf, int buflen, int packet_type, enum QoS qos, unsigned short id)
+{
+    int type;
+
+    if (packet_type == PUBLISH && qos != QOS0)
+        type = (qos == QOS1) ? PUBACK : PUBREC;
+    else if (packet_type == PUBREC)
+        type = PUBREL;
+    else if (packet_type == PUBREL)
+        type = PUBCOMP;
+    else
+        return 0;
+    return MQTTSerialize_ack(buf, buflen, type, 0, id);
+}
+
+
+inline int serializeSubscribe(unsigned char* buf, int buflen, unsigned short id, const char* topicFilter, enum QoS qos,
+    unsigned char mqttVersion)
+{
+    MQTTString topic = {(char*)topicFilter, {0, 0}};
+    MQTTProperties properties = MQTTProperties_initializer;
+    int options = qos;
+
+    return MQTTV5Serialize_subscribe(buf, buflen, 0, id, (mqttVersion == 5) ? &properties : NULL, 1, &topic, &options);
+}
+
+
+// granted is the QoS, or 0x80 and above for a refusal
+inline int deserializeSuback(unsigned short& id, int& granted, unsigned char mqttVersion, unsigned char* buf, int buflen)
+{
+    MQTTProperties properties = MQTTProperties_initializer; // skipped, but MQTT 5 has them
+    int count = 0;
+
+    granted = 0x80;
+    return MQTTV5Deserialize_suback(&id, (mqttVersion == 5) ? &properties : NULL, 1, &count, &granted, buf, buflen);
+}
+
+
+inline int serializeUnsubscribe(unsigned char* buf, int buflen, unsigned short id, const char* topicFilter, unsigned char mqttVersion)
+{
+    MQTTString topic = {(char*)topicFilter, {0, 0}};
+    MQTTProperties properties = MQTTProperties_initializer;
+
+    return MQTTV5Serialize_unsubscribe(buf, buflen, 0, id, (mqttVersion == 5) ? &properties : NULL, 1, &topic);
+}
+
+
+// reasonCode is only sent by MQTT 5 servers, 0x80 and above failures
+inline int deserializeUnsuback(unsigned short& id, int& reasonCode, unsigned char mqttVersion, unsigned char* buf, int buflen)
+{
+    MQTTProperties properties = MQTTProperties_initializer;
+    int count = 0;
+
+    reasonCode = 0;
+    if (mqttVersion != 5)
+        return MQTTDeserialize_unsuback(&id, buf, buflen);
+    return MQTTV5Deserialize_unsuback(&id, &properties, 1, &count, &reasonCode, buf, buflen);
+}
+
+
+/**
+ * @class SessionStore
+ * @brief somewhere to keep the client side of a non-clean session
+ *
+ * When cleansession is 0 the client keeps its in-flight publish and the ids of incoming QoS 2
+ * messages across reconnects.  A store lets that state survive a restart of the process too.
+ */
+class SessionStore
+{
+public:
+    virtual ~SessionStore() { }
+
+    /** Read the saved session
+     *  @return the number of bytes read, or <= 0 if there is no saved session
+     */
+    virtual int load(unsigned char* buf, int buflen) = 0;
+
+    /** Replace the saved session
+     *  @return 0 on success
+     */
+    virtual int save(const unsigned char* buf, int len) = 0;
+
+    /** Forget the saved session */
+    virtual void clear() = 0;
+};
+
+
 /**
  * @class Client
  * @brief blocking, non-threaded MQTT client API
  *
  * This version of the API blocks on all method calls, until they are complete.  This means that only one
- * MQTT request can be in process at any one time.
+ * MQTT request can be in process at any one time.  All state is held in the object, so any number of
+ * clients can be used in one process, as long as each one is only used by one thread at a time.
  * @param Network a network class which supports send, receive
  * @param Timer a timer class with the methods:
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5>
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE = 100, int MAX_MESSAGE_HANDLERS = 5, class Router = NoRouter>
 class Client
 {
 
@@ -134,11 +495,67 @@ public:
             defaultMessageHandler.detach();
     }
 
+    /** Set the router, which is offered each incoming message before the message handlers
+     *  @param router - the router, which must outlive the client, or 0 for none
+     */
+    void setRouter(Router* router)
+    {
+        this->router = router;
+    }
+
     /** Set a message handling callback.  This can be used outside of the the subscribe method.
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param mh - pointer to the callback function. If 0, removes the callback if any
      */
-    int setMessageHandler(const char* topicFilter, messageHandler mh);
+    int setMessageHandler(const char* topicFilter, messageHandler mh)
+    {
+        FP<void, MessageData&> fp;
+        if (mh != 0)
+            fp.attach(mh);
+        return setMessageHandler(topicFilter, fp);
+    }
+
+    /** Set a message handling callback which is a member function, so that each object can have its own
+     *  handlers when there is more than one client in the process.
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param item - the object to call the member function on
+     *  @param method - the member function to call
+     */
+    template<class T>
+    int setMessageHandler(const char* topicFilter, T* item, void (T::*method)(MessageData&))
+    {
+        FP<void, MessageData&> fp;
+        fp.attach(item, method);
+        return setMessageHandler(topicFilter, fp);
+    }
+
+    /** Set the store used to keep session state when connecting with cleansession 0.  The saved state
+     *  is loaded by the first such connect, and rewritten whenever it changes.
+     *  @param store - pointer to the store.  Set to 0 to keep session state in memory only.
+     */
+    void setSessionStore(SessionStore* store)
+    {
+        sessionStore = store;
+        sessionLoaded = false;
+    }
+
+    /** Set how long an MQTT 5 server should keep the session after the network connection closes,
+     *  when connecting with cleansession 0.  The default never expires, as for MQTT 3.1.1.
+     *  @param seconds - the session expiry interval
+     */
+    void setSessionExpiryInterval(unsigned int seconds)
+    {
+        sessionExpiryInterval = seconds;
+    }
+
+    /** The number of QoS 1 and 2 publishes the server will accept before acknowledging them.  Always
+     *  65535 for MQTT 3.  This client waits for each acknowledgement, so it never has more than one.
+     *  @return the server's receive maximum
+     */
+    unsigned short getReceiveMaximum()
+    {
+        return receiveMaximum;
+    }
 
     /** MQTT Connect - send an MQTT connect packet down the network and wait for a Connack
      *  The nework object must be connected to the network endpoint before calling this
@@ -190,6 +607,16 @@ public:
      */
     int publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos = QOS1, bool retained = false);
 
+    /** MQTT Publish - send an MQTT publish packet and wait for all acks to complete for all QoSs
+     *  @param topic - the prepared topic to publish to, which must outlive the call
+     *  @param payload - the data to send
+     *  @param payloadlen - the length of the data
+     *  @param qos - the QoS to send the publish at
+     *  @param retained - whether the message should be retained
+     *  @return success code -
+     */
+    int publish(const PreparedTopic& topic, const void* payload, size_t payloadlen, enum QoS qos = QOS0, bool retained = false);
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at
@@ -198,6 +625,19 @@ public:
      */
     int subscribe(const char* topicFilter, enum QoS qos, messageHandler mh);
 
+    /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback, with no handler of its
+     *  own, for a filter whose messages go to the router or the default message handler
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @return success code -
+     */
+    int subscribe(const char* topicFilter, enum QoS qos)
+    {
+        FP<void, MessageData&> fp;
+        subackData data;
+        return subscribe(topicFilter, qos, fp, data);
+    }
+
     /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
      *  @param topicFilter - a topic pattern which can include wildcards
      *  @param qos - the MQTT QoS to subscribe at©
@@ -205,7 +645,38 @@ public:
      *  @param
      *  @return success code -
      */
-    int subscribe(const char* topicFilter, enum QoS qos, messageHandler mh, subackData &data);
+    int subscribe(const char* topicFilter, enum QoS qos, messageHandler mh, subackData &data)
+    {
+        FP<void, MessageData&> fp;
+        fp.attach(mh);
+        return subscribe(topicFilter, qos, fp, data);
+    }
+
+    /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
+     *  @param topicFilter - a topic pattern which can include wildcards
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @param item - the object to call the member function on
+     *  @param method - the member function to be invoked when a message is received for this subscription
+     *  @return success code -
+     */
+    template<class T>
+    int subscribe(const char* topicFilter, enum QoS qos, T* item, void (T::*method)(MessageData&))
+    {
+        FP<void, MessageData&> fp;
+        subackData data;
+        fp.attach(item, method);
+        return subscribe(topicFilter, qos, fp, data);
+    }
+
+    /** MQTT Subscribe - send an MQTT subscribe packet and wait for the suback
+     *  @param topicFilter - a topic pattern which can include wildcards.  The client keeps the pointer,
+     *      so it must stay valid until unsubscribed
+     *  @param qos - the MQTT QoS to subscribe at
+     *  @param fp - the callback, already attached, for callers which hold on to callbacks themselves
+     *  @param data - the granted QoS - returned
+     *  @return success code -
+     */
+    int subscribe(const char* topicFilter, enum QoS qos, FP<void, MessageData&>& fp, subackData& data);
 
     /** MQTT Unsubscribe - send an MQTT unsubscribe packet and wait for the unsuback
      *  @param topicFilter - a topic pattern which can include wildcards
@@ -220,7 +691,7 @@ public:
 
     /** A call to this API must be made within the keepAlive interval to keep the MQTT connection alive
      *  yield can be called if no other MQTT operation is needed.  This will also allow messages to be
-     *  received.
+     *  received.  A timeout of 0 makes one pass, for callers which wait for the network themselves.
      *  @param timeout_ms the time to wait, in milliseconds
      *  @return success code - on failure, this means the client has disconnected
      */
@@ -238,16 +709,20 @@ private:
 
     void closeSession();
     void cleanSession();
+    void loadSession();
+    void saveSession();
+    int setMessageHandler(const char* topicFilter, FP<void, MessageData&>& fp);
     int cycle(Timer& timer);
     int waitfor(int packet_type, Timer& timer);
     int keepalive();
-    int publish(int len, Timer& timer, enum QoS qos);
+    int publish(int len, Timer& timer, enum QoS qos, int alias = 0);
 
     int decodePacket(int* value, int timeout);
     int readPacket(Timer& timer);
     int sendPacket(int length, Timer& timer);
     int deliverMessage(MQTTString& topicName, Message& message);
     bool isTopicMatched(char* topicFilter, MQTTString& topicName);
+    int topicAlias(const char* topicName, bool& known);
 
     Network& ipstack;
     unsigned long command_timeout_ms;
@@ -255,13 +730,23 @@ private:
     unsigned char sendbuf[MAX_MQTT_PACKET_SIZE];
     unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
 
-    Timer last_sent, last_received;
+    Timer last_sent, last_received, ping_sent;
     unsigned int keepAliveInterval;
     bool ping_outstanding;
     bool cleansession;
 
+    unsigned char mqttVersion;
+    unsigned int sessionExpiryInterval;
+    unsigned short receiveMaximum;
+    unsigned short topicAliasMaximum;
+    int topicAliasCount;
+    char topicAliases[MAX_TOPIC_ALIASES][MAX_TOPIC_ALIAS_LEN];  // index + 1 is the alias, valid for one connection
+
     PacketId packetid;
 
+    SessionStore* sessionStore;
+    bool sessionLoaded;
+
     struct MessageHandlers
     {
         const char* topicFilter;
@@ -269,6 +754,7 @@ private:
     } messageHandlers[MAX_MESSAGE_HANDLERS];      // Message handlers are indexed by subscription topic
 
     FP<void, MessageData&> defaultMessageHandler;
+    Router* router;
 
     bool isconnected;
 
@@ -281,13 +767,16 @@ private:
 
 #if MQTTCLIENT_QOS2
     bool pubrel;
-    #if !defined(MAX_INCOMING_QOS2_MESSAGES)
-        #define MAX_INCOMING_QOS2_MESSAGES 10
-    #endif
-    unsigned short incomingQoS2messages[MAX_INCOMING_QOS2_MESSAGES];
-    bool isQoS2msgidFree(unsigned short id);
-    bool useQoS2msgid(unsigned short id);
-	void freeQoS2msgid(unsigned short id);
+    // one bit per packet id, set from the PUBLISH until the PUBREL so that redeliveries are ignored
+    unsigned int incomingQoS2msgids[65536 / 32];
+    int incomingQoS2count;
+    bool isQoS2msgidFree(unsigned short id)
+    {
+        return (incomingQoS2msgids[id >> 5] & (1U << (id & 31))) == 0;
+    }
+    void useQoS2msgid(unsigned short id);
+    void freeQoS2msgid(unsigned short id);
+    void clearQoS2msgids();
 #endif
 
 };
@@ -295,8 +784,8 @@ private:
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Router>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Router>::cleanSession()
 {
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
         messageHandlers[i].topicFilter = 0;
@@ -308,14 +797,13 @@ void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::cleanSession()
 
 #if MQTTCLIENT_QOS2
     pubrel = false;
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
-        incomingQoS2messages[i] = 0;
+    clearQoS2msgids();
 #endif
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::closeSession()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Router>
+void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Router>::closeSession()
 {
     ping_outstanding = false;
     isconnected = false;
@@ -324,60 +812,171 @@ void MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::closeSession()
 }
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Router>
+MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Router>::Client(Network& network, unsigned int command_timeout_ms)  : ipstack(network), packetid()
 {
     this->command_timeout_ms = command_timeout_ms;
+    sessionStore = 0;
+    sessionLoaded = false;
+    mqttVersion = 4;
+    sessionExpiryInterval = 0xFFFFFFFF;
+    receiveMaximum = 65535;
+    topicAliasMaximum = 0;
+    topicAliasCount = 0;
     cleansession = true;
+    router = 0;
 	  closeSession();
 }
 
 
-#if MQTTCLIENT_QOS2
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isQoS2msgidFree(unsigned short id)
+// saved session layout: "MQS" version, next packet id, in-flight publish, then the non-zero words of
+// the incoming QoS 2 id bitmap as index/value pairs
+#define MQTTCLIENT_SESSION_VERSION 2
+#define MQTTCLIENT_SESSION_LEN(packetsize) (16 + (packetsize) + 2 + 6 * (65536 / 32))
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::saveSession()
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    if (sessionStore == 0 || cleansession)
+        return;
+
+    unsigned char buf[MQTTCLIENT_SESSION_LEN(MAX_MQTT_PACKET_SIZE)];
+    unsigned char* ptr = buf;
+
+    writeChar(&ptr, 'M');
+    writeChar(&ptr, 'Q');
+    writeChar(&ptr, 'S');
+    writeChar(&ptr, MQTTCLIENT_SESSION_VERSION);
+    writeInt(&ptr, packetid.get());
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    writeInt(&ptr, inflightMsgid);
+    writeChar(&ptr, inflightQoS);
+#if MQTTCLIENT_QOS2
+    writeChar(&ptr, pubrel);
+#else
+    writeChar(&ptr, 0);
+#endif
+    writeInt(&ptr, (inflightMsgid > 0) ? inflightLen : 0);
+    if (inflightMsgid > 0)
     {
-        if (incomingQoS2messages[i] == id)
-            return false;
+        memcpy(ptr, pubbuf, inflightLen);
+        ptr += inflightLen;
     }
-    return true;
+#endif
+#if MQTTCLIENT_QOS2
+    unsigned char* countptr = ptr;
+    int count = 0;
+    writeInt(&ptr, 0);
+    for (int i = 0; i < 65536 / 32 && count < incomingQoS2count; ++i)
+    {
+        if (incomingQoS2msgids[i] != 0)
+        {
+            writeInt(&ptr, i);
+            writeInt4(&ptr, incomingQoS2msgids[i]);
+            ++count;
+        }
+    }
+    writeInt(&countptr, count);
+#endif
+
+    if (sessionStore->save(buf, ptr - buf) != 0)
+        WARN("Failed to save session state\r\n");
 }
 
 
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::useQoS2msgid(unsigned short id)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+void MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::loadSession()
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    unsigned char buf[MQTTCLIENT_SESSION_LEN(MAX_MQTT_PACKET_SIZE)];
+    unsigned char* ptr = buf;
+    unsigned char* enddata;
+    int len;
+
+    sessionLoaded = true;
+    if (sessionStore == 0 || (len = sessionStore->load(buf, sizeof(buf))) < 6)
+        return;
+    enddata = buf + len;
+
+    if (readChar(&ptr) != 'M' || readChar(&ptr) != 'Q' || readChar(&ptr) != 'S' ||
+            readChar(&ptr) != MQTTCLIENT_SESSION_VERSION)
+        return;
+    packetid.set(readInt(&ptr));
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (enddata - ptr < 6)
+        return;
+    unsigned short msgid = readInt(&ptr);
+    enum QoS qos = (enum QoS)readChar(&ptr);
+    bool released = readChar(&ptr) != 0;
+    int publen = readInt(&ptr);
+    if (publen > MAX_MQTT_PACKET_SIZE || enddata - ptr < publen)
+        return;
+    if (msgid > 0)
     {
-        if (incomingQoS2messages[i] == 0)
+        memcpy(pubbuf, ptr, publen);
+        inflightMsgid = msgid;
+        inflightLen = publen;
+        inflightQoS = qos;
+#if MQTTCLIENT_QOS2
+        pubrel = released;
+#endif
+    }
+    ptr += publen;
+#endif
+#if MQTTCLIENT_QOS2
+    if (enddata - ptr < 2)
+        return;
+    int count = readInt(&ptr);
+    for (int i = 0; i < count && enddata - ptr >= 6; ++i)
+    {
+        int index = readInt(&ptr);
+        unsigned int word = readInt4(&ptr);
+        if (index < 65536 / 32)
         {
-            incomingQoS2messages[i] = id;
-            return true;
+            incomingQoS2msgids[index] = word;
+            for (; word != 0; word &= word - 1)
+                ++incomingQoS2count;
         }
     }
-    return false;
+#endif
+}
+
+
+#if MQTTCLIENT_QOS2
+template<class Network, class Timer, int a, int b, class Router>
+void MQTT::Client<Network, Timer, a, b, Router>::useQoS2msgid(unsigned short id)
+{
+    if (isQoS2msgidFree(id))
+    {
+        incomingQoS2msgids[id >> 5] |= 1U << (id & 31);
+        ++incomingQoS2count;
+        saveSession();
+    }
 }
 
 
-template<class Network, class Timer, int a, int b>
-void MQTT::Client<Network, Timer, a, b>::freeQoS2msgid(unsigned short id)
+template<class Network, class Timer, int a, int b, class Router>
+void MQTT::Client<Network, Timer, a, b, Router>::freeQoS2msgid(unsigned short id)
 {
-    for (int i = 0; i < MAX_INCOMING_QOS2_MESSAGES; ++i)
+    if (!isQoS2msgidFree(id))
     {
-        if (incomingQoS2messages[i] == id)
-        {
-            incomingQoS2messages[i] = 0;
-            return;
-        }
+        incomingQoS2msgids[id >> 5] &= ~(1U << (id & 31));
+        --incomingQoS2count;
+        saveSession();
     }
 }
+
+
+template<class Network, class Timer, int a, int b, class Router>
+void MQTT::Client<Network, Timer, a, b, Router>::clearQoS2msgids()
+{
+    memset(incomingQoS2msgids, 0, sizeof(incomingQoS2msgids));
+    incomingQoS2count = 0;
+}
 #endif
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
+template<class Network, class Timer, int a, int b, class Router>
+int MQTT::Client<Network, Timer, a, b, Router>::sendPacket(int length, Timer& timer)
 {
     int rc = FAILURE,
         sent = 0;
@@ -409,8 +1008,8 @@ int MQTT::Client<Network, Timer, a, b>::sendPacket(int length, Timer& timer)
 }
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
+template<class Network, class Timer, int a, int b, class Router>
+int MQTT::Client<Network, Timer, a, b, Router>::decodePacket(int* value, int timeout)
 {
     unsigned char c;
     int multiplier = 1;
@@ -429,7 +1028,10 @@ int MQTT::Client<Network, Timer, a, b>::decodePacket(int* value, int timeout)
         }
         rc = ipstack.read(&c, 1, timeout);
         if (rc != 1)
+        {
+            len = MQTTPACKET_READ_ERROR;
             goto exit;
+        }
         *value += (c & 127) * multiplier;
         multiplier *= 128;
     } while ((c & 128) != 0);
@@ -441,11 +1043,11 @@ exit:
 /**
  * If any read fails in this method, then we should disconnect from the network, as on reconnect
  * the packets can be retried.
- * @param timeout the max time to wait for the packet read to complete, in milliseconds
+ * @param timer how long to wait for a packet to start.  The rest of it has the command timeout
  * @return the MQTT packet type, 0 if none, -1 if error
  */
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::readPacket(Timer& timer)
 {
     int rc = FAILURE;
     MQTTHeader header = {0};
@@ -457,20 +1059,34 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::readPacket(Timer& tim
     if (rc != 1)
         goto exit;
 
-    len = 1;
-    /* 2. read the remaining length.  This is variable in itself */
-    decodePacket(&rem_len, timer.left_ms());
-    len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
-
-    if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
     {
-        rc = BUFFER_OVERFLOW;
-        goto exit;
-    }
+        /* the rest of the packet is on its way once its first byte is in, so it gets the whole
+           command timeout rather than what is left of a yield.  Stopping part way through would
+           lose our place in the stream, so a short read of it is a failure */
+        Timer body(command_timeout_ms);
+
+        len = 1;
+        /* 2. read the remaining length.  This is variable in itself */
+        if (decodePacket(&rem_len, body.left_ms()) == MQTTPACKET_READ_ERROR)
+        {
+            rc = FAILURE;
+            goto exit;
+        }
+        len += MQTTPacket_encode(readbuf + 1, rem_len); /* put the original remaining length into the buffer */
 
-    /* 3. read the rest of the buffer using a callback to supply the rest of the data */
-    if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, timer.left_ms()) != rem_len))
-        goto exit;
+        if (rem_len > (MAX_MQTT_PACKET_SIZE - len))
+        {
+            rc = BUFFER_OVERFLOW;
+            goto exit;
+        }
+
+        /* 3. read the rest of the buffer using a callback to supply the rest of the data */
+        if (rem_len > 0 && (ipstack.read(readbuf + len, rem_len, body.left_ms()) != rem_len))
+        {
+            rc = FAILURE;
+            goto exit;
+        }
+    }
 
     header.byte = readbuf[0];
     rc = header.bits.type;
@@ -491,43 +1107,52 @@ exit:
 
 
 // assume topic filter and name is in correct format
-// # can only be at end
-// + and # can only be next to separator
-template<class Network, class Timer, int a, int b>
-bool MQTT::Client<Network, Timer, a, b>::isTopicMatched(char* topicFilter, MQTTString& topicName)
+template<class Network, class Timer, int a, int b, class Router>
+bool MQTT::Client<Network, Timer, a, b, Router>::isTopicMatched(char* topicFilter, MQTTString& topicName)
 {
-    char* curf = topicFilter;
-    char* curn = topicName.lenstring.data;
-    char* curn_end = curn + topicName.lenstring.len;
+    return topicMatches(topicFilter, topicName.lenstring.data, topicName.lenstring.len);
+}
+
+
+/**
+ * Find or assign the MQTT 5 topic alias for a topic name.  Aliases are only valid for one network
+ * connection, and are assigned first come first served until the server's limit is reached.  A new
+ * alias is only reserved here, and is taken once the PUBLISH which defines it has been sent, so a
+ * publish which fails before then leaves the next one to define it again.
+ * @param known set to true if the server already has this alias, so the topic name can be left out
+ * @return the alias, or 0 if the topic has to be sent in full
+ */
+template<class Network, class Timer, int a, int b, class Router>
+int MQTT::Client<Network, Timer, a, b, Router>::topicAlias(const char* topicName, bool& known)
+{
+    int limit = (topicAliasMaximum < MAX_TOPIC_ALIASES) ? topicAliasMaximum : MAX_TOPIC_ALIASES;
 
-    while (*curf && curn < curn_end)
+    known = false;
+    for (int i = 0; i < topicAliasCount; ++i)
     {
-        if (*curn == '/' && *curf != '/')
-            break;
-        if (*curf != '+' && *curf != '#' && *curf != *curn)
-            break;
-        if (*curf == '+')
-        {   // skip until we meet the next separator, or end of string
-            char* nextpos = curn + 1;
-            while (nextpos < curn_end && *nextpos != '/')
-                nextpos = ++curn + 1;
+        if (strcmp(topicAliases[i], topicName) == 0)
+        {
+            known = true;
+            return i + 1;
         }
-        else if (*curf == '#')
-            curn = curn_end - 1;    // skip until end of string
-        curf++;
-        curn++;
-    };
-
-    return (curn == curn_end) && (*curf == '\0');
+    }
+    if (topicAliasCount >= limit || strlen(topicName) >= MAX_TOPIC_ALIAS_LEN)
+        return 0;
+    strcpy(topicAliases[topicAliasCount], topicName);
+    return topicAliasCount + 1;
 }
 
 
 
-template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTString& topicName, Message& message)
+template<class Network, class Timer, int a, int MAX_MESSAGE_HANDLERS, class Router>
+int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS, Router>::deliverMessage(MQTTString& topicName, Message& message)
 {
     int rc = FAILURE;
 
+    // the routes fixed at build time come first, and the handlers only get what they don't take
+    if (router != 0 && router->dispatch(topicName, message))
+        return SUCCESS;
+
     // we have to find the right message handler - indexed by topic
     for (int i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
     {
@@ -555,28 +1180,28 @@ int MQTT::Client<Network, Timer, a, MAX_MESSAGE_HANDLERS>::deliverMessage(MQTTSt
 
 
 
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::yield(unsigned long timeout_ms)
+template<class Network, class Timer, int a, int b, class Router>
+int MQTT::Client<Network, Timer, a, b, Router>::yield(unsigned long timeout_ms)
 {
     int rc = SUCCESS;
     Timer timer;
 
     timer.countdown_ms(timeout_ms);
-    while (!timer.expired())
+    do
     {
         if (cycle(timer) < 0)
         {
             rc = FAILURE;
             break;
         }
-    }
+    } while (!timer.expired());
 
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::cycle(Timer& timer)
 {
     // get one piece of work off the wire and one pass through
     int len = 0,
@@ -601,12 +1226,8 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
         {
             MQTTString topicName = MQTTString_initializer;
             Message msg;
-            int intQoS;
-            msg.payloadlen = 0; /* this is a size_t, but deserialize publish sets this as int */
-            if (MQTTDeserialize_publish((unsigned char*)&msg.dup, &intQoS, (unsigned char*)&msg.retained, (unsigned short*)&msg.id, &topicName,
-                                 (unsigned char**)&msg.payload, (int*)&msg.payloadlen, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            if (deserializePublish(topicName, msg, mqttVersion, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 goto exit;
-            msg.qos = (enum QoS)intQoS;
 #if MQTTCLIENT_QOS2
             if (msg.qos != QOS2)
 #endif
@@ -614,20 +1235,14 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
 #if MQTTCLIENT_QOS2
             else if (isQoS2msgidFree(msg.id))
             {
-                if (useQoS2msgid(msg.id))
-                    deliverMessage(topicName, msg);
-                else
-                    WARN("Maximum number of incoming QoS2 messages exceeded");
+                useQoS2msgid(msg.id);
+                deliverMessage(topicName, msg);
             }
 #endif
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
             if (msg.qos != QOS0)
             {
-                if (msg.qos == QOS1)
-                    len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBACK, 0, msg.id);
-                else if (msg.qos == QOS2)
-                    len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE, PUBREC, 0, msg.id);
-                if (len <= 0)
+                if ((len = serializeReply(sendbuf, MAX_MQTT_PACKET_SIZE, PUBLISH, msg.qos, msg.id)) <= 0)
                     rc = FAILURE;
                 else
                     rc = sendPacket(len, timer);
@@ -644,8 +1259,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
             unsigned char dup, type;
             if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 rc = FAILURE;
-            else if ((len = MQTTSerialize_ack(sendbuf, MAX_MQTT_PACKET_SIZE,
-						         (packet_type == PUBREC) ? PUBREL : PUBCOMP, 0, mypacketid)) <= 0)
+            else if ((len = serializeReply(sendbuf, MAX_MQTT_PACKET_SIZE, packet_type, QOS2, mypacketid)) <= 0)
                 rc = FAILURE;
             else if ((rc = sendPacket(len, timer)) != SUCCESS) // send the PUBREL packet
                 rc = FAILURE; // there was a problem
@@ -653,6 +1267,11 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::cycle(Timer& timer)
                 goto exit; // there was a problem
             if (packet_type == PUBREL)
                 freeQoS2msgid(mypacketid);
+            else if (inflightMsgid == mypacketid && !pubrel)
+            {
+                pubrel = true; // on reconnect, resume from the PUBREL rather than resending the PUBLISH
+                saveSession();
+            }
             break;
 
         case PUBCOMP:
@@ -676,11 +1295,10 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::keepalive()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::keepalive()
 {
     int rc = SUCCESS;
-    static Timer ping_sent;
 
     if (keepAliveInterval == 0)
         goto exit;
@@ -711,8 +1329,8 @@ exit:
 
 
 // only used in single-threaded mode where one command at a time is in process
-template<class Network, class Timer, int a, int b>
-int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
+template<class Network, class Timer, int a, int b, class Router>
+int MQTT::Client<Network, Timer, a, b, Router>::waitfor(int packet_type, Timer& timer)
 {
     int rc = FAILURE;
 
@@ -728,8 +1346,8 @@ int MQTT::Client<Network, Timer, a, b>::waitfor(int packet_type, Timer& timer)
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options, connackData& data)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::connect(MQTTPacket_connectData& options, connackData& data)
 {
     Timer connect_timer(command_timeout_ms);
     int rc = FAILURE;
@@ -740,7 +1358,19 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 
     this->keepAliveInterval = options.keepAliveInterval;
     this->cleansession = options.cleansession;
-    if ((len = MQTTSerialize_connect(sendbuf, MAX_MQTT_PACKET_SIZE, &options)) <= 0)
+    this->mqttVersion = options.MQTTVersion;
+    receiveMaximum = 65535;
+    topicAliasMaximum = 0;
+    topicAliasCount = 0;
+    if (sessionStore != 0)
+    {
+        if (cleansession)
+            sessionStore->clear();
+        else if (!sessionLoaded)
+            loadSession();
+    }
+    len = serializeConnect(sendbuf, MAX_MQTT_PACKET_SIZE, options, cleansession ? 0 : sessionExpiryInterval);
+    if (len <= 0)
         goto exit;
     if ((rc = sendPacket(len, connect_timer)) != SUCCESS)  // send the connect packet
         goto exit; // there was a problem
@@ -750,17 +1380,37 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
     // this will be a blocking call, wait for the connack
     if (waitfor(CONNACK, connect_timer) == CONNACK)
     {
+        serverLimits limits = {receiveMaximum, topicAliasMaximum, keepAliveInterval};
+
         data.rc = 0;
         data.sessionPresent = false;
-        if (MQTTDeserialize_connack((unsigned char*)&data.sessionPresent,
-                            (unsigned char*)&data.rc, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (deserializeConnack(data, limits, mqttVersion, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
             rc = data.rc;
         else
             rc = FAILURE;
+        receiveMaximum = limits.receiveMaximum;
+        topicAliasMaximum = limits.topicAliasMaximum;
+        keepAliveInterval = limits.keepAliveInterval;
     }
     else
         rc = FAILURE;
 
+    if (rc != SUCCESS || cleansession)
+        goto exit;
+
+    if (!data.sessionPresent)
+    {
+        // the server has no record of our session, so any QoS 2 exchanges it started are gone, and
+        // an outgoing QoS 2 message which has reached PUBREL has already been delivered
+#if MQTTCLIENT_QOS2
+        clearQoS2msgids();
+        if (inflightMsgid > 0 && pubrel)
+            inflightMsgid = 0;
+        pubrel = false;
+#endif
+        saveSession();
+    }
+
 #if MQTTCLIENT_QOS2
     // resend any inflight publish
     if (inflightMsgid > 0 && inflightQoS == QOS2 && pubrel)
@@ -775,7 +1425,9 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_co
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
     if (inflightMsgid > 0)
     {
-        memcpy(sendbuf, pubbuf, MAX_MQTT_PACKET_SIZE);
+        memcpy(sendbuf, pubbuf, inflightLen);
+        if (data.sessionPresent)
+            sendbuf[0] |= 0x08; // a redelivery within the same session, so set the DUP flag
         rc = publish(inflightLen, connect_timer, inflightQoS);
     }
 #endif
@@ -790,24 +1442,24 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect(MQTTPacket_connectData& options)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::connect(MQTTPacket_connectData& options)
 {
     connackData data;
     return connect(options, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::connect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::connect()
 {
     MQTTPacket_connectData default_options = MQTTPacket_connectData_initializer;
     return connect(default_options);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::setMessageHandler(const char* topicFilter, messageHandler messageHandler)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Router>::setMessageHandler(const char* topicFilter, FP<void, MessageData&>& fp)
 {
     int rc = FAILURE;
     int i = -1;
@@ -817,7 +1469,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
     {
         if (messageHandlers[i].topicFilter != 0 && strcmp(messageHandlers[i].topicFilter, topicFilter) == 0)
         {
-            if (messageHandler == 0) // remove existing
+            if (!fp.attached()) // remove existing
             {
                 messageHandlers[i].topicFilter = 0;
                 messageHandlers[i].fp.detach();
@@ -827,7 +1479,7 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         }
     }
     // if no existing, look for empty slot (unless we are removing)
-    if (messageHandler != 0) {
+    if (fp.attached()) {
         if (rc == FAILURE)
         {
             for (i = 0; i < MAX_MESSAGE_HANDLERS; ++i)
@@ -842,26 +1494,27 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::se
         if (i < MAX_MESSAGE_HANDLERS)
         {
             messageHandlers[i].topicFilter = topicFilter;
-            messageHandlers[i].fp.attach(messageHandler);
+            messageHandlers[i].fp = fp;
         }
     }
+    else
+        rc = SUCCESS;   // whether or not there was one to remove
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter,
-     enum QoS qos, messageHandler messageHandler, subackData& data)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Router>::subscribe(const char* topicFilter,
+     enum QoS qos, FP<void, MessageData&>& fp, subackData& data)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
     int len = 0;
-    MQTTString topic = {(char*)topicFilter, {0, 0}};
 
     if (!isconnected)
         goto exit;
 
-    len = MQTTSerialize_subscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic, (int*)&qos);
+    len = serializeSubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, packetid.getNext(), topicFilter, qos, mqttVersion);
     if (len <= 0)
         goto exit;
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the subscribe packet
@@ -869,13 +1522,11 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::su
 
     if (waitfor(SUBACK, timer) == SUBACK)      // wait for suback
     {
-        int count = 0;
         unsigned short mypacketid;
-        data.grantedQoS = 0;
-        if (MQTTDeserialize_suback(&mypacketid, 1, &count, &data.grantedQoS, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        if (deserializeSuback(mypacketid, data.grantedQoS, mqttVersion, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
         {
-            if (data.grantedQoS != 0x80)
-                rc = setMessageHandler(topicFilter, messageHandler);
+            if (data.grantedQoS < 0x80) // 0x80 and above are failures
+                rc = setMessageHandler(topicFilter, fp);
         }
     }
     else
@@ -888,26 +1539,25 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Router>::subscribe(const char* topicFilter, enum QoS qos, messageHandler messageHandler)
 {
     subackData data;
     return subscribe(topicFilter, qos, messageHandler, data);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::unsubscribe(const char* topicFilter)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int MAX_MESSAGE_HANDLERS, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS, Router>::unsubscribe(const char* topicFilter)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
-    MQTTString topic = {(char*)topicFilter, {0, 0}};
     int len = 0;
 
     if (!isconnected)
         goto exit;
 
-    if ((len = MQTTSerialize_unsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, 0, packetid.getNext(), 1, &topic)) <= 0)
+    if ((len = serializeUnsubscribe(sendbuf, MAX_MQTT_PACKET_SIZE, packetid.getNext(), topicFilter, mqttVersion)) <= 0)
         goto exit;
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the unsubscribe packet
         goto exit; // there was a problem
@@ -915,7 +1565,8 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, MAX_MESSAGE_HANDLERS>::un
     if (waitfor(UNSUBACK, timer) == UNSUBACK)
     {
         unsigned short mypacketid;  // should be the same as the packetid above
-        if (MQTTDeserialize_unsuback(&mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
+        int reasonCode = 0;
+        if (deserializeUnsuback(mypacketid, reasonCode, mqttVersion, readbuf, MAX_MQTT_PACKET_SIZE) == 1)
         {
             // remove the subscription message handler associated with this topic, if there is one
             setMessageHandler(topicFilter, 0);
@@ -931,13 +1582,16 @@ exit:
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Timer& timer, enum QoS qos)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::publish(int len, Timer& timer, enum QoS qos, int alias)
 {
     int rc;
+    bool rejected = false;
 
     if ((rc = sendPacket(len, timer)) != SUCCESS) // send the publish packet
         goto exit; // there was a problem
+    if (alias > topicAliasCount)
+        topicAliasCount = alias; // the server has the topic for a new alias now
 
 #if MQTTCLIENT_QOS1
     if (qos == QOS1)
@@ -945,11 +1599,22 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
         if (waitfor(PUBACK, timer) == PUBACK)
         {
             unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            int reasonCode;
+            if (deserializeAck(mypacketid, reasonCode, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+            else
+            {
+                if (inflightMsgid == mypacketid)
+                {
+                    inflightMsgid = 0;
+                    saveSession();
+                }
+                if (reasonCode >= 0x80) // an MQTT 5 server refused the message, but the connection is fine
+                {
+                    rc = FAILURE;
+                    rejected = true;
+                }
+            }
         }
         else
             rc = FAILURE;
@@ -961,11 +1626,22 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
         if (waitfor(PUBCOMP, timer) == PUBCOMP)
         {
             unsigned short mypacketid;
-            unsigned char dup, type;
-            if (MQTTDeserialize_ack(&type, &dup, &mypacketid, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
+            int reasonCode;
+            if (deserializeAck(mypacketid, reasonCode, readbuf, MAX_MQTT_PACKET_SIZE) != 1)
                 rc = FAILURE;
-            else if (inflightMsgid == mypacketid)
-                inflightMsgid = 0;
+            else
+            {
+                if (inflightMsgid == mypacketid)
+                {
+                    inflightMsgid = 0;
+                    saveSession();
+                }
+                if (reasonCode >= 0x80) // an MQTT 5 server refused the message, but the connection is fine
+                {
+                    rc = FAILURE;
+                    rejected = true;
+                }
+            }
         }
         else
             rc = FAILURE;
@@ -973,72 +1649,128 @@ int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(int len, Time
 #endif
 
 exit:
-    if (rc != SUCCESS)
+    if (rc != SUCCESS && !rejected)
         closeSession();
     return rc;
 }
 
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::publish(const char* topicName, void* payload, size_t payloadlen, unsigned short& id, enum QoS qos, bool retained)
+{
+    int rc = FAILURE;
+    Timer timer(command_timeout_ms);
+    bool aliasKnown = false;
+    int alias = 0;
+    int len = 0;
+
+    if (!isconnected)
+        goto exit;
+
+    if (mqttVersion == 5)
+        alias = topicAlias(topicName, aliasKnown);
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (qos == QOS1 || qos == QOS2)
+        id = packetid.getNext();
+#endif
+
+    // once the server knows the alias, the topic name can be left out altogether
+    len = serializePublish(sendbuf, MAX_MQTT_PACKET_SIZE, topicName, qos, retained, id, payload, payloadlen, mqttVersion, alias, aliasKnown);
+    if (len <= 0)
+        goto exit;
+
+#if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
+    if (!cleansession)
+    {
+        // aliases don't outlive the connection, so keep a copy with the full topic for resending
+        inflightLen = len;
+        if (alias != 0)
+            inflightLen = serializePublish(pubbuf, MAX_MQTT_PACKET_SIZE, topicName, qos, retained, id, payload, payloadlen, mqttVersion);
+        else
+            memcpy(pubbuf, sendbuf, len);
+        inflightMsgid = (inflightLen > 0) ? id : 0;
+        inflightQoS = qos;
+#if MQTTCLIENT_QOS2
+        pubrel = false;
+#endif
+        saveSession();
+    }
+#endif
+
+    rc = publish(len, timer, qos, alias);
+exit:
+    return rc;
+}
+
+
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::publish(const PreparedTopic& topic, const void* payload, size_t payloadlen, enum QoS qos, bool retained)
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);
-    MQTTString topicString = MQTTString_initializer;
+    unsigned short id = 0;
+    unsigned short alias = 0;
+    bool aliasKnown = false;
     int len = 0;
 
     if (!isconnected)
         goto exit;
 
-    topicString.cstring = (char*)topicName;
+    if (mqttVersion == 5)
+        alias = topicAlias(topic.name(), aliasKnown);
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
     if (qos == QOS1 || qos == QOS2)
         id = packetid.getNext();
 #endif
 
-    len = MQTTSerialize_publish(sendbuf, MAX_MQTT_PACKET_SIZE, 0, qos, retained, id,
-              topicString, (unsigned char*)payload, payloadlen);
+    len = topic.serialize(sendbuf, MAX_MQTT_PACKET_SIZE, qos, retained, id, payload, payloadlen, mqttVersion, alias, aliasKnown);
     if (len <= 0)
         goto exit;
 
 #if MQTTCLIENT_QOS1 || MQTTCLIENT_QOS2
     if (!cleansession)
     {
-        memcpy(pubbuf, sendbuf, len);
-        inflightMsgid = id;
+        // aliases don't outlive the connection, so keep a copy with the full topic for resending
         inflightLen = len;
+        if (alias != 0)
+            inflightLen = topic.serialize(pubbuf, MAX_MQTT_PACKET_SIZE, qos, retained, id, payload, payloadlen, mqttVersion);
+        else
+            memcpy(pubbuf, sendbuf, len);
+        inflightMsgid = (inflightLen > 0) ? id : 0;
         inflightQoS = qos;
 #if MQTTCLIENT_QOS2
         pubrel = false;
 #endif
+        saveSession();
     }
 #endif
 
-    rc = publish(len, timer, qos);
+    rc = publish(len, timer, qos, alias);
 exit:
     return rc;
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::publish(const char* topicName, void* payload, size_t payloadlen, enum QoS qos, bool retained)
 {
     unsigned short id = 0;  // dummy - not used for anything
     return publish(topicName, payload, payloadlen, id, qos, retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::publish(const char* topicName, Message& message)
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::publish(const char* topicName, Message& message)
 {
     return publish(topicName, message.payload, message.payloadlen, message.qos, message.retained);
 }
 
 
-template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b>
-int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b>::disconnect()
+template<class Network, class Timer, int MAX_MQTT_PACKET_SIZE, int b, class Router>
+int MQTT::Client<Network, Timer, MAX_MQTT_PACKET_SIZE, b, Router>::disconnect()
 {
     int rc = FAILURE;
     Timer timer(command_timeout_ms);     // we might wait for incomplete incoming publishes to complete
@@ -0,0 +1,303 @@
+/*******************************************************************************
+ * Routing of incoming messages fixed when the program is built.
+ *
+ * A Client matches each incoming topic against the filters of its subscriptions at runtime, and
+ * calls the handler through an FP.  A program whose topics are known when it is built can declare
+ * them instead, as a Router, and give that to the Client as its last template parameter.  Exact
+ * filters are found in a table indexed by their hash, which the compiler works out along with a
+ * table size at which no two of them share a slot, so a topic costs one hash and one compare
+ * however many routes there are.  Filters with wildcards are matched in turn, calling their
+ * member functions directly, so they can be inlined.  Messages the router doesn't take still go
+ * to the handlers set at runtime, and then to the default handler.
+ *
+ *   MQTT_ROUTE_TOPIC(UpperCommand, "relays/upper");
+ *   MQTT_ROUTE_TOPIC(AnySensor, "sensors/+");
+ *
+ *   typedef MQTT::Router<Relay,
+ *       MQTT::Route<UpperCommand, Relay, &Relay::onUpperCommand>,
+ *       MQTT::Route<AnySensor, Relay, &Relay::onSensor> > Routes;
+ *   typedef MQTT::Client<IPStack, Countdown, 100, 5, Routes> Client;
+ *
+ *   Routes routes(relay, "home/relay");   // filters are under this prefix
+ *   client.setRouter(&routes);
+ *   client.subscribe("home/relay/relays/upper", MQTT::QOS1);
+ *
+ * This needs C++11, so the Client doesn't include it: a program which routes includes it instead
+ * of MQTTClient.h, and the Client without a router still builds with C++98.
+ *******************************************************************************/
+
+#if !defined(MQTTROUTER_H)
+#define MQTTROUTER_H
+
+#include <string.h>
+#include "MQTTClient.h"
+
+/** Declare a topic filter for a Route, as a type */
+#define MQTT_ROUTE_TOPIC(name, topicFilter) \
+    struct name { static constexpr const char* filter() { return topicFilter; } }
+
+namespace MQTT
+{
+
+
+namespace route
+{
+
+// FNV-1a, which the compiler works out for the declared filters and dispatch for each topic
+constexpr unsigned int topicHash(const char* s, unsigned int h = 2166136261u)
+{
+    return (*s == '\0') ? h : topicHash(s + 1, (h ^ (unsigned char)*s) * 16777619u);
+}
+
+inline unsigned int topicHash(const char* s, const char* end)
+{
+    unsigned int h = 2166136261u;
+
+    while (s < end)
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    return h;
+}
+
+constexpr int filterLength(const char* s)
+{
+    return (*s == '\0') ? 0 : 1 + filterLength(s + 1);
+}
+
+constexpr bool hasWildcard(const char* s)
+{
+    return *s != '\0' && (*s == '+' || *s == '#' || hasWildcard(s + 1));
+}
+
+// calls every wildcard route which matches, as Client calls every handler which matches
+template<class Owner, class... Routes>
+struct Dispatch
+{
+    static bool call(Owner&, const char*, int, MessageData&)
+    {
+        return false;
+    }
+};
+
+template<class Owner, class R, class... Rest>
+struct Dispatch<Owner, R, Rest...>
+{
+    static bool call(Owner& owner, const char* topic, int len, MessageData& md)
+    {
+        bool matched = !R::exact && topicMatches(R::filter(), topic, len);
+
+        if (matched)
+            R::invoke(owner, md);
+        if (Dispatch<Owner, Rest...>::call(owner, topic, len, md))
+            matched = true;
+        return matched;
+    }
+};
+
+// no two exact filters may share a hash, so that the hash alone picks the route
+template<class R, class... Rest>
+struct Unique
+{
+    static constexpr bool value = true;
+};
+
+template<class R, class S, class... Rest>
+struct Unique<R, S, Rest...>
+{
+    static constexpr bool value = (!R::exact || !S::exact || R::hash != S::hash) && Unique<R, Rest...>::value;
+};
+
+template<class... Routes>
+struct Distinct
+{
+    static constexpr bool value = true;
+};
+
+template<class R, class... Rest>
+struct Distinct<R, Rest...>
+{
+    static constexpr bool value = Unique<R, Rest...>::value && Distinct<Rest...>::value;
+};
+
+// the same, for the slots of a table of size n
+template<unsigned int n, class R, class... Rest>
+struct UniqueSlot
+{
+    static constexpr bool value = true;
+};
+
+template<unsigned int n, class R, class S, class... Rest>
+struct UniqueSlot<n, R, S, Rest...>
+{
+    static constexpr bool value = (!R::exact || !S::exact || R::hash % n != S::hash % n) && UniqueSlot<n, R, Rest...>::value;
+};
+
+template<unsigned int n, class... Routes>
+struct DistinctSlots
+{
+    static constexpr bool value = true;
+};
+
+template<unsigned int n, class R, class... Rest>
+struct DistinctSlots<n, R, Rest...>
+{
+    static constexpr bool value = UniqueSlot<n, R, Rest...>::value && DistinctSlots<n, Rest...>::value;
+};
+
+template<class... Routes>
+struct ExactCount
+{
+    static constexpr unsigned int value = 0;
+};
+
+template<class R, class... Rest>
+struct ExactCount<R, Rest...>
+{
+    static constexpr unsigned int value = (R::exact ? 1 : 0) + ExactCount<Rest...>::value;
+};
+
+// the smallest table, from n up, in which each exact route has a slot of its own.  A handful of
+// routes finds one within a few sizes of their number
+template<unsigned int n, bool found, class... Routes>
+struct TableSize
+{
+    static_assert(n < 1024, "no table size gives every exact topic filter a slot of its own");
+    static constexpr unsigned int value = TableSize<n + 1, DistinctSlots<n + 1, Routes...>::value, Routes...>::value;
+};
+
+template<unsigned int n, class... Routes>
+struct TableSize<n, true, Routes...>
+{
+    static constexpr unsigned int value = n;
+};
+
+template<class... Routes>
+struct Table
+{
+    static constexpr unsigned int first = ExactCount<Routes...>::value > 0 ? ExactCount<Routes...>::value : 1;
+    static constexpr unsigned int size = TableSize<first, DistinctSlots<first, Routes...>::value, Routes...>::value;
+};
+
+}
+
+
+/**
+ * @class Route
+ * @brief a topic filter declared with MQTT_ROUTE_TOPIC, and the member function of Owner which handles it
+ */
+template<class Topic, class Owner, void (Owner::*handler)(MessageData&)>
+struct Route
+{
+    static constexpr bool exact = !route::hasWildcard(Topic::filter());
+    static constexpr int length = route::filterLength(Topic::filter());
+    static constexpr unsigned int hash = route::topicHash(Topic::filter());
+
+    static const char* filter()
+    {
+        return Topic::filter();
+    }
+
+    static void invoke(Owner& owner, MessageData& md)
+    {
+        (owner.*handler)(md);
+    }
+};
+
+
+/**
+ * @class Router
+ * @brief the routes of one Owner, whose filters are all under a prefix given at runtime
+ */
+template<class Owner, class... Routes>
+class Router
+{
+public:
+    /** @param prefix - the topic level the filters are under, which must outlive the router, or "" for none */
+    Router(Owner& owner, const char* prefix = "") : owner(owner)
+    {
+        int placed[] = { (place<Routes>(), 0)..., 0 };
+
+        (void)placed;
+        setPrefix(prefix);
+    }
+
+    void setPrefix(const char* prefix)
+    {
+        this->prefix = prefix;
+        prefixlen = (int)strlen(prefix);
+    }
+
+    /** Call the handler of every route which matches
+     *  @return false if none did
+     */
+    bool dispatch(MQTTString& topicName, Message& message)
+    {
+        const char* topic = topicName.lenstring.data;
+        int len = topicName.lenstring.len;
+
+        if (topicName.cstring != NULL)
+        {
+            topic = topicName.cstring;
+            len = (int)strlen(topic);
+        }
+        if (prefixlen > 0)
+        {
+            if (len <= prefixlen || topic[prefixlen] != '/' || memcmp(topic, prefix, prefixlen) != 0)
+                return false;
+            topic += prefixlen + 1;
+            len -= prefixlen + 1;
+        }
+
+        MessageData md(topicName, message);
+        bool matched = false;
+
+        if (route::ExactCount<Routes...>::value > 0)
+        {
+            unsigned int h = route::topicHash(topic, topic + len);
+            const Slot& slot = table[h % route::Table<Routes...>::size];
+
+            if (slot.invoke != 0 && slot.hash == h && slot.length == len && memcmp(topic, slot.filter, len) == 0)
+            {
+                slot.invoke(owner, md);
+                matched = true;
+            }
+        }
+        if (route::Dispatch<Owner, Routes...>::call(owner, topic, len, md))
+            matched = true;
+        return matched;
+    }
+
+private:
+    static_assert(route::Distinct<Routes...>::value, "two exact topic filters have the same hash");
+
+    struct Slot
+    {
+        unsigned int hash;
+        int length;
+        const char* filter;
+        void (*invoke)(Owner&, MessageData&);
+    };
+
+    template<class R>
+    void place()
+    {
+        if (R::exact)
+        {
+            Slot& slot = table[R::hash % route::Table<Routes...>::size];
+
+            slot.hash = R::hash;
+            slot.length = R::length;
+            slot.filter = R::filter();
+            slot.invoke = &R::invoke;
+        }
+    }
+
+    Owner& owner;
+    const char* prefix;
+    int prefixlen;
+    Slot table[route::Table<Routes...>::size] = {};
+};
+
+
+}
+
+#endif
@@ -0,0 +1,459 @@
+/*
+ * A front end for MQTT::Client on Linux which any thread can publish, subscribe and unsubscribe
+ * through.
+ *
+ * MQTT::Client is single threaded: every call shares its buffers, and has to be made on one thread.
+ * An AsyncClient gives the client and its network to a thread of its own, which is then the only
+ * one to touch them.  Other threads queue commands without taking a lock and without waiting for
+ * the network, and are told how each went through a callback.  The thread sends everything queued
+ * each time it wakes before it waits again, and it calls the handlers of the messages received, so
+ * callbacks and handlers all run on it.  QoS 1 and 2 publishes still go one at a time, since the
+ * client waits for each to be acknowledged.
+ *
+ * The network has to be one which can be waited on with poll, IPStack or TLSStack, rather than a
+ * UringStack.  Include this after linux.cpp.
+ */
+
+#if !defined(ASYNC_CPP)
+#define ASYNC_CPP
+
+#include <sys/eventfd.h>
+#include <sched.h>
+#include <new>
+#include <atomic>
+
+#include "FP.h"
+
+#define ASYNC_SUBSCRIPTIONS 5 /* the client's message handlers */
+#define ASYNC_FILTER_SIZE 128
+#define ASYNC_IDLE_MS 1000 /* the longest the thread waits, so that keepalives go out in time */
+#define ASYNC_RECONNECT_MS 100
+
+
+// how a command went, MQTT::SUCCESS or MQTT::FAILURE, called on the client's thread
+typedef void (*AsyncCallback)(void* context, int rc);
+
+// connects the client, called on the client's thread while it isn't connected.  Returns 0 once it is
+typedef int (*AsyncConnect)(void* context);
+
+
+template<class Network, class Client>
+class AsyncClient
+{
+public:
+  // network and client are the thread's once it starts, and nothing else may use them
+  AsyncClient(Network& network, Client& client) : network(network), client(client)
+  {
+		stub.next.store(NULL);
+		head.store(&stub);
+		tail = &stub;
+		sleeping.store(false);
+		stopping.store(false);
+		started = false;
+		connectFunction = NULL;
+		connectContext = NULL;
+		for (int i = 0; i < ASYNC_SUBSCRIPTIONS; i++)
+			subscriptions[i].filter[0] = '\0';
+		wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+
+  // stops the thread, after it has sent what was queued, and fails anything queued since
+  ~AsyncClient()
+  {
+		stop();
+		execute(false);
+		if (wakeFd != -1)
+			::close(wakeFd);
+  }
+
+  /**
+   * How the thread connects, and reconnects after the connection is lost, every 100 ms until it
+   * works.  Subscriptions made through the AsyncClient are made again once it has.  Without this,
+   * the client has to be connected before start, and commands fail once the connection is lost.
+   * Set it before start.
+   */
+  void setConnect(AsyncConnect function, void* context)
+  {
+		connectFunction = function;
+		connectContext = context;
+  }
+
+  // start the thread.  Returns 0, or -1 if it can't be started
+  int start()
+  {
+		if (started)
+			return 0;
+		if (wakeFd == -1)
+			return -1;
+		stopping.store(false);
+		started = pthread_create(&thread, NULL, &AsyncClient::run, this) == 0;
+		return started ? 0 : -1;
+  }
+
+  // stop the thread, once it has sent what was queued before this.  The client stays connected
+  void stop()
+  {
+		if (!started)
+			return;
+		stopping.store(true);
+		wake();
+		pthread_join(thread, NULL);
+		started = false;
+  }
+
+  /**
+   * Queue a publish, copying the topic and payload.  done, if there is one, is called with context
+   * once the publish has been sent, or for QoS 1 and 2 acknowledged, or has failed.  Returns 0, or -1
+   * if the command couldn't be queued, in which case done isn't called.
+   */
+  int publish(const char* topicName, const void* payload, size_t payloadlen, enum MQTT::QoS qos = MQTT::QOS0,
+		bool retained = false, AsyncCallback done = NULL, void* context = NULL)
+  {
+		Command* command = create(Publish, topicName, payload, payloadlen, done, context);
+
+		if (command == NULL)
+			return -1;
+		command->qos = qos;
+		command->retained = retained;
+		push(command);
+		return 0;
+  }
+
+  /**
+   * Queue a subscription, whose messages are given to handler on the client's thread.  The
+   * subscription is made again after reconnecting, until it is unsubscribed.  Returns 0, or -1 if
+   * the command couldn't be queued.
+   */
+  int subscribe(const char* topicFilter, enum MQTT::QoS qos, void (*handler)(MQTT::MessageData&),
+		AsyncCallback done = NULL, void* context = NULL)
+  {
+		FP<void, MQTT::MessageData&> fp;
+
+		fp.attach(handler);
+		return subscribe(topicFilter, qos, fp, done, context);
+  }
+
+  template<class T>
+  int subscribe(const char* topicFilter, enum MQTT::QoS qos, T* item, void (T::*method)(MQTT::MessageData&),
+		AsyncCallback done = NULL, void* context = NULL)
+  {
+		FP<void, MQTT::MessageData&> fp;
+
+		fp.attach(item, method);
+		return subscribe(topicFilter, qos, fp, done, context);
+  }
+
+  // queue an unsubscribe.  Returns 0, or -1 if the command couldn't be queued
+  int unsubscribe(const char* topicFilter, AsyncCallback done = NULL, void* context = NULL)
+  {
+		Command* command = create(Unsubscribe, topicFilter, NULL, 0, done, context);
+
+		if (command == NULL)
+			return -1;
+		push(command);
+		return 0;
+  }
+
+private:
+
+  enum CommandType
+  {
+		Publish,
+		Subscribe,
+		Unsubscribe
+  };
+
+  // one queued command, in one allocation with its topic and payload
+  struct Command
+  {
+		std::atomic<Command*> next;
+		CommandType type;
+		enum MQTT::QoS qos;
+		bool retained;
+		FP<void, MQTT::MessageData&> handler;
+		AsyncCallback done;
+		void* context;
+		char* payload;
+		size_t payloadlen;
+		char topic[1];
+  };
+
+  struct Subscription
+  {
+		char filter[ASYNC_FILTER_SIZE];  // the client keeps a pointer to this
+		enum MQTT::QoS qos;
+		FP<void, MQTT::MessageData&> handler;
+  };
+
+  int subscribe(const char* topicFilter, enum MQTT::QoS qos, FP<void, MQTT::MessageData&>& handler,
+		AsyncCallback done, void* context)
+  {
+		if (strlen(topicFilter) >= ASYNC_FILTER_SIZE)
+			return -1;
+
+		Command* command = create(Subscribe, topicFilter, NULL, 0, done, context);
+
+		if (command == NULL)
+			return -1;
+		command->qos = qos;
+		command->handler = handler;
+		push(command);
+		return 0;
+  }
+
+  Command* create(CommandType type, const char* topicName, const void* payload, size_t payloadlen,
+		AsyncCallback done, void* context)
+  {
+		size_t topicLength = strlen(topicName);
+		void* memory = malloc(sizeof(Command) + topicLength + payloadlen);
+
+		if (memory == NULL)
+			return NULL;
+
+		Command* command = new (memory) Command();
+		command->type = type;
+		command->qos = MQTT::QOS0;
+		command->retained = false;
+		command->done = done;
+		command->context = context;
+		memcpy(command->topic, topicName, topicLength + 1);
+		command->payload = command->topic + topicLength + 1;
+		command->payloadlen = payloadlen;
+		if (payloadlen > 0)
+			memcpy(command->payload, payload, payloadlen);
+		return command;
+  }
+
+  void destroy(Command* command)
+  {
+		command->~Command();
+		free(command);
+  }
+
+  /**
+   * The queue is Vyukov's intrusive MPSC queue: a producer swaps itself in at the head, then links
+   * the node it replaced to it, so pushing is one exchange and never waits.  The thread takes from
+   * the tail.  A stub node keeps the queue from ever being empty, which is what lets the last node
+   * be taken while producers are pushing.
+   */
+  void push(Command* command)
+  {
+		command->next.store(NULL, std::memory_order_relaxed);
+		Command* previous = head.exchange(command);
+		previous->next.store(command, std::memory_order_release);
+
+		// only a thread about to wait, or waiting, needs waking
+		if (sleeping.load() && sleeping.exchange(false))
+			wake();
+  }
+
+  // the oldest command, or NULL if there is none, or a producer hasn't linked the next one in yet
+  Command* pop()
+  {
+		Command* first = tail;
+		Command* next = first->next.load(std::memory_order_acquire);
+
+		if (first == &stub)
+		{
+			if (next == NULL)
+				return NULL;
+			tail = next;
+			first = next;
+			next = next->next.load(std::memory_order_acquire);
+		}
+		if (next != NULL)
+		{
+			tail = next;
+			return first;
+		}
+		if (first != head.load())
+			return NULL;
+
+		// first is the only command, so put the stub behind it before taking it
+		push(&stub);
+		next = first->next.load(std::memory_order_acquire);
+		if (next == NULL)
+			return NULL;
+		tail = next;
+		return first;
+  }
+
+  bool empty()
+  {
+		return tail == &stub && head.load() == &stub;
+  }
+
+  void wake()
+  {
+		uint64_t one = 1;
+
+		// fails only when the counter is full, which wakes the thread just the same
+		ssize_t rc = ::write(wakeFd, &one, sizeof(one));
+		(void)rc;
+  }
+
+  static void* run(void* arg)
+  {
+		((AsyncClient*)arg)->loop();
+		return NULL;
+  }
+
+  void loop()
+  {
+		Countdown reconnect(0);
+		Countdown idle(ASYNC_IDLE_MS);
+
+		while (!stopping.load())
+		{
+			if (!client.isConnected() && connectFunction != NULL && reconnect.expired())
+			{
+				if (connectFunction(connectContext) == 0)
+					resubscribe();
+				reconnect.countdown_ms(ASYNC_RECONNECT_MS);
+			}
+
+			// without a connect function there is nothing to do until a command or stop wakes us
+			int timeout = client.isConnected() ? idle.left_ms() : (connectFunction != NULL) ? reconnect.left_ms() : -1;
+			int sock = client.isConnected() ? network.getSocket() : -1;
+			struct pollfd fds[2] = {{wakeFd, POLLIN, 0}, {sock, POLLIN, 0}};
+
+			// say we are about to wait before the last look at the queue, so that a command pushed
+			// after that look sees it and wakes us
+			sleeping.store(true);
+			if (!empty() || stopping.load())
+				timeout = 0;
+			int rc = ::poll(fds, (sock != -1) ? 2 : 1, timeout);
+			sleeping.store(false);
+
+			if (rc > 0 && fds[0].revents != 0)
+			{
+				uint64_t count;
+				ssize_t cleared = ::read(wakeFd, &count, sizeof(count));
+				(void)cleared;
+			}
+
+			// everything queued goes out before anything is read
+			execute(true);
+
+			// now and then even without anything to read, so that the client sends its keepalive
+			if (client.isConnected() && ((rc > 0 && fds[1].revents != 0) || idle.expired()))
+			{
+				idle.countdown_ms(ASYNC_IDLE_MS);
+				client.yield(0);
+				while (client.isConnected() && network.buffered())
+					client.yield(0);
+			}
+			else if (rc < 0 && errno != EINTR)
+				usleep(ASYNC_RECONNECT_MS * 1000);
+		}
+
+		// commands queued before stop
+		execute(true);
+  }
+
+  // run the queued commands, or just fail them
+  void execute(bool run)
+  {
+		Command* command;
+
+		while ((command = pop()) != NULL || !empty())
+		{
+			if (command == NULL)
+			{
+				sched_yield(); // a producer is between its exchange and its link
+				continue;
+			}
+
+			int rc = MQTT::FAILURE;
+
+			if (run && client.isConnected())
+			{
+				switch (command->type)
+				{
+				case Publish:
+					rc = client.publish(command->topic, command->payload, command->payloadlen, command->qos, command->retained);
+					break;
+				case Subscribe:
+					rc = subscribe(command);
+					break;
+				case Unsubscribe:
+					if ((rc = client.unsubscribe(command->topic)) == MQTT::SUCCESS)
+						forget(command->topic);
+					break;
+				}
+			}
+			if (command->done != NULL)
+				command->done(command->context, rc);
+			destroy(command);
+		}
+  }
+
+  int subscribe(Command* command)
+  {
+		Subscription* subscription = NULL;
+		bool added = false;
+		MQTT::subackData data;
+
+		for (int i = 0; i < ASYNC_SUBSCRIPTIONS && subscription == NULL; i++)
+		{
+			if (strcmp(subscriptions[i].filter, command->topic) == 0)
+				subscription = &subscriptions[i];
+		}
+		for (int i = 0; i < ASYNC_SUBSCRIPTIONS && subscription == NULL; i++)
+		{
+			if (subscriptions[i].filter[0] == '\0')
+			{
+				subscription = &subscriptions[i];
+				strcpy(subscription->filter, command->topic);
+				added = true;
+			}
+		}
+		if (subscription == NULL)
+			return MQTT::FAILURE;
+
+		subscription->qos = command->qos;
+		subscription->handler = command->handler;
+		int rc = client.subscribe(subscription->filter, subscription->qos, subscription->handler, data);
+		if (rc != MQTT::SUCCESS && added)
+			subscription->filter[0] = '\0';
+		return rc;
+  }
+
+  void forget(const char* topicFilter)
+  {
+		for (int i = 0; i < ASYNC_SUBSCRIPTIONS; i++)
+		{
+			if (strcmp(subscriptions[i].filter, topicFilter) == 0)
+				subscriptions[i].filter[0] = '\0';
+		}
+  }
+
+  void resubscribe()
+  {
+		MQTT::subackData data;
+
+		for (int i = 0; i < ASYNC_SUBSCRIPTIONS && client.isConnected(); i++)
+		{
+			if (subscriptions[i].filter[0] != '\0')
+				client.subscribe(subscriptions[i].filter, subscriptions[i].qos, subscriptions[i].handler, data);
+		}
+  }
+
+  Network& network;
+  Client& client;
+
+  std::atomic<Command*> head;  // pushed to by any thread
+  Command* tail;               // taken from by the client's thread
+  Command stub;
+  std::atomic<bool> sleeping;
+  std::atomic<bool> stopping;
+  int wakeFd;
+
+  bool started;
+  pthread_t thread;
+  AsyncConnect connectFunction;
+  void* connectContext;
+  Subscription subscriptions[ASYNC_SUBSCRIPTIONS];
+};
+
+#endif
@@ -0,0 +1,1080 @@
+/*
+ * C++20 coroutines for MQTT on Linux, for host builds with -std=c++20.  The device's compiler has no
+ * coroutines, so without them this file is empty.
+ *
+ * MQTT::Client waits for each acknowledgement before it returns, so a caller either blocks its loop
+ * or writes a state machine of its own.  A CoClient's connect, publish, subscribe and unsubscribe
+ * are coroutines instead, which resume once the broker has answered, on PUBACK or PUBCOMP for a
+ * publish.  Any number of them can be waiting at once, up to the broker's receive maximum, so a
+ * sequence of operations reads in order while many sequences overlap:
+ *
+ *   CoTask session(CoExecutor& executor, IPStack& ipstack, CoClient<IPStack>& client)
+ *   {
+ *       while (ipstack.connect("broker", 1883) != 0)
+ *           co_await executor.sleep(1000);
+ *       if (co_await client.connect(data) != 0)
+ *           co_return -1;
+ *       co_return co_await client.subscribe("relays/#", MQTT::QOS1, onMessage);
+ *   }
+ *
+ * The packets are written and read as MQTT::Client's are, by the helpers in MQTTClient.h, so only
+ * the waiting differs.  Everything runs on the one thread which calls CoExecutor::run.  The executor waits in poll, on
+ * the socket and anything else a coroutine waits for, such as a timer or another file descriptor.
+ * Keepalives are sent as they fall due.  A CoClient keeps no session state between connections,
+ * and an operation still waiting when the connection is lost fails.
+ *
+ * Include this after linux.cpp.
+ */
+
+#if !defined(COROUTINE_CPP)
+#define COROUTINE_CPP
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <exception>
+#include <deque>
+#include <vector>
+
+#include "FP.h"
+
+#define CO_INFLIGHT 64 /* operations waiting for the broker at once */
+#define CO_HANDLERS 5
+#define CO_FILTER_SIZE 128
+
+
+/**
+ * A coroutine which produces an int, the MQTT return code for the client's operations.  It starts
+ * when it is awaited, or when it is given to CoExecutor::spawn.  Its arguments have to outlive it,
+ * which they do when it is awaited straight away.
+ */
+class CoTask
+{
+public:
+  struct promise_type
+  {
+		int value = 0;
+		bool awaited = false;  // the caller suspended, and is waiting to be resumed
+		std::coroutine_handle<> continuation;
+
+		CoTask get_return_object()
+		{
+			return CoTask(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() noexcept
+		{
+			return {};
+		}
+
+		// carry on with whoever awaited this, if it had to wait
+		struct FinalAwaiter
+		{
+			bool await_ready() noexcept
+			{
+				return false;
+			}
+
+			void await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+			{
+				if (handle.promise().awaited)
+					handle.promise().continuation.resume();
+			}
+
+			void await_resume() noexcept
+			{
+			}
+		};
+
+		FinalAwaiter final_suspend() noexcept
+		{
+			return {};
+		}
+
+		void return_value(int rc)
+		{
+			value = rc;
+		}
+
+		void unhandled_exception()
+		{
+			std::terminate();
+		}
+  };
+
+  CoTask(CoTask&& other) : handle(other.handle)
+  {
+		other.handle = nullptr;
+  }
+
+  CoTask(const CoTask&) = delete;
+  CoTask& operator=(const CoTask&) = delete;
+
+  ~CoTask()
+  {
+		if (handle)
+			handle.destroy();
+  }
+
+  bool await_ready()
+  {
+		return false;
+  }
+
+  /**
+   * Start the task here, and suspend the caller only if the task has to wait for something.  Most
+   * finish straight away, a send which fits in the socket say, and then the caller carries on
+   * without a frame more on the stack for each of them, tail calls or not.
+   */
+  bool await_suspend(std::coroutine_handle<> caller)
+  {
+		handle.promise().continuation = caller;
+		handle.resume();
+		if (handle.done())
+			return false;
+		handle.promise().awaited = true;
+		return true;
+  }
+
+  int await_resume()
+  {
+		return handle.promise().value;
+  }
+
+private:
+  explicit CoTask(std::coroutine_handle<promise_type> handle) : handle(handle)
+  {
+  }
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+
+/**
+ * Runs coroutines on one thread, resuming each when what it waits for has happened: a file
+ * descriptor becoming ready, a timeout, or another coroutine finishing.  Waiting for all of them is
+ * one poll.
+ */
+class CoExecutor
+{
+public:
+  CoExecutor()
+  {
+		stopping = false;
+  }
+
+  // waits for events on a file descriptor, -1 for none, until timeout_ms, -1 for ever.  Returns the
+  // events which happened, 0 at the timeout or POLLNVAL if cancelled
+  struct Wait
+  {
+		CoExecutor* executor;
+		int fd;
+		short events;
+		int timeout_ms;
+		short revents;
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			Watch watch = {fd, events, Countdown(timeout_ms < 0 ? 0 : timeout_ms), timeout_ms < 0, handle, &revents};
+			revents = 0;
+			executor->watches.push_back(watch);
+		}
+
+		short await_resume()
+		{
+			return revents;
+		}
+  };
+
+  // resumes the coroutine on the executor's next pass, after what is already ready
+  struct Next
+  {
+		CoExecutor* executor;
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			executor->post(handle);
+		}
+
+		void await_resume()
+		{
+		}
+  };
+
+  Wait wait(int fd, short events, int timeout_ms)
+  {
+		return Wait{this, fd, events, timeout_ms, 0};
+  }
+
+  Wait sleep(int ms)
+  {
+		return Wait{this, -1, 0, ms, 0};
+  }
+
+  Next next()
+  {
+		return Next{this};
+  }
+
+  // run task alongside everything else, from the next pass, and put what it returns in result
+  void spawn(CoTask task, int* result = NULL)
+  {
+		detach(this, std::move(task), result);
+  }
+
+  // resume a suspended coroutine on the next pass
+  void post(std::coroutine_handle<> handle)
+  {
+		ready.push_back(handle);
+  }
+
+  // wake everything waiting on fd, before it is closed, with POLLNVAL
+  void cancel(int fd)
+  {
+		for (size_t i = 0; i < watches.size(); )
+		{
+			if (fd != -1 && watches[i].fd == fd)
+			{
+				*watches[i].revents = POLLNVAL;
+				post(watches[i].handle);
+				watches.erase(watches.begin() + i);
+			}
+			else
+				i++;
+		}
+  }
+
+  // run until stop, or until there is nothing left to run
+  void run()
+  {
+		stopping = false;
+		while (!stopping && (!ready.empty() || !watches.empty()))
+			runOnce(-1);
+  }
+
+  void stop()
+  {
+		stopping = true;
+  }
+
+  /**
+   * One pass, for owners with a loop of their own: resume what is ready, then wait up to timeout_ms,
+   * -1 for as long as it takes, for what the coroutines are waiting for.
+   */
+  void runOnce(int timeout_ms)
+  {
+		// only what was ready at the start, so that a coroutine which keeps yielding can't starve the rest
+		for (size_t count = ready.size(); count > 0 && !ready.empty(); count--)
+		{
+			std::coroutine_handle<> handle = ready.front();
+			ready.pop_front();
+			handle.resume();
+		}
+
+		// and no waiting once stopped, so that run returns as soon as it is told to
+		if (!ready.empty() || stopping)
+			timeout_ms = 0;
+		if (watches.empty())
+			return;
+
+		fds.resize(watches.size());
+		for (size_t i = 0; i < watches.size(); i++)
+		{
+			fds[i].fd = watches[i].fd;
+			fds[i].events = watches[i].events;
+			fds[i].revents = 0;
+			if (!watches[i].forever && (timeout_ms < 0 || watches[i].deadline.left_ms() < timeout_ms))
+				timeout_ms = watches[i].deadline.left_ms();
+		}
+
+		if (::poll(&fds[0], fds.size(), timeout_ms) < 0 && errno != EINTR)
+			return;
+
+		// what is woken is only posted, so the watches stay in step with fds
+		for (size_t i = 0, j = 0; j < fds.size(); j++)
+		{
+			if (fds[j].revents != 0 || (!watches[i].forever && watches[i].deadline.expired()))
+			{
+				*watches[i].revents = fds[j].revents;
+				post(watches[i].handle);
+				watches.erase(watches.begin() + i);
+			}
+			else
+				i++;
+		}
+  }
+
+private:
+
+  struct Watch
+  {
+		int fd;
+		short events;
+		Countdown deadline;
+		bool forever;
+		std::coroutine_handle<> handle;
+		short* revents;
+  };
+
+  // a coroutine which nothing awaits, and which frees itself when it finishes
+  struct Detached
+  {
+		struct promise_type
+		{
+			Detached get_return_object()
+			{
+				return {};
+			}
+
+			std::suspend_never initial_suspend() noexcept
+			{
+				return {};
+			}
+
+			std::suspend_never final_suspend() noexcept
+			{
+				return {};
+			}
+
+			void return_void()
+			{
+			}
+
+			void unhandled_exception()
+			{
+				std::terminate();
+			}
+		};
+  };
+
+  static Detached detach(CoExecutor* executor, CoTask task, int* result)
+  {
+		co_await executor->next();
+		int rc = co_await task;
+		if (result != NULL)
+			*result = rc;
+  }
+
+  std::deque<std::coroutine_handle<> > ready;
+  std::vector<Watch> watches;
+  std::vector<struct pollfd> fds;
+  bool stopping;
+};
+
+
+/**
+ * An MQTT 3.1.1 or 5 client whose operations are coroutines, run by a CoExecutor.  The network has
+ * to be connected before connect, and is one which can be waited on with poll, IPStack or TLSStack.
+ */
+template<class Network, int MAX_MQTT_PACKET_SIZE = 100>
+class CoClient
+{
+public:
+  typedef void (*messageHandler)(MQTT::MessageData&);
+
+  CoClient(CoExecutor& executor, Network& network, unsigned int command_timeout_ms = 30000)
+		: executor(executor), network(network), command_timeout_ms(command_timeout_ms)
+  {
+		open = connected = false;
+		generation = 0;
+		writing = false;
+		readlen = 0;
+		mqttVersion = 4;
+		keepAliveInterval = 0;
+		receiveMaximum = CO_INFLIGHT;
+		inflight = 0;
+		ping_outstanding = false;
+		for (int i = 0; i < CO_INFLIGHT; i++)
+			pending[i].used = false;
+		for (int i = 0; i < CO_HANDLERS; i++)
+			handlers[i].filter[0] = '\0';
+		memset(incomingQoS2msgids, 0, sizeof(incomingQoS2msgids));
+  }
+
+  bool isConnected()
+  {
+		return connected;
+  }
+
+  // for messages which don't match any subscription's filter
+  void setDefaultMessageHandler(messageHandler mh)
+  {
+		if (mh != 0)
+			defaultMessageHandler.attach(mh);
+		else
+			defaultMessageHandler.detach();
+  }
+
+  // send CONNECT on the connected network, and wait for the CONNACK.  Returns its return code, or FAILURE
+  CoTask connect(MQTTPacket_connectData& options)
+  {
+		unsigned char buf[MAX_MQTT_PACKET_SIZE];
+		int len;
+
+		if (open)
+			co_return MQTT::FAILURE;
+
+		mqttVersion = options.MQTTVersion;
+		keepAliveInterval = options.keepAliveInterval;
+		receiveMaximum = CO_INFLIGHT;
+		ping_outstanding = false;
+		readlen = 0;
+		memset(incomingQoS2msgids, 0, sizeof(incomingQoS2msgids));
+		len = MQTT::serializeConnect(buf, MAX_MQTT_PACKET_SIZE, options, 0); // no session is kept
+		if (len <= 0)
+			co_return MQTT::FAILURE;
+
+		open = true;
+		generation++;
+		last_received.countdown(keepAliveInterval);
+		last_sent.countdown(keepAliveInterval);
+		executor.spawn(readLoop(generation));
+
+		Pending* slot = take(CONNACK);
+		int rc = (slot != NULL) ? MQTT::SUCCESS : MQTT::FAILURE;
+		if (rc == MQTT::SUCCESS)
+			rc = co_await sendPacket(buf, len);
+		if (rc == MQTT::SUCCESS)
+			rc = co_await Acknowledgement{slot};
+		release(slot);
+
+		if (rc == MQTT::SUCCESS)
+			connected = true;
+		else
+			close();
+		co_return rc;
+  }
+
+  // publish, and for QoS 1 and 2 wait for the PUBACK or PUBCOMP
+  CoTask publish(const char* topicName, const void* payload, size_t payloadlen, enum MQTT::QoS qos = MQTT::QOS0,
+		bool retained = false)
+  {
+		unsigned char buf[MAX_MQTT_PACKET_SIZE];
+		Pending* slot = NULL;
+		unsigned short id = 0;
+
+		if (!connected)
+			co_return MQTT::FAILURE;
+		if (qos != MQTT::QOS0)
+		{
+			while ((slot = take(qos == MQTT::QOS1 ? PUBACK : PUBREC)) == NULL && connected)
+				co_await SlotWait{this};
+			if (slot == NULL)
+				co_return MQTT::FAILURE;
+			id = slot->id;
+		}
+
+		int rc = MQTT::FAILURE;
+		int len = MQTT::serializePublish(buf, MAX_MQTT_PACKET_SIZE, topicName, qos, retained, id, payload, payloadlen, mqttVersion);
+		if (len > 0)
+			rc = co_await sendPacket(buf, len);
+		if (rc == MQTT::SUCCESS && slot != NULL)
+			rc = co_await Acknowledgement{slot};
+		if (rc == MQTT::SUCCESS && qos == MQTT::QOS2)
+		{
+			rearm(slot, PUBCOMP);
+			if ((len = MQTT::serializeReply(buf, MAX_MQTT_PACKET_SIZE, PUBREC, qos, id)) <= 0)
+				rc = MQTT::FAILURE;
+			else if ((rc = co_await sendPacket(buf, len)) == MQTT::SUCCESS)
+				rc = co_await Acknowledgement{slot};
+		}
+		release(slot);
+		co_return rc;
+  }
+
+  // subscribe, and wait for the SUBACK.  The handler is called for matching messages until unsubscribed
+  CoTask subscribe(const char* topicFilter, enum MQTT::QoS qos, messageHandler mh)
+  {
+		FP<void, MQTT::MessageData&> fp;
+
+		fp.attach(mh);
+		return subscribe(topicFilter, qos, fp);
+  }
+
+  template<class T>
+  CoTask subscribe(const char* topicFilter, enum MQTT::QoS qos, T* item, void (T::*method)(MQTT::MessageData&))
+  {
+		FP<void, MQTT::MessageData&> fp;
+
+		fp.attach(item, method);
+		return subscribe(topicFilter, qos, fp);
+  }
+
+  // unsubscribe, and wait for the UNSUBACK
+  CoTask unsubscribe(const char* topicFilter)
+  {
+		unsigned char buf[MAX_MQTT_PACKET_SIZE];
+		Pending* slot;
+
+		while ((slot = take(UNSUBACK)) == NULL && connected)
+			co_await SlotWait{this};
+		if (slot == NULL)
+			co_return MQTT::FAILURE;
+
+		int rc = MQTT::FAILURE;
+		int len = MQTT::serializeUnsubscribe(buf, MAX_MQTT_PACKET_SIZE, slot->id, topicFilter, mqttVersion);
+		if (len > 0)
+			rc = co_await sendPacket(buf, len);
+		if (rc == MQTT::SUCCESS)
+			rc = co_await Acknowledgement{slot};
+		release(slot);
+		if (rc == MQTT::SUCCESS)
+			removeHandler(topicFilter);
+		co_return rc;
+  }
+
+  // send DISCONNECT and close the network.  Anything still waiting fails
+  CoTask disconnect()
+  {
+		unsigned char buf[4];
+		int rc = MQTT::FAILURE;
+		int len = MQTTSerialize_disconnect(buf, sizeof(buf));
+
+		if (connected && len > 0)
+			rc = co_await sendPacket(buf, len);
+		close();
+		co_return rc;
+  }
+
+private:
+
+  // an operation waiting for the broker's answer, found by packet type and id
+  struct Pending
+  {
+		bool used;
+		bool done;
+		int type;
+		unsigned short id;
+		int rc;
+		Countdown deadline;
+		std::coroutine_handle<> handle;
+  };
+
+  struct Handler
+  {
+		char filter[CO_FILTER_SIZE];
+		FP<void, MQTT::MessageData&> fp;
+  };
+
+  // resumes when the answer to a pending operation has come, or the connection is lost
+  struct Acknowledgement
+  {
+		Pending* slot;
+
+		bool await_ready()
+		{
+			return slot->done;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			slot->handle = handle;
+		}
+
+		int await_resume()
+		{
+			return slot->rc;
+		}
+  };
+
+  // resumes when a pending slot may have come free, to look again
+  struct SlotWait
+  {
+		CoClient* client;
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			client->slotWaiters.push_back(handle);
+		}
+
+		void await_resume()
+		{
+		}
+  };
+
+  // resumes when the socket may be free to write a packet, to look again
+  struct WriteTurn
+  {
+		CoClient* client;
+
+		bool await_ready()
+		{
+			return false;
+		}
+
+		void await_suspend(std::coroutine_handle<> handle)
+		{
+			client->writeWaiters.push_back(handle);
+		}
+
+		void await_resume()
+		{
+		}
+  };
+
+  CoTask subscribe(const char* topicFilter, enum MQTT::QoS qos, FP<void, MQTT::MessageData&> fp)
+  {
+		unsigned char buf[MAX_MQTT_PACKET_SIZE];
+		Pending* slot;
+		bool added;
+
+		while ((slot = take(SUBACK)) == NULL && connected)
+			co_await SlotWait{this};
+		if (slot == NULL)
+			co_return MQTT::FAILURE;
+
+		// in place before the SUBSCRIBE goes, so that nothing the broker sends straight after is missed
+		int rc = MQTT::FAILURE;
+		if (addHandler(topicFilter, fp, added))
+		{
+			int len = MQTT::serializeSubscribe(buf, MAX_MQTT_PACKET_SIZE, slot->id, topicFilter, qos, mqttVersion);
+			if (len > 0)
+				rc = co_await sendPacket(buf, len);
+			if (rc == MQTT::SUCCESS)
+				rc = co_await Acknowledgement{slot};
+			if (rc != MQTT::SUCCESS && added)
+				removeHandler(topicFilter);
+		}
+		release(slot);
+		co_return rc;
+  }
+
+  // a free slot for an operation waiting for type, with a packet id no other operation has
+  Pending* take(int type)
+  {
+		int limit = (receiveMaximum < CO_INFLIGHT) ? receiveMaximum : CO_INFLIGHT;
+
+		if (!open || inflight >= limit)
+			return NULL;
+
+		Pending* slot = NULL;
+		for (int i = 0; i < CO_INFLIGHT && slot == NULL; i++)
+		{
+			if (!pending[i].used)
+				slot = &pending[i];
+		}
+
+		unsigned short id;
+		bool clash;
+		do
+		{
+			id = (type == CONNACK) ? 0 : packetid.getNext();
+			clash = false;
+			for (int i = 0; i < CO_INFLIGHT && id != 0; i++)
+				clash |= pending[i].used && pending[i].id == id;
+		} while (clash);
+
+		slot->used = true;
+		slot->id = id;
+		slot->handle = nullptr;
+		inflight++;
+		rearm(slot, type);
+		return slot;
+  }
+
+  void rearm(Pending* slot, int type)
+  {
+		slot->type = type;
+		slot->done = false;
+		slot->rc = MQTT::FAILURE;
+		slot->deadline.countdown_ms(command_timeout_ms);
+  }
+
+  void complete(Pending* slot, int rc)
+  {
+		slot->rc = rc;
+		slot->done = true;
+		if (slot->handle)
+		{
+			executor.post(slot->handle);
+			slot->handle = nullptr;
+		}
+  }
+
+  void release(Pending* slot)
+  {
+		if (slot == NULL)
+			return;
+		slot->used = false;
+		inflight--;
+		wakeAll(slotWaiters);
+  }
+
+  void wakeAll(std::deque<std::coroutine_handle<> >& waiters)
+  {
+		while (!waiters.empty())
+		{
+			executor.post(waiters.front());
+			waiters.pop_front();
+		}
+  }
+
+  // send a whole packet, one at a time, waiting for the socket when it's full
+  CoTask sendPacket(unsigned char* buf, int len)
+  {
+		Countdown deadline(command_timeout_ms);
+		int sent = 0;
+
+		while (writing && open)
+			co_await WriteTurn{this};
+		if (!open)
+			co_return MQTT::FAILURE;
+
+		writing = true;
+		while (sent < len)
+		{
+			int rc = network.write(&buf[sent], len - sent, 0);
+			if (rc < 0)
+				break;
+			sent += rc;
+			if (sent < len && (deadline.expired() || co_await executor.wait(network.getSocket(), POLLOUT, deadline.left_ms()) == 0))
+				break;
+		}
+		writing = false;
+		if (!writeWaiters.empty())
+		{
+			executor.post(writeWaiters.front());
+			writeWaiters.pop_front();
+		}
+
+		if (sent < len)
+		{
+			close();
+			co_return MQTT::FAILURE;
+		}
+		last_sent.countdown(keepAliveInterval);
+		co_return MQTT::SUCCESS;
+  }
+
+  // the length of the complete packet at the start of readbuf, 0 if there isn't one yet, or -1 if it won't fit
+  int packetLength()
+  {
+		int rem_len = 0, multiplier = 1;
+
+		for (int i = 1; i < 5; i++)
+		{
+			if (i >= readlen)
+				return 0;
+			rem_len += (readbuf[i] & 127) * multiplier;
+			multiplier *= 128;
+			if ((readbuf[i] & 128) == 0)
+			{
+				int len = 1 + i + rem_len;
+				if (len > MAX_MQTT_PACKET_SIZE)
+					return -1;
+				return (readlen >= len) ? len : 0;
+			}
+		}
+		return -1;
+  }
+
+  // reads and handles everything the broker sends, until the connection of this generation closes
+  CoTask readLoop(unsigned int generation)
+  {
+		while (open && generation == this->generation)
+		{
+			int rc = network.read(&readbuf[readlen], MAX_MQTT_PACKET_SIZE - readlen, 0);
+			if (rc < 0)
+				break;
+			readlen += rc;
+
+			int len;
+			while ((len = packetLength()) > 0 && open && generation == this->generation)
+			{
+				if (co_await handle(len) != MQTT::SUCCESS)
+				{
+					len = -1;
+					break;
+				}
+				readlen -= len;
+				memmove(readbuf, &readbuf[len], readlen);
+				last_received.countdown(keepAliveInterval);
+			}
+			if (len < 0 || !open || generation != this->generation)
+				break;
+
+			if (co_await keepalive() != MQTT::SUCCESS)
+				break;
+			if (rc == 0 && !network.buffered())
+				co_await executor.wait(network.getSocket(), POLLIN, nextDeadline());
+		}
+		if (generation == this->generation)
+			close();
+		co_return MQTT::SUCCESS;
+  }
+
+  // send a PINGREQ when one is due, and give up on a broker which hasn't answered, or hasn't
+  // answered an operation in time
+  CoTask keepalive()
+  {
+		for (int i = 0; i < CO_INFLIGHT; i++)
+		{
+			if (pending[i].used && !pending[i].done && pending[i].deadline.expired())
+				co_return MQTT::FAILURE;
+		}
+		if (keepAliveInterval == 0)
+			co_return MQTT::SUCCESS;
+		if (ping_outstanding)
+			co_return ping_sent.expired() ? MQTT::FAILURE : MQTT::SUCCESS;
+		if (!last_sent.expired() && !last_received.expired())
+			co_return MQTT::SUCCESS;
+
+		unsigned char buf[2];
+		int len = MQTTSerialize_pingreq(buf, sizeof(buf));
+		if (len <= 0 || co_await sendPacket(buf, len) != MQTT::SUCCESS)
+			co_return MQTT::FAILURE;
+		ping_outstanding = true;
+		ping_sent.countdown(keepAliveInterval);
+		co_return MQTT::SUCCESS;
+  }
+
+  // how long the reader can wait before keepalive has something to do.  Never longer than the
+  // command timeout, so that an operation started while it waits is timed out no more than that late
+  int nextDeadline()
+  {
+		int timeout = command_timeout_ms;
+
+		for (int i = 0; i < CO_INFLIGHT; i++)
+		{
+			if (pending[i].used && !pending[i].done && pending[i].deadline.left_ms() < timeout)
+				timeout = pending[i].deadline.left_ms();
+		}
+		if (keepAliveInterval > 0)
+		{
+			int left = ping_outstanding ? ping_sent.left_ms()
+					: (last_sent.left_ms() < last_received.left_ms() ? last_sent.left_ms() : last_received.left_ms());
+			if (left < timeout)
+				timeout = left;
+		}
+		return timeout;
+  }
+
+  Pending* find(int type, unsigned short id)
+  {
+		for (int i = 0; i < CO_INFLIGHT; i++)
+		{
+			if (pending[i].used && !pending[i].done && pending[i].type == type && pending[i].id == id)
+				return &pending[i];
+		}
+		return NULL;
+  }
+
+  // one packet of len bytes at the start of readbuf
+  CoTask handle(int len)
+  {
+		MQTTHeader header = {0};
+		unsigned char buf[4];
+		unsigned short id;
+		int reasonCode = 0;
+
+		header.byte = readbuf[0];
+		switch (header.bits.type)
+		{
+		case CONNACK:
+		{
+			MQTT::connackData data;
+			MQTT::serverLimits limits = {receiveMaximum, 0, keepAliveInterval};
+			Pending* slot = find(CONNACK, 0);
+
+			if (MQTT::deserializeConnack(data, limits, mqttVersion, readbuf, len) != 1)
+				co_return MQTT::FAILURE;
+			receiveMaximum = limits.receiveMaximum;
+			keepAliveInterval = limits.keepAliveInterval;
+			if (slot != NULL)
+				complete(slot, data.rc);
+			break;
+		}
+		case PUBACK:
+		case PUBREC:
+		case PUBCOMP:
+		{
+			if (MQTT::deserializeAck(id, reasonCode, readbuf, len) != 1)
+				co_return MQTT::FAILURE;
+			Pending* slot = find(header.bits.type, id);
+			if (slot != NULL)
+				complete(slot, reasonCode >= 0x80 ? MQTT::FAILURE : MQTT::SUCCESS);
+			else if (header.bits.type == PUBREC)
+			{
+				// not ours any more, but the broker is waiting for the PUBREL
+				if ((len = MQTT::serializeReply(buf, sizeof(buf), PUBREC, MQTT::QOS2, id)) <= 0 || co_await sendPacket(buf, len) != MQTT::SUCCESS)
+					co_return MQTT::FAILURE;
+			}
+			break;
+		}
+		case SUBACK:
+		{
+			int granted;
+			if (MQTT::deserializeSuback(id, granted, mqttVersion, readbuf, len) != 1)
+				co_return MQTT::FAILURE;
+			Pending* slot = find(SUBACK, id);
+			if (slot != NULL)
+				complete(slot, granted < 0x80 ? MQTT::SUCCESS : MQTT::FAILURE); // 0x80 and above are failures
+			break;
+		}
+		case UNSUBACK:
+		{
+			if (MQTT::deserializeUnsuback(id, reasonCode, mqttVersion, readbuf, len) != 1)
+				co_return MQTT::FAILURE;
+			Pending* slot = find(UNSUBACK, id);
+			if (slot != NULL)
+				complete(slot, reasonCode >= 0x80 ? MQTT::FAILURE : MQTT::SUCCESS);
+			break;
+		}
+		case PUBLISH:
+		{
+			MQTTString topicName = MQTTString_initializer;
+			MQTT::Message msg;
+
+			if (MQTT::deserializePublish(topicName, msg, mqttVersion, readbuf, len) != 1)
+				co_return MQTT::FAILURE;
+
+			// a QoS 2 message is delivered once, however often it is sent before the PUBREL
+			if (msg.qos != MQTT::QOS2 || (incomingQoS2msgids[msg.id >> 5] & (1U << (msg.id & 31))) == 0)
+			{
+				if (msg.qos == MQTT::QOS2)
+					incomingQoS2msgids[msg.id >> 5] |= 1U << (msg.id & 31);
+				deliver(topicName, msg);
+			}
+			if (msg.qos != MQTT::QOS0)
+			{
+				if ((len = MQTT::serializeReply(buf, sizeof(buf), PUBLISH, msg.qos, msg.id)) <= 0
+						|| co_await sendPacket(buf, len) != MQTT::SUCCESS)
+					co_return MQTT::FAILURE;
+			}
+			break;
+		}
+		case PUBREL:
+		{
+			if (MQTT::deserializeAck(id, reasonCode, readbuf, len) != 1)
+				co_return MQTT::FAILURE;
+			incomingQoS2msgids[id >> 5] &= ~(1U << (id & 31));
+			if ((len = MQTT::serializeReply(buf, sizeof(buf), PUBREL, MQTT::QOS2, id)) <= 0 || co_await sendPacket(buf, len) != MQTT::SUCCESS)
+				co_return MQTT::FAILURE;
+			break;
+		}
+		case PINGRESP:
+			ping_outstanding = false;
+			break;
+		}
+		co_return MQTT::SUCCESS;
+  }
+
+  void deliver(MQTTString& topicName, MQTT::Message& message)
+  {
+		bool delivered = false;
+
+		for (int i = 0; i < CO_HANDLERS; i++)
+		{
+			if (handlers[i].filter[0] != '\0' && MQTT::topicMatches(handlers[i].filter, topicName.lenstring.data, topicName.lenstring.len))
+			{
+				MQTT::MessageData md(topicName, message);
+				handlers[i].fp(md);
+				delivered = true;
+			}
+		}
+		if (!delivered && defaultMessageHandler.attached())
+		{
+			MQTT::MessageData md(topicName, message);
+			defaultMessageHandler(md);
+		}
+  }
+
+  bool addHandler(const char* topicFilter, FP<void, MQTT::MessageData&>& fp, bool& added)
+  {
+		Handler* handler = NULL;
+
+		added = false;
+		if (strlen(topicFilter) >= CO_FILTER_SIZE)
+			return false;
+		for (int i = 0; i < CO_HANDLERS && handler == NULL; i++)
+		{
+			if (strcmp(handlers[i].filter, topicFilter) == 0)
+				handler = &handlers[i];
+		}
+		for (int i = 0; i < CO_HANDLERS && handler == NULL; i++)
+		{
+			if (handlers[i].filter[0] == '\0')
+			{
+				handler = &handlers[i];
+				strcpy(handler->filter, topicFilter);
+				added = true;
+			}
+		}
+		if (handler != NULL)
+			handler->fp = fp;
+		return handler != NULL;
+  }
+
+  void removeHandler(const char* topicFilter)
+  {
+		for (int i = 0; i < CO_HANDLERS; i++)
+		{
+			if (strcmp(handlers[i].filter, topicFilter) == 0)
+				handlers[i].filter[0] = '\0';
+		}
+  }
+
+  // close the network, failing whatever is still waiting on it
+  void close()
+  {
+		if (!open)
+			return;
+		open = connected = false;
+		writing = false;
+		executor.cancel(network.getSocket());
+		network.disconnect();
+		for (int i = 0; i < CO_INFLIGHT; i++)
+		{
+			if (pending[i].used && !pending[i].done)
+				complete(&pending[i], MQTT::FAILURE);
+		}
+		wakeAll(slotWaiters);
+		wakeAll(writeWaiters);
+  }
+
+  CoExecutor& executor;
+  Network& network;
+  unsigned int command_timeout_ms;
+
+  bool open;       // the network is ours, from CONNECT until it closes
+  bool connected;  // and the broker accepted the CONNECT
+  unsigned int generation;
+  unsigned char mqttVersion;
+  unsigned int keepAliveInterval;
+  unsigned short receiveMaximum;
+  Countdown last_sent, last_received, ping_sent;
+  bool ping_outstanding;
+
+  unsigned char readbuf[MAX_MQTT_PACKET_SIZE];
+  int readlen;
+  bool writing;
+  std::deque<std::coroutine_handle<> > writeWaiters;
+
+  MQTT::PacketId packetid;
+  Pending pending[CO_INFLIGHT];
+  int inflight;
+  std::deque<std::coroutine_handle<> > slotWaiters;
+
+  Handler handlers[CO_HANDLERS];
+  FP<void, MQTT::MessageData&> defaultMessageHandler;
+  unsigned int incomingQoS2msgids[65536 / 32];
+};
+
+#endif
+
+#endif
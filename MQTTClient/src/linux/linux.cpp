@@ -17,9 +17,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/param.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
@@ -28,186 +31,722 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <signal.h>
 
+#include "MQTTClient.h"
 
-class IPStack
+
+class Countdown
 {
 public:
-  IPStack()
+  Countdown()
   {
 
   }
 
-  int connect(const char* hostname, int port)
+  Countdown(int ms)
   {
-		int type = SOCK_STREAM;
-		struct sockaddr_in address;
-		int rc = -1;
-		sa_family_t family = AF_INET;
-		struct addrinfo *result = NULL;
-		struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+		countdown_ms(ms);
+  }
 
-		if ((rc = getaddrinfo(hostname, NULL, &hints, &result)) == 0)
+
+  bool expired()
+  {
+		struct timeval now, res;
+		getTime(now);
+		timersub(&end_time, &now, &res);
+		//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
+		//if (res.tv_sec > 0 || res.tv_usec > 0)
+		//	printf("expired %d %d\n", res.tv_sec, res.tv_usec);
+        return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+  }
+
+
+  void countdown_ms(int ms)
+  {
+		struct timeval now;
+		getTime(now);
+		struct timeval interval = {ms / 1000, (ms % 1000) * 1000};
+		//printf("interval %d %d\n", interval.tv_sec, interval.tv_usec);
+		timeradd(&now, &interval, &end_time);
+  }
+
+
+  void countdown(int seconds)
+  {
+		struct timeval now;
+		getTime(now);
+		struct timeval interval = {seconds, 0};
+		timeradd(&now, &interval, &end_time);
+  }
+
+
+  int left_ms()
+  {
+		struct timeval now, res;
+		getTime(now);
+		timersub(&end_time, &now, &res);
+		//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
+		// rounded up, so that waiting for this long leaves it expired rather than a fraction of a
+		// millisecond short, which callers would spend polling with no timeout
+        return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + (res.tv_usec + 999) / 1000;
+  }
+
+private:
+
+  // monotonic, so that setting the clock, as happens once the network is up, neither fires
+  // timers early nor holds them up
+  static void getTime(struct timeval &now)
+  {
+		struct timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		now.tv_sec = ts.tv_sec;
+		now.tv_usec = ts.tv_nsec / 1000;
+  }
+
+	struct timeval end_time;
+};
+
+
+#define CONNECTION_ATTEMPT_DELAY_MS 250 /* RFC 8305 */
+#define MAX_CONNECTION_ATTEMPTS 8
+
+
+// the addresses of a host, in the order they should be tried
+struct AddressList
+{
+  struct sockaddr_storage address[MAX_CONNECTION_ATTEMPTS];
+  socklen_t length[MAX_CONNECTION_ATTEMPTS];
+  int count;
+  char host[128]; // the name they were looked up by, which TLS checks the certificate against
+  int port;
+};
+
+
+#define UNIX_PREFIX "unix:"
+
+// a broker on this host listening on a Unix domain socket, unix:/path, or unix:@name for one in the
+// abstract namespace
+static bool isUnixAddress(const char* hostname)
+{
+	return strncmp(hostname, UNIX_PREFIX, sizeof(UNIX_PREFIX) - 1) == 0;
+}
+
+
+/**
+ * Look up hostname with getaddrinfo, interleaving the address families and starting with the one
+ * getaddrinfo prefers (RFC 8305).  flags are extra AI_ flags, such as AI_NUMERICHOST.  Returns 0, or
+ * the getaddrinfo error.  A unix: address needs no lookup, and port is ignored.
+ */
+static int resolveAddresses(const char* hostname, int port, int flags, AddressList& list)
+{
+	struct addrinfo* result = NULL;
+	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
+	char service[8];
+	int rc;
+
+	list.count = 0;
+	snprintf(list.host, sizeof(list.host), "%s", hostname);
+	list.port = port;
+	if (isUnixAddress(hostname))
+	{
+		struct sockaddr_un* address = (struct sockaddr_un*)&list.address[0];
+		const char* path = hostname + sizeof(UNIX_PREFIX) - 1;
+		size_t len = strlen(path);
+
+		if (len == 0 || len >= sizeof(address->sun_path))
+			return EAI_NONAME;
+		memset(address, 0, sizeof(*address));
+		address->sun_family = AF_UNIX;
+		memcpy(address->sun_path, path, len);
+		if (path[0] == '@')
+			address->sun_path[0] = '\0'; // abstract names are not terminated
+		else
+			len++;
+		list.length[0] = offsetof(struct sockaddr_un, sun_path) + len;
+		list.count = 1;
+		return 0;
+	}
+
+	snprintf(service, sizeof(service), "%d", port);
+	hints.ai_flags = AI_NUMERICSERV | flags;
+	if ((rc = getaddrinfo(hostname, service, &hints, &result)) != 0)
+		return rc;
+
+	struct addrinfo* next[2] = {result, result};
+	int family[2] = {result->ai_family, result->ai_family == AF_INET6 ? AF_INET : AF_INET6};
+	for (int turn = 0; list.count < MAX_CONNECTION_ATTEMPTS; turn = !turn)
+	{
+		while (next[turn] && next[turn]->ai_family != family[turn])
+			next[turn] = next[turn]->ai_next;
+		if (next[turn])
+		{
+			memcpy(&list.address[list.count], next[turn]->ai_addr, next[turn]->ai_addrlen);
+			list.length[list.count++] = next[turn]->ai_addrlen;
+			next[turn] = next[turn]->ai_next;
+		}
+		else if (!next[!turn])
+			break;
+	}
+
+	freeaddrinfo(result);
+	return 0;
+}
+
+
+#define RESOLVE_PENDING 1
+#define RESOLVER_ENTRIES 8
+#define RESOLVER_TTL_S 300
+#define RESOLVER_MAX_STALE_S 86400 /* RFC 8767 suggests one to three days */
+
+
+/**
+ * A cache of host addresses, looked up on a thread of its own so that connecting never waits on a
+ * DNS server.  getaddrinfo doesn't give the record's TTL, so addresses are kept for a fixed time,
+ * after which they are still used while they are looked up again.  If that lookup fails they go on
+ * being used for up to a day, since an address which worked recently is a better bet than none
+ * (RFC 8767).  IP addresses are parsed straight away and never wait for the thread.  One Resolver
+ * can be shared by many IPStacks, on any thread.
+ */
+class Resolver
+{
+public:
+  Resolver(int ttl_s = RESOLVER_TTL_S)
+  {
+		this->ttl_s = ttl_s;
+		lookupFunction = resolveAddresses;
+		started = false;
+		stopping = false;
+		used = 0;
+		for (int i = 0; i < RESOLVER_ENTRIES; i++)
+			entries[i] = Entry();
+		pthread_mutex_init(&mutex, NULL);
+		pthread_cond_init(&cond, NULL);
+  }
+
+  // waits for any lookup in progress to finish
+  ~Resolver()
+  {
+		pthread_mutex_lock(&mutex);
+		stopping = true;
+		pthread_cond_signal(&cond);
+		pthread_mutex_unlock(&mutex);
+		if (started)
+			pthread_join(thread, NULL);
+		pthread_cond_destroy(&cond);
+		pthread_mutex_destroy(&mutex);
+  }
+
+  void setTTL(int ttl_s)
+  {
+		this->ttl_s = ttl_s;
+  }
+
+  // what the thread looks hosts up with, resolveAddresses unless a check has put a stub in its place
+  typedef int (*LookupFunction)(const char* hostname, int port, int flags, AddressList& list);
+
+  void setLookup(LookupFunction lookupFunction)
+  {
+		this->lookupFunction = lookupFunction;
+  }
+
+  /**
+   * Returns 0 with the addresses of hostname, RESOLVE_PENDING if they are still being looked up, or
+   * -1 if the lookup failed and there are no addresses to fall back on.  The next call after a
+   * failure starts another lookup.
+   */
+  int lookup(const char* hostname, int port, AddressList& list)
+  {
+		if (resolveAddresses(hostname, port, AI_NUMERICHOST, list) == 0)
+			return 0;
+		if (isUnixAddress(hostname))
+			return -1; // a path which doesn't fit, which no lookup will change
+
+		pthread_mutex_lock(&mutex);
+
+		Entry* entry = find(hostname, port);
+		int rc = RESOLVE_PENDING;
+
+		if (entry == NULL)
+			rc = RESOLVE_PENDING; // try again once the thread has caught up
+		else if (entry->failed)
+		{
+			entry->failed = false;
+			rc = -1;
+		}
+		else if (entry->valid && !entry->usable.expired())
+		{
+			list = entry->list;
+			rc = 0;
+			if (entry->fresh.expired())
+				request(entry);
+		}
+		else
+			request(entry);
+
+		pthread_mutex_unlock(&mutex);
+		return rc;
+  }
+
+private:
+
+  struct Entry
+  {
+		char host[128];
+		int port;
+		bool valid;     // list holds addresses, though they may be stale
+		bool pending;   // waiting for the thread to look it up
+		bool failed;    // the last lookup failed with nothing to fall back on
+		AddressList list;
+		Countdown fresh;
+		Countdown usable;
+		unsigned long lastUsed;
+  };
+
+  // the entry for hostname, or a new one in place of the one unused for longest, or NULL if none is free
+  Entry* find(const char* hostname, int port)
+  {
+		Entry* oldest = NULL;
+
+		used++;
+		for (int i = 0; i < RESOLVER_ENTRIES; i++)
 		{
-			struct addrinfo* res = result;
+			Entry* entry = &entries[i];
 
-			/* prefer ip4 addresses */
-			while (res)
+			if (entry->port == port && strcmp(entry->host, hostname) == 0)
 			{
-				if (res->ai_family == AF_INET)
-				{
-					result = res;
-					break;
-				}
-				res = res->ai_next;
+				entry->lastUsed = used;
+				return entry;
+			}
+			if (!entry->pending && (oldest == NULL || entry->lastUsed < oldest->lastUsed))
+				oldest = entry;
+		}
+
+		// only with more hosts than entries
+		if (oldest == NULL)
+			return NULL;
+		*oldest = Entry();
+		snprintf(oldest->host, sizeof(oldest->host), "%s", hostname);
+		oldest->port = port;
+		oldest->lastUsed = used;
+		return oldest;
+  }
+
+  // called with the mutex held
+  void request(Entry* entry)
+  {
+		if (entry->pending)
+			return;
+
+		entry->pending = true;
+		if (!started)
+		{
+			started = pthread_create(&thread, NULL, &Resolver::run, this) == 0;
+			if (!started)
+			{
+				// no thread, so look it up here rather than never
+				pthread_mutex_unlock(&mutex);
+				resolve(entry);
+				pthread_mutex_lock(&mutex);
 			}
+		}
+		pthread_cond_signal(&cond);
+  }
+
+  static void* run(void* arg)
+  {
+		Resolver* resolver = (Resolver*)arg;
+
+		pthread_mutex_lock(&resolver->mutex);
+		while (!resolver->stopping)
+		{
+			Entry* entry = NULL;
 
-			if (result->ai_family == AF_INET)
+			for (int i = 0; i < RESOLVER_ENTRIES && entry == NULL; i++)
 			{
-				address.sin_port = htons(port);
-				address.sin_family = family = AF_INET;
-				address.sin_addr = ((struct sockaddr_in*)(result->ai_addr))->sin_addr;
+				if (resolver->entries[i].pending)
+					entry = &resolver->entries[i];
 			}
+
+			if (entry == NULL)
+				pthread_cond_wait(&resolver->cond, &resolver->mutex);
 			else
-				rc = -1;
+			{
+				pthread_mutex_unlock(&resolver->mutex);
+				resolver->resolve(entry);
+				pthread_mutex_lock(&resolver->mutex);
+			}
+		}
+		pthread_mutex_unlock(&resolver->mutex);
+		return NULL;
+  }
+
+  // called without the mutex, for an entry which stays put while it is pending
+  void resolve(Entry* entry)
+  {
+		AddressList list;
+		char host[128];
+
+		pthread_mutex_lock(&mutex);
+		memcpy(host, entry->host, sizeof(host));
+		int port = entry->port;
+		pthread_mutex_unlock(&mutex);
 
-			freeaddrinfo(result);
+		int rc = lookupFunction(host, port, 0, list);
+
+		pthread_mutex_lock(&mutex);
+		if (rc == 0 && list.count > 0)
+		{
+			entry->list = list;
+			entry->valid = true;
+			entry->fresh.countdown(ttl_s);
+			entry->usable.countdown(RESOLVER_MAX_STALE_S);
 		}
+		else if (!entry->valid || entry->usable.expired())
+		{
+			entry->valid = false;
+			entry->failed = true;
+		}
+		else
+			entry->fresh.countdown(ttl_s); // keep serving the stale addresses, and try again later
+		entry->pending = false;
+		pthread_mutex_unlock(&mutex);
+  }
 
-		if (rc == 0)
+  int ttl_s;
+  LookupFunction lookupFunction;
+  bool started;
+  bool stopping;
+  unsigned long used;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  Entry entries[RESOLVER_ENTRIES];
+};
+
+
+class IPStack
+{
+public:
+  IPStack()
+  {
+		mysock = -1;
+		connect_timeout_ms = 5000;
+  }
+
+  // how long each address gets to complete the TCP handshake
+  void setConnectTimeout(int timeout_ms)
+  {
+		connect_timeout_ms = timeout_ms;
+  }
+
+  // look up hostname, waiting for the answer, and connect to it
+  int connect(const char* hostname, int port)
+  {
+		AddressList list;
+
+		mysock = -1;
+		if (resolveAddresses(hostname, port, 0, list) != 0)
+			return -1;
+		return connect(list);
+  }
+
+  /**
+   * Connect to the first of the addresses which answers, trying them in order, with each attempt
+   * started 250 ms after the one before or as soon as it fails, and abandoned after the connect
+   * timeout (RFC 8305).  So an address which is blackholed costs 250 ms rather than the kernel's SYN
+   * timeout.
+   */
+  int connect(const AddressList& list)
+  {
+		struct pollfd fds[MAX_CONNECTION_ATTEMPTS];
+		Countdown deadlines[MAX_CONNECTION_ATTEMPTS];
+		Countdown nextAttempt(0);
+		int started = 0, running = 0, winner = -1;
+		int count = list.count;
+
+		mysock = -1;
+		while (mysock == -1 && (started < count || running > 0))
 		{
-			mysock = socket(family, type, 0);
-			if (mysock != -1)
+			if (started < count && (nextAttempt.expired() || running == 0))
 			{
-				int opt = 1;
+				const struct sockaddr* address = (const struct sockaddr*)&list.address[started];
+				int sock = socket(address->sa_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
 
-				//if (setsockopt(mysock, SOL_SOCKET, SO_NOSIGPIPE, (void*)&opt, sizeof(opt)) != 0)
-				//	printf("Could not set SO_NOSIGPIPE for socket %d", mysock);
+				fds[started].fd = -1;
+				fds[started].events = POLLOUT;
+				if (sock != -1 && (::connect(sock, address, list.length[started]) == 0 || errno == EINPROGRESS))
+				{
+					fds[started].fd = sock;
+					deadlines[started].countdown_ms(connect_timeout_ms);
+					running++;
+				}
+				else if (sock != -1)
+					::close(sock);
+				started++;
+				nextAttempt.countdown_ms(CONNECTION_ATTEMPT_DELAY_MS);
+				continue;
+			}
+
+			int timeout = started < count ? nextAttempt.left_ms() : connect_timeout_ms;
+			for (int i = 0; i < started; i++)
+			{
+				if (fds[i].fd != -1 && deadlines[i].left_ms() < timeout)
+					timeout = deadlines[i].left_ms();
+			}
+
+			if (::poll(fds, started, timeout) < 0 && errno != EINTR)
+				break;
+
+			for (int i = 0; i < started; i++)
+			{
+				int error = 0;
+				socklen_t len = sizeof(error);
 
-				rc = ::connect(mysock, (struct sockaddr*)&address, sizeof(address));
+				if (fds[i].fd == -1)
+					continue;
+				if (fds[i].revents != 0 && getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0 && mysock == -1)
+				{
+					mysock = fds[i].fd;
+					fds[i].fd = -1;
+					winner = i;
+				}
+				else if (fds[i].revents != 0 || deadlines[i].expired())
+				{
+					::close(fds[i].fd);
+					fds[i].fd = -1;
+					running--;
+					nextAttempt.countdown_ms(0); // a failed attempt starts the next one straight away
+				}
 			}
 		}
 
-        return rc;
-    }
+		for (int i = 0; i < started; i++)
+		{
+			if (fds[i].fd != -1)
+				::close(fds[i].fd);
+		}
+
+		if (mysock == -1)
+			return -1;
+
+		// the socket stays non-blocking, with read and write waiting in poll.  MQTT packets are
+		// small and each is sent in one write, so there is nothing for Nagle to gather
+		if (((const struct sockaddr*)&list.address[winner])->sa_family != AF_UNIX)
+		{
+			int nodelay = 1;
+			setsockopt(mysock, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+		}
+		return 0;
+  }
 
   // return -1 on error, or the number of bytes read
   // which could be 0 on a read timeout
   int read(unsigned char* buffer, int len, int timeout_ms)
   {
-		struct timeval interval = {timeout_ms / 1000, (timeout_ms % 1000) * 1000};
-		if (interval.tv_sec < 0 || (interval.tv_sec == 0 && interval.tv_usec <= 0))
-		{
-			interval.tv_sec = 0;
-			interval.tv_usec = 100;
-		}
-
-		setsockopt(mysock, SOL_SOCKET, SO_RCVTIMEO, (char *)&interval, sizeof(struct timeval));
-
+		Countdown deadline(timeout_ms);
 		int bytes = 0;
-    int i = 0; const int max_tries = 10;
+
+		// try first and poll only if there is nothing there yet, so that data which has
+		// already arrived costs one system call
 		while (bytes < len)
 		{
 			int rc = ::recv(mysock, &buffer[bytes], (size_t)(len - bytes), 0);
-			if (rc == -1)
+			if (rc > 0)
+				bytes += rc;
+			else if (rc == 0)
 			{
-        if (errno != EAGAIN && errno != EWOULDBLOCK)
-          bytes = -1;
-        break;
+				if (bytes == 0)
+					bytes = -1; // the other end closed the connection
+				break;
+			}
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				if (deadline.expired() || wait(POLLIN, deadline) <= 0)
+					break;
+			}
+			else if (errno != EINTR)
+			{
+				bytes = -1;
+				break;
 			}
-			else
-				bytes += rc;
-      if (++i >= max_tries)
-        break;
-      if (rc == 0)
-        break;
 		}
 		return bytes;
   }
 
-  int write(unsigned char* buffer, int len, int timeout)
+  // return -1 on error, or the number of bytes written, which is less than len on a timeout
+  int write(unsigned char* buffer, int len, int timeout_ms)
   {
-		struct timeval tv;
-
-		tv.tv_sec = 0;  /* 30 Secs Timeout */
-		tv.tv_usec = timeout * 1000;  // Not init'ing this can cause strange errors
+		Countdown deadline(timeout_ms);
+		int bytes = 0;
 
-		setsockopt(mysock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(struct timeval));
-		int	rc = ::write(mysock, buffer, len);
-		//printf("write rc %d\n", rc);
-		return rc;
+		while (bytes < len)
+		{
+			// MSG_NOSIGNAL, so that a closed connection is an error rather than a SIGPIPE
+			int rc = ::send(mysock, &buffer[bytes], (size_t)(len - bytes), MSG_NOSIGNAL);
+			if (rc >= 0)
+				bytes += rc;
+			else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				if (deadline.expired() || wait(POLLOUT, deadline) <= 0)
+					break;
+			}
+			else if (errno != EINTR)
+			{
+				bytes = -1;
+				break;
+			}
+		}
+		return bytes;
   }
 
 	int disconnect()
 	{
-		return ::close(mysock);
+		int rc = ::close(mysock);
+		mysock = -1;
+		return rc;
 	}
 
-private:
+	// the socket, so that many connections can be waited on together, or -1
+	int getSocket()
+	{
+		return mysock;
+	}
+
+	// whether read has data held above the socket, which waiting on the socket won't see
+	bool buffered()
+	{
+		return false;
+	}
+
+	// take over a socket connected somewhere else, such as a standby connection to another broker
+	void adopt(int sock)
+	{
+		if (mysock != -1)
+			::close(mysock);
+		mysock = sock;
+	}
+
+	// give up the socket without closing it
+	int release()
+	{
+		int sock = mysock;
+		mysock = -1;
+		return sock;
+	}
+
+protected:
 
-    int mysock;
+  // wait for events on the socket until the deadline.  Returns > 0 when they happen, 0 at the
+  // deadline or -1 on error
+  int wait(short events, Countdown& deadline)
+  {
+		struct pollfd pfd = {mysock, events, 0};
+		int rc;
+
+		while ((rc = ::poll(&pfd, 1, deadline.left_ms())) == -1 && errno == EINTR)
+			;
+		return rc;
+  }
+
+  int mysock;
+  int connect_timeout_ms;
 };
 
 
-class Countdown
+class FileSessionStore : public MQTT::SessionStore
 {
 public:
-  Countdown()
+  FileSessionStore(const char* path)
   {
-
+		snprintf(filename, sizeof(filename), "%s", path);
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", path);
   }
 
-  Countdown(int ms)
+  int load(unsigned char* buf, int buflen)
   {
-		countdown_ms(ms);
+		int fd = open(filename, O_RDONLY);
+		if (fd == -1)
+			return -1;
+		int rc = ::read(fd, buf, buflen);
+		close(fd);
+		return rc;
   }
 
-
-  bool expired()
+  // write a new copy and rename it over the old one, so a power cut never leaves half a session
+  int save(const unsigned char* buf, int len)
   {
-		struct timeval now, res;
-		gettimeofday(&now, NULL);
-		timersub(&end_time, &now, &res);
-		//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-		//if (res.tv_sec > 0 || res.tv_usec > 0)
-		//	printf("expired %d %d\n", res.tv_sec, res.tv_usec);
-        return res.tv_sec < 0 || (res.tv_sec == 0 && res.tv_usec <= 0);
+		int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd == -1)
+			return -1;
+		int rc = (::write(fd, buf, len) == len && fsync(fd) == 0) ? 0 : -1;
+		close(fd);
+		if (rc == 0)
+			rc = rename(tmpname, filename);
+		return rc;
   }
 
-
-  void countdown_ms(int ms)
+  void clear()
   {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		struct timeval interval = {ms / 1000, (ms % 1000) * 1000};
-		//printf("interval %d %d\n", interval.tv_sec, interval.tv_usec);
-		timeradd(&now, &interval, &end_time);
+		unlink(filename);
   }
 
+private:
 
-  void countdown(int seconds)
+	char filename[256];
+	char tmpname[260];
+};
+
+
+#define MAX_READER_FILES 8
+
+/**
+ * Reads a set of small files from the start each time, as poll does with sysfs attributes, with a
+ * pread for each rather than a seek and a read.
+ */
+class FileReader
+{
+public:
+  FileReader()
   {
-		struct timeval now;
-		gettimeofday(&now, NULL);
-		struct timeval interval = {seconds, 0};
-		timeradd(&now, &interval, &end_time);
+		count = 0;
   }
 
+  // the files to read, which the caller keeps open
+  void setFiles(const int* fds, int count)
+  {
+		this->count = count < MAX_READER_FILES ? count : MAX_READER_FILES;
+		for (int i = 0; i < this->count; i++)
+			this->fds[i] = fds[i];
+  }
 
-  int left_ms()
+  /**
+   * Read up to size - 1 bytes of the ith file into buffers + i * size, terminated.  A file which
+   * can't be read leaves its buffer as it was.  Returns the number of files read.
+   */
+  int read(char* buffers, int size)
   {
-		struct timeval now, res;
-		gettimeofday(&now, NULL);
-		timersub(&end_time, &now, &res);
-		//printf("left %d ms\n", (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000);
-        return (res.tv_sec < 0) ? 0 : res.tv_sec * 1000 + res.tv_usec / 1000;
+		int n = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			int rc = pread(fds[i], &buffers[i * size], size - 1, 0);
+			if (rc >= 0)
+			{
+				buffers[i * size + rc] = '\0';
+				n++;
+			}
+		}
+		return n;
   }
 
-private:
+protected:
 
-	struct timeval end_time;
+  int fds[MAX_READER_FILES];
+  int count;
 };
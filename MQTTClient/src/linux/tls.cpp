@@ -0,0 +1,521 @@
+/*
+ * TLS for MQTT::Client on Linux, with OpenSSL 1.1.1 or later, used in place of IPStack when built
+ * with WINK_USE_TLS.
+ *
+ * A TLSContext holds the certificates and the sessions of the brokers connected to, and can be
+ * shared by many TLSStacks.  Reconnecting to a broker resumes the last session it gave us, which
+ * skips sending and checking its certificate chain, and the sessions can be kept in a file so
+ * that a restarted handler resumes them too.  Where OpenSSL and the kernel support kernel TLS,
+ * records are encrypted as they are sent, straight from the client's buffer.
+ *
+ * Without a context, TLSStack behaves as the IPStack it extends.  Include this after linux.cpp.
+ */
+
+#if !defined(TLS_CPP)
+#define TLS_CPP
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#define TLS_SESSIONS 8
+#define TLS_SESSION_SIZE 8192 /* the largest session kept in the file, which includes the broker's certificate */
+#define TLS_SAVE_INTERVAL_S 60
+
+
+// who a connection is to, which is how its session is found again
+struct TLSPeer
+{
+  char host[128];
+  int port;
+};
+
+
+class TLSContext
+{
+public:
+  TLSContext()
+  {
+		ctx = NULL;
+		started = false;
+		valid = false;
+		caFile[0] = certFile[0] = keyFile[0] = sessionFile[0] = '\0';
+		for (int i = 0; i < TLS_SESSIONS; i++)
+		{
+			entries[i].peer.host[0] = '\0';
+			entries[i].session = NULL;
+		}
+		saveTimer.countdown_ms(0);
+		pthread_mutex_init(&mutex, NULL);
+  }
+
+  ~TLSContext()
+  {
+		for (int i = 0; i < TLS_SESSIONS; i++)
+			SSL_SESSION_free(entries[i].session);
+		SSL_CTX_free(ctx);
+		pthread_mutex_destroy(&mutex);
+  }
+
+  // the certificates to trust, rather than the system's
+  void setCAFile(const char* path)
+  {
+		snprintf(caFile, sizeof(caFile), "%s", path != NULL ? path : "");
+  }
+
+  // a certificate for brokers which want the client to have one, with its key if that is in a file of its own
+  void setCertificate(const char* certPath, const char* keyPath)
+  {
+		snprintf(certFile, sizeof(certFile), "%s", certPath != NULL ? certPath : "");
+		snprintf(keyFile, sizeof(keyFile), "%s", keyPath != NULL ? keyPath : certFile);
+  }
+
+  // keep the sessions in a file as well, so that they outlast the process
+  void setSessionFile(const char* path)
+  {
+		snprintf(sessionFile, sizeof(sessionFile), "%s", path != NULL ? path : "");
+  }
+
+  // whether the certificates could be loaded.  Everything is set up on first use, after the settings
+  bool isValid()
+  {
+		pthread_mutex_lock(&mutex);
+		if (!started)
+		{
+			started = true;
+			valid = setup() == 0;
+		}
+		pthread_mutex_unlock(&mutex);
+		return valid;
+  }
+
+  // a connection to peer, which checks its certificate and offers the session it last gave us
+  SSL* open(TLSPeer* peer)
+  {
+		SSL* ssl;
+		unsigned char address[16];
+
+		if (!isValid() || (ssl = SSL_new(ctx)) == NULL)
+			return NULL;
+
+		SSL_set_app_data(ssl, peer);
+		if (inet_pton(AF_INET, peer->host, address) == 1 || inet_pton(AF_INET6, peer->host, address) == 1)
+			X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), peer->host);
+		else
+		{
+			SSL_set_tlsext_host_name(ssl, peer->host);
+			SSL_set1_host(ssl, peer->host);
+		}
+
+		pthread_mutex_lock(&mutex);
+		Entry* entry = find(peer, false);
+		if (entry != NULL && entry->session != NULL)
+			SSL_set_session(ssl, entry->session);
+		pthread_mutex_unlock(&mutex);
+		return ssl;
+  }
+
+  // forget peer's session, which it wouldn't take
+  void forget(TLSPeer* peer)
+  {
+		pthread_mutex_lock(&mutex);
+		Entry* entry = find(peer, false);
+		if (entry != NULL)
+		{
+			SSL_SESSION_free(entry->session);
+			entry->session = NULL;
+			entry->peer.host[0] = '\0';
+		}
+		pthread_mutex_unlock(&mutex);
+  }
+
+private:
+
+  struct Entry
+  {
+		TLSPeer peer;
+		SSL_SESSION* session;
+  };
+
+  int setup()
+  {
+		if ((ctx = SSL_CTX_new(TLS_client_method())) == NULL)
+			return -1;
+
+		SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+		if ((caFile[0] != '\0' ? SSL_CTX_load_verify_locations(ctx, caFile, NULL) : SSL_CTX_set_default_verify_paths(ctx)) != 1)
+			return -1;
+		if (certFile[0] != '\0' && SSL_CTX_use_certificate_chain_file(ctx, certFile) != 1)
+			return -1;
+		if (certFile[0] != '\0' && SSL_CTX_use_PrivateKey_file(ctx, keyFile, SSL_FILETYPE_PEM) != 1)
+			return -1;
+
+		// sessions are kept here, by broker, rather than in OpenSSL's cache, which a client can't look up by
+		SSL_CTX_set_app_data(ctx, this);
+		SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx, newSession);
+
+		// write straight from the caller's buffer, which may move between retries, and free the
+		// record buffers of connections with nothing to send or receive
+		SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+#if defined(SSL_OP_ENABLE_KTLS)
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+
+		// OpenSSL writes to the socket without MSG_NOSIGNAL, so a broker which has gone away would
+		// kill the process with SIGPIPE, unless something else is already handling it
+		struct sigaction action;
+		if (sigaction(SIGPIPE, NULL, &action) == 0 && action.sa_handler == SIG_DFL)
+			signal(SIGPIPE, SIG_IGN);
+
+		load();
+		return 0;
+  }
+
+  // OpenSSL hands over a session when the handshake is done, or for TLS 1.3 when the broker sends a ticket
+  static int newSession(SSL* ssl, SSL_SESSION* session)
+  {
+		TLSContext* context = (TLSContext*)SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+		TLSPeer* peer = (TLSPeer*)SSL_get_app_data(ssl);
+
+		pthread_mutex_lock(&context->mutex);
+		Entry* entry = context->find(peer, true);
+		SSL_SESSION_free(entry->session);
+		entry->session = session;
+		// writing the file would add to the reconnect it arrived during, and a session from a
+		// minute ago resumes as well after a restart
+		if (context->saveTimer.expired())
+		{
+			context->save();
+			context->saveTimer.countdown(TLS_SAVE_INTERVAL_S);
+		}
+		pthread_mutex_unlock(&context->mutex);
+		return 1; // the session is ours now
+  }
+
+  // the entry for peer, or if create, an empty one or the first in its place
+  Entry* find(TLSPeer* peer, bool create)
+  {
+		Entry* empty = NULL;
+
+		for (int i = 0; i < TLS_SESSIONS; i++)
+		{
+			if (entries[i].peer.host[0] == '\0')
+			{
+				if (empty == NULL)
+					empty = &entries[i];
+			}
+			else if (entries[i].peer.port == peer->port && strcmp(entries[i].peer.host, peer->host) == 0)
+				return &entries[i];
+		}
+		if (!create)
+			return NULL;
+
+		Entry* entry = empty != NULL ? empty : &entries[0];
+		SSL_SESSION_free(entry->session);
+		entry->session = NULL;
+		entry->peer = *peer;
+		return entry;
+  }
+
+  // each session as its peer followed by its length and its DER encoding
+  void load()
+  {
+		FILE* file;
+		TLSPeer peer;
+		int len;
+		unsigned char buffer[TLS_SESSION_SIZE];
+
+		if (sessionFile[0] == '\0' || (file = fopen(sessionFile, "rb")) == NULL)
+			return;
+		while (fread(&peer, sizeof(peer), 1, file) == 1 && fread(&len, sizeof(len), 1, file) == 1 &&
+			   len > 0 && len <= TLS_SESSION_SIZE && fread(buffer, len, 1, file) == 1)
+		{
+			const unsigned char* p = buffer;
+			SSL_SESSION* session = d2i_SSL_SESSION(NULL, &p, len);
+
+			peer.host[sizeof(peer.host) - 1] = '\0';
+			if (session != NULL && SSL_SESSION_is_resumable(session) && isTrusted(session, &peer))
+				find(&peer, true)->session = session;
+			else
+				SSL_SESSION_free(session);
+		}
+		fclose(file);
+  }
+
+  /**
+   * Whether the certificate a saved session was made with would pass now.  Resuming a session skips
+   * checking the broker's certificate, so one from a file written with other settings, or by
+   * someone else, must not get around them.
+   */
+  bool isTrusted(SSL_SESSION* session, TLSPeer* peer)
+  {
+		X509* cert = SSL_SESSION_get0_peer(session);
+		X509_STORE_CTX* store = X509_STORE_CTX_new();
+		unsigned char address[16];
+		bool trusted = false;
+
+		if (cert != NULL && store != NULL && X509_STORE_CTX_init(store, SSL_CTX_get_cert_store(ctx), cert, NULL) == 1)
+		{
+			X509_STORE_CTX_set_default(store, "ssl_server");
+			if (X509_verify_cert(store) == 1)
+			{
+				if (inet_pton(AF_INET, peer->host, address) == 1 || inet_pton(AF_INET6, peer->host, address) == 1)
+					trusted = X509_check_ip_asc(cert, peer->host, 0) == 1;
+				else
+					trusted = X509_check_host(cert, peer->host, 0, 0, NULL) == 1;
+			}
+		}
+		X509_STORE_CTX_free(store);
+		return trusted;
+  }
+
+  // write a new copy and rename it over the old one.  Not synced, as a lost session only costs a full handshake
+  void save()
+  {
+		char tmpname[260];
+		FILE* file;
+
+		if (sessionFile[0] == '\0')
+			return;
+		snprintf(tmpname, sizeof(tmpname), "%s.tmp", sessionFile);
+		if ((file = fopen(tmpname, "wb")) == NULL)
+			return;
+		for (int i = 0; i < TLS_SESSIONS; i++)
+		{
+			unsigned char buffer[TLS_SESSION_SIZE];
+			unsigned char* p = buffer;
+			int len;
+
+			if (entries[i].session == NULL || (len = i2d_SSL_SESSION(entries[i].session, NULL)) <= 0 || len > TLS_SESSION_SIZE)
+				continue;
+			i2d_SSL_SESSION(entries[i].session, &p);
+			fwrite(&entries[i].peer, sizeof(entries[i].peer), 1, file);
+			fwrite(&len, sizeof(len), 1, file);
+			fwrite(buffer, len, 1, file);
+		}
+		if (fclose(file) == 0)
+			rename(tmpname, sessionFile);
+  }
+
+  SSL_CTX* ctx;
+  bool started;
+  bool valid;
+  char caFile[256];
+  char certFile[256];
+  char keyFile[256];
+  char sessionFile[256];
+
+  Entry entries[TLS_SESSIONS];
+  Countdown saveTimer;
+  pthread_mutex_t mutex;
+};
+
+
+/**
+ * An IPStack which runs TLS over its connections, once given a TLSContext.  Connections over a
+ * Unix domain socket stay plain, as they never leave the host.
+ */
+class TLSStack : public IPStack
+{
+public:
+  TLSStack()
+  {
+		context = NULL;
+		ssl = NULL;
+		resumed = false;
+		lastError = SSL_ERROR_NONE;
+  }
+
+  ~TLSStack()
+  {
+		disconnect();
+  }
+
+  void setContext(TLSContext* context)
+  {
+		this->context = context;
+  }
+
+  // look up hostname, waiting for the answer, and connect to it
+  int connect(const char* hostname, int port)
+  {
+		AddressList list;
+
+		if (resolveAddresses(hostname, port, 0, list) != 0)
+			return -1;
+		return connect(list);
+  }
+
+  int connect(const AddressList& list)
+  {
+		int rc = IPStack::connect(list);
+		if (rc == 0)
+			rc = handshake(list.host, list.port);
+		return rc;
+  }
+
+  /**
+   * Start TLS with host on a connection made some other way, such as a standby connection adopted
+   * from an IPStack, within the connect timeout.  Returns 0, or -1 having disconnected.
+   */
+  int handshake(const char* host, int port)
+  {
+		if (context == NULL || isUnixAddress(host))
+			return 0;
+
+		Countdown deadline(connect_timeout_ms);
+
+		if (ssl != NULL)
+			SSL_free(ssl);
+		resumed = false;
+		lastError = SSL_ERROR_NONE;
+		snprintf(peer.host, sizeof(peer.host), "%s", host);
+		peer.port = port;
+		ERR_clear_error();
+		if ((ssl = context->open(&peer)) == NULL || SSL_set_fd(ssl, mysock) != 1)
+		{
+			disconnect();
+			return -1;
+		}
+
+		int rc;
+		while ((rc = SSL_connect(ssl)) != 1)
+		{
+			if (!retry(rc, deadline))
+			{
+				// the session may be what it didn't like, so don't offer it again
+				if (SSL_session_reused(ssl))
+					context->forget(&peer);
+				disconnect();
+				return -1;
+			}
+		}
+		resumed = SSL_session_reused(ssl);
+		return 0;
+  }
+
+  // whether the last handshake resumed a session, rather than checking the broker's certificate again
+  bool isResumed()
+  {
+		return resumed;
+  }
+
+  // whether read has data held above the socket: the rest of a record which had more than one packet
+  bool buffered()
+  {
+		return ssl != NULL && SSL_has_pending(ssl);
+  }
+
+  // return -1 on error, or the number of bytes read
+  // which could be 0 on a read timeout
+  int read(unsigned char* buffer, int len, int timeout_ms)
+  {
+		if (ssl == NULL)
+			return IPStack::read(buffer, len, timeout_ms);
+
+		Countdown deadline(timeout_ms);
+		int bytes = 0;
+
+		ERR_clear_error();
+		while (bytes < len)
+		{
+			int rc = SSL_read(ssl, &buffer[bytes], len - bytes);
+			if (rc > 0)
+				bytes += rc;
+			else if (!retry(rc, deadline))
+			{
+				if (bytes == 0 && !isTimeout())
+					bytes = -1;
+				break;
+			}
+		}
+		return bytes;
+  }
+
+  // return -1 on error, or the number of bytes written, which is less than len on a timeout
+  int write(unsigned char* buffer, int len, int timeout_ms)
+  {
+		if (ssl == NULL)
+			return IPStack::write(buffer, len, timeout_ms);
+
+		Countdown deadline(timeout_ms);
+		int bytes = 0;
+
+		ERR_clear_error();
+		while (bytes < len)
+		{
+			int rc = SSL_write(ssl, &buffer[bytes], len - bytes);
+			if (rc > 0)
+				bytes += rc;
+			else if (!retry(rc, deadline))
+			{
+				if (!isTimeout())
+					bytes = -1;
+				break;
+			}
+		}
+		return bytes;
+  }
+
+  int disconnect()
+  {
+		if (ssl != NULL)
+		{
+			// a close_notify if there is room for it, without waiting, which isn't allowed after a fatal error
+			if (lastError != SSL_ERROR_SYSCALL && lastError != SSL_ERROR_SSL)
+				SSL_shutdown(ssl);
+			SSL_free(ssl);
+			ssl = NULL;
+		}
+		return IPStack::disconnect();
+  }
+
+  // take over a plain connection, on which handshake starts TLS
+  void adopt(int sock)
+  {
+		if (ssl != NULL)
+		{
+			SSL_free(ssl);
+			ssl = NULL;
+		}
+		IPStack::adopt(sock);
+  }
+
+  // give up the socket without closing it.  Its TLS session can't go with it
+  int release()
+  {
+		if (ssl != NULL)
+		{
+			SSL_free(ssl);
+			ssl = NULL;
+		}
+		return IPStack::release();
+  }
+
+private:
+
+  // whether the call which returned rc only needs the socket to be ready, and it was before the deadline
+  bool retry(int rc, Countdown& deadline)
+  {
+		lastError = SSL_get_error(ssl, rc);
+		if (lastError != SSL_ERROR_WANT_READ && lastError != SSL_ERROR_WANT_WRITE)
+			return false;
+		return !deadline.expired() && wait(lastError == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, deadline) > 0;
+  }
+
+  // whether the last call gave up at the deadline, rather than failing
+  bool isTimeout()
+  {
+		return lastError == SSL_ERROR_WANT_READ || lastError == SSL_ERROR_WANT_WRITE;
+  }
+
+  TLSContext* context;
+  TLSPeer peer;
+  SSL* ssl;
+  bool resumed;
+  int lastError;
+};
+
+#endif
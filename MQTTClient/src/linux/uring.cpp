@@ -0,0 +1,835 @@
+/*
+ * io_uring networking for MQTT::Client on Linux 6.0 and later, used in place of IPStack when built
+ * with WINK_USE_IO_URING.
+ *
+ * One Uring is shared by every connection on a thread.  Each connection keeps a multishot receive
+ * armed which picks buffers from a ring the kernel takes them from, and sends are queued without
+ * waiting for them to complete.  Waiting for a deadline is a timeout on the same io_uring_enter
+ * that submits, so a thread running many connections reaps everything that has arrived from
+ * shared memory and makes one system call per round rather than several per packet.  UringReader
+ * reads a relay's sysfs files through the same ring, all of them in one submission.
+ *
+ * With a kernel which can't do this, UringStack and UringReader quietly behave as the IPStack and
+ * FileReader they extend.  Include
+ * this after linux.cpp.
+ */
+
+#if !defined(URING_CPP)
+#define URING_CPP
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include "FP.h"
+
+#define URING_ENTRIES 256
+#define URING_BUFFERS 1024 /* a power of two */
+#define URING_BUFFER_SIZE 2048
+#define URING_SEND_SIZE 4096
+#define URING_FILES 4096
+
+
+// what a request does when it completes, called with the completion
+typedef FP<void, const struct io_uring_cqe&> UringRequest;
+
+
+// received data waiting to be read, as a list of the ring's buffers
+struct UringQueue
+{
+  int head;
+  int tail;
+  int offset; // into the head buffer
+};
+
+
+class Uring
+{
+public:
+  Uring(unsigned buffers = URING_BUFFERS, unsigned entries = URING_ENTRIES)
+  {
+		this->buffers = buffers;
+		this->entries = entries;
+		fd = -1;
+		valid = false;
+		started = false;
+		multishot = true;
+		autoSubmit = true;
+		toSubmit = 0;
+		fileSlots = 0;
+		nextFile = 0;
+		sqRing = cqRing = NULL;
+		sqes = NULL;
+		bufRing = NULL;
+		pool = NULL;
+		links = NULL;
+  }
+
+  ~Uring()
+  {
+		if (fd != -1)
+			::close(fd);
+		if (sqRing != NULL)
+			munmap(sqRing, sqRingSize);
+		if (cqRing != NULL && cqRing != sqRing)
+			munmap(cqRing, cqRingSize);
+		if (sqes != NULL)
+			munmap(sqes, entries * sizeof(struct io_uring_sqe));
+		if (bufRing != NULL)
+			munmap(bufRing, buffers * sizeof(struct io_uring_buf));
+		delete[] pool;
+		delete[] links;
+  }
+
+  // whether this kernel can do what UringStack needs.  The ring is set up on first use, by the
+  // thread which will use it
+  bool isValid()
+  {
+		if (!started)
+		{
+			started = true;
+			valid = setup() == 0;
+		}
+		return valid;
+  }
+
+  /**
+   * With autoSubmit off, queued requests wait to be submitted along with the next wait, or a call to
+   * submit(), so that a loop over many connections makes one system call for all of their sends.
+   */
+  void setAutoSubmit(bool autoSubmit)
+  {
+		this->autoSubmit = autoSubmit;
+  }
+
+  bool getAutoSubmit()
+  {
+		return autoSubmit;
+  }
+
+  bool getMultishot()
+  {
+		return multishot;
+  }
+
+  // multishot receives came back EINVAL, so this kernel is older than 6.0
+  void clearMultishot()
+  {
+		multishot = false;
+  }
+
+  // the next free submission entry, cleared, submitting what is queued first if there are none
+  struct io_uring_sqe* getSqe()
+  {
+		unsigned tail = *sqTail;
+
+		if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries)
+		{
+			submit();
+			if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= entries)
+				return NULL;
+		}
+
+		struct io_uring_sqe* sqe = &sqes[tail & *sqMask];
+		memset(sqe, 0, sizeof(*sqe));
+		sqArray[tail & *sqMask] = tail & *sqMask;
+		__atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+		toSubmit++;
+		return sqe;
+  }
+
+  // hand the queued requests to the kernel without waiting
+  int submit()
+  {
+		return isValid() && toSubmit > 0 ? enter(0, 0) : 0;
+  }
+
+  /**
+   * Submit what is queued, wait until there are waitFor completions or timeout_ms has gone, and run
+   * the completions.  Returns the number run, or -1 on error.
+   */
+  int run(int timeout_ms, unsigned waitFor = 1)
+  {
+		if (!isValid())
+			return -1;
+
+		// completions the CQ had no room for wait in the kernel until we enter
+		if (__atomic_load_n(sqFlags, __ATOMIC_RELAXED) & IORING_SQ_CQ_OVERFLOW)
+			enter(0, 0);
+
+		int count = reap();
+
+		if (count == 0 && timeout_ms > 0)
+		{
+			if (enter(waitFor, timeout_ms) < 0 && errno != ETIME && errno != EINTR)
+				return -1;
+			count = reap();
+		}
+		else if (toSubmit > 0)
+			enter(0, 0);
+		return count;
+  }
+
+  // run the completions which have already arrived, which needs no system call
+  int reap()
+  {
+		int count = 0;
+		unsigned head = *cqHead;
+
+		while (head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE))
+		{
+			struct io_uring_cqe cqe = cqes[head & *cqMask];
+
+			__atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+			if (cqe.user_data != 0)
+				(*(UringRequest*)(uintptr_t)cqe.user_data)(cqe);
+			count++;
+		}
+		return count;
+  }
+
+  /**
+   * Register files with the ring, so that reading them skips looking up the descriptor each time.
+   * Returns the index of the first, or -1 if the table is full or the kernel is older than 5.19.
+   * They stay registered for as long as the ring lasts.
+   */
+  int addFiles(const int* fds, int count)
+  {
+		if (!isValid())
+			return -1;
+		if (fileSlots == 0)
+		{
+			// an empty table which fills as files are added, no larger than the open file limit
+			struct io_uring_rsrc_register reg;
+			struct rlimit limit;
+
+			memset(&reg, 0, sizeof(reg));
+			reg.nr = URING_FILES;
+			if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < reg.nr)
+				reg.nr = limit.rlim_cur;
+			reg.flags = IORING_RSRC_REGISTER_SPARSE;
+			fileSlots = syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES2, &reg, sizeof(reg)) == 0 ? reg.nr : -1;
+		}
+		if (nextFile + count > fileSlots)
+			return -1;
+
+		struct io_uring_rsrc_update2 update;
+		memset(&update, 0, sizeof(update));
+		update.offset = nextFile;
+		update.data = (uintptr_t)fds;
+		update.nr = count;
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES_UPDATE2, &update, sizeof(update)) != count)
+			return -1;
+		nextFile += count;
+		return nextFile - count;
+  }
+
+  unsigned char* getBuffer(int bid)
+  {
+		return &pool[bid * URING_BUFFER_SIZE];
+  }
+
+  // give a buffer back for the kernel to receive into
+  void recycle(int bid)
+  {
+		unsigned short tail = bufRing->tail;
+		// not bufRing->bufs, which C++ places after the empty struct the uapi header wraps it in
+		struct io_uring_buf* buf = (struct io_uring_buf*)bufRing + (tail & (buffers - 1));
+
+		buf->addr = (uintptr_t)getBuffer(bid);
+		buf->len = URING_BUFFER_SIZE;
+		buf->bid = bid;
+		__atomic_store_n(&bufRing->tail, tail + 1, __ATOMIC_RELEASE);
+  }
+
+  void push(UringQueue& queue, int bid, int len)
+  {
+		links[bid].next = -1;
+		links[bid].len = len;
+		if (queue.head == -1)
+		{
+			queue.head = bid;
+			queue.offset = 0;
+		}
+		else
+			links[queue.tail].next = bid;
+		queue.tail = bid;
+  }
+
+  // copy up to len bytes off the front of the queue, recycling the buffers emptied
+  int pop(UringQueue& queue, unsigned char* buffer, int len)
+  {
+		int bytes = 0;
+
+		while (bytes < len && queue.head != -1)
+		{
+			int bid = queue.head;
+			int n = links[bid].len - queue.offset;
+
+			if (n > len - bytes)
+				n = len - bytes;
+			memcpy(&buffer[bytes], getBuffer(bid) + queue.offset, n);
+			bytes += n;
+			queue.offset += n;
+			if (queue.offset == links[bid].len)
+			{
+				queue.head = links[bid].next;
+				queue.offset = 0;
+				recycle(bid);
+			}
+		}
+		return bytes;
+  }
+
+  void clear(UringQueue& queue)
+  {
+		while (queue.head != -1)
+		{
+			int bid = queue.head;
+
+			queue.head = links[bid].next;
+			recycle(bid);
+		}
+		queue.offset = 0;
+  }
+
+private:
+
+  int setup()
+  {
+		struct io_uring_params params;
+
+		memset(&params, 0, sizeof(params));
+		// room for a completion from every buffer, and the sends besides
+		unsigned cqEntries = (buffers > entries ? buffers : entries) * 2;
+		params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+		params.cq_entries = cqEntries;
+		if ((fd = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+		{
+			// kernels before 6.0 don't know the last two flags, which only save a little work
+			memset(&params, 0, sizeof(params));
+			params.flags = IORING_SETUP_CQSIZE;
+			params.cq_entries = cqEntries;
+			if ((fd = syscall(__NR_io_uring_setup, entries, &params)) == -1)
+				return -1;
+		}
+		if (!(params.features & IORING_FEAT_EXT_ARG) || !(params.features & IORING_FEAT_NODROP))
+			return -1;
+
+		entries = params.sq_entries;
+		sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+
+		sqRing = (unsigned char*)mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+		if (sqRing == MAP_FAILED)
+		{
+			sqRing = NULL;
+			return -1;
+		}
+		if (params.features & IORING_FEAT_SINGLE_MMAP)
+			cqRing = sqRing;
+		else
+		{
+			cqRing = (unsigned char*)mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+			if (cqRing == MAP_FAILED)
+			{
+				cqRing = NULL;
+				return -1;
+			}
+		}
+		sqes = (struct io_uring_sqe*)mmap(NULL, entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED)
+		{
+			sqes = NULL;
+			return -1;
+		}
+
+		sqHead = (unsigned*)(sqRing + params.sq_off.head);
+		sqTail = (unsigned*)(sqRing + params.sq_off.tail);
+		sqMask = (unsigned*)(sqRing + params.sq_off.ring_mask);
+		sqArray = (unsigned*)(sqRing + params.sq_off.array);
+		sqFlags = (unsigned*)(sqRing + params.sq_off.flags);
+		cqHead = (unsigned*)(cqRing + params.cq_off.head);
+		cqTail = (unsigned*)(cqRing + params.cq_off.tail);
+		cqMask = (unsigned*)(cqRing + params.cq_off.ring_mask);
+		cqes = (struct io_uring_cqe*)(cqRing + params.cq_off.cqes);
+
+		// the buffers receives pick from, which needs 5.19
+		bufRing = (struct io_uring_buf_ring*)mmap(NULL, buffers * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+		if (bufRing == MAP_FAILED)
+		{
+			bufRing = NULL;
+			return -1;
+		}
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = (uintptr_t)bufRing;
+		reg.ring_entries = buffers;
+		reg.bgid = 0;
+		if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+			return -1;
+
+		pool = new unsigned char[buffers * URING_BUFFER_SIZE];
+		links = new Link[buffers];
+		for (unsigned i = 0; i < buffers; i++)
+			recycle(i);
+		return 0;
+  }
+
+  int enter(unsigned waitFor, int timeout_ms)
+  {
+		struct __kernel_timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+		struct io_uring_getevents_arg arg;
+		unsigned flags = IORING_ENTER_GETEVENTS;
+		int rc;
+
+		memset(&arg, 0, sizeof(arg));
+		arg.ts = (uintptr_t)&ts;
+		if (waitFor > 0)
+			flags |= IORING_ENTER_EXT_ARG;
+
+		rc = syscall(__NR_io_uring_enter, fd, toSubmit, waitFor, flags, waitFor > 0 ? &arg : NULL, waitFor > 0 ? sizeof(arg) : 0);
+		if (rc > 0)
+			toSubmit -= rc < (int)toSubmit ? rc : toSubmit;
+		return rc;
+  }
+
+  struct Link
+  {
+		int next;
+		int len;
+  };
+
+  unsigned buffers;
+  unsigned entries;
+  int fd;
+  bool valid;
+  bool started;
+  bool multishot;
+  bool autoSubmit;
+  unsigned toSubmit;
+  int fileSlots; // -1 when the kernel can't register them
+  int nextFile;
+
+  unsigned char* sqRing;
+  unsigned char* cqRing;
+  size_t sqRingSize, cqRingSize;
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray, *sqFlags;
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_sqe* sqes;
+  struct io_uring_cqe* cqes;
+
+  struct io_uring_buf_ring* bufRing;
+  unsigned char* pool;
+  Link* links;
+};
+
+
+/**
+ * An IPStack whose reads and writes go through a Uring.  Connecting is still done by IPStack, and
+ * the socket is then handed to the ring.
+ */
+class UringStack : public IPStack
+{
+public:
+  UringStack()
+  {
+		ring = NULL;
+		ownRing = NULL;
+		active = false;
+		reset();
+		recvRequest.attach(this, &UringStack::received);
+		sendRequest.attach(this, &UringStack::sent);
+  }
+
+  ~UringStack()
+  {
+		disconnect();
+		delete ownRing;
+  }
+
+  // share a ring with the other connections on this thread, rather than have one of our own
+  void setRing(Uring* ring)
+  {
+		this->ring = ring;
+  }
+
+  int connect(const char* hostname, int port)
+  {
+		int rc = IPStack::connect(hostname, port);
+		if (rc == 0)
+			start();
+		return rc;
+  }
+
+  int connect(const AddressList& list)
+  {
+		int rc = IPStack::connect(list);
+		if (rc == 0)
+			start();
+		return rc;
+  }
+
+  void adopt(int sock)
+  {
+		disconnect();
+		IPStack::adopt(sock);
+		start();
+  }
+
+  // data already received but not read is lost
+  int release()
+  {
+		stop();
+		return IPStack::release();
+  }
+
+  int disconnect()
+  {
+		if (getSocket() == -1)
+			return 0;
+		stop();
+		return IPStack::disconnect();
+  }
+
+  // whether read has something to return straight away, data or the end of the connection
+  bool readable()
+  {
+		if (active)
+			ring->reap();
+		return queue.head != -1 || closed || failed || starved;
+  }
+
+  // return -1 on error, or the number of bytes read
+  // which could be 0 on a read timeout
+  int read(unsigned char* buffer, int len, int timeout_ms)
+  {
+		if (!active)
+			return IPStack::read(buffer, len, timeout_ms);
+
+		Countdown deadline(timeout_ms);
+		int bytes = 0;
+
+		while (bytes < len)
+		{
+			bytes += ring->pop(queue, &buffer[bytes], len - bytes);
+			if (bytes == len)
+				break;
+			if (closed || failed)
+			{
+				if (bytes == 0)
+					bytes = -1;
+				break;
+			}
+			if (starved)
+			{
+				// every buffer is in use, so read the socket itself, in order as the queue is empty
+				int rc = IPStack::read(&buffer[bytes], len - bytes, deadline.left_ms());
+				if (rc < 0)
+				{
+					failed = true;
+					if (bytes == 0)
+						bytes = -1;
+					break;
+				}
+				bytes += rc;
+				starved = false;
+				continue;
+			}
+			if (!armed)
+				arm();
+			if (ring->reap() > 0)
+				continue;
+			if (deadline.expired())
+			{
+				ring->submit();
+				break;
+			}
+			if (ring->run(deadline.left_ms()) < 0)
+			{
+				bytes = -1;
+				break;
+			}
+		}
+		return bytes;
+  }
+
+  // return -1 on error, or the number of bytes queued to be sent, which is less than len on a timeout
+  int write(unsigned char* buffer, int len, int timeout_ms)
+  {
+		if (!active)
+			return IPStack::write(buffer, len, timeout_ms);
+
+		Countdown deadline(timeout_ms);
+		int bytes = 0;
+
+		while (bytes < len && !failed)
+		{
+			int room = URING_SEND_SIZE - fillLen;
+
+			if (room == 0)
+			{
+				// both buffers are full, so wait for the send in flight to finish
+				if (deadline.expired() || ring->run(deadline.left_ms()) < 0)
+					break;
+				continue;
+			}
+
+			int n = len - bytes < room ? len - bytes : room;
+			memcpy(&sendBuf[fill][fillLen], &buffer[bytes], n);
+			fillLen += n;
+			bytes += n;
+			if (!sending)
+				send();
+		}
+
+		if (failed)
+			return -1;
+		if (ring->getAutoSubmit())
+			ring->submit();
+		return bytes;
+  }
+
+private:
+
+  void reset()
+  {
+		queue.head = queue.tail = -1;
+		queue.offset = 0;
+		armed = false;
+		closed = false;
+		failed = false;
+		starved = false;
+		sending = false;
+		fill = 0;
+		fillLen = 0;
+  }
+
+  void start()
+  {
+		if (ring == NULL)
+			ring = ownRing = new Uring(32);
+		active = ring->isValid();
+		reset();
+		if (active)
+			arm();
+  }
+
+  // end the receive and any send in flight, and wait for them to say so, so that no completion
+  // arrives for a connection which has gone
+  void stop()
+  {
+		if (!active)
+			return;
+
+		closed = true; // so that nothing is rearmed or sent
+		struct io_uring_sqe* sqe = armed ? ring->getSqe() : NULL;
+		if (sqe != NULL)
+		{
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = (uintptr_t)&recvRequest;
+		}
+		shutdown(getSocket(), SHUT_RDWR);
+
+		Countdown deadline(1000);
+		while ((armed || sending) && !deadline.expired())
+		{
+			if (ring->run(deadline.left_ms()) < 0)
+				break;
+		}
+
+		ring->clear(queue);
+		active = false;
+  }
+
+  void arm()
+  {
+		struct io_uring_sqe* sqe = ring->getSqe();
+		if (sqe == NULL)
+			return;
+
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = getSocket();
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = 0;
+		sqe->ioprio = ring->getMultishot() ? IORING_RECV_MULTISHOT : 0;
+		sqe->user_data = (uintptr_t)&recvRequest;
+		armed = true;
+  }
+
+  // send the buffer being filled, and fill the other one while it goes
+  void send()
+  {
+		struct io_uring_sqe* sqe = ring->getSqe();
+		if (sqe == NULL)
+			return;
+
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = getSocket();
+		sqe->addr = (uintptr_t)sendBuf[fill];
+		sqe->len = fillLen;
+		sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+		sqe->user_data = (uintptr_t)&sendRequest;
+		sending = true;
+		sendLen = fillLen;
+		fill = !fill;
+		fillLen = 0;
+  }
+
+  void received(const struct io_uring_cqe& cqe)
+  {
+		bool rearm = false;
+
+		if (!(cqe.flags & IORING_CQE_F_MORE))
+			armed = false;
+
+		if (cqe.res > 0 && (cqe.flags & IORING_CQE_F_BUFFER))
+		{
+			ring->push(queue, cqe.flags >> IORING_CQE_BUFFER_SHIFT, cqe.res);
+			rearm = true;
+		}
+		else if (cqe.res == 0)
+			closed = true;
+		else if (cqe.res == -EINVAL && ring->getMultishot())
+		{
+			ring->clearMultishot();
+			rearm = true;
+		}
+		else if (cqe.res == -ENOBUFS)
+			starved = true;
+		else if (cqe.res != -ECANCELED)
+			failed = true;
+
+		// a single shot receive, or a multishot one which the kernel ended.  One which ran out of
+		// buffers is left for read, which reads the socket directly before rearming
+		if (!armed && rearm && !closed)
+			arm();
+  }
+
+  void sent(const struct io_uring_cqe& cqe)
+  {
+		sending = false;
+		if (cqe.res != sendLen)
+			failed = true;
+		else if (fillLen > 0 && !closed)
+			send();
+  }
+
+  Uring* ring;
+  Uring* ownRing;
+  bool active;
+
+  UringRequest recvRequest;
+  UringQueue queue;
+  bool armed;
+  bool closed;
+  bool failed;
+  bool starved;
+
+  UringRequest sendRequest;
+  unsigned char sendBuf[2][URING_SEND_SIZE];
+  int fill;
+  int fillLen;
+  int sendLen;
+  bool sending;
+};
+
+/**
+ * A FileReader which reads all of its files with one submission to a Uring, as fixed files, and
+ * waits for them together, so that sampling the hardware is one system call however many files
+ * there are.  Without a ring, or with a kernel which can't, it preads them.
+ */
+class UringReader : public FileReader
+{
+public:
+  UringReader()
+  {
+		ring = NULL;
+		base = -1;
+		registered = false;
+		pending = 0;
+		for (int i = 0; i < MAX_READER_FILES; i++)
+			requests[i].attach(this, &UringReader::done);
+  }
+
+  void setRing(Uring* ring)
+  {
+		this->ring = ring;
+		registered = false;
+  }
+
+  void setFiles(const int* fds, int count)
+  {
+		FileReader::setFiles(fds, count);
+		registered = false;
+  }
+
+  int read(char* buffers, int size)
+  {
+		// reads still pending from a round the ring failed in would write over this one
+		if (ring == NULL || pending > 0 || !ring->isValid())
+			return FileReader::read(buffers, size);
+
+		if (!registered)
+		{
+			registered = true;
+			base = ring->addFiles(fds, count);
+		}
+
+		this->buffers = buffers;
+		this->size = size;
+		filesRead = 0;
+		for (int i = 0; i < count; i++)
+		{
+			struct io_uring_sqe* sqe = ring->getSqe();
+			if (sqe == NULL)
+				break;
+
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = base != -1 ? base + i : fds[i];
+			sqe->flags = base != -1 ? IOSQE_FIXED_FILE : 0;
+			sqe->addr = (uintptr_t)&buffers[i * size];
+			sqe->len = size - 1;
+			sqe->off = 0;
+			sqe->user_data = (uintptr_t)&requests[i];
+			pending++;
+		}
+
+		while (pending > 0)
+		{
+			if (ring->run(1000, pending) < 0)
+				break;
+		}
+		return filesRead;
+  }
+
+private:
+
+  void done(const struct io_uring_cqe& cqe)
+  {
+		int i = (UringRequest*)(uintptr_t)cqe.user_data - requests;
+
+		if (cqe.res >= 0)
+		{
+			buffers[i * size + cqe.res] = '\0';
+			filesRead++;
+		}
+		pending--;
+  }
+
+  Uring* ring;
+  int base; // of our files in the ring's table, or -1 if they aren't registered
+  bool registered;
+
+  UringRequest requests[MAX_READER_FILES];
+  int pending;
+  char* buffers;
+  int size;
+  int filesRead;
+};
+
+#endif
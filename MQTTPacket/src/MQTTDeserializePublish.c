@@ -35,6 +35,27 @@
   */
 int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
 		unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
+{
+	return MQTTV5Deserialize_publish(dup, qos, retained, packetid, topicName, NULL, payload, payloadlen, buf, buflen);
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into publish data, including MQTT 5 properties
+  * @param dup returned integer - the MQTT dup flag
+  * @param qos returned integer - the MQTT QoS value
+  * @param retained returned integer - the MQTT retained flag
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param topicName returned MQTTString - the MQTT topic in the publish
+  * @param properties the properties returned, or NULL for an MQTT 3 publish
+  * @param payload returned byte buffer - the MQTT publish payload
+  * @param payloadlen returned integer - the length of the MQTT payload
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success
+  */
+int MQTTV5Deserialize_publish(unsigned char* dup, int* qos, unsigned char* retained, unsigned short* packetid, MQTTString* topicName,
+		MQTTProperties* properties, unsigned char** payload, int* payloadlen, unsigned char* buf, int buflen)
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -60,6 +81,12 @@ int MQTTDeserialize_publish(unsigned char* dup, int* qos, unsigned char* retaine
 	if (*qos > 0)
 		*packetid = readInt(&curdata);
 
+	if (properties && !MQTTProperties_read(properties, &curdata, enddata))
+	{
+		rc = 0;
+		goto exit;
+	}
+
 	*payloadlen = enddata - curdata;
 	*payload = curdata;
 	rc = 1;
@@ -105,3 +132,49 @@ exit:
 	return rc;
 }
 
+
+/**
+  * Deserializes the supplied (wire) buffer into an MQTT 5 ack, which can carry a reason code and properties
+  * @param packettype returned integer - the MQTT packet type
+  * @param dup returned integer - the MQTT dup flag
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param reasonCode returned integer - the reason code, 0 (success) if it was omitted
+  * @param properties the properties returned, or NULL
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_ack(unsigned char* packettype, unsigned char* dup, unsigned short* packetid,
+		int* reasonCode, MQTTProperties* properties, unsigned char* buf, int buflen)
+{
+	MQTTHeader header = {0};
+	unsigned char* curdata = buf;
+	unsigned char* enddata = NULL;
+	int rc = 0;
+	int mylen;
+
+	FUNC_ENTRY;
+	header.byte = readChar(&curdata);
+	*dup = header.bits.dup;
+	*packettype = header.bits.type;
+
+	curdata += MQTTPacket_decodeBuf(curdata, &mylen); /* read remaining length */
+	enddata = curdata + mylen;
+
+	if (enddata - curdata < 2)
+		goto exit;
+	*packetid = readInt(&curdata);
+
+	*reasonCode = 0;
+	if (properties)
+		properties->count = 0;
+	if (enddata - curdata >= 1)
+		*reasonCode = (unsigned char)readChar(&curdata);
+	if (enddata - curdata >= 1 && !MQTTProperties_read(properties, &curdata, enddata))
+		goto exit;
+
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
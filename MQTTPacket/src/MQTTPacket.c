@@ -98,22 +98,72 @@ int MQTTPacket_len(int rem_len)
 }
 
 
-static unsigned char* bufptr;
+/**
+ * Decodes the message length according to the MQTT algorithm, from a buffer rather than a stream.
+ * Needs no state outside the call, so it is safe to use from any number of clients and threads.
+ * @param buf the buffer holding the encoded length
+ * @param value the decoded length returned
+ * @return the number of bytes used from the buffer
+ */
+int MQTTPacket_decodeBuf(unsigned char* buf, int* value)
+{
+	unsigned char c;
+	int multiplier = 1;
+	int len = 0;
+
+	*value = 0;
+	do
+	{
+		if (len >= MAX_NO_OF_REMAINING_LENGTH_BYTES)
+			break; /* bad data */
+		c = buf[len++];
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return len;
+}
 
-int bufchar(unsigned char* c, int count)
+
+/**
+ * Decodes a variable byte integer from a buffer, without reading beyond the end of the data
+ * @param buf the buffer holding the encoded integer
+ * @param enddata pointer to the end of the data: do not read beyond
+ * @param value the decoded value returned
+ * @return the number of bytes used, or 0 if the data is incomplete or malformed
+ */
+int MQTTPacket_decodeBufLen(unsigned char* buf, unsigned char* enddata, int* value)
 {
-	int i;
+	int multiplier = 1;
+	int len = 0;
+	unsigned char c;
 
-	for (i = 0; i < count; ++i)
-		*c = *bufptr++;
-	return count;
+	*value = 0;
+	do
+	{
+		if (len >= MAX_NO_OF_REMAINING_LENGTH_BYTES || buf + len >= enddata)
+			return 0;
+		c = buf[len++];
+		*value += (c & 127) * multiplier;
+		multiplier *= 128;
+	} while ((c & 128) != 0);
+	return len;
 }
 
 
-int MQTTPacket_decodeBuf(unsigned char* buf, int* value)
+/**
+ * Returns the number of bytes needed to encode a variable byte integer
+ * @param value the value to be encoded
+ * @return the length of the encoding
+ */
+int MQTTPacket_VBIlen(int value)
 {
-	bufptr = buf;
-	return MQTTPacket_decode(bufchar, value);
+	if (value < 128)
+		return 1;
+	else if (value < 16384)
+		return 2;
+	else if (value < 2097152)
+		return 3;
+	return 4;
 }
 
 
@@ -131,6 +181,20 @@ int readInt(unsigned char** pptr)
 }
 
 
+/**
+ * Calculates an integer from four bytes read from the input buffer
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ * @return the integer value calculated
+ */
+unsigned int readInt4(unsigned char** pptr)
+{
+	unsigned char* ptr = *pptr;
+	unsigned int value = ((unsigned int)ptr[0] << 24) | ((unsigned int)ptr[1] << 16) | ((unsigned int)ptr[2] << 8) | ptr[3];
+	*pptr += 4;
+	return value;
+}
+
+
 /**
  * Reads one character from the input buffer.
  * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
@@ -170,6 +234,20 @@ void writeInt(unsigned char** pptr, int anInt)
 }
 
 
+/**
+ * Writes an integer as 4 bytes to an output buffer.
+ * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
+ * @param anInt the integer to write
+ */
+void writeInt4(unsigned char** pptr, unsigned int anInt)
+{
+	writeChar(pptr, (unsigned char)(anInt >> 24));
+	writeChar(pptr, (unsigned char)(anInt >> 16));
+	writeChar(pptr, (unsigned char)(anInt >> 8));
+	writeChar(pptr, (unsigned char)anInt);
+}
+
+
 /**
  * Writes a "UTF" string to an output buffer.  Converts C string to length-delimited.
  * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
@@ -88,6 +88,7 @@ typedef struct
 
 int MQTTstrlen(MQTTString mqttstring);
 
+#include "MQTTProperties.h"
 #include "MQTTConnect.h"
 #include "MQTTPublish.h"
 #include "MQTTSubscribe.h"
@@ -103,11 +104,15 @@ DLLExport int MQTTPacket_equals(MQTTString* a, char* b);
 DLLExport int MQTTPacket_encode(unsigned char* buf, int length);
 int MQTTPacket_decode(int (*getcharfn)(unsigned char*, int), int* value);
 int MQTTPacket_decodeBuf(unsigned char* buf, int* value);
+int MQTTPacket_decodeBufLen(unsigned char* buf, unsigned char* enddata, int* value);
+int MQTTPacket_VBIlen(int value);
 
 int readInt(unsigned char** pptr);
+unsigned int readInt4(unsigned char** pptr);
 char readChar(unsigned char** pptr);
 void writeChar(unsigned char** pptr, char c);
 void writeInt(unsigned char** pptr, int anInt);
+void writeInt4(unsigned char** pptr, unsigned int anInt);
 int readMQTTLenString(MQTTString* mqttstring, unsigned char** pptr, unsigned char* enddata);
 void writeCString(unsigned char** pptr, const char* string);
 void writeMQTTString(unsigned char** pptr, MQTTString mqttstring);
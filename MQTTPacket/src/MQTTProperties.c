@@ -0,0 +1,289 @@
+/*******************************************************************************
+ * This program and the accompanying materials are made available under the
+ * terms of the Eclipse Public License v1.0 and Eclipse Distribution License
+ * v1.0 which accompany this distribution.
+ *
+ * The Eclipse Public License is available at
+ *    http://www.eclipse.org/legal/epl-v10.html
+ * and the Eclipse Distribution License is available at
+ *   http://www.eclipse.org/org/documents/edl-v10.php.
+ *
+ * Contributors:
+ *    MQTT 5 property encoding for the embedded packet library
+ *******************************************************************************/
+
+#include "MQTTPacket.h"
+#include "StackTrace.h"
+
+#include <string.h>
+
+
+static const struct
+{
+	int identifier;
+	int type;
+} namesToTypes[] =
+{
+	{MQTTPROPERTY_CODE_PAYLOAD_FORMAT_INDICATOR, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_MESSAGE_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_CONTENT_TYPE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_RESPONSE_TOPIC, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_CORRELATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
+	{MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIER, MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_SESSION_EXPIRY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_ASSIGNED_CLIENT_IDENTIFIER, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_SERVER_KEEP_ALIVE, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_AUTHENTICATION_METHOD, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_AUTHENTICATION_DATA, MQTTPROPERTY_TYPE_BINARY_DATA},
+	{MQTTPROPERTY_CODE_REQUEST_PROBLEM_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_WILL_DELAY_INTERVAL, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_REQUEST_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_RESPONSE_INFORMATION, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_SERVER_REFERENCE, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_REASON_STRING, MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING},
+	{MQTTPROPERTY_CODE_RECEIVE_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_TOPIC_ALIAS_MAXIMUM, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_TOPIC_ALIAS, MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_MAXIMUM_QOS, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_RETAIN_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_USER_PROPERTY, MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR},
+	{MQTTPROPERTY_CODE_MAXIMUM_PACKET_SIZE, MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER},
+	{MQTTPROPERTY_CODE_WILDCARD_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_SUBSCRIPTION_IDENTIFIERS_AVAILABLE, MQTTPROPERTY_TYPE_BYTE},
+	{MQTTPROPERTY_CODE_SHARED_SUBSCRIPTION_AVAILABLE, MQTTPROPERTY_TYPE_BYTE}
+};
+
+
+/**
+ * Returns the type of the value of a property
+ * @param identifier the property identifier
+ * @return one of MQTTPropertyTypes, or -1 if the identifier is not known
+ */
+int MQTTProperty_getType(int identifier)
+{
+	int i, rc = -1;
+
+	for (i = 0; i < (int)(sizeof(namesToTypes) / sizeof(namesToTypes[0])); ++i)
+	{
+		if (namesToTypes[i].identifier == identifier)
+		{
+			rc = namesToTypes[i].type;
+			break;
+		}
+	}
+	return rc;
+}
+
+
+/**
+ * Returns the serialized length of a property list, including the variable length field in front of it
+ * @param props the property list, which can be NULL for an empty list
+ * @return the length in bytes
+ */
+int MQTTProperties_len(MQTTProperties* props)
+{
+	int len = (props == NULL) ? 0 : props->length;
+
+	return len + MQTTPacket_VBIlen(len);
+}
+
+
+static int MQTTProperty_len(MQTTProperty* prop)
+{
+	int len = 0;
+
+	switch (MQTTProperty_getType(prop->identifier))
+	{
+		case MQTTPROPERTY_TYPE_BYTE:
+			len = 1;
+			break;
+		case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+			len = 2;
+			break;
+		case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+			len = 4;
+			break;
+		case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			len = MQTTPacket_VBIlen(prop->value.integer4);
+			break;
+		case MQTTPROPERTY_TYPE_BINARY_DATA:
+		case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+			len = 2 + prop->value.string.data.len;
+			break;
+		case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+			len = 2 + prop->value.string.data.len + 2 + prop->value.string.value.len;
+			break;
+		default:
+			return -1;
+	}
+	return len + 1; /* identifier */
+}
+
+
+/**
+ * Adds a property to a property list, updating its serialized length
+ * @param props the property list
+ * @param prop the property to add - string values are not copied
+ * @return 0 on success, -1 if the list is full or the property is not known
+ */
+int MQTTProperties_add(MQTTProperties* props, MQTTProperty* prop)
+{
+	int len;
+
+	if (props->count >= props->max_count || (len = MQTTProperty_len(prop)) < 0)
+		return -1;
+	props->array[props->count++] = *prop;
+	props->length += len;
+	return 0;
+}
+
+
+/**
+ * Writes a property list, preceded by its length, to an output buffer
+ * @param pptr pointer to the output buffer - incremented by the number of bytes used & returned
+ * @param properties the property list, which can be NULL for an empty list
+ * @return the number of bytes written
+ */
+int MQTTProperties_write(unsigned char** pptr, MQTTProperties* properties)
+{
+	unsigned char* start = *pptr;
+	int i;
+
+	if (properties == NULL)
+	{
+		writeChar(pptr, 0);
+		return 1;
+	}
+
+	*pptr += MQTTPacket_encode(*pptr, properties->length);
+	for (i = 0; i < properties->count; ++i)
+	{
+		MQTTProperty* prop = &properties->array[i];
+
+		writeChar(pptr, prop->identifier);
+		switch (MQTTProperty_getType(prop->identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				writeChar(pptr, prop->value.byte);
+				break;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				writeInt(pptr, prop->value.integer2);
+				break;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+				writeInt4(pptr, prop->value.integer4);
+				break;
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+				*pptr += MQTTPacket_encode(*pptr, prop->value.integer4);
+				break;
+			case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+				writeInt(pptr, prop->value.string.data.len);
+				memcpy(*pptr, prop->value.string.data.data, prop->value.string.data.len);
+				*pptr += prop->value.string.data.len;
+				writeInt(pptr, prop->value.string.value.len);
+				memcpy(*pptr, prop->value.string.value.data, prop->value.string.value.len);
+				*pptr += prop->value.string.value.len;
+				break;
+			default: /* binary data and strings */
+				writeInt(pptr, prop->value.string.data.len);
+				memcpy(*pptr, prop->value.string.data.data, prop->value.string.data.len);
+				*pptr += prop->value.string.data.len;
+				break;
+		}
+	}
+	return *pptr - start;
+}
+
+
+static int readLenString(MQTTLenString* string, unsigned char** pptr, unsigned char* enddata)
+{
+	if (enddata - *pptr < 2)
+		return 0;
+	string->len = readInt(pptr);
+	if (enddata - *pptr < string->len)
+		return 0;
+	string->data = (char*)*pptr;
+	*pptr += string->len;
+	return 1;
+}
+
+
+/**
+ * Reads a property list, preceded by its length, from an input buffer.  Properties beyond the space in
+ * the list are skipped, so a list with max_count 0 can be used just to step over the properties.
+ * @param properties the property list to fill in, which can be NULL
+ * @param pptr pointer to the input buffer - incremented by the number of bytes used & returned
+ * @param enddata pointer to the end of the data: do not read beyond
+ * @return 1 if successful, 0 if not
+ */
+int MQTTProperties_read(MQTTProperties* properties, unsigned char** pptr, unsigned char* enddata)
+{
+	int rc = 0;
+	int length = 0;
+	int vbilen;
+	unsigned char* propend;
+
+	FUNC_ENTRY;
+	if ((vbilen = MQTTPacket_decodeBufLen(*pptr, enddata, &length)) <= 0)
+		goto exit;
+	*pptr += vbilen;
+	if (enddata - *pptr < length)
+		goto exit;
+	propend = *pptr + length;
+	if (properties)
+	{
+		properties->count = 0;
+		properties->length = length;
+	}
+
+	while (*pptr < propend)
+	{
+		MQTTProperty prop;
+
+		prop.identifier = readChar(pptr);
+		switch (MQTTProperty_getType(prop.identifier))
+		{
+			case MQTTPROPERTY_TYPE_BYTE:
+				if (propend - *pptr < 1)
+					goto exit;
+				prop.value.byte = readChar(pptr);
+				break;
+			case MQTTPROPERTY_TYPE_TWO_BYTE_INTEGER:
+				if (propend - *pptr < 2)
+					goto exit;
+				prop.value.integer2 = readInt(pptr);
+				break;
+			case MQTTPROPERTY_TYPE_FOUR_BYTE_INTEGER:
+				if (propend - *pptr < 4)
+					goto exit;
+				prop.value.integer4 = readInt4(pptr);
+				break;
+			case MQTTPROPERTY_TYPE_VARIABLE_BYTE_INTEGER:
+			{
+				int value = 0;
+				if ((vbilen = MQTTPacket_decodeBufLen(*pptr, propend, &value)) <= 0)
+					goto exit;
+				*pptr += vbilen;
+				prop.value.integer4 = value;
+				break;
+			}
+			case MQTTPROPERTY_TYPE_BINARY_DATA:
+			case MQTTPROPERTY_TYPE_UTF_8_ENCODED_STRING:
+				if (!readLenString(&prop.value.string.data, pptr, propend))
+					goto exit;
+				break;
+			case MQTTPROPERTY_TYPE_UTF_8_STRING_PAIR:
+				if (!readLenString(&prop.value.string.data, pptr, propend) ||
+						!readLenString(&prop.value.string.value, pptr, propend))
+					goto exit;
+				break;
+			default:
+				goto exit; /* we can't know how long an unknown property is */
+		}
+		if (properties && properties->count < properties->max_count)
+			properties->array[properties->count++] = prop;
+	}
+	rc = 1;
+exit:
+	FUNC_EXIT_RC(rc);
+	return rc;
+}
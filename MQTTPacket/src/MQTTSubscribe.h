@@ -35,5 +35,11 @@ DLLExport int MQTTSerialize_suback(unsigned char* buf, int buflen, unsigned shor
 
 DLLExport int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, int grantedQoSs[], unsigned char* buf, int len);
 
+DLLExport int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], int subscriptionOptions[]);
+
+DLLExport int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count, int reasonCodes[],
+		unsigned char* buf, int len);
+
 
 #endif /* MQTTSUBSCRIBE_H_ */
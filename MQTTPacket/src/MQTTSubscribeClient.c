@@ -23,13 +23,17 @@
   * Determines the length of the MQTT subscribe packet that would be produced using the supplied parameters
   * @param count the number of topic filter strings in topicFilters
   * @param topicFilters the array of topic filter strings to be used in the publish
+  * @param properties the MQTT 5 properties, or NULL for MQTT 3
   * @return the length of buffer needed to contain the serialized version of the packet
   */
-int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[])
+int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[], MQTTProperties* properties)
 {
 	int i;
 	int len = 2; /* packetid */
 
+	if (properties)
+		len += MQTTProperties_len(properties);
+
 	for (i = 0; i < count; ++i)
 		len += 2 + MQTTstrlen(topicFilters[i]) + 1; /* length + topic + req_qos */
 	return len;
@@ -49,6 +53,26 @@ int MQTTSerialize_subscribeLength(int count, MQTTString topicFilters[])
   */
 int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid, int count,
 		MQTTString topicFilters[], int requestedQoSs[])
+{
+	return MQTTV5Serialize_subscribe(buf, buflen, dup, packetid, NULL, count, topicFilters, requestedQoSs);
+}
+
+
+/**
+  * Serializes the supplied subscribe data into the supplied buffer, with MQTT 5 properties
+  * @param buf the buffer into which the packet will be serialized
+  * @param buflen the length in bytes of the supplied bufferr
+  * @param dup integer - the MQTT dup flag
+  * @param packetid integer - the MQTT packet identifier
+  * @param properties the MQTT 5 properties, or NULL for an MQTT 3 subscribe
+  * @param count - number of members in the topicFilters and subscriptionOptions arrays
+  * @param topicFilters - array of topic filter names
+  * @param subscriptionOptions - array of subscription options: the requested QoS in the low 2 bits,
+  *        and for MQTT 5 the no local, retain as published and retain handling flags
+  * @return the length of the serialized data.  <= 0 indicates error
+  */
+int MQTTV5Serialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[], int subscriptionOptions[])
 {
 	unsigned char *ptr = buf;
 	MQTTHeader header = {0};
@@ -57,7 +81,7 @@ int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, u
 	int i = 0;
 
 	FUNC_ENTRY;
-	if (MQTTPacket_len(rem_len = MQTTSerialize_subscribeLength(count, topicFilters)) > buflen)
+	if (MQTTPacket_len(rem_len = MQTTSerialize_subscribeLength(count, topicFilters, properties)) > buflen)
 	{
 		rc = MQTTPACKET_BUFFER_TOO_SHORT;
 		goto exit;
@@ -73,10 +97,13 @@ int MQTTSerialize_subscribe(unsigned char* buf, int buflen, unsigned char dup, u
 
 	writeInt(&ptr, packetid);
 
+	if (properties)
+		MQTTProperties_write(&ptr, properties);
+
 	for (i = 0; i < count; ++i)
 	{
 		writeMQTTString(&ptr, topicFilters[i]);
-		writeChar(&ptr, requestedQoSs[i]);
+		writeChar(&ptr, subscriptionOptions[i]);
 	}
 
 	rc = ptr - buf;
@@ -98,6 +125,24 @@ exit:
   * @return error code.  1 is success, 0 is failure
   */
 int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, int grantedQoSs[], unsigned char* buf, int buflen)
+{
+	return MQTTV5Deserialize_suback(packetid, NULL, maxcount, count, grantedQoSs, buf, buflen);
+}
+
+
+/**
+  * Deserializes the supplied (wire) buffer into suback data, including MQTT 5 properties
+  * @param packetid returned integer - the MQTT packet identifier
+  * @param properties the properties returned, or NULL for an MQTT 3 suback
+  * @param maxcount - the maximum number of members allowed in the reasonCodes array
+  * @param count returned integer - number of members in the reasonCodes array
+  * @param reasonCodes returned array of integers - the granted qualities of service, or failure codes >= 0x80
+  * @param buf the raw buffer data, of the correct length determined by the remaining length field
+  * @param buflen the length in bytes of the data in the supplied buffer
+  * @return error code.  1 is success, 0 is failure
+  */
+int MQTTV5Deserialize_suback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count, int reasonCodes[],
+		unsigned char* buf, int buflen)
 {
 	MQTTHeader header = {0};
 	unsigned char* curdata = buf;
@@ -117,15 +162,21 @@ int MQTTDeserialize_suback(unsigned short* packetid, int maxcount, int* count, i
 
 	*packetid = readInt(&curdata);
 
+	if (properties && !MQTTProperties_read(properties, &curdata, enddata))
+	{
+		rc = 0;
+		goto exit;
+	}
+
 	*count = 0;
 	while (curdata < enddata)
 	{
-		if (*count > maxcount)
+		if (*count >= maxcount)
 		{
 			rc = -1;
 			goto exit;
 		}
-		grantedQoSs[(*count)++] = readChar(&curdata);
+		reasonCodes[(*count)++] = (unsigned char)readChar(&curdata);
 	}
 
 	rc = 1;
@@ -35,4 +35,10 @@ DLLExport int MQTTSerialize_unsuback(unsigned char* buf, int buflen, unsigned sh
 
 DLLExport int MQTTDeserialize_unsuback(unsigned short* packetid, unsigned char* buf, int len);
 
+DLLExport int MQTTV5Serialize_unsubscribe(unsigned char* buf, int buflen, unsigned char dup, unsigned short packetid,
+		MQTTProperties* properties, int count, MQTTString topicFilters[]);
+
+DLLExport int MQTTV5Deserialize_unsuback(unsigned short* packetid, MQTTProperties* properties, int maxcount, int* count, int reasonCodes[],
+		unsigned char* buf, int len);
+
 #endif /* MQTTUNSUBSCRIBE_H_ */
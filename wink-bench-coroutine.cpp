@@ -0,0 +1,158 @@
+/*
+ * Times a run of publishes through the blocking MQTT::Client, which waits for each acknowledgement
+ * before it sends the next, and through CoClient, which has many of them waiting at once, against
+ * the fleet's broker stand-in holding each packet for a few latencies.  Built for the host with
+ * C++20, for the coroutines.  Prints ms for the whole run, at QoS 1 and 2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "linux.cpp"
+#include "MQTTClient.h"
+#include "coroutine.cpp"
+#include "wink-fleet-broker.h"
+
+#if !defined(__cpp_impl_coroutine)
+#error "wink-bench-coroutine needs C++20 coroutines"
+#endif
+
+typedef MQTT::Client<IPStack, Countdown> Client;
+typedef CoClient<IPStack> CoroutineClient;
+
+static const int latencies[] = {0, 1, 5, 20};
+
+static int port = 18884;
+static const char *topic = "bench/co";
+static unsigned char payload[2] = {'O', 'N'};
+static int left, failed;
+
+static double nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void connectData(MQTTPacket_connectData &data, const char *clientid)
+{
+	data.clientID.cstring = (char *)clientid;
+	data.keepAliveInterval = 30;
+	data.cleansession = 1;
+}
+
+// each publish after the last one's acknowledgement
+static double timeClient(int count, MQTT::QoS qos)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	IPStack ipstack;
+	Client client(ipstack, 5000);
+
+	connectData(data, "bench-client");
+	if (ipstack.connect("127.0.0.1", port) != 0 || client.connect(data) != MQTT::SUCCESS)
+		return -1;
+
+	double start = nowMs();
+	for (int i = 0; i < count; i++)
+	{
+		if (client.publish(topic, payload, sizeof(payload), qos) != MQTT::SUCCESS)
+			failed++;
+	}
+	double elapsed = nowMs() - start;
+
+	client.disconnect();
+	ipstack.disconnect();
+	return elapsed;
+}
+
+static CoTask coConnect(CoExecutor &executor, CoroutineClient &client, MQTTPacket_connectData &data, int &rc)
+{
+	rc = co_await client.connect(data);
+	executor.stop();
+	co_return rc;
+}
+
+static CoTask coPublish(CoExecutor &executor, CoroutineClient &client, MQTT::QoS qos)
+{
+	int rc = co_await client.publish(topic, payload, sizeof(payload), qos);
+
+	if (rc != MQTT::SUCCESS)
+		failed++;
+	if (--left == 0)
+		executor.stop();
+	co_return rc;
+}
+
+// all the publishes at once, as many waiting for their acknowledgements as CO_INFLIGHT allows
+static double timeCoClient(int count, MQTT::QoS qos)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	CoExecutor executor;
+	IPStack ipstack;
+	CoroutineClient client(executor, ipstack, 5000);
+	int rc = MQTT::FAILURE;
+
+	connectData(data, "bench-coclient");
+	if (ipstack.connect("127.0.0.1", port) != 0)
+		return -1;
+	executor.spawn(coConnect(executor, client, data, rc));
+	executor.run();
+	if (rc != MQTT::SUCCESS)
+		return -1;
+
+	double start = nowMs();
+	left = count;
+	for (int i = 0; i < count; i++)
+		executor.spawn(coPublish(executor, client, qos));
+	executor.run();
+	double elapsed = nowMs() - start;
+
+	executor.spawn(client.disconnect());
+	executor.run();
+	return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+	int count = 100;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:p:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n': count = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default: fprintf(stderr, "usage: wink-bench-coroutine [-n publishes] [-p port]\n"); return 1;
+		}
+	}
+
+	FleetBroker broker(port, 0);
+	if (broker.start() != 0)
+	{
+		fprintf(stderr, "Can't listen on port %d\n", port);
+		return 1;
+	}
+
+	printf("%d publishes, ms for them all\n", count);
+	printf("  latency  QoS   Client  CoClient\n");
+	for (size_t i = 0; i < sizeof(latencies) / sizeof(latencies[0]); i++)
+	{
+		broker.setLatency(latencies[i]);
+		for (int qos = MQTT::QOS1; qos <= MQTT::QOS2; qos++)
+		{
+			double blocking = timeClient(count, (MQTT::QoS)qos);
+			double coroutine = timeCoClient(count, (MQTT::QoS)qos);
+
+			printf("  %4d ms  %3d  %7.1f  %8.1f\n", latencies[i], qos, blocking, coroutine);
+		}
+	}
+	broker.stop();
+
+	if (failed > 0)
+		printf("%d publishes failed\n", failed);
+	return failed > 0;
+}
@@ -0,0 +1,110 @@
+/*
+ * Times serializing the relay's publishes, built for the host: a 2 byte QoS 1 payload to each of
+ * the seven topics a relay publishes to, as the handler did before PreparedTopic, by formatting the
+ * topic and then MQTTSerialize_publish, through MQTTSerialize_publish alone with the topic already
+ * formatted, and through PreparedTopic::serialize.  Prints the best of a few rounds, in ns a packet.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "MQTTClient.h"
+
+#define TOPICS 7
+#define ROUNDS 5
+
+static const char *names[TOPICS] = {"relays/upper_state", "relays/lower_state", "relays/state", "switches/upper",
+		"switches/lower", "sensors/temperature", "sensors/humidity"};
+
+static const char *prefix = "home/wink/relay-00042";
+static char formatted[TOPICS][256];
+static MQTT::PreparedTopic prepared[TOPICS];
+static unsigned char buf[256];
+static unsigned char payload[2] = {'O', 'N'};
+
+// kept, so that the compiler can't leave the serializing out
+static volatile unsigned long total;
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int sprintfSerialize(int i, unsigned short id)
+{
+	char topic[1024];
+	MQTTString topicString = MQTTString_initializer;
+
+	snprintf(topic, sizeof(topic), "%s/%s", prefix, names[i % TOPICS]);
+	topicString.cstring = topic;
+	return MQTTSerialize_publish(buf, sizeof(buf), 0, 1, 0, id, topicString, payload, sizeof(payload));
+}
+
+static int serialize(int i, unsigned short id)
+{
+	MQTTString topicString = MQTTString_initializer;
+
+	topicString.cstring = formatted[i % TOPICS];
+	return MQTTSerialize_publish(buf, sizeof(buf), 0, 1, 0, id, topicString, payload, sizeof(payload));
+}
+
+static int preparedSerialize(int i, unsigned short id)
+{
+	return prepared[i % TOPICS].serialize(buf, sizeof(buf), MQTT::QOS1, false, id, payload, sizeof(payload));
+}
+
+// the best of the rounds, as the others have only been held up
+static double timeSerialize(int (*serialize)(int, unsigned short), int count)
+{
+	double best = 0;
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		unsigned long sum = 0;
+		double start = nowNs();
+
+		for (int i = 0; i < count; i++)
+		{
+			sum += serialize(i, (unsigned short)(i | 1)) + buf[2];
+		}
+		double ns = (nowNs() - start) / count;
+		total += sum;
+		if (round == 0 || ns < best)
+		{
+			best = ns;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	int count = 5000000;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n': count = atoi(optarg); break;
+		default: fprintf(stderr, "usage: wink-bench-serialize [-n packets a round]\n"); return 1;
+		}
+	}
+
+	for (int i = 0; i < TOPICS; i++)
+	{
+		snprintf(formatted[i], sizeof(formatted[i]), "%s/%s", prefix, names[i]);
+		prepared[i].set(formatted[i]);
+	}
+
+	printf("%d packets a round, best of %d, ns a packet\n", count, ROUNDS);
+	printf("  sprintf + MQTTSerialize_publish  %6.1f\n", timeSerialize(sprintfSerialize, count));
+	printf("  MQTTSerialize_publish alone      %6.1f\n", timeSerialize(serialize, count));
+	printf("  PreparedTopic::serialize         %6.1f\n", timeSerialize(preparedSerialize, count));
+	return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ * Times a relay's sampling round, built for the host: reading the seven hardware files of a fake
+ * sysfs tree with an lseek and a read each, as the handler did before FileReader, with a pread
+ * each through FileReader, and all together in one submission through UringReader.  Prints the
+ * best of a few rounds, in ns a round.  A fake tree is on an ordinary file system rather than
+ * sysfs, so this measures the system calls rather than the drivers behind them.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "linux.cpp"
+#include "uring.cpp"
+
+#define FILES 7
+#define SIZE 16
+#define ROUNDS 5
+
+static const char *files[FILES][2] =
+{
+	{"gpio8_value", "0"},
+	{"gpio7_value", "0"},
+	{"gpio203_value", "0"},
+	{"gpio204_value", "0"},
+	{"temp1_input", "021000\n"},
+	{"humidity1_input", "040000\n"},
+	{"ps_input_data", "000000\n"},
+};
+
+static int fds[FILES];
+static char buffers[FILES * SIZE];
+static FileReader fileReader;
+static UringReader uringReader;
+
+// kept, so that the compiler can't leave the reading out
+static volatile unsigned long total;
+
+static double nowNs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int seekRead()
+{
+	int n = 0;
+
+	for (int i = 0; i < FILES; i++)
+	{
+		lseek(fds[i], 0, SEEK_SET);
+		int rc = read(fds[i], &buffers[i * SIZE], SIZE - 1);
+		if (rc >= 0)
+		{
+			buffers[i * SIZE + rc] = '\0';
+			n++;
+		}
+	}
+	return n;
+}
+
+static int fileRead()
+{
+	return fileReader.read(buffers, SIZE);
+}
+
+static int uringRead()
+{
+	return uringReader.read(buffers, SIZE);
+}
+
+// the best of the rounds, as the others have only been held up.  -1 if a file wasn't read
+static double timeRead(int (*readFiles)(), int count)
+{
+	double best = 0;
+
+	for (int round = 0; round < ROUNDS; round++)
+	{
+		unsigned long sum = 0;
+		double start = nowNs();
+
+		for (int i = 0; i < count; i++)
+		{
+			if (readFiles() != FILES)
+			{
+				return -1;
+			}
+			sum += buffers[0];
+		}
+		double ns = (nowNs() - start) / count;
+		total += sum;
+		if (round == 0 || ns < best)
+		{
+			best = ns;
+		}
+	}
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	char root[] = "/tmp/wink-bench-sysfs.XXXXXX";
+	char path[512];
+	int count = 100000;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n': count = atoi(optarg); break;
+		default: fprintf(stderr, "usage: wink-bench-sysfs [-n rounds]\n"); return 1;
+		}
+	}
+
+	if (mkdtemp(root) == NULL)
+	{
+		fprintf(stderr, "Can't make a directory for the tree: %s\n", strerror(errno));
+		return 1;
+	}
+	for (int i = 0; i < FILES; i++)
+	{
+		snprintf(path, sizeof(path), "%s/%s", root, files[i][0]);
+		int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1 || write(fd, files[i][1], strlen(files[i][1])) < 0)
+		{
+			fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+			return 1;
+		}
+		fds[i] = fd;
+	}
+
+	Uring ring(1);
+	fileReader.setFiles(fds, FILES);
+	uringReader.setFiles(fds, FILES);
+	uringReader.setRing(&ring);
+
+	printf("%d rounds of %d files, best of %d, ns a round\n", count, FILES, ROUNDS);
+	printf("  lseek + read        %8.0f  (%d system calls)\n", timeRead(seekRead, count), 2 * FILES);
+	printf("  FileReader, pread   %8.0f  (%d)\n", timeRead(fileRead, count), FILES);
+	if (ring.isValid())
+		printf("  UringReader         %8.0f  (1)\n", timeRead(uringRead, count));
+	else
+		printf("  UringReader         no io_uring here, so it preads as FileReader does\n");
+
+	for (int i = 0; i < FILES; i++)
+	{
+		close(fds[i]);
+		snprintf(path, sizeof(path), "%s/%s", root, files[i][0]);
+		unlink(path);
+	}
+	rmdir(root);
+	return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Times reconnecting over TLS, built for the host with OpenSSL: TLSStack connects to a stand-in
+ * for an openssl s_server on a loopback port, once with a full handshake each time, its session
+ * forgotten first, and once resuming the session the stand-in gave it last.  The stand-in has a
+ * self-signed RSA 2048 certificate made at start, which the client checks as it would a broker's.
+ * Prints the mean ms a connection, with the TCP connect, and how many resumed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "linux.cpp"
+#include "tls.cpp"
+
+static int port = 18886;
+static const char *host = "127.0.0.1";
+
+static double nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int addExtension(X509 *cert, int nid, const char *value)
+{
+	X509V3_CTX v3;
+	X509V3_set_ctx(&v3, cert, cert, NULL, NULL, 0);
+	X509_EXTENSION *extension = X509V3_EXT_conf_nid(NULL, &v3, nid, value);
+	int rc = (extension != NULL && X509_add_ext(cert, extension, -1) == 1) ? 0 : -1;
+	X509_EXTENSION_free(extension);
+	return rc;
+}
+
+// a key and a certificate for the stand-in, and the certificate in caFile for the client to trust
+static int makeCertificate(EVP_PKEY **key, X509 **cert, const char *caFile)
+{
+	EVP_PKEY_CTX *keyContext = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL);
+
+	*key = NULL;
+	if (keyContext == NULL || EVP_PKEY_keygen_init(keyContext) != 1 || EVP_PKEY_CTX_set_rsa_keygen_bits(keyContext, 2048) != 1
+			|| EVP_PKEY_keygen(keyContext, key) != 1)
+	{
+		EVP_PKEY_CTX_free(keyContext);
+		return -1;
+	}
+	EVP_PKEY_CTX_free(keyContext);
+
+	*cert = X509_new();
+	X509_set_version(*cert, 2);
+	ASN1_INTEGER_set(X509_get_serialNumber(*cert), 1);
+	X509_gmtime_adj(X509_getm_notBefore(*cert), -60);
+	X509_gmtime_adj(X509_getm_notAfter(*cert), 24 * 60 * 60);
+	X509_set_pubkey(*cert, *key);
+	X509_NAME_add_entry_by_txt(X509_get_subject_name(*cert), "CN", MBSTRING_ASC, (const unsigned char *)host, -1, -1, 0);
+	X509_set_issuer_name(*cert, X509_get_subject_name(*cert));
+	if (addExtension(*cert, NID_basic_constraints, "critical,CA:TRUE") != 0
+			|| addExtension(*cert, NID_subject_alt_name, "IP:127.0.0.1") != 0 || X509_sign(*cert, *key, EVP_sha256()) == 0)
+		return -1;
+
+	FILE *file = fopen(caFile, "w");
+	if (file == NULL)
+		return -1;
+	int rc = PEM_write_X509(file, *cert) == 1 ? 0 : -1;
+	fclose(file);
+	return rc;
+}
+
+static int listenOn()
+{
+	struct sockaddr_in address;
+	int opt = 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0 || listen(fd, 16) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// as openssl s_server does, with its session tickets: a handshake, then sends back what it's sent
+// until the client goes, one connection at a time, until the listener is shut down
+static void serve(int listener, SSL_CTX *ctx)
+{
+	int fd;
+
+	while ((fd = accept(listener, NULL, NULL)) != -1)
+	{
+		SSL *ssl = SSL_new(ctx);
+		unsigned char buf[64];
+		int one = 1;
+		int rc;
+
+		// as brokers do, or the handshake's flights wait on delayed ACKs
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		SSL_set_fd(ssl, fd);
+		if (SSL_accept(ssl) == 1)
+		{
+			while ((rc = SSL_read(ssl, buf, sizeof(buf))) > 0)
+			{
+				if (SSL_write(ssl, buf, rc) != rc)
+					break;
+			}
+			SSL_shutdown(ssl);
+		}
+		SSL_free(ssl);
+		close(fd);
+	}
+}
+
+/**
+ * The mean ms a connection, from the TCP connect to a PINGREQ answered, which for TLS 1.3 is also
+ * when the client gets the stand-in's ticket.  -1 if one failed
+ */
+static double timeConnects(TLSContext &context, bool resume, int count, int &resumed)
+{
+	TLSPeer peer;
+	unsigned char ping[2] = {0xC0, 0x00};
+	double start = nowMs();
+
+	snprintf(peer.host, sizeof(peer.host), "%s", host);
+	peer.port = port;
+	resumed = 0;
+	for (int i = 0; i < count; i++)
+	{
+		TLSStack ipstack;
+
+		if (!resume)
+			context.forget(&peer);
+		ipstack.setContext(&context);
+		if (ipstack.connect(host, port) != 0 || ipstack.write(ping, sizeof(ping), 1000) != sizeof(ping)
+				|| ipstack.read(ping, sizeof(ping), 1000) != sizeof(ping))
+			return -1;
+		if (ipstack.isResumed())
+			resumed++;
+		ipstack.disconnect();
+	}
+	return (nowMs() - start) / count;
+}
+
+int main(int argc, char **argv)
+{
+	char caFile[] = "/tmp/wink-bench-tls.XXXXXX";
+	EVP_PKEY *key;
+	X509 *cert;
+	int count = 200;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:p:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n': count = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default: fprintf(stderr, "usage: wink-bench-tls [-n connections] [-p port]\n"); return 1;
+		}
+	}
+
+	int fd = mkstemp(caFile);
+	if (fd == -1)
+	{
+		fprintf(stderr, "Can't make a file for the certificate\n");
+		return 1;
+	}
+	close(fd);
+	if (makeCertificate(&key, &cert, caFile) != 0)
+	{
+		fprintf(stderr, "Can't make a certificate for the stand-in\n");
+		unlink(caFile);
+		return 1;
+	}
+
+	SSL_CTX *serverContext = SSL_CTX_new(TLS_server_method());
+	int listener = listenOn();
+	if (serverContext == NULL || SSL_CTX_use_certificate(serverContext, cert) != 1 || SSL_CTX_use_PrivateKey(serverContext, key) != 1
+			|| listener == -1)
+	{
+		fprintf(stderr, "Can't run the stand-in on port %d\n", port);
+		unlink(caFile);
+		return 1;
+	}
+
+	TLSContext context;
+	context.setCAFile(caFile);
+	if (!context.isValid())
+	{
+		fprintf(stderr, "Can't set up TLS for the client\n");
+		unlink(caFile);
+		return 1;
+	}
+	std::thread server(serve, listener, serverContext);
+
+	int fullResumed, resumed;
+	double full = timeConnects(context, false, count, fullResumed);
+	double resuming = timeConnects(context, true, count, resumed);
+
+	printf("%d connections each, mean ms a connection\n", count);
+	printf("  full handshake     %6.2f  (%d resumed)\n", full, fullResumed);
+	printf("  resumed handshake  %6.2f  (%d resumed)\n", resuming, resumed);
+
+	shutdown(listener, SHUT_RDWR);
+	server.join();
+	close(listener);
+	SSL_CTX_free(serverContext);
+	X509_free(cert);
+	EVP_PKEY_free(key);
+	unlink(caFile);
+	return (full < 0 || resuming < 0) ? 1 : 0;
+}
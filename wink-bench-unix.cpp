@@ -0,0 +1,142 @@
+/*
+ * Times round trips to a broker on the same host, built for the host: IPStack sends a packet to an
+ * echo server and reads it back, over TCP loopback and over a Unix domain socket, unix:@name as a
+ * broker is given in mqtt.ini.  A PINGREQ sized packet and a relay publish sized one, each the best
+ * of a few rounds, in us a round trip.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <thread>
+
+#include "linux.cpp"
+
+#define ROUNDS 5
+
+static const int sizes[] = {2, 64};
+
+static int port = 18885;
+static const char *unixHost = "unix:@wink-bench-unix";
+
+static double nowUs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// a listener on the address, which resolveAddresses gives as a broker's would be
+static int listenOn(const char *host)
+{
+	AddressList list;
+	int opt = 1;
+
+	if (resolveAddresses(host, port, AI_NUMERICHOST, list) != 0 || list.count == 0)
+		return -1;
+
+	const struct sockaddr *address = (const struct sockaddr *)&list.address[0];
+	int fd = socket(address->sa_family, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (bind(fd, address, list.length[0]) != 0 || listen(fd, 1) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// sends back whatever one connection sends, until it closes
+static void echo(int listener)
+{
+	unsigned char buf[256];
+	int one = 1;
+	int fd = accept(listener, NULL, NULL);
+	int rc;
+
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on a Unix socket
+	while ((rc = recv(fd, buf, sizeof(buf), 0)) > 0)
+	{
+		if (send(fd, buf, rc, MSG_NOSIGNAL) != rc)
+			break;
+	}
+	close(fd);
+}
+
+// the best of the rounds, as the others have only been held up.  -1 if it couldn't connect
+static double timeRoundTrips(const char *host, int size, int count)
+{
+	unsigned char buf[256];
+	IPStack ipstack;
+	double best = 0;
+
+	int listener = listenOn(host);
+	if (listener == -1)
+		return -1;
+	std::thread server(echo, listener);
+	if (ipstack.connect(host, port) != 0)
+	{
+		shutdown(listener, SHUT_RDWR);
+		server.join();
+		close(listener);
+		return -1;
+	}
+
+	memset(buf, 0xC0, size);
+	for (int round = 0; round < ROUNDS && best >= 0; round++)
+	{
+		double start = nowUs();
+
+		for (int i = 0; i < count; i++)
+		{
+			if (ipstack.write(buf, size, 1000) != size || ipstack.read(buf, size, 1000) != size)
+			{
+				best = -1;
+				break;
+			}
+		}
+		double us = (nowUs() - start) / count;
+		if (best >= 0 && (round == 0 || us < best))
+		{
+			best = us;
+		}
+	}
+
+	ipstack.disconnect();
+	server.join();
+	close(listener);
+	return best;
+}
+
+int main(int argc, char **argv)
+{
+	int count = 20000;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:p:")) != -1)
+	{
+		switch (c)
+		{
+		case 'n': count = atoi(optarg); break;
+		case 'p': port = atoi(optarg); break;
+		default: fprintf(stderr, "usage: wink-bench-unix [-n round trips] [-p port]\n"); return 1;
+		}
+	}
+
+	printf("%d round trips, best of %d, us a round trip\n", count, ROUNDS);
+	printf("  bytes  TCP loopback  Unix socket\n");
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+	{
+		double tcp = timeRoundTrips("127.0.0.1", sizes[i], count);
+		double local = timeRoundTrips(unixHost, sizes[i], count);
+
+		printf("  %5d  %12.2f  %11.2f\n", sizes[i], tcp, local);
+	}
+	return 0;
+}
@@ -0,0 +1,677 @@
+/*
+ * Behaviour checks for the host front ends of the MQTT client, run with make check against the
+ * fleet's broker stand-in on a loopback port.  Each check prints ok or FAILED, and the exit status
+ * is the number which failed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+#include "linux.cpp"
+#include "MQTTRouter.h"
+#include "async.cpp"
+#include "coroutine.cpp"
+#include "wink-fleet-broker.h"
+
+typedef MQTT::Client<IPStack, Countdown> Client;
+
+static int port = 18883;
+static int failures = 0;
+
+static void check(const char *name, bool ok)
+{
+	printf("%-70s %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok)
+	{
+		failures++;
+	}
+}
+
+// waits up to timeout_ms for done to be true
+template<class Done>
+static bool waitFor(Done done, int timeout_ms)
+{
+	Countdown deadline(timeout_ms);
+
+	while (!done())
+	{
+		if (deadline.expired())
+		{
+			return false;
+		}
+		usleep(1000);
+	}
+	return true;
+}
+
+static long cpuMs()
+{
+	struct rusage usage;
+
+	getrusage(RUSAGE_SELF, &usage);
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000L + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000;
+}
+
+static int connectClient(IPStack &ipstack, Client &client, const char *clientid)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+	if (ipstack.connect("127.0.0.1", port) != 0)
+	{
+		return -1;
+	}
+	data.clientID.cstring = (char *)clientid;
+	data.keepAliveInterval = 10;
+	if (client.connect(data) != MQTT::SUCCESS)
+	{
+		ipstack.disconnect();
+		return -1;
+	}
+	return 0;
+}
+
+MQTT_ROUTE_TOPIC(CheckUpper, "relays/upper");
+MQTT_ROUTE_TOPIC(CheckLower, "relays/lower");
+MQTT_ROUTE_TOPIC(CheckAnyRelay, "relays/+");
+MQTT_ROUTE_TOPIC(CheckAll, "sensors/#");
+MQTT_ROUTE_TOPIC(CheckT0, "t/0");
+MQTT_ROUTE_TOPIC(CheckT1, "t/1");
+MQTT_ROUTE_TOPIC(CheckT2, "t/2");
+MQTT_ROUTE_TOPIC(CheckT3, "t/3");
+MQTT_ROUTE_TOPIC(CheckT4, "t/4");
+MQTT_ROUTE_TOPIC(CheckT5, "t/5");
+MQTT_ROUTE_TOPIC(CheckT6, "t/6");
+MQTT_ROUTE_TOPIC(CheckT7, "t/7");
+
+/**
+ * Counts the messages each route is given.
+ */
+struct RouteCounts
+{
+	int hits[8];
+
+	template<int i>
+	void on(MQTT::MessageData &md)
+	{
+		hits[i]++;
+	}
+};
+
+typedef MQTT::Router<RouteCounts,
+	MQTT::Route<CheckUpper, RouteCounts, &RouteCounts::on<0> >,
+	MQTT::Route<CheckLower, RouteCounts, &RouteCounts::on<1> >,
+	MQTT::Route<CheckAnyRelay, RouteCounts, &RouteCounts::on<2> >,
+	MQTT::Route<CheckAll, RouteCounts, &RouteCounts::on<3> > > RelayRoutes;
+
+typedef MQTT::Router<RouteCounts,
+	MQTT::Route<CheckT0, RouteCounts, &RouteCounts::on<0> >,
+	MQTT::Route<CheckT1, RouteCounts, &RouteCounts::on<1> >,
+	MQTT::Route<CheckT2, RouteCounts, &RouteCounts::on<2> >,
+	MQTT::Route<CheckT3, RouteCounts, &RouteCounts::on<3> >,
+	MQTT::Route<CheckT4, RouteCounts, &RouteCounts::on<4> >,
+	MQTT::Route<CheckT5, RouteCounts, &RouteCounts::on<5> >,
+	MQTT::Route<CheckT6, RouteCounts, &RouteCounts::on<6> >,
+	MQTT::Route<CheckT7, RouteCounts, &RouteCounts::on<7> > > ExactRoutes;
+
+// gives the router a topic which isn't NUL terminated, as it is in a received packet
+template<class Routes>
+static bool route(Routes &routes, RouteCounts &counts, const char *topic)
+{
+	char packet[128];
+	MQTTString topicName = MQTTString_initializer;
+	MQTT::Message message = {MQTT::QOS0, false, false, 0, NULL, 0};
+	int len = strlen(topic);
+
+	memcpy(packet, topic, len);
+	packet[len] = '/';
+	topicName.lenstring.data = packet;
+	topicName.lenstring.len = len;
+	memset(counts.hits, 0, sizeof(counts.hits));
+	return routes.dispatch(topicName, message);
+}
+
+static bool hitsAre(RouteCounts &counts, int a, int b, int c, int d)
+{
+	return counts.hits[0] == a && counts.hits[1] == b && counts.hits[2] == c && counts.hits[3] == d;
+}
+
+static void checkRouter()
+{
+	RouteCounts counts;
+	RelayRoutes relayRoutes(counts, "home/relay");
+	ExactRoutes exactRoutes(counts);
+	bool all = true;
+
+	check("Router calls an exact route and the wildcard route which match",
+			route(relayRoutes, counts, "home/relay/relays/upper") && hitsAre(counts, 1, 0, 1, 0));
+	check("Router calls a wildcard route alone",
+			route(relayRoutes, counts, "home/relay/relays/other") && hitsAre(counts, 0, 0, 1, 0));
+	check("Router matches # to the end of the topic",
+			route(relayRoutes, counts, "home/relay/sensors/a/b") && hitsAre(counts, 0, 0, 0, 1));
+	check("Router takes nothing outside its prefix",
+			!route(relayRoutes, counts, "home/other/relays/upper") && hitsAre(counts, 0, 0, 0, 0));
+	check("Router takes nothing which no route matches",
+			!route(relayRoutes, counts, "home/relay/relays/upper/x") && hitsAre(counts, 0, 0, 0, 0));
+
+	for (int i = 0; i < 8; i++)
+	{
+		char topic[8];
+
+		snprintf(topic, sizeof(topic), "t/%d", i);
+		all = all && route(exactRoutes, counts, topic) && counts.hits[i] == 1;
+		for (int j = 0; j < 8; j++)
+		{
+			all = all && (j == i || counts.hits[j] == 0);
+		}
+	}
+	check("Router gives each exact route a slot of its own", all && !route(exactRoutes, counts, "t/8"));
+}
+
+// the same publish through MQTTV5Serialize_publish, which a PreparedTopic has to match byte for byte
+static int referencePublish(unsigned char *buf, int buflen, const char *topic, MQTT::QoS qos, bool retained,
+		unsigned short id, unsigned char *payload, int payloadlen, int mqttVersion, unsigned short alias, bool aliasKnown)
+{
+	MQTTString topicString = MQTTString_initializer;
+	MQTTProperty aliasProperty;
+	MQTTProperties properties = MQTTProperties_initializer;
+
+	topicString.cstring = aliasKnown ? (char *)"" : (char *)topic;
+	properties.array = &aliasProperty;
+	properties.max_count = 1;
+	aliasProperty.identifier = MQTTPROPERTY_CODE_TOPIC_ALIAS;
+	aliasProperty.value.integer2 = alias;
+	if (alias != 0)
+		MQTTProperties_add(&properties, &aliasProperty);
+	return MQTTV5Serialize_publish(buf, buflen, 0, qos, retained, id, topicString, mqttVersion == 5 ? &properties : NULL, payload, payloadlen);
+}
+
+static void checkPreparedTopic()
+{
+	static unsigned char payload[16000], expected[17000], actual[17000];
+	const int payloadLengths[] = {0, 2, 100, 200, 16000};    // remaining lengths of one, two and three bytes
+	const char *topic = "home/relay/sensors/temperature";
+	MQTT::PreparedTopic prepared;
+	int cases = 0, matched = 0;
+
+	prepared.set(topic);
+	for (int i = 0; i < (int)sizeof(payload); i++)
+	{
+		payload[i] = (unsigned char)i;
+	}
+
+	for (int version = 4; version <= 5; version++)
+	{
+		for (int qos = 0; qos <= 2; qos++)
+		{
+			for (int retained = 0; retained <= 1; retained++)
+			{
+				// no alias, a new one and one the server knows, which only MQTT 5 has
+				for (int aliasCase = 0; aliasCase < (version == 5 ? 3 : 1); aliasCase++)
+				{
+					for (int len : payloadLengths)
+					{
+						unsigned short alias = aliasCase > 0 ? 3 : 0;
+						bool known = aliasCase == 2;
+						int e = referencePublish(expected, sizeof(expected), topic, (MQTT::QoS)qos, retained, 1234, payload, len, version, alias, known);
+						int a = prepared.serialize(actual, sizeof(actual), (MQTT::QoS)qos, retained, 1234, payload, len, version, alias, known);
+
+						cases++;
+						if (e > 0 && a == e && memcmp(expected, actual, e) == 0)
+						{
+							matched++;
+						}
+					}
+				}
+			}
+		}
+	}
+	check("PreparedTopic serializes publishes as MQTTSerialize_publish does", matched == cases);
+
+	int len = prepared.serialize(actual, sizeof(actual), MQTT::QOS1, false, 1, payload, 100);
+	check("PreparedTopic fails a buffer one byte short",
+			prepared.serialize(actual, len - 1, MQTT::QOS1, false, 1, payload, 100) == MQTTPACKET_BUFFER_TOO_SHORT);
+	check("PreparedTopic refuses a topic which is too long, and is left empty",
+			!prepared.set(std::string(MAX_PREPARED_TOPIC_LEN + 1, 'x').c_str()) && prepared.name()[0] == '\0');
+}
+
+// stands in for a DNS server, which answers every name with the loopback address after a delay,
+// or fails
+static std::atomic<int> stubDelayMs(0), stubCalls(0);
+static std::atomic<bool> stubFails(false);
+
+static int stubLookup(const char *hostname, int port, int flags, AddressList &list)
+{
+	stubCalls++;
+	usleep(stubDelayMs * 1000);
+	if (stubFails)
+	{
+		list.count = 0;
+		return EAI_AGAIN;
+	}
+	return resolveAddresses("127.0.0.1", port, AI_NUMERICHOST, list);
+}
+
+static void checkResolver()
+{
+	Resolver resolver(1);
+	AddressList list;
+	int calls;
+
+	resolver.setLookup(stubLookup);
+	stubDelayMs = 300;
+
+	Countdown quick(50);
+	check("Resolver answers the first lookup without waiting for it",
+			resolver.lookup("check.invalid", 1883, list) == RESOLVE_PENDING && !quick.expired());
+	check("Resolver gives the addresses once they have been looked up",
+			waitFor([&] { return resolver.lookup("check.invalid", 1883, list) == 0; }, 2000) && list.count == 1);
+
+	calls = stubCalls;
+	bool reused = true;
+	for (int i = 0; i < 10; i++)
+	{
+		reused = reused && resolver.lookup("check.invalid", 1883, list) == 0 && list.count == 1;
+	}
+	usleep(50000);
+	check("Resolver reuses an entry until its TTL is up", reused && stubCalls == calls);
+
+	// past the TTL, with the DNS server failing
+	usleep(1100000);
+	stubFails = true;
+	calls = stubCalls;
+	quick.countdown_ms(50);
+	bool served = resolver.lookup("check.invalid", 1883, list) == 0 && list.count == 1 && !quick.expired();
+	served = served && waitFor([&] { return stubCalls > calls; }, 1000);
+	usleep(500000);
+	served = served && resolver.lookup("check.invalid", 1883, list) == 0 && list.count == 1;
+	check("Resolver serves stale addresses while looking them up fails", served);
+
+	check("Resolver fails a host with no addresses to fall back on",
+			resolver.lookup("other.invalid", 1883, list) == RESOLVE_PENDING
+			&& waitFor([&] { return resolver.lookup("other.invalid", 1883, list) == -1; }, 2000));
+
+	calls = stubCalls;
+	check("Resolver takes an IP address as it is", resolver.lookup("127.0.0.1", 1883, list) == 0 && stubCalls == calls);
+	stubFails = false;
+}
+
+/**
+ * A loopback listener for the connect checks, which either takes connections, or has its backlog
+ * filled so that it drops every SYN, as a host which has gone away does.
+ */
+struct Listener
+{
+	int fd;
+	int port;
+	int fills[3];
+
+	Listener(const char *ip, bool full) : fd(-1), port(0)
+	{
+		AddressList list;
+		struct sockaddr_storage address;
+		socklen_t len = sizeof(address);
+
+		resolveAddresses(ip, 0, AI_NUMERICHOST, list);
+		fd = socket(list.address[0].ss_family, SOCK_STREAM, 0);
+		bind(fd, (struct sockaddr *)&list.address[0], list.length[0]);
+		listen(fd, full ? 0 : 16);
+		getsockname(fd, (struct sockaddr *)&address, &len);
+		port = ntohs(address.ss_family == AF_INET6 ? ((struct sockaddr_in6 *)&address)->sin6_port : ((struct sockaddr_in *)&address)->sin_port);
+
+		for (int i = 0; i < 3; i++)
+		{
+			fills[i] = -1;
+			if (full)
+			{
+				resolveAddresses(ip, port, AI_NUMERICHOST, list);
+				fills[i] = socket(list.address[0].ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+				::connect(fills[i], (struct sockaddr *)&list.address[0], list.length[0]);
+			}
+		}
+		usleep(50000);
+	}
+
+	~Listener()
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			if (fills[i] != -1)
+				close(fills[i]);
+		}
+		close(fd);
+	}
+};
+
+// a port on ip with nothing listening, which refuses connections
+static int closedPort(const char *ip)
+{
+	Listener listener(ip, false);
+	return listener.port;
+}
+
+static void addAddress(AddressList &list, const char *ip, int port)
+{
+	AddressList one;
+
+	resolveAddresses(ip, port, AI_NUMERICHOST, one);
+	list.address[list.count] = one.address[0];
+	list.length[list.count++] = one.length[0];
+}
+
+// connects to the addresses in order, giving the family of the one connected to, or -1
+static int connectFamily(IPStack &ipstack, const AddressList &list, long &elapsed_ms)
+{
+	struct sockaddr_storage address;
+	socklen_t len = sizeof(address);
+	struct timespec start, end;
+	int family = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (ipstack.connect(list) == 0)
+	{
+		getpeername(ipstack.getSocket(), (struct sockaddr *)&address, &len);
+		family = address.ss_family;
+		ipstack.disconnect();
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	elapsed_ms = (end.tv_sec - start.tv_sec) * 1000L + (end.tv_nsec - start.tv_nsec) / 1000000;
+	return family;
+}
+
+static void checkConnect()
+{
+	IPStack ipstack;
+	Listener v4("127.0.0.1", false), deadV4("127.0.0.1", true), deadV6("::1", true);
+	AddressList list;
+	long elapsed;
+
+	ipstack.setConnectTimeout(400);
+	memset(&list, 0, sizeof(list));
+
+	list.count = 0;
+	addAddress(list, "::1", closedPort("::1"));
+	addAddress(list, "127.0.0.1", v4.port);
+	check("IPStack connects over IPv4 straight away when IPv6 refuses",
+			connectFamily(ipstack, list, elapsed) == AF_INET && elapsed < CONNECTION_ATTEMPT_DELAY_MS);
+
+	list.count = 0;
+	addAddress(list, "::1", deadV6.port);
+	addAddress(list, "127.0.0.1", v4.port);
+	check("IPStack connects over IPv4 250 ms after IPv6 goes unanswered",
+			connectFamily(ipstack, list, elapsed) == AF_INET && elapsed >= CONNECTION_ATTEMPT_DELAY_MS - 10 && elapsed < 400);
+
+	list.count = 0;
+	addAddress(list, "127.0.0.1", deadV4.port);
+	check("IPStack gives up on a listener which never accepts at its timeout",
+			connectFamily(ipstack, list, elapsed) == -1 && elapsed >= 390 && elapsed < 600);
+
+	// the last attempt starts 500 ms in, and has its 400 ms
+	list.count = 0;
+	addAddress(list, "::1", deadV6.port);
+	addAddress(list, "127.0.0.1", deadV4.port);
+	addAddress(list, "127.0.0.1", closedPort("127.0.0.1"));
+	check("IPStack fails within the overall deadline when every address fails",
+			connectFamily(ipstack, list, elapsed) == -1 && elapsed < 2 * CONNECTION_ATTEMPT_DELAY_MS + 400 + 100);
+}
+
+/**
+ * What the AsyncClient checks count, from their callbacks and handler on the client's thread.
+ */
+struct AsyncResults
+{
+	std::atomic<int> succeeded;
+	std::atomic<int> failed;
+	std::atomic<int> received;
+
+	void reset()
+	{
+		succeeded = failed = received = 0;
+	}
+
+	int done()
+	{
+		return succeeded + failed;
+	}
+};
+
+static IPStack asyncNetwork;
+static Client asyncClient(asyncNetwork, 2000);
+static AsyncResults asyncResults;
+
+static void asyncDone(void *context, int rc)
+{
+	(rc == MQTT::SUCCESS ? asyncResults.succeeded : asyncResults.failed)++;
+}
+
+static void asyncMessage(MQTT::MessageData &md)
+{
+	asyncResults.received++;
+}
+
+static int asyncConnect(void *context)
+{
+	return connectClient(asyncNetwork, asyncClient, "check-async");
+}
+
+static void checkAsyncClient(FleetBroker &broker)
+{
+	typedef AsyncClient<IPStack, Client> Async;
+	const int threads = 4, qos0 = 250, qos1 = 25;
+
+	{
+		Async idle(asyncNetwork, asyncClient);
+		idle.start();
+		asyncResults.reset();
+		idle.publish("check/async/idle", "x", 1, MQTT::QOS1, false, asyncDone, NULL);
+		check("AsyncClient fails commands while disconnected", waitFor([] { return asyncResults.failed == 1; }, 1000));
+
+		long cpu = cpuMs();
+		usleep(300000);
+		check("AsyncClient waits without spinning while disconnected", cpuMs() - cpu < 30);
+	}
+
+	Async async(asyncNetwork, asyncClient);
+	async.setConnect(asyncConnect, NULL);
+	async.start();
+
+	asyncResults.reset();
+	async.subscribe("check/async/#", MQTT::QOS1, asyncMessage, asyncDone, NULL);
+	check("AsyncClient connects and subscribes", waitFor([] { return asyncResults.succeeded == 1; }, 2000));
+
+	// from several threads at once, which only the queue keeps apart
+	asyncResults.reset();
+	std::thread producers[threads];
+	for (int t = 0; t < threads; t++)
+	{
+		producers[t] = std::thread([&async, t]
+		{
+			char topic[32];
+			snprintf(topic, sizeof(topic), "check/async/%d", t);
+			for (int i = 0; i < qos0 + qos1; i++)
+			{
+				async.publish(topic, &i, sizeof(i), i < qos0 ? MQTT::QOS0 : MQTT::QOS1, false, asyncDone, NULL);
+			}
+		});
+	}
+	for (int t = 0; t < threads; t++)
+	{
+		producers[t].join();
+	}
+	const int total = threads * (qos0 + qos1);
+	check("AsyncClient sends publishes from many threads",
+			waitFor([=] { return asyncResults.done() == total; }, 5000) && asyncResults.succeeded == total);
+	check("AsyncClient delivers the messages subscribed to", waitFor([=] { return asyncResults.received == total; }, 5000));
+
+	asyncResults.reset();
+	async.unsubscribe("check/async/#", asyncDone, NULL);
+	waitFor([] { return asyncResults.done() == 1; }, 2000);
+	async.publish("check/async/after", "x", 1, MQTT::QOS1, false, asyncDone, NULL);
+	waitFor([] { return asyncResults.done() == 2; }, 2000);
+	usleep(100000);
+	check("AsyncClient unsubscribes", asyncResults.succeeded == 2 && asyncResults.received == 0);
+
+	// the subscription is made again once the thread has reconnected
+	asyncResults.reset();
+	async.subscribe("check/async/#", MQTT::QOS1, asyncMessage, asyncDone, NULL);
+	waitFor([] { return asyncResults.done() == 1; }, 2000);
+	unsigned long connects = broker.connects;
+	broker.restart(300);
+	waitFor([&] { return broker.connects > connects; }, 5000);
+	asyncResults.reset();
+	async.publish("check/async/restart", "x", 1, MQTT::QOS1, false, asyncDone, NULL);
+	bool delivered = waitFor([] { return asyncResults.received == 1; }, 2000);
+	check("AsyncClient reconnects and subscribes again after a broker restart", delivered);
+
+	// what is queued before stop is sent
+	asyncResults.reset();
+	for (int i = 0; i < 200; i++)
+	{
+		async.publish("check/stop", &i, sizeof(i), MQTT::QOS0, false, asyncDone, NULL);
+	}
+	async.stop();
+	check("AsyncClient sends what was queued before stop", asyncResults.succeeded == 200);
+
+	if (asyncClient.isConnected())
+	{
+		asyncClient.disconnect();
+	}
+	asyncNetwork.disconnect();
+}
+
+#if defined(__cpp_impl_coroutine)
+
+typedef CoClient<IPStack> CoroutineClient;
+
+static int coReceived;
+
+static void coMessage(MQTT::MessageData &md)
+{
+	coReceived++;
+}
+
+// lets the executor run until done is true, or timeout_ms has passed
+template<class Done>
+static CoTask coWaitFor(CoExecutor &executor, Done done, int timeout_ms)
+{
+	Countdown deadline(timeout_ms);
+
+	while (!done() && !deadline.expired())
+	{
+		co_await executor.sleep(1);
+	}
+	co_return done();
+}
+
+static CoTask checkCoClient(CoExecutor &executor, IPStack &ipstack, CoroutineClient &client, FleetBroker &broker)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+	const int count = 100;
+	int results[count];
+
+	data.clientID.cstring = (char *)"check-co";
+	data.keepAliveInterval = 10;
+	int rc = ipstack.connect("127.0.0.1", port);
+	if (rc == 0)
+	{
+		rc = co_await client.connect(data);
+	}
+	check("CoClient connects", rc == MQTT::SUCCESS);
+	check("CoClient subscribes", co_await client.subscribe("check/co/#", MQTT::QOS1, coMessage) == MQTT::SUCCESS);
+
+	// all waiting for their PUBACKs at once
+	coReceived = 0;
+	for (int i = 0; i < count; i++)
+	{
+		results[i] = -99;
+		executor.spawn(client.publish("check/co/many", &i, sizeof(i), MQTT::QOS1), &results[i]);
+	}
+	bool acknowledged = co_await coWaitFor(executor, [&]
+	{
+		for (int i = 0; i < count; i++)
+		{
+			if (results[i] == -99)
+			{
+				return false;
+			}
+		}
+		return true;
+	}, 5000);
+	for (int i = 0; i < count; i++)
+	{
+		acknowledged = acknowledged && results[i] == MQTT::SUCCESS;
+	}
+	check("CoClient waits for many publishes at once", acknowledged);
+	check("CoClient delivers the messages subscribed to", co_await coWaitFor(executor, [=] { return coReceived == count; }, 5000));
+
+	coReceived = 0;
+	check("CoClient resumes a QoS 2 publish on its PUBCOMP", co_await client.publish("check/co/two", "x", 1, MQTT::QOS2) == MQTT::SUCCESS
+			&& co_await coWaitFor(executor, [] { return coReceived == 1; }, 2000));
+
+	coReceived = 0;
+	bool unsubscribed = co_await client.unsubscribe("check/co/#") == MQTT::SUCCESS
+			&& co_await client.publish("check/co/after", "x", 1, MQTT::QOS1) == MQTT::SUCCESS;
+	co_await executor.sleep(100);
+	check("CoClient unsubscribes", unsubscribed && coReceived == 0);
+
+	// no session is kept, so losing the connection is the end of it
+	broker.restart(300);
+	check("CoClient sees the connection lost in a broker restart", co_await coWaitFor(executor, [&] { return !client.isConnected(); }, 5000));
+	check("CoClient fails operations once the connection is lost", co_await client.publish("check/co/lost", "x", 1, MQTT::QOS1) == MQTT::FAILURE);
+
+	executor.stop();
+	co_return 0;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "p:")) != -1)
+	{
+		switch (c)
+		{
+		case 'p': port = atoi(optarg); break;
+		default: fprintf(stderr, "usage: wink-client-check [-p port]\n"); return 1;
+		}
+	}
+
+	FleetBroker broker(port, 0);
+	if (broker.start() != 0)
+	{
+		fprintf(stderr, "Can't listen on port %d\n", port);
+		return 1;
+	}
+
+	checkRouter();
+	checkPreparedTopic();
+	checkResolver();
+	checkConnect();
+	checkAsyncClient(broker);
+#if defined(__cpp_impl_coroutine)
+	{
+		CoExecutor executor;
+		IPStack ipstack;
+		CoroutineClient client(executor, ipstack);
+
+		// the restart in the AsyncClient checks is over once the stand-in takes connections again
+		waitFor([&] { return ipstack.connect("127.0.0.1", port) == 0 && ipstack.disconnect() == 0; }, 5000);
+		executor.spawn(checkCoClient(executor, ipstack, client, broker));
+		executor.run();
+	}
+#else
+	printf("CoClient not checked, without C++20 coroutines\n");
+#endif
+
+	broker.stop();
+	printf("%d failed\n", failures);
+	return failures;
+}
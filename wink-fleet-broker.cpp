@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#include "MQTTPacket.h"
+#include "wink-fleet-broker.h"
+
+#define MAX_EVENTS 64
+#define MAX_FILTERS 8
+
+static unsigned long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+// MQTT topic matching, with + for one level and # for the rest
+static bool topicMatches(const char *filter, const char *topic, int topicLength)
+{
+	const char *end = topic + topicLength;
+
+	while (*filter && topic < end)
+	{
+		if (*filter == '#')
+			return true;
+		if (*filter == '+')
+		{
+			while (topic < end && *topic != '/')
+				topic++;
+			filter++;
+		}
+		else if (*filter++ != *topic++)
+			return false;
+	}
+	return (*filter == '\0' || strcmp(filter, "/#") == 0 || strcmp(filter, "#") == 0) && topic == end;
+}
+
+FleetBroker::FleetBroker(int port, int connectRate)
+	: accepts(0), connects(0), refused(0), publishes(0), port(port), connectRate(connectRate), listener(-1), epfd(-1),
+	  running(false), restartRequested(-1), latency(0), rateSecond(0), rateCount(0)
+{
+}
+
+FleetBroker::~FleetBroker()
+{
+	stop();
+}
+
+int FleetBroker::listen()
+{
+	struct sockaddr_in address;
+	int opt = 1;
+
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	if (listener == -1)
+		return -1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	if (bind(listener, (struct sockaddr *)&address, sizeof(address)) != 0 || ::listen(listener, 4096) != 0)
+	{
+		::close(listener);
+		listener = -1;
+		return -1;
+	}
+
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = NULL;
+	return epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &event);
+}
+
+int FleetBroker::start()
+{
+	epfd = epoll_create1(0);
+	if (epfd == -1 || listen() != 0)
+		return -1;
+
+	running = true;
+	thread = std::thread(&FleetBroker::run, this);
+	return 0;
+}
+
+void FleetBroker::stop()
+{
+	if (!running)
+		return;
+
+	running = false;
+	thread.join();
+	closeAll();
+	::close(epfd);
+}
+
+void FleetBroker::close(Connection *connection)
+{
+	::close(connection->fd); // which takes it out of the epoll set too
+	connections.erase(std::find(connections.begin(), connections.end(), connection));
+	delete connection;
+}
+
+void FleetBroker::closeAll()
+{
+	while (!connections.empty())
+	{
+		close(connections.back());
+	}
+	if (listener != -1)
+	{
+		::close(listener);
+		listener = -1;
+	}
+}
+
+void FleetBroker::accept()
+{
+	int fd, one = 1;
+
+	while ((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK)) != -1)
+	{
+		Connection *connection = new Connection();
+		struct epoll_event event;
+
+		connection->fd = fd;
+		connection->len = 0;
+		connection->connected = false;
+		connection->nextPacketid = 0;
+		// replies are a few bytes each, and shouldn't wait on each other
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		event.events = EPOLLIN;
+		event.data.ptr = connection;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+		connections.push_back(connection);
+		accepts++;
+	}
+}
+
+void FleetBroker::forward(const char *topic, int topicLength, unsigned char *payload, int payloadLength, int qos)
+{
+	unsigned char buf[1024];
+	MQTTString topicName = MQTTString_initializer;
+	int len = -1;
+
+	topicName.lenstring.data = (char *)topic;
+	topicName.lenstring.len = topicLength;
+	for (Connection *connection : connections)
+	{
+		for (const Subscription &subscription : connection->subscriptions)
+		{
+			if (!topicMatches(subscription.filter.c_str(), topic, topicLength))
+				continue;
+
+			int granted = std::min(qos, subscription.qos);
+			if (granted > 0)
+			{
+				// each connection has packet ids of its own
+				if (++connection->nextPacketid == 0)
+					connection->nextPacketid = 1;
+				int n = MQTTSerialize_publish(buf, sizeof(buf), 0, granted, 0, connection->nextPacketid, topicName, payload, payloadLength);
+				if (n > 0)
+					send(connection->fd, buf, n, MSG_NOSIGNAL | MSG_DONTWAIT);
+				len = -1;
+			}
+			else
+			{
+				if (len == -1)
+					len = MQTTSerialize_publish(buf, sizeof(buf), 0, 0, 0, 0, topicName, payload, payloadLength);
+				if (len > 0)
+					send(connection->fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+			}
+			break;
+		}
+	}
+}
+
+// returns -1 if the connection should be closed
+int FleetBroker::handle(Connection *connection, unsigned char *packet, int len)
+{
+	unsigned char reply[64];
+	int replyLength = 0;
+	int type = packet[0] >> 4;
+
+	if (type != CONNECT && !connection->connected)
+		return -1;
+
+	switch (type)
+	{
+	case CONNECT:
+	{
+		MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+		unsigned long second = nowMs() / 1000;
+
+		if (MQTTDeserialize_connect(&data, packet, len) != 1)
+			return -1;
+
+		if (second != rateSecond)
+		{
+			rateSecond = second;
+			rateCount = 0;
+		}
+		if (connectRate > 0 && ++rateCount > connectRate)
+		{
+			refused++;
+			replyLength = MQTTSerialize_connack(reply, sizeof(reply), 3, 0); // server unavailable
+			send(connection->fd, reply, replyLength, MSG_NOSIGNAL | MSG_DONTWAIT);
+			return -1;
+		}
+
+		connects++;
+		connection->connected = true;
+		replyLength = MQTTSerialize_connack(reply, sizeof(reply), 0, 0);
+		break;
+	}
+	case SUBSCRIBE:
+	{
+		unsigned char dup;
+		unsigned short packetid;
+		int count;
+		MQTTString filters[MAX_FILTERS];
+		int qos[MAX_FILTERS];
+
+		if (MQTTDeserialize_subscribe(&dup, &packetid, MAX_FILTERS, &count, filters, qos, packet, len) != 1)
+			return -1;
+		for (int i = 0; i < count; i++)
+		{
+			Subscription subscription = {std::string(filters[i].lenstring.data, filters[i].lenstring.len), qos[i]};
+			connection->subscriptions.push_back(subscription);
+		}
+		replyLength = MQTTSerialize_suback(reply, sizeof(reply), packetid, count, qos);
+		break;
+	}
+	case UNSUBSCRIBE:
+	{
+		unsigned char dup;
+		unsigned short packetid;
+		int count;
+		MQTTString filters[MAX_FILTERS];
+
+		if (MQTTDeserialize_unsubscribe(&dup, &packetid, MAX_FILTERS, &count, filters, packet, len) != 1)
+			return -1;
+		for (int i = 0; i < count; i++)
+		{
+			std::string filter(filters[i].lenstring.data, filters[i].lenstring.len);
+			auto &subscriptions = connection->subscriptions;
+			subscriptions.erase(std::remove_if(subscriptions.begin(), subscriptions.end(),
+					[&](const Subscription &subscription) { return subscription.filter == filter; }), subscriptions.end());
+		}
+		replyLength = MQTTSerialize_unsuback(reply, sizeof(reply), packetid);
+		break;
+	}
+	case PUBLISH:
+	{
+		unsigned char dup, retained;
+		unsigned short packetid;
+		int qos, payloadLength;
+		unsigned char *payload;
+		MQTTString topicName = MQTTString_initializer;
+
+		if (MQTTDeserialize_publish(&dup, &qos, &retained, &packetid, &topicName, &payload, &payloadLength, packet, len) != 1)
+			return -1;
+
+		publishes++;
+		if (qos == 2)
+		{
+			Held held = {packetid, std::string(topicName.lenstring.data, topicName.lenstring.len),
+					std::string((char *)payload, payloadLength)};
+			connection->held.push_back(held);
+			replyLength = MQTTSerialize_ack(reply, sizeof(reply), PUBREC, 0, packetid);
+			break;
+		}
+		if (qos == 1)
+			replyLength = MQTTSerialize_puback(reply, sizeof(reply), packetid);
+		forward(topicName.lenstring.data, topicName.lenstring.len, payload, payloadLength, qos);
+		break;
+	}
+	case PUBREL:
+	{
+		unsigned char packettype, dup;
+		unsigned short packetid;
+
+		if (MQTTDeserialize_ack(&packettype, &dup, &packetid, packet, len) != 1)
+			return -1;
+		for (auto held = connection->held.begin(); held != connection->held.end(); ++held)
+		{
+			if (held->packetid == packetid)
+			{
+				forward(held->topic.data(), held->topic.size(), (unsigned char *)&held->payload[0], held->payload.size(), 2);
+				connection->held.erase(held);
+				break;
+			}
+		}
+		replyLength = MQTTSerialize_pubcomp(reply, sizeof(reply), packetid);
+		break;
+	}
+	case PUBREC:
+	{
+		unsigned char packettype, dup;
+		unsigned short packetid;
+
+		if (MQTTDeserialize_ack(&packettype, &dup, &packetid, packet, len) != 1)
+			return -1;
+		replyLength = MQTTSerialize_ack(reply, sizeof(reply), PUBREL, 0, packetid);
+		break;
+	}
+	case PINGREQ:
+		reply[0] = PINGRESP << 4;
+		reply[1] = 0;
+		replyLength = 2;
+		break;
+	case DISCONNECT:
+		return -1;
+	default:
+		break;
+	}
+
+	if (replyLength > 0 && send(connection->fd, reply, replyLength, MSG_NOSIGNAL | MSG_DONTWAIT) != replyLength)
+		return -1;
+	return 0;
+}
+
+void FleetBroker::receive(Connection *connection)
+{
+	int rc = recv(connection->fd, connection->buf + connection->len, sizeof(connection->buf) - connection->len, 0);
+
+	if (rc <= 0)
+	{
+		if (rc == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			close(connection);
+		return;
+	}
+	connection->len += rc;
+
+	// handle every complete packet in the buffer
+	while (connection->len >= 2)
+	{
+		int remaining;
+		int lengthBytes = MQTTPacket_decodeBufLen(connection->buf + 1, connection->buf + connection->len, &remaining);
+		int packetLength = 1 + lengthBytes + remaining;
+
+		if (lengthBytes == 0 || packetLength > connection->len)
+		{
+			if (packetLength > (int)sizeof(connection->buf) || (connection->len > 5 && lengthBytes == 0))
+				close(connection); // larger than any relay sends, or malformed
+			return;
+		}
+
+		// behind any still held, so that they keep their order when the latency changes
+		if (latency > 0 || !connection->delayed.empty())
+		{
+			Delayed delayed = {nowMs() + latency, std::string((char *)connection->buf, packetLength)};
+			connection->delayed.push_back(delayed);
+		}
+		else if (handle(connection, connection->buf, packetLength) != 0)
+		{
+			close(connection);
+			return;
+		}
+
+		connection->len -= packetLength;
+		memmove(connection->buf, connection->buf + packetLength, connection->len);
+	}
+}
+
+// the packets whose latency is up, in the order they came on each connection
+void FleetBroker::handleDelayed()
+{
+	unsigned long now = nowMs();
+
+	// backwards, as closing a connection takes it out
+	for (size_t i = connections.size(); i-- > 0; )
+	{
+		Connection *connection = connections[i];
+
+		while (!connection->delayed.empty() && connection->delayed.front().due <= now)
+		{
+			std::string packet = connection->delayed.front().packet;
+
+			connection->delayed.pop_front();
+			if (handle(connection, (unsigned char *)&packet[0], packet.size()) != 0)
+			{
+				close(connection);
+				break;
+			}
+		}
+	}
+}
+
+void FleetBroker::run()
+{
+	struct epoll_event events[MAX_EVENTS];
+	unsigned long restartAt = 0;
+
+	while (running)
+	{
+		int down_ms = restartRequested.exchange(-1);
+		if (down_ms >= 0)
+		{
+			closeAll();
+			restartAt = nowMs() + down_ms;
+		}
+		if (restartAt != 0 && nowMs() >= restartAt && listen() == 0)
+		{
+			restartAt = 0;
+		}
+
+		int n = epoll_wait(epfd, events, MAX_EVENTS, (latency > 0) ? 1 : 10);
+		for (int i = 0; i < n; i++)
+		{
+			Connection *connection = (Connection *)events[i].data.ptr;
+
+			if (connection == NULL)
+				accept();
+			else
+				receive(connection);
+		}
+		handleDelayed();
+	}
+}
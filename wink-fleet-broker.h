@@ -0,0 +1,104 @@
+#ifndef WINK_FLEET_BROKER_H
+#define WINK_FLEET_BROKER_H
+
+#include <atomic>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * Just enough of an MQTT 3.1.1 broker to see what a fleet of relays does to one.  It answers
+ * CONNECT, SUBSCRIBE, UNSUBSCRIBE, PUBLISH and PINGREQ, passes publishes on to matching subscriptions at the
+ * lower of the two QoS, holding QoS 2 publishes until their PUBREL as mosquitto does, and counts
+ * what arrives.  Nothing is sent again, as nothing is lost on loopback.  It can act out a restart,
+ * can be limited to a number of CONNECTs a second to act out a broker which is struggling, and can
+ * hold each packet it receives for a while to act out one which is far away.
+ */
+class FleetBroker
+{
+public:
+	// connectRate 0 accepts every CONNECT
+	FleetBroker(int port, int connectRate);
+	~FleetBroker();
+
+	int start();
+	void stop();
+
+	// drop every connection and stop listening, then listen again after down_ms
+	void restart(int down_ms)
+	{
+		restartRequested = down_ms;
+	}
+
+	// handle each packet latency_ms after it arrives, to the millisecond, which adds that to every
+	// round trip.  0, the default, handles them as they come
+	void setLatency(int latency_ms)
+	{
+		latency = latency_ms;
+	}
+
+	std::atomic<unsigned long> accepts;
+	std::atomic<unsigned long> connects;
+	std::atomic<unsigned long> refused;
+	std::atomic<unsigned long> publishes;
+
+private:
+	struct Subscription
+	{
+		std::string filter;
+		int qos;
+	};
+
+	// a QoS 2 publish waiting for its PUBREL
+	struct Held
+	{
+		unsigned short packetid;
+		std::string topic;
+		std::string payload;
+	};
+
+	// a packet received, to be handled once the latency is up
+	struct Delayed
+	{
+		unsigned long due;
+		std::string packet;
+	};
+
+	struct Connection
+	{
+		int fd;
+		unsigned char buf[1024];
+		int len;
+		bool connected;
+		unsigned short nextPacketid;
+		std::vector<Subscription> subscriptions;
+		std::vector<Held> held;
+		std::deque<Delayed> delayed;
+	};
+
+	void run();
+	int listen();
+	void accept();
+	void receive(Connection *connection);
+	void handleDelayed();
+	int handle(Connection *connection, unsigned char *packet, int len);
+	void forward(const char *topic, int topicLength, unsigned char *payload, int payloadLength, int qos);
+	void close(Connection *connection);
+	void closeAll();
+
+	int port;
+	int connectRate;
+	int listener;
+	int epfd;
+	std::vector<Connection *> connections;
+	std::atomic<bool> running;
+	std::atomic<int> restartRequested;
+	std::atomic<int> latency;
+	std::thread thread;
+
+	unsigned long rateSecond;
+	int rateCount;
+};
+
+#endif
@@ -0,0 +1,817 @@
+/*
+ * Fleet simulator: runs many virtual Wink Relays in one process against a real broker, to load
+ * test the broker and whatever sits behind it.
+ *
+ * Each relay is the same WinkRelay the handler runs on the device, reading a fake sysfs tree of its
+ * own in which the simulator presses switches and moves the sensors.  The relays are split into
+ * shards, one thread each, and a shard waits for all of its sockets with one epoll, or built with
+ * WINK_USE_IO_URING, with one io_uring which all of its relays send, receive and read their files
+ * through.  A controller client sends relay commands and times how long each takes to come back as
+ * a state change.
+ *
+ * With -B it runs its own broker stand-in instead, which can act out a restart or a broker
+ * that can only take so many CONNECTs a second, to measure the reconnect storm that follows.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "wink-relay.h"
+#include "wink-fleet-broker.h"
+
+#define MAX_EVENTS 64
+
+struct Options
+{
+	const char *host;
+	int port;
+	int relays;
+	int shards;
+	int seconds;
+	const char *root;
+	const char *prefix;
+	int commandRate;
+	int commandQos;
+	int pressInterval;
+	int tick;
+	int dropAt;
+	int mqttVersion;
+	bool standIn;
+	int standInRate;
+	int standInLatency;
+	int downtime;
+	bool legacyRetry;
+};
+
+static Options options = {"localhost", 1883, 100, 0, 60, "/tmp/wink-fleet", "fleet", 10, 2, 30, 100, 0, 4, false, 0, 0, 5, false};
+
+static std::atomic<bool> running(true);
+
+// set once every relay has connected, as before that a command may go to one not yet subscribed
+static std::atomic<bool> fleetUp(false);
+
+static unsigned long nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void printPercentiles(const char *name, std::vector<unsigned long> &samples)
+{
+	if (samples.empty())
+	{
+		printf("%s: no samples\n", name);
+		return;
+	}
+
+	std::sort(samples.begin(), samples.end());
+	printf("%s: %lu samples, p50 %lu ms, p90 %lu ms, p99 %lu ms, max %lu ms\n", name, (unsigned long)samples.size(),
+		   samples[samples.size() * 50 / 100], samples[samples.size() * 90 / 100], samples[samples.size() * 99 / 100],
+		   samples.back());
+}
+
+/**
+ * The fake hardware of one relay, and the script which drives it.
+ */
+struct SimulatedRelay
+{
+	WinkRelay *relay;
+	char root[256];
+	unsigned long nextPress;
+	unsigned long release;
+	unsigned long nextSensor;
+	int temperature;
+	int humidity;
+	bool connected;
+	bool registered;
+	unsigned long disconnectedAt;
+	unsigned long lastYield;
+	unsigned long published;
+	unsigned long attempts;
+};
+
+static int writeFile(const char *root, const char *path, const char *value)
+{
+	char fullPath[512];
+
+	snprintf(fullPath, sizeof(fullPath), "%s%s", root, path);
+
+	int fd = open(fullPath, O_WRONLY | O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+
+	// the same length every time, so the relay never sees the tail of an older value
+	int rc = pwrite(fd, value, strlen(value), 0);
+	close(fd);
+	return rc;
+}
+
+static int makeDirectories(const char *path)
+{
+	char dir[512];
+
+	snprintf(dir, sizeof(dir), "%s", path);
+	for (char *p = dir + 1; *p; p++)
+	{
+		if (*p == '/')
+		{
+			*p = '\0';
+			if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+				return -1;
+			*p = '/';
+		}
+	}
+	return 0;
+}
+
+static int makeTree(SimulatedRelay *sim)
+{
+	static const char *files[][2] =
+	{
+		{"/sys/class/gpio/gpio8/value", "0"},
+		{"/sys/class/gpio/gpio7/value", "0"},
+		{"/sys/class/gpio/gpio30/value", "1"},
+		{"/sys/class/gpio/gpio203/value", "0"},
+		{"/sys/class/gpio/gpio204/value", "0"},
+		{"/sys/bus/i2c/devices/2-0040/temp1_input", "021000\n"},
+		{"/sys/bus/i2c/devices/2-0040/humidity1_input", "040000\n"},
+		{"/sys/devices/platform/imx-i2c.2/i2c-2/2-005a/input/input3/ps_input_data", "000000\n"},
+	};
+	char path[512];
+
+	for (unsigned int i = 0; i < sizeof(files) / sizeof(files[0]); i++)
+	{
+		snprintf(path, sizeof(path), "%s%s", sim->root, files[i][0]);
+		if (makeDirectories(path) != 0 || writeFile(sim->root, files[i][0], files[i][1]) < 0)
+			return -1;
+	}
+
+	// an empty file reads like an input device with no events waiting
+	snprintf(path, sizeof(path), "%s/dev/input/event0", sim->root);
+	if (makeDirectories(path) != 0)
+		return -1;
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1)
+		return -1;
+	close(fd);
+	return 0;
+}
+
+// press the upper switch now and then, and let the sensors wander
+static void runScript(SimulatedRelay *sim, unsigned long now)
+{
+	char value[16];
+
+	if (sim->release != 0 && now >= sim->release)
+	{
+		writeFile(sim->root, "/sys/class/gpio/gpio8/value", "0");
+		sim->release = 0;
+	}
+	else if (options.pressInterval > 0 && now >= sim->nextPress)
+	{
+		writeFile(sim->root, "/sys/class/gpio/gpio8/value", "1");
+		sim->release = now + 200;
+		sim->nextPress = now + options.pressInterval * 500UL + rand() % (options.pressInterval * 1000UL);
+	}
+
+	if (now >= sim->nextSensor)
+	{
+		sim->temperature = std::min(std::max(sim->temperature + rand() % 601 - 300, 5000), 40000);
+		sim->humidity = std::min(std::max(sim->humidity + rand() % 1001 - 500, 10000), 90000);
+
+		snprintf(value, sizeof(value), "%06d\n", sim->temperature);
+		writeFile(sim->root, "/sys/bus/i2c/devices/2-0040/temp1_input", value);
+		snprintf(value, sizeof(value), "%06d\n", sim->humidity);
+		writeFile(sim->root, "/sys/bus/i2c/devices/2-0040/humidity1_input", value);
+		sim->nextSensor = now + 5000;
+	}
+}
+
+/**
+ * A thread which runs its share of the relays.
+ */
+class Shard
+{
+public:
+	Shard(int index) : index(index), published(0), connected(0), attempts(0), drops(0), dropRequested(false)
+	{
+	}
+
+	void add(SimulatedRelay *sim)
+	{
+		sims.push_back(sim);
+#if defined(WINK_USE_IO_URING)
+		sim->relay->setRing(&ring);
+#endif
+	}
+
+	void run();
+
+	int index;
+	std::vector<SimulatedRelay *> sims;
+	std::vector<unsigned long> reconnectTimes;
+
+	std::atomic<unsigned long> published;
+	std::atomic<int> connected;
+	std::atomic<unsigned long> attempts;
+	std::atomic<unsigned long> drops;
+	std::atomic<bool> dropRequested;
+
+private:
+	void reconnect(SimulatedRelay *sim, unsigned long now);
+	void service(SimulatedRelay *sim, unsigned long now);
+	void lost(SimulatedRelay *sim, unsigned long now);
+
+	int epfd;
+#if defined(WINK_USE_IO_URING)
+	Uring ring;
+#endif
+};
+
+void Shard::lost(SimulatedRelay *sim, unsigned long now)
+{
+	if (sim->registered)
+	{
+		epoll_ctl(epfd, EPOLL_CTL_DEL, sim->relay->getSocket(), NULL);
+		sim->registered = false;
+	}
+	if (sim->connected)
+	{
+		sim->connected = false;
+		sim->disconnectedAt = now;
+		connected--;
+		drops++;
+	}
+}
+
+void Shard::reconnect(SimulatedRelay *sim, unsigned long now)
+{
+	int rc = sim->relay->reconnect();
+
+	attempts += sim->relay->getConnectAttempts() - sim->attempts;
+	sim->attempts = sim->relay->getConnectAttempts();
+	if (rc != 0)
+	{
+		return;
+	}
+
+#if !defined(WINK_USE_IO_URING)
+	struct epoll_event event;
+	event.events = EPOLLIN;
+	event.data.ptr = sim;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, sim->relay->getSocket(), &event) == 0)
+	{
+		sim->registered = true;
+	}
+#endif
+
+	sim->connected = true;
+	sim->lastYield = now;
+	connected++;
+
+	if (sim->disconnectedAt != 0)
+	{
+		reconnectTimes.push_back(nowMs() - sim->disconnectedAt);
+	}
+}
+
+void Shard::service(SimulatedRelay *sim, unsigned long now)
+{
+	sim->relay->yield(0);
+	sim->lastYield = now;
+
+	if (sim->relay->isConnected())
+	{
+		// a command may have just switched a relay, so report it without waiting for the tick
+		sim->relay->poll();
+	}
+	else
+	{
+		lost(sim, now);
+	}
+}
+
+void Shard::run()
+{
+#if !defined(WINK_USE_IO_URING)
+	struct epoll_event events[MAX_EVENTS];
+#endif
+	unsigned long nextTick = nowMs();
+	cpu_set_t cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(index % std::thread::hardware_concurrency(), &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+	epfd = epoll_create1(0);
+#if defined(WINK_USE_IO_URING)
+	// sends wait to go with the next wait on the ring, one system call for the whole shard
+	ring.setAutoSubmit(false);
+#endif
+
+	while (running)
+	{
+		unsigned long now = nowMs();
+#if defined(WINK_USE_IO_URING)
+		ring.run(now < nextTick ? nextTick - now : 0);
+
+		now = nowMs();
+		for (SimulatedRelay *sim : sims)
+		{
+			if (sim->connected && sim->relay->getNetwork().readable())
+				service(sim, now);
+		}
+#else
+		int n = epoll_wait(epfd, events, MAX_EVENTS, now < nextTick ? nextTick - now : 0);
+
+		now = nowMs();
+		for (int i = 0; i < n; i++)
+		{
+			service((SimulatedRelay *)events[i].data.ptr, now);
+		}
+#endif
+
+		if (now < nextTick)
+			continue;
+		nextTick = std::max(nextTick + options.tick, now);
+
+		if (dropRequested.exchange(false))
+		{
+			// as if the broker went away: the client notices when its next read fails
+			for (SimulatedRelay *sim : sims)
+			{
+				if (sim->connected)
+					shutdown(sim->relay->getSocket(), SHUT_RDWR);
+			}
+		}
+
+		for (SimulatedRelay *sim : sims)
+		{
+			runScript(sim, now);
+			sim->relay->poll();
+
+			if (sim->connected && !sim->relay->isConnected())
+			{
+				lost(sim, now);
+			}
+
+			if (!sim->relay->isConnected())
+			{
+				reconnect(sim, nowMs());
+			}
+			else if (now - sim->lastYield >= 1000)
+			{
+				service(sim, now); // keepalive for relays with nothing to read
+			}
+
+			published += sim->relay->getPublishCount() - sim->published;
+			sim->published = sim->relay->getPublishCount();
+		}
+	}
+
+#if defined(WINK_USE_IO_URING)
+	// the ring can only be entered from this thread, so close the connections here
+	for (SimulatedRelay *sim : sims)
+	{
+		sim->relay->getNetwork().disconnect();
+	}
+#endif
+	close(epfd);
+}
+
+/**
+ * Sends commands to the relays in turn, and times the state change which comes back for each.
+ */
+class Controller
+{
+public:
+	typedef MQTT::Client<IPStack, Countdown, 256> Client;
+
+	Controller() : sent(0), lostCommands(0), client(ipstack, 5000)
+	{
+		snprintf(stateFilter, sizeof(stateFilter), "%s/+/relays/upper_state", options.prefix);
+		pending.resize(options.relays, 0);
+		expected.resize(options.relays, 'N');
+		state.resize(options.relays, ' ');
+	}
+
+	void run();
+
+	std::vector<unsigned long> latencies;
+	unsigned long sent;
+	unsigned long lostCommands;
+
+private:
+	void onState(MQTT::MessageData &md);
+	int connect();
+
+	IPStack ipstack;
+	Client client;
+	char stateFilter[256];
+	std::vector<unsigned long> pending;
+	std::vector<char> expected;
+	std::vector<char> state;
+};
+
+void Controller::onState(MQTT::MessageData &md)
+{
+	MQTTLenString &topic = md.topicName.lenstring;
+	int prefixLength = strlen(options.prefix);
+
+	if (topic.len <= prefixLength + 1 || strncmp(topic.data, options.prefix, prefixLength) != 0)
+		return;
+
+	int i = atoi(topic.data + prefixLength + 1);
+	if (i < 0 || i >= options.relays)
+		return;
+
+	char on = (md.message.payloadlen == 2 && strncmp((char *)md.message.payload, "ON", 2) == 0) ? 'Y' : 'N';
+	state[i] = on;
+
+	if (pending[i] != 0 && expected[i] == on)
+	{
+		latencies.push_back(nowMs() - pending[i]);
+		pending[i] = 0;
+	}
+}
+
+int Controller::connect()
+{
+	int rc;
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+	data.MQTTVersion = options.mqttVersion;
+	data.keepAliveInterval = 10;
+	data.clientID.cstring = (char *)"wink-fleet-controller";
+
+	ipstack.disconnect();
+	if ((rc = ipstack.connect(options.host, options.port)) != 0 || (rc = client.connect(data)) != 0)
+		return rc;
+	return client.subscribe(stateFilter, MQTT::QOS0, this, &Controller::onState);
+}
+
+void Controller::run()
+{
+	unsigned long nextCommand = nowMs();
+	unsigned long interval = 1000 / options.commandRate;
+	int next = 0;
+	char topic[256];
+
+	while (running)
+	{
+		if ((!client.isConnected() && connect() != 0) || !fleetUp)
+		{
+			usleep(100000);
+			nextCommand = nowMs();
+			continue;
+		}
+
+		unsigned long now = nowMs();
+		if (now >= nextCommand)
+		{
+			nextCommand += interval;
+
+			if (pending[next] != 0 && now - pending[next] > 10000)
+			{
+				lostCommands++;
+				pending[next] = 0;
+			}
+
+			if (pending[next] == 0)
+			{
+				MQTT::Message message;
+
+				expected[next] = state[next] == 'Y' ? 'N' : 'Y';
+				message.qos = options.commandQos == 1 ? MQTT::QOS1 : MQTT::QOS2;
+				message.retained = false;
+				message.dup = false;
+				message.payload = (void *)(expected[next] == 'Y' ? "ON" : "OFF");
+				message.payloadlen = strlen((char *)message.payload);
+
+				snprintf(topic, sizeof(topic), "%s/%05d/relays/upper", options.prefix, next);
+				pending[next] = now;
+				if (client.publish(topic, message) == 0)
+					sent++;
+				else
+					pending[next] = 0;
+			}
+			next = (next + 1) % options.relays;
+		}
+		else
+		{
+			client.yield(std::min(nextCommand - now, 100UL));
+		}
+	}
+
+	client.disconnect();
+	ipstack.disconnect();
+}
+
+static void usage()
+{
+	fprintf(stderr,
+			"usage: wink-fleet [options]\n"
+			"  -h host      broker host (localhost)\n"
+			"  -p port      broker port (1883)\n"
+			"  -n relays    number of relays (100)\n"
+			"  -s shards    number of threads (one per core)\n"
+			"  -d seconds   how long to run (60)\n"
+			"  -r dir       where to build the fake sysfs trees (/tmp/wink-fleet)\n"
+			"  -t prefix    topic prefix, each relay uses prefix/NNNNN (fleet)\n"
+			"  -c rate      relay commands per second, 0 for none (10)\n"
+			"  -q qos       QoS of the relay commands, 1 or 2 (2)\n"
+			"  -b seconds   average time between switch presses, 0 for none (30)\n"
+			"  -i ms        hardware poll interval (100)\n"
+			"  -x seconds   drop every connection at this time, to watch them come back\n"
+			"  -B           run a broker stand-in on localhost at the port, instead of using a broker\n"
+			"  -a rate      CONNECTs per second the stand-in accepts, refusing the rest (no limit)\n"
+			"  -L ms        how long the stand-in holds each packet it's sent, as a distant broker would (0)\n"
+			"  -D seconds   with -B and -x, how long the stand-in stays down for (5)\n"
+			"  -l           retry connecting every 50 ms, as older versions did, to compare\n"
+			"  -5           connect with MQTT 5\n"
+			"  -v           log from every relay\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	logQuiet = true;
+	while ((c = getopt(argc, argv, "h:p:n:s:d:r:t:c:q:b:i:x:Ba:L:D:l5v")) != -1)
+	{
+		switch (c)
+		{
+		case 'h': options.host = optarg; break;
+		case 'p': options.port = atoi(optarg); break;
+		case 'n': options.relays = atoi(optarg); break;
+		case 's': options.shards = atoi(optarg); break;
+		case 'd': options.seconds = atoi(optarg); break;
+		case 'r': options.root = optarg; break;
+		case 't': options.prefix = optarg; break;
+		case 'c': options.commandRate = atoi(optarg); break;
+		case 'q': options.commandQos = atoi(optarg); break;
+		case 'b': options.pressInterval = atoi(optarg); break;
+		case 'i': options.tick = atoi(optarg); break;
+		case 'x': options.dropAt = atoi(optarg); break;
+		case 'B': options.standIn = true; break;
+		case 'a': options.standInRate = atoi(optarg); break;
+		case 'L': options.standInLatency = atoi(optarg); break;
+		case 'D': options.downtime = atoi(optarg); break;
+		case 'l': options.legacyRetry = true; break;
+		case '5': options.mqttVersion = 5; break;
+		case 'v': logQuiet = false; break;
+		default: usage(); return 1;
+		}
+	}
+
+	if (options.relays <= 0 || options.tick <= 0 || options.commandRate < 0 || options.commandRate > 1000
+			|| options.commandQos < 1 || options.commandQos > 2 || options.standInLatency < 0)
+	{
+		usage();
+		return 1;
+	}
+	if (options.standIn && options.mqttVersion == 5)
+	{
+		fprintf(stderr, "The broker stand-in only speaks MQTT 3.1.1\n");
+		return 1;
+	}
+	if (options.shards <= 0)
+	{
+		options.shards = std::max(1u, std::thread::hardware_concurrency());
+	}
+#if defined(WINK_USE_IO_URING)
+	if (!Uring(1).isValid())
+	{
+		fprintf(stderr, "This kernel can't run the relays through io_uring\n");
+		return 1;
+	}
+#endif
+
+	// nine files and a socket for each relay
+	struct rlimit limits;
+	getrlimit(RLIMIT_NOFILE, &limits);
+	limits.rlim_cur = limits.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limits);
+	if (limits.rlim_cur != RLIM_INFINITY && (rlim_t)options.relays * 10 + options.shards + 64 > limits.rlim_cur)
+	{
+		fprintf(stderr, "Too many relays for the open file limit of %lu\n", (unsigned long)limits.rlim_cur);
+		return 1;
+	}
+
+	std::vector<SimulatedRelay> sims(options.relays);
+	std::vector<Shard *> shards;
+	Resolver resolver; // one lookup thread for the fleet, rather than one per relay
+	unsigned long start = nowMs();
+
+	for (int i = 0; i < options.shards; i++)
+	{
+		shards.push_back(new Shard(i));
+	}
+
+	for (int i = 0; i < options.relays; i++)
+	{
+		SimulatedRelay *sim = &sims[i];
+		Configuration config = {};
+		char name[64];
+
+		memset(sim, 0, sizeof(*sim));
+		snprintf(sim->root, sizeof(sim->root), "%s/relay-%05d", options.root, i);
+		sim->temperature = 21000;
+		sim->humidity = 40000;
+		sim->nextPress = options.pressInterval > 0 ? start + rand() % (options.pressInterval * 1000UL) : 0;
+
+		if (makeTree(sim) != 0)
+		{
+			fprintf(stderr, "Can't create %s - %s\n", sim->root, strerror(errno));
+			return 1;
+		}
+
+		config.host = (char *)options.host;
+		config.port = options.port;
+		snprintf(name, sizeof(name), "wink-fleet-%05d", i);
+		config.clientid = strdup(name);
+		snprintf(name, sizeof(name), "%s/%05d", options.prefix, i);
+		config.topic_prefix = strdup(name);
+		config.screen_timeout = 10;
+		config.proximity_threshold = 5000;
+		config.enable_upper_button = 1;
+		config.command_qos = options.commandQos;
+		config.command_id_window = 60;
+		config.mqtt_version = options.mqttVersion;
+
+		sim->relay = new WinkRelay(config, sim->root);
+		sim->relay->setResolver(&resolver);
+		sim->relay->open();
+		if (options.legacyRetry)
+		{
+			sim->relay->setBackoff(ConnectPhase::Network, 50, 50);
+			sim->relay->setBackoff(ConnectPhase::Connect, 50, 50);
+			sim->relay->setBackoff(ConnectPhase::Subscribe, 50, 50);
+		}
+		shards[i % options.shards]->add(sim);
+	}
+
+	FleetBroker broker(options.port, options.standInRate);
+	if (options.standIn)
+	{
+		broker.setLatency(options.standInLatency);
+		if (broker.start() != 0)
+		{
+			fprintf(stderr, "Can't start the broker stand-in on port %d - %s\n", options.port, strerror(errno));
+			return 1;
+		}
+		options.host = "localhost";
+	}
+
+	printf("%d relays in %d shards, broker %s:%d%s\n", options.relays, options.shards, options.host, options.port,
+		   options.standIn ? " (stand-in)" : "");
+
+	std::vector<std::thread> threads;
+	for (Shard *shard : shards)
+	{
+		threads.push_back(std::thread(&Shard::run, shard));
+	}
+
+	Controller controller;
+	std::thread controllerThread;
+	if (options.commandRate > 0)
+	{
+		controllerThread = std::thread(&Controller::run, &controller);
+	}
+
+	unsigned long lastPublished = 0, lastAttempts = 0, peakAttempts = 0, peakPublished = 0;
+	unsigned long lastAccepts = 0, lastConnects = 0, peakAccepts = 0, peakConnects = 0;
+	unsigned long stormStart = 0;
+	bool allConnected = false;
+	std::vector<unsigned long> recoveries;
+
+	for (int second = 1; second <= options.seconds; second++)
+	{
+		sleep(1);
+
+		if (second == options.dropAt && options.standIn)
+		{
+			broker.restart(options.downtime * 1000);
+		}
+		else if (second == options.dropAt)
+		{
+			for (Shard *shard : shards)
+			{
+				shard->dropRequested = true;
+			}
+		}
+
+		unsigned long published = 0, attempts = 0;
+		int connected = 0;
+		for (Shard *shard : shards)
+		{
+			published += shard->published;
+			attempts += shard->attempts;
+			connected += shard->connected;
+		}
+
+		// a storm starts when the whole fleet was up and some of it drops, and ends when all are back
+		unsigned long now = nowMs();
+		if (connected == options.relays && !allConnected)
+		{
+			allConnected = true;
+			fleetUp = true;
+			if (stormStart != 0)
+			{
+				recoveries.push_back(now - stormStart);
+				stormStart = 0;
+			}
+		}
+		else if (connected < options.relays && allConnected)
+		{
+			allConnected = false;
+			stormStart = now;
+		}
+
+		peakAttempts = std::max(peakAttempts, attempts - lastAttempts);
+		peakPublished = std::max(peakPublished, published - lastPublished);
+		printf("%4ds connected %d/%d, publishes %lu/s, connect attempts %lu/s", second, connected, options.relays,
+			   published - lastPublished, attempts - lastAttempts);
+		if (options.standIn)
+		{
+			// the storm as the broker sees it
+			peakAccepts = std::max(peakAccepts, broker.accepts - lastAccepts);
+			peakConnects = std::max(peakConnects, broker.connects + broker.refused - lastConnects);
+			printf(", broker accepts %lu/s, CONNECTs %lu/s", broker.accepts - lastAccepts,
+				   broker.connects + broker.refused - lastConnects);
+			lastAccepts = broker.accepts;
+			lastConnects = broker.connects + broker.refused;
+		}
+		printf("\n");
+		fflush(stdout);
+		lastPublished = published;
+		lastAttempts = attempts;
+	}
+
+	running = false;
+	for (std::thread &thread : threads)
+	{
+		thread.join();
+	}
+	if (controllerThread.joinable())
+	{
+		controllerThread.join();
+	}
+
+	unsigned long attempts = 0, drops = 0;
+	std::vector<unsigned long> reconnectTimes;
+	for (Shard *shard : shards)
+	{
+		attempts += shard->attempts;
+		drops += shard->drops;
+		reconnectTimes.insert(reconnectTimes.end(), shard->reconnectTimes.begin(), shard->reconnectTimes.end());
+	}
+
+	printf("\nPublish throughput: %.1f/s average, %lu/s peak, %lu in total\n", (double)lastPublished / options.seconds,
+		   peakPublished, lastPublished);
+	printf("Commands: %lu sent, %lu answered, %lu lost\n", controller.sent, (unsigned long)controller.latencies.size(),
+		   controller.lostCommands);
+	printPercentiles("Command round trip", controller.latencies);
+	printf("Connections: %lu attempts, %lu dropped, peak %lu attempts/s\n", attempts, drops, peakAttempts);
+	if (options.standIn)
+	{
+		printf("Broker stand-in: %lu TCP accepts (peak %lu/s), %lu CONNECTs accepted, %lu refused (peak %lu/s)\n",
+			   (unsigned long)broker.accepts, peakAccepts, (unsigned long)broker.connects, (unsigned long)broker.refused,
+			   peakConnects);
+	}
+	printPercentiles("Reconnect time", reconnectTimes);
+	for (unsigned int i = 0; i < recoveries.size(); i++)
+	{
+		printf("Storm %u: whole fleet back after %lu ms\n", i + 1, recoveries[i]);
+	}
+	if (stormStart != 0)
+	{
+		printf("Storm: fleet still not back after %lu ms\n", nowMs() - stormStart);
+	}
+
+	for (SimulatedRelay &sim : sims)
+	{
+		delete sim.relay;
+	}
+	for (Shard *shard : shards)
+	{
+		delete shard;
+	}
+	return 0;
+}
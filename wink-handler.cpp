@@ -4,78 +4,62 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
-#include <linux/input.h>
 #include <sys/time.h>
 #include <sys/resource.h>
-#include <android/log.h>
 
 #include "ini.h"
-#include "MQTTClient.h"
-#include "linux.cpp"
-
-#define LOG_TAG "WinkHandler"
-
-#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
-#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
-
-struct Configuration
-{
-	char *username;
-	char *password;
-	char *host;
-	char *clientid;
-	char *topic_prefix;
-	int port;
-	int screen_timeout;
-	int startup_power_on;
-	int enable_upper_button;
-	int enable_lower_button;
-	int proximity_threshold;
-};
+#include "wink-relay.h"
 
 static struct Configuration config;
 
-enum class Relay
-{
-	Upper,
-	Lower
-};
-
-void setRelay(Relay relay, bool on)
+static void set_format(const char *name, const char *value, PayloadFormat &format)
 {
-	signal(SIGPIPE, SIG_IGN);
-
-	int fd = open(relay == Relay::Upper ? "/sys/class/gpio/gpio203/value" : "/sys/class/gpio/gpio204/value", O_RDWR);
-	char screenPower = on == true ? '1' : '0';
-
-	write(fd, &screenPower, 1);
-	close(fd);
+	if (!parsePayloadFormat(value, format))
+	{
+		LOGE("Unknown payload format '%s' for %s", value, name);
+	}
 }
 
-void onTopicMessage(Relay relay, char *payloadMessage, int payloadLength)
+static void add_rule(const char *rule)
 {
-	LOGD("MQTT - Received %s relay message - '%s' [length: %d]", relay == Relay::Upper ? "upper" : "lower", payloadMessage, payloadLength);
+	if (addRule(config.rules, rule))
+	{
+		return;
+	}
 
-	if (strncmp(payloadMessage, "ON", payloadLength) == 0)
+	if (config.rules.count == MAX_RULES)
 	{
-		setRelay(relay, true);
+		LOGE("Too many rules - '%s' is ignored", rule);
 	}
-	else if (strncmp(payloadMessage, "OFF", payloadLength) == 0)
+	else
 	{
-		setRelay(relay, false);
+		LOGE("Can't understand the rule '%s'", rule);
 	}
 }
 
-void onUpperTopicMessageReceived(MQTT::MessageData &md)
+// one rule a line, with blank lines and lines starting with # left out
+static void load_rules(const char *path)
 {
-	MQTT::Message &message = md.message;
-	onTopicMessage(Relay::Upper, (char *)message.payload, message.payloadlen);
-}
+	char line[256];
+	FILE *file = fopen(path, "r");
 
-void onLowerTopicMessageReceived(MQTT::MessageData &md)
-{
-	MQTT::Message &message = md.message;
-	onTopicMessage(Relay::Lower, (char *)message.payload, message.payloadlen);
+	if (file == NULL)
+	{
+		LOGE("Can't load rules from %s", path);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		char *rule = line + strspn(line, " \t");
+
+		rule[strcspn(rule, "\r\n")] = '\0';
+		if (rule[0] != '\0' && rule[0] != '#')
+		{
+			add_rule(rule);
+		}
+	}
+	fclose(file);
 }
 
 static int config_handler(void *data, const char *section, const char *name, const char *value)
@@ -124,48 +108,93 @@ static int config_handler(void *data, const char *section, const char *name, con
 	{
 		config.proximity_threshold = atoi(value);
 	}
+	else if (strcmp(name, "persistent_session") == 0)
+	{
+		config.persistent_session = atoi(value);
+	}
+	else if (strcmp(name, "session_file") == 0)
+	{
+		config.session_file = strdup(value);
+	}
+	else if (strcmp(name, "mqtt_version") == 0)
+	{
+		config.mqtt_version = atoi(value);
+	}
+	else if (strcmp(name, "standby") == 0)
+	{
+		config.standby = atoi(value);
+	}
+	else if (strcmp(name, "failback_interval") == 0)
+	{
+		config.failback_interval = atoi(value);
+	}
+	else if (strcmp(name, "dns_ttl") == 0)
+	{
+		config.dns_ttl = atoi(value);
+	}
+	else if (strcmp(name, "tls") == 0)
+	{
+		config.tls = atoi(value);
+	}
+	else if (strcmp(name, "tls_ca_file") == 0)
+	{
+		config.tls_ca_file = strdup(value);
+	}
+	else if (strcmp(name, "tls_cert_file") == 0)
+	{
+		config.tls_cert_file = strdup(value);
+	}
+	else if (strcmp(name, "tls_key_file") == 0)
+	{
+		config.tls_key_file = strdup(value);
+	}
+	else if (strcmp(name, "tls_session_file") == 0)
+	{
+		config.tls_session_file = strdup(value);
+	}
+	else if (strcmp(name, "command_qos") == 0)
+	{
+		config.command_qos = atoi(value);
+	}
+	else if (strcmp(name, "command_id_window") == 0)
+	{
+		config.command_id_window = atoi(value);
+	}
+	else if (strcmp(name, "rule") == 0)
+	{
+		add_rule(value);
+	}
+	else if (strcmp(name, "rules_file") == 0)
+	{
+		config.rules_file = strdup(value);
+	}
+	else if (strcmp(name, "schedules_file") == 0)
+	{
+		config.schedules_file = strdup(value);
+	}
+	else if (strcmp(name, "relay_format") == 0)
+	{
+		set_format(name, value, config.relay_format);
+	}
+	else if (strcmp(name, "switch_format") == 0)
+	{
+		set_format(name, value, config.switch_format);
+	}
+	else if (strcmp(name, "sensor_format") == 0)
+	{
+		set_format(name, value, config.sensor_format);
+	}
+	else if (strcmp(name, "screen_format") == 0)
+	{
+		set_format(name, value, config.screen_format);
+	}
 
 	return 1;
 }
 
-void publishMessage(MQTT::Client<IPStack, Countdown> *client, const char *topic, const char *payload, bool retain)
-{
-	if (client->isConnected())
-	{
-		MQTT::Message message;
-		message.qos = MQTT::QOS1;
-		message.retained = retain;
-		message.dup = false;
-		message.payload = (void *)payload;
-		message.payloadlen = strlen(payload);
-
-		int rc;
-		if ((rc = client->publish(topic, message)) != 0)
-		{
-			LOGE("Failed to publish message for topic '%s' - %d", topic, rc);
-		}
-	}
-}
-
 int main()
 {
-	int rc;
-	int upperSwitch, lowerSwitch, input, screen, upperRelay, lowerRelay, temp, humid, prox;
-	bool upperSwitchState = true;
-	bool lowerSwitchState = true;
-	char upperRelayState = ' ';
-	char lowerRelayState = ' ';
-	int last_input = time(NULL);
-	struct input_event event;
-	char buffer[30];
-	char screenPower = '1';
-	char payload[30];
-	char proxdata[100];
-	int temperature, humidity, last_temperature = -1, last_humidity = -1;
-	long proximity;
-	int failedConnectionAttempts = 0;
 	struct rlimit limits;
-	char topic[1024], upperTopic[1024], lowerTopic[1024];
 
 	LOGD("Main");
 
@@ -175,6 +204,12 @@ int main()
 		return 1;
 	}
 
+	// after mqtt.ini's own rules, wherever rules_file was in it
+	if (config.rules_file != NULL)
+	{
+		load_rules(config.rules_file);
+	}
+
 	if (config.topic_prefix == NULL)
 	{
 		config.topic_prefix = (char *)"Relay";
@@ -190,6 +225,36 @@ int main()
 		config.proximity_threshold = 5000;
 	}
 
+	if (config.mqtt_version != 5)
+	{
+		config.mqtt_version = 4;
+	}
+
+	if (config.failback_interval == 0)
+	{
+		config.failback_interval = 60;
+	}
+
+	if (config.dns_ttl == 0)
+	{
+		config.dns_ttl = 300;
+	}
+
+	if (config.command_qos != 1)
+	{
+		config.command_qos = 2;
+	}
+
+	if (config.command_id_window == 0)
+	{
+		config.command_id_window = 60;
+	}
+
+	if (config.schedules_file == NULL)
+	{
+		config.schedules_file = (char *)"/sdcard/schedules.txt";
+	}
+
 	LOGD("Configuration:");
 	LOGD("\tUsername: %s", config.username);
 	LOGD("\tPassword length: %d", strlen(config.password));
@@ -201,250 +266,43 @@ int main()
 	LOGD("\tEnable upper button: %d", config.enable_upper_button);
 	LOGD("\tEnable lower button: %d", config.enable_lower_button);
 	LOGD("\tProximity threshold: %d", config.proximity_threshold);
+	LOGD("\tPersistent session: %d", config.persistent_session);
+	LOGD("\tSession file: %s", config.session_file);
+	LOGD("\tMQTT version: %d", config.mqtt_version);
+	LOGD("\tStandby connection: %d", config.standby);
+	LOGD("\tFail back after: %d", config.failback_interval);
+	LOGD("\tDNS TTL: %d", config.dns_ttl);
+	LOGD("\tCommand QoS: %d", config.command_qos);
+	LOGD("\tCommand id window: %d", config.command_id_window);
+	LOGD("\tRules: %d", config.rules.count);
+	LOGD("\tSchedules file: %s", config.schedules_file);
+	LOGD("\tTLS: %d", config.tls);
+	LOGD("\tTLS CA file: %s", config.tls_ca_file);
+	LOGD("\tTLS certificate file: %s", config.tls_cert_file);
+	LOGD("\tTLS session file: %s", config.tls_session_file);
 
 	LOGD("Opening devices...");
 
-	upperSwitch = open("/sys/class/gpio/gpio8/value", O_RDONLY);
-	lowerSwitch = open("/sys/class/gpio/gpio7/value", O_RDONLY);
-	screen = open("/sys/class/gpio/gpio30/value", O_RDWR);
-	upperRelay = open("/sys/class/gpio/gpio203/value", O_RDWR);
-	lowerRelay = open("/sys/class/gpio/gpio204/value", O_RDWR);
-	input = open("/dev/input/event0", O_RDONLY | O_NONBLOCK);
-	temp = open("/sys/bus/i2c/devices/2-0040/temp1_input", O_RDONLY);
-	humid = open("/sys/bus/i2c/devices/2-0040/humidity1_input", O_RDONLY);
-	prox = open("/sys/devices/platform/imx-i2c.2/i2c-2/2-005a/input/input3/ps_input_data", O_RDONLY);
-
-	if (config.startup_power_on == 1)
-	{
-		LOGD("Startup device screenPower on");
-
-		write(upperRelay, &screenPower, 1);
-		write(lowerRelay, &screenPower, 1);
-	}
-
-	lseek(screen, 0, SEEK_SET);
-	read(screen, &screenPower, sizeof(screenPower));
+	WinkRelay relay(config);
+	relay.open();
 
 	limits.rlim_cur = RLIM_INFINITY;
 	limits.rlim_max = RLIM_INFINITY;
 	setrlimit(RLIMIT_CORE, &limits);
 
-	sprintf(upperTopic, "%s/relays/upper", config.topic_prefix);
-	sprintf(lowerTopic, "%s/relays/lower", config.topic_prefix);
-
-	IPStack ipstack = IPStack();
-
-	MQTT::Client<IPStack, Countdown> client = MQTT::Client<IPStack, Countdown>(ipstack, 2000);
-
-	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
-	data.MQTTVersion = 4;
-	data.willFlag = 0;
-	data.keepAliveInterval = 10;
-	data.cleansession = 1;
-
-	data.clientID.cstring = config.clientid != NULL ? config.clientid : (char *)"Wink_Relay";
-
-	if (config.username != NULL)
-	{
-		data.username.cstring = config.username;
-	}
-
-	if (config.password != NULL)
-	{
-		data.password.cstring = config.password;
-	}
-
 	while (1)
 	{
-		lseek(upperRelay, 0, SEEK_SET);
-		read(upperRelay, buffer, sizeof(buffer));
-		if (upperRelayState != buffer[0])
-		{
-			upperRelayState = buffer[0];
-
-			LOGD("Relay changed state - upper");
-
-			sprintf(topic, "%s/relays/upper_state", config.topic_prefix);
-			sprintf(payload, buffer[0] == '0' ? "OFF" : "ON");
-			publishMessage(&client, topic, payload, true);
-		}
-
-		lseek(lowerRelay, 0, SEEK_SET);
-		read(lowerRelay, buffer, sizeof(buffer));
-		if (lowerRelayState != buffer[0])
-		{
-			lowerRelayState = buffer[0];
-
-			LOGD("Relay changed state - lower");
-
-			sprintf(topic, "%s/relays/lower_state", config.topic_prefix);
-			sprintf(payload, buffer[0] == '0' ? "OFF" : "ON");
-			publishMessage(&client, topic, payload, true);
-		}
+		relay.poll();
 
-		lseek(upperSwitch, 0, SEEK_SET);
-		read(upperSwitch, buffer, sizeof(buffer));
-		if (upperSwitchState != (buffer[0] == '1'))
+		// the hardware keeps being serviced while the backoff holds off the next connection attempt
+		// and no later than the end of a timed relay command
+		if (relay.reconnect() == 0)
 		{
-			upperSwitchState = buffer[0] == '1';
-
-			if (upperSwitchState)
-			{
-				LOGD("Switch changed state - upper");
-
-				sprintf(topic, "%s/switches/upper", config.topic_prefix);
-				sprintf(payload, "ON");
-				publishMessage(&client, topic, payload, false);
-
-				if (config.enable_upper_button == 1)
-				{
-					setRelay(Relay::Upper, upperRelayState == '0');
-				}
-			}
-		}
-
-		lseek(lowerSwitch, 0, SEEK_SET);
-		read(lowerSwitch, buffer, sizeof(buffer));
-		if (lowerSwitchState != (buffer[0] == '1'))
-		{
-			lowerSwitchState = buffer[0] == '1';
-
-			if (lowerSwitchState)
-			{
-				LOGD("Switch changed state - lower");
-
-				sprintf(topic, "%s/switches/lower", config.topic_prefix);
-				sprintf(payload, "ON");
-				publishMessage(&client, topic, payload, false);
-
-				if (config.enable_lower_button == 1)
-				{
-					setRelay(Relay::Lower, lowerRelayState == '0');
-				}
-			}
-		}
-
-		lseek(temp, 0, SEEK_SET);
-		read(temp, buffer, sizeof(buffer));
-		temperature = atoi(buffer);
-		if (abs(temperature - last_temperature) > 100)
-		{
-			last_temperature = temperature;
-
-			sprintf(topic, "%s/sensors/temperature", config.topic_prefix);
-			sprintf(payload, "%f", temperature / 1000.0);
-			publishMessage(&client, topic, payload, true);
-		}
-
-		lseek(humid, 0, SEEK_SET);
-		read(humid, buffer, sizeof(buffer));
-		humidity = atoi(buffer);
-		if (abs(humidity - last_humidity) > 100)
-		{
-			last_humidity = humidity;
-
-			sprintf(topic, "%s/sensors/humidity", config.topic_prefix);
-			sprintf(payload, "%f", humidity / 1000.0);
-			publishMessage(&client, topic, payload, true);
-		}
-
-		lseek(prox, 0, SEEK_SET);
-		read(prox, proxdata, sizeof(proxdata));
-		proximity = strtol(proxdata, NULL, 10);
-		if (proximity >= config.proximity_threshold)
-		{
-			last_input = time(NULL);
-		}
-
-		while (read(input, &event, sizeof(event)) > 0)
-		{
-			last_input = time(NULL);
-		}
-
-		bool shouldTurnOnScreen = (time(NULL) - last_input) <= config.screen_timeout;
-		if (shouldTurnOnScreen && screenPower != '1')
-		{
-			screenPower = '1';
-			write(screen, &screenPower, sizeof(screenPower));
-
-			LOGD("Screen state changed - on");
-
-			sprintf(topic, "%s/screen/state", config.topic_prefix);
-			sprintf(payload, "ON");
-			publishMessage(&client, topic, payload, true);
-		}
-		else if (!shouldTurnOnScreen && screenPower == '1')
-		{
-			screenPower = '0';
-			write(screen, &screenPower, sizeof(screenPower));
-
-			LOGD("Screen state changed - off");
-
-			sprintf(topic, "%s/screen/state", config.topic_prefix);
-			sprintf(payload, "OFF");
-			publishMessage(&client, topic, payload, true);
-		}
-
-		if (client.isConnected())
-		{
-			client.yield(100);
+			relay.yield(relay.pollTimeout(100));
 		}
 		else
 		{
-			LOGD("IPStack - Connecting...");
-
-			ipstack.disconnect();
-
-			while ((rc = ipstack.connect(config.host, config.port)) != 0)
-			{
-				LOGE("IPStack - Failed to connect - %d\n", rc);
-				usleep(50000);
-				continue;
-			}
-
-			LOGD("MQTT - Connecting...");
-
-			if ((rc = client.connect(data)) == 0)
-			{
-				LOGD("MQTT - Connected");
-
-				rc = client.subscribe(upperTopic, MQTT::QOS2, onUpperTopicMessageReceived);
-				if (rc == 0)
-				{
-					rc = client.subscribe(lowerTopic, MQTT::QOS2, onLowerTopicMessageReceived);
-					if (rc == 0)
-					{
-						failedConnectionAttempts = 0;
-
-						LOGD("MQTT - All ready!");
-					}
-					else
-					{
-						LOGE("MQTT - Failed to subscribe to '%s' - %d\n", lowerTopic, rc);
-						client.disconnect();
-						usleep(50000);
-					}
-				}
-				else
-				{
-					LOGE("MQTT - Failed to subscribe to '%s' - %d\n", upperTopic, rc);
-					client.disconnect();
-					usleep(50000);
-				}
-			}
-			else
-			{
-				LOGE("MQTT - Failed to connect - %d", rc);
-				failedConnectionAttempts++;
-
-				if (failedConnectionAttempts > 5)
-				{
-					LOGE("MQTT - Too many failed connection attempts. Quitting...");
-					return 1;
-				}
-
-				usleep(50000);
-			}
+			usleep(relay.pollTimeout(100) * 1000);
 		}
 	}
 }
@@ -0,0 +1,257 @@
+/*
+ * Checks of the payload codecs, run with make check: the fixed point numbers, each format's round
+ * trip, and the payloads a broker could pass on which have to be refused rather than taken for a
+ * command, such as a prefix of ON or a document cut short.  Each check prints ok or FAILED, and the
+ * exit status is the number which failed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#include "wink-payload.h"
+
+static int failures = 0;
+
+static void check(const char *name, bool ok)
+{
+	printf("%-70s %s\n", name, ok ? "ok" : "FAILED");
+	if (!ok)
+	{
+		failures++;
+	}
+}
+
+static bool formatsAs(long value, int scale, const char *expected)
+{
+	char buf[32];
+	int n = formatFixed(buf, sizeof(buf), value, scale);
+
+	return n == (int)strlen(expected) && memcmp(buf, expected, n) == 0;
+}
+
+static bool parsesAs(const char *text, int scale, long expected)
+{
+	long value = expected + 1;
+
+	return parseFixed(text, strlen(text), scale, value) && value == expected;
+}
+
+static bool parseFails(const char *text)
+{
+	long value;
+
+	return !parseFixed(text, strlen(text), 3, value);
+}
+
+static void checkFixed()
+{
+	char buf[32];
+	char lowest[32];
+
+	snprintf(lowest, sizeof(lowest), "%ld", LONG_MIN);
+	check("formatFixed writes no more decimals than it needs",
+			formatsAs(21500, 3, "21.5") && formatsAs(21000, 3, "21") && formatsAs(21005, 3, "21.005") && formatsAs(7, 0, "7")
+			&& formatsAs(0, 3, "0"));
+	check("formatFixed writes negatives, and values under one",
+			formatsAs(-500, 3, "-0.5") && formatsAs(-21500, 3, "-21.5") && formatsAs(5, 3, "0.005") && formatsAs(LONG_MIN, 0, lowest));
+	check("formatFixed fails a buffer too short", formatFixed(buf, 3, 21500, 3) == -1 && formatFixed(buf, 4, 21500, 3) == 4);
+
+	check("parseFixed reads a number as value * 10^scale",
+			parsesAs("21.5", 3, 21500) && parsesAs("-21.5", 3, -21500) && parsesAs("21", 3, 21000) && parsesAs("0.005", 3, 5)
+			&& parsesAs("-0", 0, 0));
+	check("parseFixed rounds digits past the scale",
+			parsesAs("21.5555", 3, 21556) && parsesAs("21.5554", 3, 21555) && parsesAs("2.9999", 3, 3000) && parsesAs("-0.0005", 3, -1)
+			&& parsesAs("0.4", 0, 0) && parsesAs("0.5", 0, 1));
+	check("parseFixed refuses anything but a whole number",
+			parseFails("") && parseFails("-") && parseFails(".") && parseFails("1.2.3") && parseFails("1e3") && parseFails(" 1")
+			&& parseFails("1 ") && parseFails("+1") && parseFails("99999999999999999999"));
+}
+
+static bool stateIs(PayloadFormat format, const char *payload, int len, bool expected)
+{
+	PayloadReader reader(format, payload, len);
+	bool on = !expected;
+
+	return reader.getState("state", on) && on == expected;
+}
+
+static bool stateRefused(PayloadFormat format, const char *payload, int len)
+{
+	PayloadReader reader(format, payload, len);
+	bool on;
+
+	return !reader.getState("state", on);
+}
+
+static bool textStateIs(const char *payload, bool expected)
+{
+	return stateIs(PayloadFormat::Text, payload, strlen(payload), expected);
+}
+
+static bool textRefused(const char *payload)
+{
+	return stateRefused(PayloadFormat::Text, payload, strlen(payload));
+}
+
+static bool numberIs(PayloadFormat format, const char *payload, int len, int scale, long expected)
+{
+	PayloadReader reader(format, payload, len);
+	long value = expected + 1;
+
+	return reader.getNumber("t", scale, value) && value == expected;
+}
+
+// every prefix of a payload, none of which is the whole document
+static bool prefixesRefused(PayloadFormat format, const char *payload, int len)
+{
+	for (int n = 0; n < len; n++)
+	{
+		if (!stateRefused(format, payload, n))
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// a document of every kind of value, written and read back
+static bool roundTrips(PayloadFormat format)
+{
+	char buf[128];
+	PayloadWriter writer(format, buf, sizeof(buf));
+	bool upper = false, lower = true, missing;
+	long temperature = 0, timer = 0;
+	const char *result = NULL;
+	int resultLength = 0;
+
+	writer.addState("upper", true);
+	writer.addState("lower", false);
+	writer.addNumber("temperature", -21500, 3);
+	writer.addNumber("timer_ms", 300000, 0);
+	writer.addString("result", "changed", 7);
+	int len = writer.finish();
+
+	PayloadReader reader(format, buf, len);
+	return len > 0 && reader.getState("upper", upper) && upper && reader.getState("lower", lower) && !lower
+			&& reader.getNumber("temperature", 3, temperature) && temperature == -21500
+			&& reader.getNumber("timer_ms", 0, timer) && timer == 300000
+			&& reader.getString("result", result, resultLength) && resultLength == 7 && memcmp(result, "changed", 7) == 0
+			&& !reader.getState("missing", missing);
+}
+
+static void checkText()
+{
+	char buf[16];
+
+	check("Text reads ON and OFF", textStateIs("ON", true) && textStateIs("OFF", false));
+	check("Text refuses an empty payload, a prefix of ON, and more than ON",
+			textRefused("") && textRefused("O") && textRefused("OF") && textRefused("ONX") && textRefused("on"));
+
+	PayloadWriter state(PayloadFormat::Text, buf, sizeof(buf));
+	state.addState("state", true);
+	int stateLength = state.finish();
+	PayloadWriter number(PayloadFormat::Text, buf + 8, 8);
+	number.addNumber("t", 21500, 3);
+	number.addNumber("ignored", 1, 0);
+	int numberLength = number.finish();
+	check("Text writes a bare value, and only the first",
+			stateLength == 2 && memcmp(buf, "ON", 2) == 0 && numberLength == 4 && memcmp(buf + 8, "21.5", 4) == 0
+			&& numberIs(PayloadFormat::Text, buf + 8, numberLength, 3, 21500));
+}
+
+static void checkJson()
+{
+	static const char *nested = "{\"meta\":{\"a\":[1,{\"b\":\"}\"},[]],\"c\":null},\"state\":\"ON\"}";
+	static const char *spaced = " { \"state\" : true ,\r\n\t\"other\" : false } \n";
+	static const char *escaped = "{\"note\":\"say \\\"ON\\\"\",\"state\":\"OFF\"}";
+	static const char *deep = "{\"a\":[[[[[[[[[[1]]]]]]]]]],\"state\":\"ON\"}";
+	static const char *command = "{\"state\":\"ON\",\"duration_ms\":5000}";
+	char buf[8];
+
+	check("JSON round trips a document of every kind of value", roundTrips(PayloadFormat::Json));
+	check("JSON skips nested values, and strings with brackets in them", stateIs(PayloadFormat::Json, nested, strlen(nested), true));
+	check("JSON takes white space between tokens, and true and false",
+			stateIs(PayloadFormat::Json, spaced, strlen(spaced), true));
+	check("JSON skips escaped quotes in strings", stateIs(PayloadFormat::Json, escaped, strlen(escaped), false));
+	check("JSON refuses nesting deeper than it skips", stateRefused(PayloadFormat::Json, deep, strlen(deep)));
+	check("JSON refuses every prefix of a document",
+			stateIs(PayloadFormat::Json, command, strlen(command), true) && prefixesRefused(PayloadFormat::Json, command, strlen(command)));
+	check("JSON refuses more after the document",
+			stateRefused(PayloadFormat::Json, "{\"state\":\"ON\"}x", 15) && stateRefused(PayloadFormat::Json, "{\"state\":\"ON\"}{}", 16));
+	check("JSON refuses a state which isn't ON, OFF, true or false",
+			stateRefused(PayloadFormat::Json, "{\"state\":\"O\"}", 13) && stateRefused(PayloadFormat::Json, "{\"state\":1}", 11)
+			&& stateRefused(PayloadFormat::Json, "{\"state\":\"\"}", 12));
+
+	PayloadWriter writer(PayloadFormat::Json, buf, sizeof(buf));
+	writer.addState("state", true);
+	check("JSON fails a document which doesn't fit", writer.finish() == -1);
+}
+
+static void checkCbor()
+{
+	static const unsigned char state[] = {0xA1, 0x65, 's', 't', 'a', 't', 'e', 0xF5};
+	static const unsigned char temperature[] = {0xA1, 0x61, 't', 0xC4, 0x82, 0x20, 0x18, 0xD7};
+	static const unsigned char indefinite[] = {0xBF, 0x64, 'n', 'o', 't', 'e', 0x7F, 0x62, 'a', 'b', 0x61, 'c', 0xFF,
+			0x65, 's', 't', 'a', 't', 'e', 0xF4, 0xFF};
+	static const unsigned char nested[] = {0xA2, 0x64, 'm', 'e', 't', 'a', 0xA1, 0x61, 'a', 0x82, 0x01, 0xA0,
+			0x65, 's', 't', 'a', 't', 'e', 0xF5};
+	static const unsigned char half[] = {0xA1, 0x61, 't', 0xF9, 0x4D, 0x60};
+	static const unsigned char single[] = {0xA1, 0x61, 't', 0xFA, 0x41, 0xAC, 0x00, 0x00};
+	static const unsigned char twice[] = {0xA1, 0x61, 't', 0xFB, 0x40, 0x35, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00};
+	static const unsigned char negative[] = {0xA1, 0x61, 't', 0x38, 0x63};
+	static const unsigned char fraction[] = {0xA1, 0x61, 't', 0xC4, 0x82, 0x21, 0x39, 0x08, 0x65};
+	static const unsigned char trailing[] = {0xA1, 0x65, 's', 't', 'a', 't', 'e', 0xF5, 0x00};
+	static const unsigned char short_[] = {0xA2, 0x65, 's', 't', 'a', 't', 'e', 0xF5};
+	static const unsigned char numberKey[] = {0xA1, 0x01, 0xF5};
+	char buf[64];
+
+	check("CBOR round trips a document of every kind of value", roundTrips(PayloadFormat::Cbor));
+
+	PayloadWriter stateWriter(PayloadFormat::Cbor, buf, sizeof(buf));
+	stateWriter.addState("state", true);
+	int stateLength = stateWriter.finish();
+	PayloadWriter numberWriter(PayloadFormat::Cbor, buf + 32, 32);
+	numberWriter.addNumber("t", 21500, 3);
+	int numberLength = numberWriter.finish();
+	check("CBOR writes a state as a simple value, and 21.5 as a decimal fraction",
+			stateLength == sizeof(state) && memcmp(buf, state, sizeof(state)) == 0
+			&& numberLength == sizeof(temperature) && memcmp(buf + 32, temperature, sizeof(temperature)) == 0);
+
+	check("CBOR reads indefinite maps, and skips indefinite strings",
+			stateIs(PayloadFormat::Cbor, (const char *)indefinite, sizeof(indefinite), false));
+	check("CBOR skips nested maps and arrays", stateIs(PayloadFormat::Cbor, (const char *)nested, sizeof(nested), true));
+	check("CBOR reads half, single and double precision floats",
+			numberIs(PayloadFormat::Cbor, (const char *)half, sizeof(half), 3, 21500)
+			&& numberIs(PayloadFormat::Cbor, (const char *)single, sizeof(single), 3, 21500)
+			&& numberIs(PayloadFormat::Cbor, (const char *)twice, sizeof(twice), 3, 21500));
+	check("CBOR reads negative integers and decimal fractions",
+			numberIs(PayloadFormat::Cbor, (const char *)negative, sizeof(negative), 0, -100)
+			&& numberIs(PayloadFormat::Cbor, (const char *)fraction, sizeof(fraction), 3, -21500));
+	check("CBOR refuses every prefix of a document",
+			prefixesRefused(PayloadFormat::Cbor, (const char *)state, sizeof(state))
+			&& prefixesRefused(PayloadFormat::Cbor, (const char *)indefinite, sizeof(indefinite))
+			&& prefixesRefused(PayloadFormat::Cbor, (const char *)nested, sizeof(nested)));
+	check("CBOR refuses trailing bytes, missing values and keys which aren't strings",
+			stateRefused(PayloadFormat::Cbor, (const char *)trailing, sizeof(trailing))
+			&& stateRefused(PayloadFormat::Cbor, (const char *)short_, sizeof(short_))
+			&& stateRefused(PayloadFormat::Cbor, (const char *)numberKey, sizeof(numberKey)));
+
+	PayloadWriter writer(PayloadFormat::Cbor, buf, sizeof(buf));
+	for (int i = 0; i < 24; i++)
+	{
+		writer.addState("s", true);
+	}
+	check("CBOR fails a map of more values than its header holds", writer.finish() == -1);
+}
+
+int main()
+{
+	checkFixed();
+	checkText();
+	checkJson();
+	checkCbor();
+
+	printf("%d failed\n", failures);
+	return failures;
+}
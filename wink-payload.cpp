@@ -0,0 +1,839 @@
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#include "wink-payload.h"
+
+// nesting deeper than this, in the parts of a document being skipped, is taken as garbage
+#define MAX_DEPTH 8
+
+bool parsePayloadFormat(const char *name, PayloadFormat &format)
+{
+	if (strcmp(name, "text") == 0)
+	{
+		format = PayloadFormat::Text;
+	}
+	else if (strcmp(name, "json") == 0)
+	{
+		format = PayloadFormat::Json;
+	}
+	else if (strcmp(name, "cbor") == 0)
+	{
+		format = PayloadFormat::Cbor;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+int formatFixed(char *buf, int size, long value, int scale)
+{
+	char digits[24];
+	unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value : (unsigned long)value;
+	int n = 0;
+
+	// least significant first, with at least one digit in front of the point
+	do
+	{
+		digits[n++] = '0' + magnitude % 10;
+		magnitude /= 10;
+	} while ((magnitude > 0 || n <= scale) && n < (int)sizeof(digits));
+
+	int zeros = 0;
+	while (zeros < scale && digits[zeros] == '0')
+	{
+		zeros++;
+	}
+
+	int decimals = scale - zeros;
+	int length = (value < 0 ? 1 : 0) + (n - scale) + (decimals > 0 ? 1 + decimals : 0);
+	if (length > size)
+	{
+		return -1;
+	}
+
+	char *p = buf;
+	if (value < 0)
+	{
+		*p++ = '-';
+	}
+	for (int i = n - 1; i >= scale; i--)
+	{
+		*p++ = digits[i];
+	}
+	if (decimals > 0)
+	{
+		*p++ = '.';
+		for (int i = scale - 1; i >= zeros; i--)
+		{
+			*p++ = digits[i];
+		}
+	}
+	return length;
+}
+
+bool parseFixed(const char *text, int len, int scale, long &value)
+{
+	const char *p = text, *end = text + len;
+	bool negative = false, point = false, digits = false, roundUp = false;
+	int decimals = 0;
+	long result = 0;
+
+	if (p < end && *p == '-')
+	{
+		negative = true;
+		p++;
+	}
+
+	for (; p < end; p++)
+	{
+		if (*p >= '0' && *p <= '9')
+		{
+			digits = true;
+			if (!point || decimals < scale)
+			{
+				if (result > (LONG_MAX - 9) / 10)
+				{
+					return false;
+				}
+				result = result * 10 + (*p - '0');
+				decimals += point ? 1 : 0;
+			}
+			else if (decimals == scale)
+			{
+				// the first digit past the scale decides the rounding, and the rest are dropped
+				roundUp = *p >= '5';
+				decimals++;
+			}
+		}
+		else if (*p == '.' && !point)
+		{
+			point = true;
+		}
+		else
+		{
+			return false;
+		}
+	}
+
+	if (!digits)
+	{
+		return false;
+	}
+	for (; decimals < scale; decimals++)
+	{
+		if (result > LONG_MAX / 10)
+		{
+			return false;
+		}
+		result *= 10;
+	}
+	if (roundUp)
+	{
+		result++;
+	}
+
+	value = negative ? -result : result;
+	return true;
+}
+
+PayloadWriter::PayloadWriter(PayloadFormat format, char *buf, int size)
+	: format(format), buf(buf), size(size), len(0), count(0), overflow(false)
+{
+	// the map's header, with its count filled in by finish
+	if (format == PayloadFormat::Cbor)
+	{
+		putByte(0xA0);
+	}
+}
+
+void PayloadWriter::addState(const char *name, bool on)
+{
+	if (format == PayloadFormat::Text)
+	{
+		if (count++ == 0)
+		{
+			put(on ? "ON" : "OFF", on ? 2 : 3);
+		}
+		return;
+	}
+
+	beginValue(name);
+	if (format == PayloadFormat::Json)
+	{
+		put(on ? "\"ON\"" : "\"OFF\"", on ? 4 : 5);
+	}
+	else
+	{
+		putByte(on ? 0xF5 : 0xF4);
+	}
+}
+
+void PayloadWriter::addNumber(const char *name, long value, int scale)
+{
+	if (format == PayloadFormat::Text && count++ > 0)
+	{
+		return;
+	}
+
+	if (format != PayloadFormat::Text)
+	{
+		beginValue(name);
+	}
+
+	if (format == PayloadFormat::Cbor)
+	{
+		// as few digits as it needs: an integer, or a decimal fraction of an exponent and a mantissa
+		while (scale > 0 && value % 10 == 0)
+		{
+			value /= 10;
+			scale--;
+		}
+		if (scale > 0)
+		{
+			putByte(0xC4);
+			putByte(0x82);
+			putCborInteger(-scale);
+		}
+		putCborInteger(value);
+	}
+	else
+	{
+		char number[24];
+		int n = formatFixed(number, sizeof(number), value, scale);
+		put(number, n);
+	}
+}
+
+void PayloadWriter::addString(const char *name, const char *value, int valueLength)
+{
+	if (format == PayloadFormat::Text)
+	{
+		if (count++ == 0)
+		{
+			put(value, valueLength);
+		}
+		return;
+	}
+
+	beginValue(name);
+	if (format == PayloadFormat::Json)
+	{
+		put("\"", 1);
+		put(value, valueLength);
+		put("\"", 1);
+	}
+	else
+	{
+		putCborHead(3, valueLength);
+		put(value, valueLength);
+	}
+}
+
+int PayloadWriter::finish()
+{
+	if (format == PayloadFormat::Json)
+	{
+		put(count == 0 ? "{}" : "}", count == 0 ? 2 : 1);
+	}
+	else if (format == PayloadFormat::Cbor && len > 0)
+	{
+		buf[0] = (char)(0xA0 | count);
+	}
+	return overflow ? -1 : len;
+}
+
+void PayloadWriter::beginValue(const char *name)
+{
+	int n = strlen(name);
+
+	if (format == PayloadFormat::Json)
+	{
+		put(count == 0 ? "{\"" : ",\"", 2);
+		put(name, n);
+		put("\":", 2);
+	}
+	else
+	{
+		// the count has to fit in the map's one byte header
+		if (count == 23)
+		{
+			overflow = true;
+		}
+		putCborHead(3, n);
+		put(name, n);
+	}
+	count++;
+}
+
+void PayloadWriter::put(const char *data, int n)
+{
+	if (n < 0 || len + n > size)
+	{
+		overflow = true;
+		return;
+	}
+	memcpy(&buf[len], data, n);
+	len += n;
+}
+
+void PayloadWriter::putByte(unsigned char byte)
+{
+	put((const char *)&byte, 1);
+}
+
+void PayloadWriter::putCborHead(int major, unsigned long long value)
+{
+	unsigned char head[9];
+	int bytes = (value < 24) ? 0 : (value <= 0xFF) ? 1 : (value <= 0xFFFF) ? 2 : (value <= 0xFFFFFFFFULL) ? 4 : 8;
+
+	head[0] = (unsigned char)(major << 5 | (bytes == 0 ? value : bytes == 1 ? 24 : bytes == 2 ? 25 : bytes == 4 ? 26 : 27));
+	for (int i = bytes; i > 0; i--)
+	{
+		head[i] = (unsigned char)(value & 0xFF);
+		value >>= 8;
+	}
+	put((const char *)head, 1 + bytes);
+}
+
+void PayloadWriter::putCborInteger(long long value)
+{
+	if (value >= 0)
+	{
+		putCborHead(0, value);
+	}
+	else
+	{
+		putCborHead(1, (unsigned long long)(-1 - value));
+	}
+}
+
+static const char *skipSpace(const char *p, const char *end)
+{
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+	{
+		p++;
+	}
+	return p;
+}
+
+// a JSON string at p, which is left after it
+static bool jsonString(const char *&p, const char *end, const char *&value, int &len)
+{
+	if (p >= end || *p != '"')
+	{
+		return false;
+	}
+
+	const char *start = ++p;
+	while (p < end && *p != '"')
+	{
+		p += (*p == '\\') ? 2 : 1;
+	}
+	if (p >= end)
+	{
+		return false;
+	}
+
+	value = start;
+	len = p++ - start;
+	return true;
+}
+
+static bool jsonSkip(const char *&p, const char *end, int depth)
+{
+	const char *s;
+	int n;
+
+	if (p >= end || depth > MAX_DEPTH)
+	{
+		return false;
+	}
+
+	if (*p == '"')
+	{
+		return jsonString(p, end, s, n);
+	}
+
+	if (*p == '{' || *p == '[')
+	{
+		char close = (*p++ == '{') ? '}' : ']';
+
+		p = skipSpace(p, end);
+		if (p < end && *p == close)
+		{
+			p++;
+			return true;
+		}
+		for (;;)
+		{
+			if (close == '}')
+			{
+				if (!jsonString(p, end, s, n))
+				{
+					return false;
+				}
+				p = skipSpace(p, end);
+				if (p >= end || *p++ != ':')
+				{
+					return false;
+				}
+				p = skipSpace(p, end);
+			}
+			if (!jsonSkip(p, end, depth + 1))
+			{
+				return false;
+			}
+			p = skipSpace(p, end);
+			if (p < end && *p == ',')
+			{
+				p = skipSpace(p + 1, end);
+			}
+			else if (p < end && *p == close)
+			{
+				p++;
+				return true;
+			}
+			else
+			{
+				return false;
+			}
+		}
+	}
+
+	// a number, true, false or null
+	const char *start = p;
+	while (p < end && ((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || *p == '.' || *p == '-' || *p == '+'))
+	{
+		p++;
+	}
+	return p > start;
+}
+
+static bool cborHead(const unsigned char *&p, const unsigned char *end, int &major, unsigned long long &value, bool &indefinite)
+{
+	if (p >= end)
+	{
+		return false;
+	}
+
+	int info = *p & 31;
+	major = *p++ >> 5;
+	indefinite = false;
+	value = info;
+
+	if (info >= 24 && info <= 27)
+	{
+		int bytes = 1 << (info - 24);
+		if (end - p < bytes)
+		{
+			return false;
+		}
+		for (value = 0; bytes > 0; bytes--)
+		{
+			value = value << 8 | *p++;
+		}
+	}
+	else if (info == 31 && major >= 2 && major <= 5)
+	{
+		indefinite = true;
+	}
+	else if (info >= 24)
+	{
+		return false;
+	}
+	return true;
+}
+
+static bool cborSkip(const unsigned char *&p, const unsigned char *end, int depth)
+{
+	int major;
+	unsigned long long value;
+	bool indefinite;
+
+	if (depth > MAX_DEPTH || !cborHead(p, end, major, value, indefinite))
+	{
+		return false;
+	}
+
+	switch (major)
+	{
+	case 2:
+	case 3:
+		if (indefinite)
+		{
+			// chunks of definite strings, up to a break
+			while (p < end && *p != 0xFF)
+			{
+				if ((*p >> 5) != major || (*p & 31) == 31 || !cborSkip(p, end, depth + 1))
+				{
+					return false;
+				}
+			}
+			return p++ < end;
+		}
+		if ((unsigned long long)(end - p) < value)
+		{
+			return false;
+		}
+		p += value;
+		return true;
+	case 4:
+	case 5:
+		if (indefinite)
+		{
+			while (p < end && *p != 0xFF)
+			{
+				if (!cborSkip(p, end, depth + 1))
+				{
+					return false;
+				}
+			}
+			return p++ < end;
+		}
+		for (unsigned long long i = 0; i < (major == 5 ? value * 2 : value); i++)
+		{
+			if (!cborSkip(p, end, depth + 1))
+			{
+				return false;
+			}
+		}
+		return true;
+	case 6:
+		return cborSkip(p, end, depth + 1);
+	default:
+		return true;
+	}
+}
+
+static bool cborInteger(const unsigned char *&p, const unsigned char *end, long long &value)
+{
+	int major;
+	unsigned long long arg;
+	bool indefinite;
+
+	if (!cborHead(p, end, major, arg, indefinite) || major > 1 || arg > LLONG_MAX)
+	{
+		return false;
+	}
+	value = (major == 0) ? (long long)arg : -1 - (long long)arg;
+	return true;
+}
+
+// value * 10^shift, rounded, if it fits in a long
+static bool scaleInteger(long long value, int shift, long &result)
+{
+	for (; shift > 0; shift--)
+	{
+		if (value > LONG_MAX / 10 || value < LONG_MIN / 10)
+		{
+			return false;
+		}
+		value *= 10;
+	}
+	if (shift < -18)
+	{
+		value = 0;
+	}
+	else if (shift < 0)
+	{
+		long long divisor = 1;
+		for (; shift < 0; shift++)
+		{
+			divisor *= 10;
+		}
+		value = (value + (value < 0 ? -divisor : divisor) / 2) / divisor;
+	}
+	if (value > LONG_MAX || value < LONG_MIN)
+	{
+		return false;
+	}
+	result = (long)value;
+	return true;
+}
+
+PayloadReader::PayloadReader(PayloadFormat format, const char *payload, int len)
+	: format(format), payload(payload), len(len)
+{
+}
+
+bool PayloadReader::find(const char *name, const char *&value, const char *&end)
+{
+	int namelen = strlen(name);
+
+	if (format == PayloadFormat::Text)
+	{
+		value = payload;
+		end = payload + len;
+		return true;
+	}
+
+	// the whole payload has to be the document, so that one cut short isn't taken for what it starts with
+	bool found = false;
+
+	if (format == PayloadFormat::Json)
+	{
+		const char *p = skipSpace(payload, payload + len), *e = payload + len;
+
+		if (p >= e || *p++ != '{')
+		{
+			return false;
+		}
+		p = skipSpace(p, e);
+		if (p < e && *p == '}')
+		{
+			return false;
+		}
+		for (;;)
+		{
+			const char *key;
+			int keylen;
+
+			if (!jsonString(p, e, key, keylen))
+			{
+				return false;
+			}
+			p = skipSpace(p, e);
+			if (p >= e || *p++ != ':')
+			{
+				return false;
+			}
+			p = skipSpace(p, e);
+
+			const char *start = p;
+			if (!jsonSkip(p, e, 0))
+			{
+				return false;
+			}
+			if (!found && keylen == namelen && memcmp(key, name, namelen) == 0)
+			{
+				value = start;
+				end = p;
+				found = true;
+			}
+
+			p = skipSpace(p, e);
+			if (p < e && *p == '}')
+			{
+				return found && skipSpace(p + 1, e) == e;
+			}
+			if (p >= e || *p++ != ',')
+			{
+				return false;
+			}
+			p = skipSpace(p, e);
+		}
+	}
+
+	const unsigned char *p = (const unsigned char *)payload, *e = p + len;
+	int major;
+	unsigned long long count;
+	bool indefinite;
+
+	if (!cborHead(p, e, major, count, indefinite) || major != 5)
+	{
+		return false;
+	}
+	for (unsigned long long i = 0; indefinite ? (p < e && *p != 0xFF) : i < count; i++)
+	{
+		unsigned long long keylen;
+		bool keyIndefinite;
+
+		if (!cborHead(p, e, major, keylen, keyIndefinite) || major != 3 || keyIndefinite || (unsigned long long)(e - p) < keylen)
+		{
+			return false;
+		}
+		const unsigned char *key = p;
+		p += keylen;
+
+		const unsigned char *start = p;
+		if (!cborSkip(p, e, 0))
+		{
+			return false;
+		}
+		if (!found && keylen == (unsigned long long)namelen && memcmp(key, name, namelen) == 0)
+		{
+			value = (const char *)start;
+			end = (const char *)p;
+			found = true;
+		}
+	}
+	if (indefinite && (p >= e || *p++ != 0xFF))
+	{
+		return false;
+	}
+	return found && p == e;
+}
+
+bool PayloadReader::getString(const char *name, const char *&value, int &len)
+{
+	const char *start, *end;
+
+	return find(name, start, end) && stringValue(start, end, value, len);
+}
+
+bool PayloadReader::stringValue(const char *start, const char *end, const char *&value, int &len)
+{
+	if (format == PayloadFormat::Text)
+	{
+		value = start;
+		len = end - start;
+		return true;
+	}
+
+	if (format == PayloadFormat::Json)
+	{
+		return jsonString(start, end, value, len) && start == end;
+	}
+
+	const unsigned char *p = (const unsigned char *)start;
+	int major;
+	unsigned long long n;
+	bool indefinite;
+
+	if (!cborHead(p, (const unsigned char *)end, major, n, indefinite) || major != 3 || indefinite)
+	{
+		return false;
+	}
+	value = (const char *)p;
+	len = (int)n;
+	return true;
+}
+
+bool PayloadReader::getState(const char *name, bool &on)
+{
+	const char *start, *end, *text;
+	int n;
+
+	if (!find(name, start, end))
+	{
+		return false;
+	}
+
+	if (stringValue(start, end, text, n))
+	{
+		if (n == 2 && memcmp(text, "ON", 2) == 0)
+		{
+			on = true;
+			return true;
+		}
+		if (n == 3 && memcmp(text, "OFF", 3) == 0)
+		{
+			on = false;
+			return true;
+		}
+		return false;
+	}
+
+	if (format == PayloadFormat::Text)
+	{
+		return false;
+	}
+
+	if (format == PayloadFormat::Json)
+	{
+		if (end - start == 4 && memcmp(start, "true", 4) == 0)
+		{
+			on = true;
+			return true;
+		}
+		if (end - start == 5 && memcmp(start, "false", 5) == 0)
+		{
+			on = false;
+			return true;
+		}
+		return false;
+	}
+
+	// CBOR's simple values true and false
+	if (end - start == 1 && ((unsigned char)*start == 0xF5 || (unsigned char)*start == 0xF4))
+	{
+		on = (unsigned char)*start == 0xF5;
+		return true;
+	}
+	return false;
+}
+
+bool PayloadReader::getNumber(const char *name, int scale, long &value)
+{
+	const char *start, *end;
+
+	if (!find(name, start, end))
+	{
+		return false;
+	}
+
+	if (format != PayloadFormat::Cbor)
+	{
+		return parseFixed(start, end - start, scale, value);
+	}
+
+	const unsigned char *p = (const unsigned char *)start, *e = (const unsigned char *)end;
+	int major;
+	unsigned long long arg;
+	bool indefinite;
+	long long integer, exponent;
+
+	if (!cborHead(p, e, major, arg, indefinite))
+	{
+		return false;
+	}
+
+	if (major <= 1)
+	{
+		p = (const unsigned char *)start;
+		return cborInteger(p, e, integer) && scaleInteger(integer, scale, value);
+	}
+
+	if (major == 6 && arg == 4)
+	{
+		// a decimal fraction, [exponent, mantissa]
+		if (!cborHead(p, e, major, arg, indefinite) || major != 4 || arg != 2 || !cborInteger(p, e, exponent) || !cborInteger(p, e, integer)
+				|| exponent < -30 || exponent > 30)
+		{
+			return false;
+		}
+		return scaleInteger(integer, (int)exponent + scale, value);
+	}
+
+	if (major == 7)
+	{
+		// a half, single or double precision float, from whoever doesn't write decimal fractions
+		double number;
+		int info = (unsigned char)*start & 31;
+
+		if (info == 25)
+		{
+			int half = (int)arg, exp = (half >> 10) & 0x1F, mant = half & 0x3FF;
+			number = (exp == 0) ? ldexp(mant, -24) : (exp == 31) ? NAN : ldexp(mant + 1024, exp - 25);
+			number = (half & 0x8000) ? -number : number;
+		}
+		else if (info == 26)
+		{
+			unsigned int bits = (unsigned int)arg;
+			float f;
+			memcpy(&f, &bits, sizeof(f));
+			number = f;
+		}
+		else if (info == 27)
+		{
+			memcpy(&number, &arg, sizeof(number));
+		}
+		else
+		{
+			return false;
+		}
+
+		number = floor(number * pow(10, scale) + 0.5);
+		if (!(number >= LONG_MIN && number <= LONG_MAX))
+		{
+			return false;
+		}
+		value = (long)number;
+		return true;
+	}
+
+	return false;
+}
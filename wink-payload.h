@@ -0,0 +1,92 @@
+#ifndef WINK_PAYLOAD_H
+#define WINK_PAYLOAD_H
+
+/**
+ * How a group of topics encodes its payloads.  Text is a bare value, ON, OFF or a number, as the
+ * handler has always sent.  JSON and CBOR are documents of named values, so that one message can
+ * carry several of them, and CBOR is the smallest of the three for links where every byte counts.
+ */
+enum class PayloadFormat
+{
+	Text,
+	Json,
+	Cbor
+};
+
+// text, json or cbor.  Returns false, leaving format alone, for anything else
+bool parsePayloadFormat(const char *name, PayloadFormat &format);
+
+// writes value / 10^scale with no more decimals than it needs, whatever the locale, so 21500 at
+// scale 3 is "21.5".  Returns the length, which isn't NUL terminated, or -1 if it doesn't fit
+int formatFixed(char *buf, int size, long value, int scale);
+
+// reads a decimal number, such as "-21.5", as value * 10^scale, rounding any further digits.
+// Returns false unless all len characters are the number
+bool parseFixed(const char *text, int len, int scale, long &value);
+
+/**
+ * Builds a payload in a caller's buffer, without allocating.  Each add is one named value of the
+ * document, and a text payload is just the first value.
+ */
+class PayloadWriter
+{
+public:
+	PayloadWriter(PayloadFormat format, char *buf, int size);
+
+	void addState(const char *name, bool on);
+
+	void addNumber(const char *name, long value, int scale);
+
+	// written as it is, so a string for JSON has to be escaped already, as getString leaves it
+	void addString(const char *name, const char *value, int valueLength);
+
+	// the length of the payload, or -1 if it didn't fit
+	int finish();
+
+private:
+	void beginValue(const char *name);
+	void put(const char *data, int len);
+	void putByte(unsigned char byte);
+	void putCborHead(int major, unsigned long long value);
+	void putCborInteger(long long value);
+
+	PayloadFormat format;
+	char *buf;
+	int size;
+	int len;
+	int count;
+	bool overflow;
+};
+
+/**
+ * Finds named values in a payload, which stays where it is.  A text payload is a single value,
+ * whatever the name asked for.  JSON and CBOR documents are maps of names to values, and anything
+ * else in them, such as nested maps, is skipped over.
+ */
+class PayloadReader
+{
+public:
+	PayloadReader(PayloadFormat format, const char *payload, int len);
+
+	// ON or OFF, or true or false
+	bool getState(const char *name, bool &on);
+
+	// a number, as value * 10^scale
+	bool getNumber(const char *name, int scale, long &value);
+
+	// a string, pointing into the payload.  JSON escapes are left as they are
+	bool getString(const char *name, const char *&value, int &len);
+
+private:
+	// where the value for name starts, and for JSON where it ends
+	bool find(const char *name, const char *&value, const char *&end);
+
+	// the string between start and end, as getString
+	bool stringValue(const char *start, const char *end, const char *&value, int &len);
+
+	PayloadFormat format;
+	const char *payload;
+	int len;
+};
+
+#endif
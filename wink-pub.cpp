@@ -0,0 +1,138 @@
+/*
+ * Publishes each line read from stdin as a message, through an AsyncClient: a sample of the
+ * thread-safe client, built for the host.
+ *
+ * The main thread only reads and queues, so a slow broker never holds up reading, and the client's
+ * own thread connects, reconnects when the connection drops, and sends.  Each publish reports back
+ * through its callback, on the client's thread, which is counted here.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <atomic>
+
+#include "linux.cpp"
+#include "MQTTClient.h"
+#include "async.cpp"
+
+typedef MQTT::Client<IPStack, Countdown> Client;
+
+struct Options
+{
+	const char *host;
+	int port;
+	const char *topic;
+	int qos;
+	const char *clientid;
+};
+
+static Options options = {"localhost", 1883, "wink/pub", 1, "wink-pub"};
+
+static IPStack ipstack;
+static Client client(ipstack, 2000);
+
+static std::atomic<unsigned long> sent(0), failed(0);
+
+// first on the main thread, and then on the client's thread whenever the connection has dropped
+static int connectBroker(void *context)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+	if (ipstack.connect(options.host, options.port) != 0)
+	{
+		return -1;
+	}
+
+	data.clientID.cstring = (char *)options.clientid;
+	data.keepAliveInterval = 10;
+	if (client.connect(data) != MQTT::SUCCESS)
+	{
+		ipstack.disconnect();
+		return -1;
+	}
+	fprintf(stderr, "Connected to %s:%d\n", options.host, options.port);
+	return 0;
+}
+
+static void published(void *context, int rc)
+{
+	if (rc == MQTT::SUCCESS)
+	{
+		sent++;
+	}
+	else
+	{
+		failed++;
+	}
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: wink-pub [options] < lines\n"
+			"  -h host      broker host (localhost)\n"
+			"  -p port      broker port (1883)\n"
+			"  -t topic     topic to publish each line to (wink/pub)\n"
+			"  -q qos       QoS of the publishes, 0, 1 or 2 (1)\n"
+			"  -i clientid  client id (wink-pub)\n");
+}
+
+int main(int argc, char **argv)
+{
+	char line[256];
+	int c;
+
+	while ((c = getopt(argc, argv, "h:p:t:q:i:")) != -1)
+	{
+		switch (c)
+		{
+		case 'h': options.host = optarg; break;
+		case 'p': options.port = atoi(optarg); break;
+		case 't': options.topic = optarg; break;
+		case 'q': options.qos = atoi(optarg); break;
+		case 'i': options.clientid = optarg; break;
+		default: usage(); return 1;
+		}
+	}
+	if (options.qos < 0 || options.qos > 2)
+	{
+		usage();
+		return 1;
+	}
+
+	// connected before the thread starts, so that lines piped in straight away aren't lost
+	if (connectBroker(NULL) != 0)
+	{
+		fprintf(stderr, "Can't connect to %s:%d\n", options.host, options.port);
+		return 1;
+	}
+
+	AsyncClient<IPStack, Client> async(ipstack, client);
+	async.setConnect(connectBroker, NULL);
+	if (async.start() != 0)
+	{
+		fprintf(stderr, "Can't start the client's thread\n");
+		return 1;
+	}
+
+	// lines read while the connection is down fail, rather than waiting for it
+	while (fgets(line, sizeof(line), stdin) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = '\0';
+		if (async.publish(options.topic, line, strlen(line), (enum MQTT::QoS)options.qos, false, published, NULL) != 0)
+		{
+			failed++;
+		}
+	}
+
+	// sends what was queued before it, and gives the client back to this thread
+	async.stop();
+	if (client.isConnected())
+	{
+		client.disconnect();
+	}
+	printf("%lu published, %lu failed\n", sent.load(), failed.load());
+	return failed > 0 ? 1 : 0;
+}
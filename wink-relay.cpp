@@ -0,0 +1,1315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <linux/input.h>
+
+#include "wink-relay.h"
+
+#if !defined(__ANDROID__)
+bool logQuiet = false;
+#endif
+
+// a connection which lasts this long clears the backoff, one which drops sooner does not
+#define STABLE_CONNECTION_MS 30000
+
+WinkRelay::WinkRelay(const Configuration &config, const char *root)
+	: config(config),
+	  upperSwitch(-1), lowerSwitch(-1), input(-1), screen(-1), upperRelay(-1), lowerRelay(-1), temp(-1), humid(-1), prox(-1),
+	  upperSwitchState(true),
+	  lowerSwitchState(true),
+	  upperRelayState(' '),
+	  lowerRelayState(' '),
+	  upperRelayOn(false),
+	  lowerRelayOn(false),
+	  nextScheduleAt(0),
+	  scheduleCheckedAt(time(NULL)),
+	  last_input(time(NULL)),
+	  screenPower('1'),
+	  last_temperature(-1),
+	  last_humidity(-1),
+	  last_proximity(-1),
+	  publishCount(0),
+	  brokerCount(0),
+	  current(-1),
+	  standbyBroker(-1),
+	  standbyBackoff(10000, 300000),
+	  resolver(&ownResolver),
+	  wasConnected(false),
+	  connectAttempts(0),
+	  nextCommandId(0),
+	  lastResult(NULL),
+#if defined(WINK_USE_IO_URING)
+	  ownRing(32, 32),
+#endif
+	  ipstack(),
+	  routes(*this, config.topic_prefix),
+	  client(ipstack, 2000),
+	  sessionStore(config.session_file != NULL ? config.session_file : "")
+{
+	snprintf(this->root, sizeof(this->root), "%s", root);
+	memset(samples, 0, sizeof(samples));
+	for (int i = 0; i < COMMAND_IDS; i++)
+	{
+		commandIds[i].len = 0;
+	}
+	lastCommand.len = 0;
+	timers[(int)Relay::Upper].armed = false;
+	timers[(int)Relay::Lower].armed = false;
+
+	// the buttons toggling their relays are rules like any other, which run ahead of the configured ones
+	rules.count = 0;
+	if (config.enable_upper_button == 1)
+	{
+		addRule(rules, "upper_switch -> upper TOGGLE");
+	}
+	if (config.enable_lower_button == 1)
+	{
+		addRule(rules, "lower_switch -> lower TOGGLE");
+	}
+	for (int i = 0; i < config.rules.count; i++)
+	{
+		if (rules.count == MAX_RULES)
+		{
+			LOGE("Too many rules - only the first %d are used", MAX_RULES);
+			break;
+		}
+		rules.rules[rules.count++] = config.rules.rules[i];
+	}
+	memset(ruleMatched, 0, sizeof(ruleMatched));
+
+	// what was saved, until the broker sends the retained schedules again
+	schedules.count = 0;
+	loadSchedules();
+	planSchedules(time(NULL));
+
+#if defined(WINK_USE_IO_URING)
+	setRing(&ownRing);
+#endif
+	client.setRouter(&routes);
+
+	snprintf(upperTopic, sizeof(upperTopic), "%s/relays/upper", config.topic_prefix);
+	snprintf(lowerTopic, sizeof(lowerTopic), "%s/relays/lower", config.topic_prefix);
+	snprintf(batchTopic, sizeof(batchTopic), "%s/relays/set", config.topic_prefix);
+	snprintf(scheduleTopic, sizeof(scheduleTopic), "%s/config/schedules/+", config.topic_prefix);
+
+	prepareTopic(Topic::UpperRelayState, "relays/upper_state", config.relay_format);
+	prepareTopic(Topic::LowerRelayState, "relays/lower_state", config.relay_format);
+	// both relays in one document, which plain text can't be, and the batch commands are the same
+	prepareTopic(Topic::RelayStates, "relays/state", config.relay_format == PayloadFormat::Text ? PayloadFormat::Json : config.relay_format);
+	prepareTopic(Topic::UpperSwitch, "switches/upper", config.switch_format);
+	prepareTopic(Topic::LowerSwitch, "switches/lower", config.switch_format);
+	prepareTopic(Topic::Temperature, "sensors/temperature", config.sensor_format);
+	prepareTopic(Topic::Humidity, "sensors/humidity", config.sensor_format);
+	prepareTopic(Topic::ScreenState, "screen/state", config.screen_format);
+
+	parseBrokers();
+
+	if (config.dns_ttl > 0)
+	{
+		ownResolver.setTTL(config.dns_ttl);
+	}
+
+	if (config.tls == 1)
+	{
+#if defined(WINK_USE_TLS)
+		tls.setCAFile(config.tls_ca_file);
+		tls.setCertificate(config.tls_cert_file, config.tls_key_file);
+		tls.setSessionFile(config.tls_session_file);
+		ipstack.setContext(&tls);
+		if (!tls.isValid())
+		{
+			LOGE("TLS - Can't load the certificates");
+		}
+#else
+		// rather than send the password in the clear
+		LOGE("TLS - Not built with TLS, so not connecting");
+		brokerCount = 0;
+#endif
+	}
+
+	// a broker which is down is retried sooner than one which refuses us
+	setBackoff(ConnectPhase::Network, 1000, 60000);
+	setBackoff(ConnectPhase::Connect, 2000, 120000);
+	setBackoff(ConnectPhase::Subscribe, 1000, 30000);
+
+	// relays which lose power together boot together, so the client id has to go into the seed
+	unsigned int seed = 2166136261u ^ getpid() ^ time(NULL);
+	for (const char *p = config.clientid != NULL ? config.clientid : ""; *p; p++)
+	{
+		seed = (seed ^ (unsigned char)*p) * 16777619u;
+	}
+	for (int i = 0; i < brokerCount; i++)
+	{
+		for (int phase = 0; phase < 3; phase++)
+		{
+			brokers[i].backoff[phase].setSeed(seed + i * 3 + phase);
+		}
+		brokers[i].retry.countdown_ms(0);
+	}
+	standbyBackoff.setSeed(seed + MAX_BROKERS * 3);
+	standbyRetry.countdown_ms(0);
+
+	if (config.persistent_session == 1 && config.session_file != NULL)
+	{
+		client.setSessionStore(&sessionStore);
+	}
+
+	data = MQTTPacket_connectData_initializer;
+	data.MQTTVersion = config.mqtt_version;
+	data.willFlag = 0;
+	data.keepAliveInterval = 10;
+	data.cleansession = config.persistent_session == 1 ? 0 : 1;
+
+	data.clientID.cstring = config.clientid != NULL ? config.clientid : (char *)"Wink_Relay";
+
+	if (config.username != NULL)
+	{
+		data.username.cstring = config.username;
+	}
+
+	if (config.password != NULL)
+	{
+		data.password.cstring = config.password;
+	}
+}
+
+WinkRelay::~WinkRelay()
+{
+	int fds[] = {upperSwitch, lowerSwitch, input, screen, upperRelay, lowerRelay, temp, humid, prox};
+
+	for (unsigned int i = 0; i < sizeof(fds) / sizeof(fds[0]); i++)
+	{
+		if (fds[i] != -1)
+		{
+			close(fds[i]);
+		}
+	}
+
+	if (ipstack.getSocket() != -1)
+	{
+		ipstack.disconnect();
+	}
+
+	if (standby.getSocket() != -1)
+	{
+		standby.disconnect();
+	}
+}
+
+int WinkRelay::openFile(const char *path, int flags)
+{
+	char fullPath[512];
+
+	snprintf(fullPath, sizeof(fullPath), "%s%s", root, path);
+	return ::open(fullPath, flags);
+}
+
+void WinkRelay::open()
+{
+	upperSwitch = openFile("/sys/class/gpio/gpio8/value", O_RDONLY);
+	lowerSwitch = openFile("/sys/class/gpio/gpio7/value", O_RDONLY);
+	screen = openFile("/sys/class/gpio/gpio30/value", O_RDWR);
+	upperRelay = openFile("/sys/class/gpio/gpio203/value", O_RDWR);
+	lowerRelay = openFile("/sys/class/gpio/gpio204/value", O_RDWR);
+	input = openFile("/dev/input/event0", O_RDONLY | O_NONBLOCK);
+	temp = openFile("/sys/bus/i2c/devices/2-0040/temp1_input", O_RDONLY);
+	humid = openFile("/sys/bus/i2c/devices/2-0040/humidity1_input", O_RDONLY);
+	prox = openFile("/sys/devices/platform/imx-i2c.2/i2c-2/2-005a/input/input3/ps_input_data", O_RDONLY);
+
+	// in the order of Sample
+	int files[] = {upperRelay, lowerRelay, upperSwitch, lowerSwitch, temp, humid, prox};
+	reader.setFiles(files, (int)Sample::Count);
+
+	if (config.startup_power_on == 1)
+	{
+		LOGD("Startup device screenPower on");
+
+		write(upperRelay, &screenPower, 1);
+		write(lowerRelay, &screenPower, 1);
+	}
+
+	lseek(screen, 0, SEEK_SET);
+	read(screen, &screenPower, sizeof(screenPower));
+}
+
+// the command for one relay, named name in the payload, which is timed for default_ms unless the
+// command gives a time of its own
+static bool readCommand(PayloadReader &reader, const char *name, bool on, int &target, long default_ms, long &duration_ms)
+{
+	const char *text;
+	int len;
+	bool state;
+	RelayCommand command;
+
+	if (reader.getState(name, state))
+	{
+		target = state;
+		duration_ms = default_ms;
+		return true;
+	}
+	if (!reader.getString(name, text, len) || !parseRelayCommand(text, len, command))
+	{
+		return false;
+	}
+	target = command.target(on);
+	duration_ms = command.duration_ms != 0 ? command.duration_ms : default_ms;
+	return true;
+}
+
+// a document's duration_ms, for the commands in it which don't give a time, or 0 if it has none
+static bool readDuration(PayloadReader &reader, long &duration_ms)
+{
+	duration_ms = 0;
+	return !reader.getNumber("duration_ms", 0, duration_ms) || (duration_ms > 0 && duration_ms <= MAX_RELAY_TIMER_MS);
+}
+
+void WinkRelay::setRelay(Relay relay, bool on)
+{
+	if (relay == Relay::Upper)
+	{
+		setRelays(on, -1);
+	}
+	else
+	{
+		setRelays(-1, on);
+	}
+}
+
+void WinkRelay::setRelays(int upper, int lower)
+{
+	// through the files open() left open, which poll() reads back, so that a batch changes both
+	// relays before the next poll and is published as one state
+	char value;
+
+	// anything which sets a relay, a command or a button, cancels its timer
+	if (upper != -1)
+	{
+		value = upper ? '1' : '0';
+		pwrite(upperRelay, &value, 1, 0);
+		upperRelayOn = upper;
+		timers[(int)Relay::Upper].armed = false;
+	}
+	if (lower != -1)
+	{
+		value = lower ? '1' : '0';
+		pwrite(lowerRelay, &value, 1, 0);
+		lowerRelayOn = lower;
+		timers[(int)Relay::Lower].armed = false;
+	}
+}
+
+void WinkRelay::startTimer(Relay relay, bool on, int duration_ms)
+{
+	RelayTimer &timer = timers[(int)relay];
+
+	timer.armed = true;
+	timer.on = on;
+	timer.expiry.countdown_ms(duration_ms);
+}
+
+void WinkRelay::runRules(RuleEvent event, long value)
+{
+	for (int i = 0; i < rules.count; i++)
+	{
+		const Rule &rule = rules.rules[i];
+
+		if (rule.event != event)
+		{
+			continue;
+		}
+
+		// a test runs its rule as it becomes true, rather than on every event while it stays true
+		bool matched = rule.matches(value);
+		bool run = matched && (rule.test == RuleTest::Any || !ruleMatched[i]);
+		ruleMatched[i] = matched;
+		if (run)
+		{
+			runCommand(rule.target, rule.command);
+		}
+	}
+}
+
+void WinkRelay::runCommand(RuleTarget target, const RelayCommand &command)
+{
+	if (target == RuleTarget::Screen)
+	{
+		// as if the screen had just been touched, or had been left alone for long enough
+		int on = command.target(screenPower == '1');
+		if (on != -1)
+		{
+			last_input = on ? time(NULL) : time(NULL) - config.screen_timeout - 1;
+		}
+		return;
+	}
+
+	Relay relay = target == RuleTarget::Upper ? Relay::Upper : Relay::Lower;
+	int on = command.target(relay == Relay::Upper ? upperRelayOn : lowerRelayOn);
+	if (on != -1)
+	{
+		setRelay(relay, on);
+		if (command.duration_ms > 0)
+		{
+			startTimer(relay, !on, command.duration_ms);
+		}
+	}
+}
+
+void WinkRelay::setSchedule(const char *name, int nameLength, const char *text, int textLength)
+{
+	char line[MAX_SCHEDULE_TEXT];
+	Schedule schedule;
+	int i = 0;
+
+	// the name goes into the schedules file ahead of a tab
+	if (nameLength == 0 || nameLength >= MAX_SCHEDULE_NAME || memchr(name, '\t', nameLength) != NULL)
+	{
+		LOGE("Schedule name '%.*s' can't be used", nameLength, name);
+		return;
+	}
+
+	while (i < schedules.count && (strlen(schedules.schedules[i].name) != (size_t)nameLength
+			|| memcmp(schedules.schedules[i].name, name, nameLength) != 0))
+	{
+		i++;
+	}
+
+	if (textLength == 0)
+	{
+		if (i < schedules.count)
+		{
+			LOGD("Schedule removed - %s", schedules.schedules[i].name);
+			schedules.schedules[i] = schedules.schedules[--schedules.count];
+			saveSchedules();
+		}
+		return;
+	}
+
+	if (textLength >= (int)sizeof(line))
+	{
+		LOGE("Schedule %.*s is too long", nameLength, name);
+		return;
+	}
+	snprintf(line, sizeof(line), "%.*s", textLength, text);
+
+	// the broker sends the retained schedules again on every connect, which needn't be saved again
+	if (i < schedules.count && strcmp(schedules.schedules[i].text, line) == 0)
+	{
+		return;
+	}
+	if (!parseSchedule(line, schedule))
+	{
+		LOGE("Can't understand the schedule %.*s - '%s'", nameLength, name, line);
+		return;
+	}
+	if (i == MAX_SCHEDULES)
+	{
+		LOGE("Too many schedules - %.*s is ignored", nameLength, name);
+		return;
+	}
+	if (i == schedules.count)
+	{
+		schedules.count++;
+	}
+
+	snprintf(schedule.name, sizeof(schedule.name), "%.*s", nameLength, name);
+	schedule.next = nextScheduleTime(schedule, time(NULL));
+	schedules.schedules[i] = schedule;
+	if (schedule.next < nextScheduleAt)
+	{
+		nextScheduleAt = schedule.next;
+	}
+	LOGD("Schedule set - %s: %s", schedule.name, schedule.text);
+
+	saveSchedules();
+}
+
+void WinkRelay::planSchedules(time_t now)
+{
+	for (int i = 0; i < schedules.count; i++)
+	{
+		schedules.schedules[i].next = nextScheduleTime(schedules.schedules[i], now);
+	}
+
+	// none of them is due, so this only finds the soonest
+	runSchedules(now);
+}
+
+void WinkRelay::runSchedules(time_t now)
+{
+	// every schedule runs at least once a week, so with none this only looks again in a week
+	nextScheduleAt = now + 7 * 24 * 60 * 60;
+
+	for (int i = 0; i < schedules.count; i++)
+	{
+		Schedule &schedule = schedules.schedules[i];
+
+		if (schedule.next <= now)
+		{
+			if (now - schedule.next <= SCHEDULE_GRACE)
+			{
+				LOGD("Schedule running - %s", schedule.name);
+				runCommand(schedule.target, schedule.command);
+			}
+			else
+			{
+				LOGD("Schedule skipped, the clock having moved past it - %s", schedule.name);
+			}
+			schedule.next = nextScheduleTime(schedule, now);
+		}
+
+		if (schedule.next < nextScheduleAt)
+		{
+			nextScheduleAt = schedule.next;
+		}
+	}
+}
+
+// one schedule a line, as its name, a tab and its text
+void WinkRelay::loadSchedules()
+{
+	char line[MAX_SCHEDULE_NAME + MAX_SCHEDULE_TEXT + 2];
+	FILE *file;
+
+	if (config.schedules_file == NULL || (file = fopen(config.schedules_file, "r")) == NULL)
+	{
+		return;
+	}
+
+	while (schedules.count < MAX_SCHEDULES && fgets(line, sizeof(line), file) != NULL)
+	{
+		Schedule &schedule = schedules.schedules[schedules.count];
+		char *tab = strchr(line, '\t');
+
+		line[strcspn(line, "\r\n")] = '\0';
+		if (tab == NULL || tab - line >= MAX_SCHEDULE_NAME || !parseSchedule(tab + 1, schedule))
+		{
+			LOGE("Can't load the schedule '%s' from %s", line, config.schedules_file);
+			continue;
+		}
+		snprintf(schedule.name, sizeof(schedule.name), "%.*s", (int)(tab - line), line);
+		schedules.count++;
+	}
+	fclose(file);
+}
+
+// a new copy renamed over the old one, so a power cut never loses the schedules
+void WinkRelay::saveSchedules()
+{
+	char tmpname[1024];
+	FILE *file;
+
+	if (config.schedules_file == NULL)
+	{
+		return;
+	}
+
+	snprintf(tmpname, sizeof(tmpname), "%s.tmp", config.schedules_file);
+	if ((file = fopen(tmpname, "w")) == NULL)
+	{
+		LOGE("Can't save the schedules to %s", tmpname);
+		return;
+	}
+
+	for (int i = 0; i < schedules.count; i++)
+	{
+		fprintf(file, "%s\t%s\n", schedules.schedules[i].name, schedules.schedules[i].text);
+	}
+
+	bool written = fflush(file) == 0 && fsync(fileno(file)) == 0;
+	if (fclose(file) != 0 || !written || rename(tmpname, config.schedules_file) != 0)
+	{
+		LOGE("Can't save the schedules to %s", config.schedules_file);
+		unlink(tmpname);
+	}
+}
+
+int WinkRelay::pollTimeout(int max_ms)
+{
+	int timeout = max_ms;
+	struct timespec now;
+
+	// the schedules are to the second, on the time of day
+	clock_gettime(CLOCK_REALTIME, &now);
+	if (nextScheduleAt - now.tv_sec <= timeout / 1000 + 1)
+	{
+		long left = (nextScheduleAt - now.tv_sec) * 1000L - now.tv_nsec / 1000000;
+		timeout = left < 0 ? 0 : left < timeout ? left : timeout;
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		if (timers[i].armed && timers[i].expiry.left_ms() < timeout)
+		{
+			timeout = timers[i].expiry.left_ms();
+		}
+	}
+	return timeout;
+}
+
+void WinkRelay::applyCommand(int upper, int lower)
+{
+	bool changed = (upper != -1 && upper != upperRelayOn) || (lower != -1 && lower != lowerRelayOn);
+
+	setRelays(upper, lower);
+	lastResult = changed ? "changed" : "unchanged";
+}
+
+void WinkRelay::onTopicMessage(Relay relay, char *payloadMessage, int payloadLength)
+{
+	PayloadReader reader(config.relay_format, payloadMessage, payloadLength);
+	int target;
+	long default_ms, duration_ms;
+
+	LOGD("MQTT - Received %s relay message - '%.*s' [length: %d]", relay == Relay::Upper ? "upper" : "lower", payloadLength, payloadMessage, payloadLength);
+
+	if (!isNewCommand(config.relay_format, reader))
+	{
+		return;
+	}
+
+	// the whole payload has to be the command, so that an empty one, or "O", isn't taken for ON
+	if (readDuration(reader, default_ms)
+			&& readCommand(reader, "state", relay == Relay::Upper ? upperRelayOn : lowerRelayOn, target, default_ms, duration_ms))
+	{
+		applyCommand(relay == Relay::Upper ? target : -1, relay == Relay::Lower ? target : -1);
+		if (target != -1 && duration_ms > 0)
+		{
+			startTimer(relay, !target, duration_ms);
+		}
+		recordCommand();
+	}
+	else
+	{
+		LOGE("MQTT - Unrecognised %s relay command", relay == Relay::Upper ? "upper" : "lower");
+		lastResult = "invalid";
+	}
+}
+
+void WinkRelay::onUpperTopicMessageReceived(MQTT::MessageData &md)
+{
+	MQTT::Message &message = md.message;
+	onTopicMessage(Relay::Upper, (char *)message.payload, message.payloadlen);
+}
+
+void WinkRelay::onLowerTopicMessageReceived(MQTT::MessageData &md)
+{
+	MQTT::Message &message = md.message;
+	onTopicMessage(Relay::Lower, (char *)message.payload, message.payloadlen);
+}
+
+void WinkRelay::onScheduleMessageReceived(MQTT::MessageData &md)
+{
+	MQTT::Message &message = md.message;
+	const char *topic = md.topicName.lenstring.data;
+	const char *name = topic + md.topicName.lenstring.len;
+
+	// named for the last level of the topic
+	while (name > topic && name[-1] != '/')
+	{
+		name--;
+	}
+
+	LOGD("MQTT - Received schedule %.*s - '%.*s'", (int)(topic + md.topicName.lenstring.len - name), name, (int)message.payloadlen, (char *)message.payload);
+	setSchedule(name, topic + md.topicName.lenstring.len - name, (const char *)message.payload, message.payloadlen);
+}
+
+void WinkRelay::onBatchMessageReceived(MQTT::MessageData &md)
+{
+	MQTT::Message &message = md.message;
+	PayloadReader reader(formats[(int)Topic::RelayStates], (const char *)message.payload, message.payloadlen);
+	// both are worked out from the relays as they were before the batch
+	int upper, lower;
+	long default_ms, upper_ms, lower_ms;
+	bool valid = readDuration(reader, default_ms);
+	bool hasUpper = valid && readCommand(reader, "upper", upperRelayOn, upper, default_ms, upper_ms);
+	bool hasLower = valid && readCommand(reader, "lower", lowerRelayOn, lower, default_ms, lower_ms);
+
+	LOGD("MQTT - Received relay batch - '%.*s' [length: %d]", (int)message.payloadlen, (char *)message.payload, (int)message.payloadlen);
+
+	if (!isNewCommand(formats[(int)Topic::RelayStates], reader))
+	{
+		return;
+	}
+
+	if (hasUpper || hasLower)
+	{
+		applyCommand(hasUpper ? upper : -1, hasLower ? lower : -1);
+		if (hasUpper && upper != -1 && upper_ms > 0)
+		{
+			startTimer(Relay::Upper, !upper, upper_ms);
+		}
+		if (hasLower && lower != -1 && lower_ms > 0)
+		{
+			startTimer(Relay::Lower, !lower, lower_ms);
+		}
+		recordCommand();
+	}
+	else
+	{
+		LOGE("MQTT - Unrecognised relay batch");
+		lastResult = "invalid";
+	}
+}
+
+bool WinkRelay::isNewCommand(PayloadFormat format, PayloadReader &reader)
+{
+	const char *id;
+	int len;
+
+	lastCommand.len = 0;
+
+	// only a document has room for an id, and a command without one is always applied
+	if (format == PayloadFormat::Text || !reader.getString("id", id, len))
+	{
+		return true;
+	}
+	if (len > MAX_COMMAND_ID)
+	{
+		LOGE("MQTT - Command id '%.*s' is too long to remember", len, id);
+		return true;
+	}
+
+	for (int i = 0; i < COMMAND_IDS; i++)
+	{
+		CommandId &recent = commandIds[i];
+
+		if (recent.len == len && memcmp(recent.id, id, len) == 0 && !recent.expiry.expired())
+		{
+			LOGD("MQTT - Ignoring command '%.*s', which has already been applied", len, id);
+			return false;
+		}
+	}
+
+	// remembered by recordCommand once it has been applied, so that one which was invalid can be
+	// corrected and sent again with the same id
+	memcpy(lastCommand.id, id, len);
+	lastCommand.len = len;
+	return true;
+}
+
+void WinkRelay::recordCommand()
+{
+	if (lastCommand.len == 0)
+	{
+		return;
+	}
+
+	CommandId &recent = commandIds[nextCommandId];
+	nextCommandId = (nextCommandId + 1) % COMMAND_IDS;
+	memcpy(recent.id, lastCommand.id, lastCommand.len);
+	recent.len = lastCommand.len;
+	recent.expiry.countdown(config.command_id_window);
+}
+
+void WinkRelay::prepareTopic(Topic topic, const char *name, PayloadFormat format)
+{
+	char full[1024];
+
+	formats[(int)topic] = format;
+	snprintf(full, sizeof(full), "%s/%s", config.topic_prefix, name);
+	if (!topics[(int)topic].set(full))
+	{
+		LOGE("Topic '%s' is too long to publish to", full);
+	}
+}
+
+void WinkRelay::publishState(Topic topic, bool on, bool retain)
+{
+	char payload[32];
+	PayloadWriter writer(formats[(int)topic], payload, sizeof(payload));
+
+	writer.addState("state", on);
+	publishMessage(topic, payload, writer.finish(), retain);
+}
+
+void WinkRelay::publishNumber(Topic topic, const char *name, long value, int scale, bool retain)
+{
+	char payload[48];
+	PayloadWriter writer(formats[(int)topic], payload, sizeof(payload));
+
+	writer.addNumber(name, value, scale);
+	publishMessage(topic, payload, writer.finish(), retain);
+}
+
+void WinkRelay::publishRelayStates()
+{
+	char payload[192];
+	PayloadWriter writer(formats[(int)Topic::RelayStates], payload, sizeof(payload));
+
+	writer.addState("upper", upperRelayState != '0');
+	writer.addState("lower", lowerRelayState != '0');
+	if (timers[(int)Relay::Upper].armed)
+	{
+		writer.addNumber("upper_timer_ms", timers[(int)Relay::Upper].expiry.left_ms(), 0);
+	}
+	if (timers[(int)Relay::Lower].armed)
+	{
+		writer.addNumber("lower_timer_ms", timers[(int)Relay::Lower].expiry.left_ms(), 0);
+	}
+	if (lastResult != NULL)
+	{
+		writer.addString("result", lastResult, strlen(lastResult));
+		if (lastCommand.len > 0)
+		{
+			writer.addString("id", lastCommand.id, lastCommand.len);
+		}
+		lastResult = NULL;
+	}
+	publishMessage(Topic::RelayStates, payload, writer.finish(), true);
+}
+
+void WinkRelay::publishMessage(Topic topic, const char *payload, int payloadLength, bool retain)
+{
+	if (payloadLength < 0)
+	{
+		LOGE("Payload for topic '%s' doesn't fit", topics[(int)topic].name());
+	}
+	else if (client.isConnected())
+	{
+		const MQTT::PreparedTopic &prepared = topics[(int)topic];
+
+		int rc;
+		if ((rc = client.publish(prepared, payload, payloadLength, MQTT::QOS1, retain)) != 0)
+		{
+			LOGE("Failed to publish message for topic '%s' - %d", prepared.name(), rc);
+		}
+		else
+		{
+			publishCount++;
+		}
+	}
+}
+
+void WinkRelay::poll()
+{
+	struct input_event event;
+	const char *buffer;
+	int temperature, humidity;
+	long proximity;
+	bool relaysChanged = false;
+	struct timespec clock;
+
+	// the schedules are only looked at once one is due, or the clock has been set back under them.
+	// This is the clock pollTimeout() waits on, which time() can lag by a few ms
+	clock_gettime(CLOCK_REALTIME, &clock);
+	time_t now = clock.tv_sec;
+	if (now < scheduleCheckedAt)
+	{
+		planSchedules(now);
+	}
+	else if (now >= nextScheduleAt)
+	{
+		runSchedules(now);
+	}
+	scheduleCheckedAt = now;
+
+	// timed commands which have run their course, before the relays are read back
+	for (int i = 0; i < 2; i++)
+	{
+		if (timers[i].armed && timers[i].expiry.expired())
+		{
+			LOGD("Relay timer finished - %s", i == (int)Relay::Upper ? "upper" : "lower");
+			setRelay((Relay)i, timers[i].on);
+		}
+	}
+
+	// every file is read before any is looked at, which with io_uring is a single system call
+	reader.read(samples[0], SAMPLE_SIZE);
+
+	buffer = sample(Sample::UpperRelay);
+	upperRelayOn = buffer[0] != '0';
+	if (upperRelayState != buffer[0])
+	{
+		upperRelayState = buffer[0];
+
+		LOGD("Relay changed state - upper");
+
+		publishState(Topic::UpperRelayState, buffer[0] != '0', true);
+		relaysChanged = true;
+		runRules(RuleEvent::UpperRelay, buffer[0] != '0');
+	}
+
+	buffer = sample(Sample::LowerRelay);
+	lowerRelayOn = buffer[0] != '0';
+	if (lowerRelayState != buffer[0])
+	{
+		lowerRelayState = buffer[0];
+
+		LOGD("Relay changed state - lower");
+
+		publishState(Topic::LowerRelayState, buffer[0] != '0', true);
+		relaysChanged = true;
+		runRules(RuleEvent::LowerRelay, buffer[0] != '0');
+	}
+
+	// a command which left the relays as they were still has its result reported
+	if (relaysChanged || lastResult != NULL)
+	{
+		publishRelayStates();
+	}
+
+	buffer = sample(Sample::UpperSwitch);
+	if (upperSwitchState != (buffer[0] == '1'))
+	{
+		upperSwitchState = buffer[0] == '1';
+
+		if (upperSwitchState)
+		{
+			LOGD("Switch changed state - upper");
+
+			publishState(Topic::UpperSwitch, true, false);
+			runRules(RuleEvent::UpperSwitch, 1);
+		}
+	}
+
+	buffer = sample(Sample::LowerSwitch);
+	if (lowerSwitchState != (buffer[0] == '1'))
+	{
+		lowerSwitchState = buffer[0] == '1';
+
+		if (lowerSwitchState)
+		{
+			LOGD("Switch changed state - lower");
+
+			publishState(Topic::LowerSwitch, true, false);
+			runRules(RuleEvent::LowerSwitch, 1);
+		}
+	}
+
+	temperature = atoi(sample(Sample::Temperature));
+	if (abs(temperature - last_temperature) > 100)
+	{
+		last_temperature = temperature;
+
+		publishNumber(Topic::Temperature, "temperature", temperature, 3, true);
+		runRules(RuleEvent::Temperature, temperature);
+	}
+
+	humidity = atoi(sample(Sample::Humidity));
+	if (abs(humidity - last_humidity) > 100)
+	{
+		last_humidity = humidity;
+
+		publishNumber(Topic::Humidity, "humidity", humidity, 3, true);
+		runRules(RuleEvent::Humidity, humidity);
+	}
+
+	proximity = strtol(sample(Sample::Proximity), NULL, 10);
+	if (proximity != last_proximity)
+	{
+		last_proximity = proximity;
+		runRules(RuleEvent::Proximity, proximity);
+	}
+	if (proximity >= config.proximity_threshold)
+	{
+		last_input = time(NULL);
+	}
+
+	while (read(input, &event, sizeof(event)) > 0)
+	{
+		last_input = time(NULL);
+	}
+
+	bool shouldTurnOnScreen = (time(NULL) - last_input) <= config.screen_timeout;
+	if (shouldTurnOnScreen && screenPower != '1')
+	{
+		screenPower = '1';
+		write(screen, &screenPower, sizeof(screenPower));
+
+		LOGD("Screen state changed - on");
+
+		publishState(Topic::ScreenState, true, true);
+	}
+	else if (!shouldTurnOnScreen && screenPower == '1')
+	{
+		screenPower = '0';
+		write(screen, &screenPower, sizeof(screenPower));
+
+		LOGD("Screen state changed - off");
+
+		publishState(Topic::ScreenState, false, true);
+	}
+}
+
+// host is a comma separated list of brokers, in order of preference, each with an optional port or
+// as unix:/path
+// copies host into the broker, or says why not if it doesn't fit
+static bool setBrokerHost(Broker *broker, const char *host)
+{
+	size_t len = strlen(host);
+
+	if (len >= sizeof(broker->host))
+	{
+		LOGE("Broker host '%s' is too long, at most %d characters", host, (int)sizeof(broker->host) - 1);
+		return false;
+	}
+	memcpy(broker->host, host, len + 1);
+	return true;
+}
+
+void WinkRelay::parseBrokers()
+{
+	const char *p = config.host != NULL ? config.host : "";
+
+	while (*p != '\0' && brokerCount < MAX_BROKERS)
+	{
+		Broker *broker = &brokers[brokerCount];
+		const char *end = strchr(p, ',');
+		int len = end != NULL ? end - p : strlen(p);
+		// a host, with room for the brackets around an IPv6 address and a port
+		char entry[sizeof(Broker::host) + 8];
+		char *colon;
+		bool valid;
+
+		while (len > 0 && *p == ' ')
+		{
+			p++;
+			len--;
+		}
+		if (len >= (int)sizeof(entry))
+		{
+			LOGE("Broker '%.*s' is too long", len, p);
+			p = end != NULL ? end + 1 : p + len;
+			continue;
+		}
+		memcpy(entry, p, len);
+		entry[len] = '\0';
+		p = end != NULL ? end + 1 : p + len;
+
+		broker->port = config.port;
+		if (isUnixAddress(entry))
+		{
+			// a Unix domain socket, whose path may have colons of its own
+			valid = setBrokerHost(broker, entry);
+		}
+		else if (entry[0] == '[')
+		{
+			// an IPv6 address, which has to be in brackets to be given a port
+			char *close = strchr(entry, ']');
+			if (close == NULL)
+				continue;
+			*close = '\0';
+			if (close[1] == ':')
+				broker->port = atoi(close + 2);
+			valid = setBrokerHost(broker, entry + 1);
+		}
+		else
+		{
+			if ((colon = strchr(entry, ':')) != NULL && strchr(colon + 1, ':') == NULL)
+			{
+				*colon = '\0';
+				broker->port = atoi(colon + 1);
+			}
+			valid = setBrokerHost(broker, entry);
+		}
+
+		if (valid && broker->host[0] != '\0')
+			brokerCount++;
+	}
+
+	if (brokerCount == 0)
+	{
+		LOGE("No broker host configured");
+	}
+}
+
+// the first healthy broker in the list, other than skip, or -1 if they are all waiting to be retried
+int WinkRelay::nextBroker(int skip)
+{
+	for (int i = 0; i < brokerCount; i++)
+	{
+		if (i != skip && brokers[i].retry.expired())
+			return i;
+	}
+	return -1;
+}
+
+// returns RESOLVE_PENDING, without having tried, while the broker's address is being looked up
+int WinkRelay::connectNetwork(int broker)
+{
+	AddressList addresses;
+	int rc;
+
+	if (ipstack.getSocket() != -1)
+	{
+		ipstack.disconnect();
+	}
+
+	// a standby connection to this broker saves the DNS lookup and the TCP handshake
+	if (broker == standbyBroker)
+	{
+		LOGD("IPStack - Using standby connection to %s:%d", brokers[broker].host, brokers[broker].port);
+
+		ipstack.adopt(standby.release());
+		standbyBroker = -1;
+#if defined(WINK_USE_TLS)
+		// the standby connection is only TCP, so the handshake is still to do, but usually resumes a session
+		return ipstack.handshake(brokers[broker].host, brokers[broker].port);
+#else
+		return 0;
+#endif
+	}
+
+	if ((rc = resolver->lookup(brokers[broker].host, brokers[broker].port, addresses)) != 0)
+	{
+		if (rc != RESOLVE_PENDING)
+		{
+			LOGE("IPStack - Failed to look up %s", brokers[broker].host);
+		}
+		return rc;
+	}
+
+	LOGD("IPStack - Connecting to %s:%d...", brokers[broker].host, brokers[broker].port);
+
+	rc = ipstack.connect(addresses);
+#if defined(WINK_USE_TLS)
+	if (rc == 0 && config.tls == 1)
+	{
+		LOGD("TLS - %s handshake", ipstack.isResumed() ? "Resumed" : "Full");
+	}
+#endif
+	return rc;
+}
+
+int WinkRelay::connectStandby(int broker)
+{
+	AddressList addresses;
+	int rc;
+
+	if ((rc = resolver->lookup(brokers[broker].host, brokers[broker].port, addresses)) != 0)
+	{
+		return rc;
+	}
+
+	return standby.connect(addresses);
+}
+
+int WinkRelay::connectMQTT()
+{
+	int rc;
+	MQTT::connackData connack;
+
+	if ((rc = client.connect(data, connack)) == 0)
+	{
+		// the client itself forgets a saved session the broker no longer has
+		LOGD("MQTT - Connected%s", connack.sessionPresent ? ", resuming session" : "");
+	}
+	else
+	{
+		LOGE("MQTT - Failed to connect - %d", rc);
+	}
+
+	return rc;
+}
+
+int WinkRelay::subscribe()
+{
+	int rc = 0;
+	// QoS 1 costs half the packets of QoS 2, with commands carrying ids to make up for the repeats
+	MQTT::QoS qos = config.command_qos == 1 ? MQTT::QOS1 : MQTT::QOS2;
+
+	// even into a session the broker kept, whose subscriptions may be from another topic_prefix or
+	// command_qos.  Subscribing again to the same filter only replaces it
+	if ((rc = client.subscribe(upperTopic, qos)) != 0)
+	{
+		LOGE("MQTT - Failed to subscribe to '%s' - %d", upperTopic, rc);
+		client.disconnect();
+	}
+	else if ((rc = client.subscribe(lowerTopic, qos)) != 0)
+	{
+		LOGE("MQTT - Failed to subscribe to '%s' - %d", lowerTopic, rc);
+		client.disconnect();
+	}
+	else if ((rc = client.subscribe(batchTopic, qos)) != 0)
+	{
+		LOGE("MQTT - Failed to subscribe to '%s' - %d", batchTopic, rc);
+		client.disconnect();
+	}
+	else if ((rc = client.subscribe(scheduleTopic, qos)) != 0)
+	{
+		LOGE("MQTT - Failed to subscribe to '%s' - %d", scheduleTopic, rc);
+		client.disconnect();
+	}
+
+	return rc;
+}
+
+void WinkRelay::retryLater(int broker, ConnectPhase phase)
+{
+	int delay = brokers[broker].backoff[(int)phase].next();
+
+	// don't hold a connection open at a broker which has just turned us away
+	if (ipstack.getSocket() != -1)
+	{
+		ipstack.disconnect();
+	}
+
+	brokers[broker].retry.countdown_ms(delay);
+	LOGD("Retrying %s:%d in %d ms", brokers[broker].host, brokers[broker].port, delay);
+}
+
+void WinkRelay::closeStandby(bool retry)
+{
+	if (standby.getSocket() != -1)
+	{
+		standby.disconnect();
+	}
+	standbyBroker = -1;
+
+	if (retry)
+	{
+		standbyRetry.countdown_ms(standbyBackoff.next());
+	}
+}
+
+// keep a TCP connection open to the broker we would move to next, and move back to a broker
+// earlier in the list once it has been reachable for a while
+void WinkRelay::maintainStandby()
+{
+	struct pollfd pfd;
+
+	if (config.standby != 1 || brokerCount < 2)
+	{
+		return;
+	}
+
+	if (standbyBroker != -1)
+	{
+		// nothing should arrive before we send a CONNECT, so anything readable means it was closed
+		pfd.fd = standby.getSocket();
+		pfd.events = POLLIN;
+		if (::poll(&pfd, 1, 0) != 0)
+		{
+			LOGD("IPStack - Standby connection to %s:%d closed", brokers[standbyBroker].host, brokers[standbyBroker].port);
+
+			// a broker which drops idle connections shouldn't be reconnected to at once every time
+			if (standbyStable.expired())
+			{
+				standbyBackoff.reset();
+			}
+			closeStandby(true);
+			return;
+		}
+
+		if (standbyBroker < current && failback.expired())
+		{
+			LOGD("MQTT - Failing back to %s:%d", brokers[standbyBroker].host, brokers[standbyBroker].port);
+
+			// not a failure of the current broker, so it keeps its health, and the next
+			// reconnect picks the earlier broker and its standby connection
+			client.disconnect();
+			wasConnected = false;
+			return;
+		}
+	}
+
+	int target = nextBroker(current);
+	if (target != standbyBroker && standbyBroker != -1)
+	{
+		closeStandby(false);
+	}
+
+	if (target != -1 && standbyBroker == -1 && standbyRetry.expired())
+	{
+		int rc = connectStandby(target);
+
+		if (rc == RESOLVE_PENDING)
+		{
+			return;
+		}
+		else if (rc == 0)
+		{
+			LOGD("IPStack - Standby connection to %s:%d", brokers[target].host, brokers[target].port);
+
+			standbyBroker = target;
+			standbyStable.countdown_ms(STABLE_CONNECTION_MS);
+		}
+		else
+		{
+			LOGD("IPStack - Failed standby connection to %s:%d", brokers[target].host, brokers[target].port);
+
+			closeStandby(true);
+			brokers[target].retry.countdown_ms(brokers[target].backoff[(int)ConnectPhase::Network].next());
+		}
+	}
+}
+
+int WinkRelay::reconnect()
+{
+	int rc;
+	int broker;
+
+	if (client.isConnected())
+	{
+		maintainStandby();
+		return 0;
+	}
+
+	if (wasConnected)
+	{
+		LOGD("MQTT - Connection lost");
+
+		wasConnected = false;
+		if (stable.expired())
+		{
+			for (int i = 0; i < brokerCount; i++)
+			{
+				for (int phase = 0; phase < 3; phase++)
+				{
+					brokers[i].backoff[phase].reset();
+				}
+			}
+		}
+
+		// even the first retry of this broker waits a little, or a broker restart brings every relay
+		// back at once.  Any other healthy broker can be tried straight away
+		retryLater(current, ConnectPhase::Network);
+	}
+
+	if ((broker = nextBroker(-1)) == -1)
+	{
+		return -1;
+	}
+
+	current = broker;
+
+	if ((rc = connectNetwork(broker)) == RESOLVE_PENDING)
+	{
+		return rc;
+	}
+
+	connectAttempts++;
+
+	if (rc != 0)
+	{
+		LOGE("IPStack - Failed to connect - %d", rc);
+		retryLater(broker, ConnectPhase::Network);
+		return rc;
+	}
+
+	LOGD("MQTT - Connecting...");
+
+	if ((rc = connectMQTT()) != 0)
+	{
+		retryLater(broker, ConnectPhase::Connect);
+		return rc;
+	}
+
+	if ((rc = subscribe()) != 0)
+	{
+		retryLater(broker, ConnectPhase::Subscribe);
+		return rc;
+	}
+
+	LOGD("MQTT - All ready!");
+
+	wasConnected = true;
+	stable.countdown_ms(STABLE_CONNECTION_MS);
+	failback.countdown(config.failback_interval);
+	return 0;
+}
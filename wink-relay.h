@@ -0,0 +1,449 @@
+#ifndef WINK_RELAY_H
+#define WINK_RELAY_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "MQTTRouter.h"
+#include "linux.cpp"
+#include "wink-payload.h"
+#include "wink-rules.h"
+
+// host builds for many connections can send and receive through io_uring
+#if defined(WINK_USE_IO_URING) && defined(WINK_USE_TLS)
+#error "WINK_USE_IO_URING and WINK_USE_TLS can't be used together"
+#elif defined(WINK_USE_IO_URING)
+#include "uring.cpp"
+
+typedef UringStack NetworkStack;
+typedef UringReader SampleReader;
+#elif defined(WINK_USE_TLS)
+#include "tls.cpp"
+
+typedef TLSStack NetworkStack;
+typedef FileReader SampleReader;
+#else
+typedef IPStack NetworkStack;
+typedef FileReader SampleReader;
+#endif
+
+#define LOG_TAG "WinkHandler"
+
+#if defined(__ANDROID__)
+#include <android/log.h>
+
+#define LOGD(...) __android_log_print(ANDROID_LOG_DEBUG, LOG_TAG, __VA_ARGS__)
+#define LOGE(...) __android_log_print(ANDROID_LOG_ERROR, LOG_TAG, __VA_ARGS__)
+#else
+// host builds log to stderr, and debug messages can be silenced when running many relays
+extern bool logQuiet;
+
+#define LOGD(...) do { if (!logQuiet) { fprintf(stderr, LOG_TAG " D " __VA_ARGS__); fputc('\n', stderr); } } while (0)
+#define LOGE(...) do { fprintf(stderr, LOG_TAG " E " __VA_ARGS__); fputc('\n', stderr); } while (0)
+#endif
+
+struct Configuration
+{
+	char *username;
+	char *password;
+	char *host;
+	char *clientid;
+	char *topic_prefix;
+	char *session_file;
+	char *tls_ca_file;
+	char *tls_cert_file;
+	char *tls_key_file;
+	char *tls_session_file;
+	char *rules_file;
+	char *schedules_file;
+	int port;
+	int screen_timeout;
+	int startup_power_on;
+	int enable_upper_button;
+	int enable_lower_button;
+	int proximity_threshold;
+	int persistent_session;
+	int mqtt_version;
+	int standby;
+	int failback_interval;
+	int dns_ttl;
+	int tls;
+	int command_qos;
+	int command_id_window;
+	RuleTable rules;
+	PayloadFormat relay_format;
+	PayloadFormat switch_format;
+	PayloadFormat sensor_format;
+	PayloadFormat screen_format;
+};
+
+enum class Relay
+{
+	Upper,
+	Lower
+};
+
+/**
+ * Capped exponential backoff with full jitter: the nth delay is random between 0 and
+ * min(cap, base * 2^n), so that a fleet which lost its broker at the same moment spreads
+ * its reconnects out instead of arriving together.
+ */
+class Backoff
+{
+public:
+	Backoff(int base_ms = 1000, int cap_ms = 60000) : base_ms(base_ms), cap_ms(cap_ms), attempts(0), seed(1)
+	{
+	}
+
+	void set(int base_ms, int cap_ms)
+	{
+		this->base_ms = base_ms;
+		this->cap_ms = cap_ms;
+	}
+
+	// each relay needs its own sequence, or they would all jitter the same way
+	void setSeed(unsigned int seed)
+	{
+		this->seed = seed != 0 ? seed : 1;
+	}
+
+	int next()
+	{
+		long long limit = (long long)base_ms << (attempts < 20 ? attempts : 20);
+
+		if (limit > cap_ms)
+			limit = cap_ms;
+		attempts++;
+
+		// xorshift, which is plenty for spreading out retries
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+		return seed % (limit + 1);
+	}
+
+	void reset()
+	{
+		attempts = 0;
+	}
+
+	int getAttempts()
+	{
+		return attempts;
+	}
+
+private:
+	int base_ms;
+	int cap_ms;
+	int attempts;
+	unsigned int seed;
+};
+
+/**
+ * The steps of connecting to the broker.  Each has its own backoff, so a broker which takes the TCP
+ * connection but refuses the MQTT CONNECT is not hit at the rate a missing broker is retried.
+ */
+enum class ConnectPhase
+{
+	Network,
+	Connect,
+	Subscribe
+};
+
+/**
+ * The files poll reads on every pass, all at once, in the order they are given to the reader.
+ */
+enum class Sample
+{
+	UpperRelay,
+	LowerRelay,
+	UpperSwitch,
+	LowerSwitch,
+	Temperature,
+	Humidity,
+	Proximity,
+	Count
+};
+
+#define SAMPLE_SIZE 100
+
+/**
+ * The topics the relay publishes to, under topic_prefix.  Each is encoded once, when the relay is
+ * created, along with the payload format of its group.
+ */
+enum class Topic
+{
+	UpperRelayState,
+	LowerRelayState,
+	RelayStates,
+	UpperSwitch,
+	LowerSwitch,
+	Temperature,
+	Humidity,
+	ScreenState,
+	Count
+};
+
+#define MAX_BROKERS 4
+
+/**
+ * One of the brokers in the host list, and how well it has been doing.  A broker is healthy
+ * when its retry countdown has expired, and the list is tried in order among the healthy ones.
+ */
+struct Broker
+{
+	char host[128];
+	int port;
+	Backoff backoff[3];
+	Countdown retry;
+};
+
+#define COMMAND_IDS 16
+#define MAX_COMMAND_ID 32
+
+/**
+ * The id of a command applied recently, so that a QoS 1 command which the broker sends again,
+ * because our PUBACK went missing, isn't applied twice.
+ */
+struct CommandId
+{
+	char id[MAX_COMMAND_ID];
+	int len;
+	Countdown expiry;
+};
+
+/**
+ * What a relay goes back to at the end of a timed command, unless something else sets it first.
+ */
+struct RelayTimer
+{
+	bool armed;
+	bool on;
+	Countdown expiry;
+};
+
+// the relay commands, under topic_prefix
+MQTT_ROUTE_TOPIC(UpperRelayCommand, "relays/upper");
+MQTT_ROUTE_TOPIC(LowerRelayCommand, "relays/lower");
+MQTT_ROUTE_TOPIC(RelayBatchCommand, "relays/set");
+// retained schedules, one to a topic named for the schedule
+MQTT_ROUTE_TOPIC(ScheduleConfig, "config/schedules/+");
+
+/**
+ * One Wink Relay: its hardware, found under a sysfs root which is empty on the device itself,
+ * and its MQTT connection.  The owner calls poll() and then yield() or, when not connected,
+ * reconnect() in a loop.
+ */
+class WinkRelay
+{
+public:
+	WinkRelay(const Configuration &config, const char *root = "");
+	~WinkRelay();
+
+	// open the hardware, and apply the startup settings
+	void open();
+
+	// one pass through the hardware, publishing any changes
+	void poll();
+
+	// how long, up to max_ms, until poll() next has something to do besides read the hardware
+	int pollTimeout(int max_ms);
+
+	// try to connect, if the backoff allows it yet.  Returns 0 when connected, and RESOLVE_PENDING
+	// rather than waiting while the broker's address is looked up
+	int reconnect();
+
+	// change the backoff of one phase of connecting, for every broker
+	void setBackoff(ConnectPhase phase, int base_ms, int cap_ms)
+	{
+		for (int i = 0; i < brokerCount; i++)
+		{
+			brokers[i].backoff[(int)phase].set(base_ms, cap_ms);
+		}
+	}
+
+	int yield(int timeout_ms)
+	{
+		return client.yield(timeout_ms);
+	}
+
+	bool isConnected()
+	{
+		return client.isConnected();
+	}
+
+	int getSocket()
+	{
+		return ipstack.getSocket();
+	}
+
+	NetworkStack &getNetwork()
+	{
+		return ipstack;
+	}
+
+	const Configuration &getConfig()
+	{
+		return config;
+	}
+
+	unsigned long getPublishCount()
+	{
+		return publishCount;
+	}
+
+	unsigned long getConnectAttempts()
+	{
+		return connectAttempts;
+	}
+
+	// look up broker hosts with a resolver shared with other relays, rather than one of our own
+	void setResolver(Resolver *resolver)
+	{
+		this->resolver = resolver;
+	}
+
+#if defined(WINK_USE_IO_URING)
+	// send, receive and read the hardware through a ring shared with other relays on this thread,
+	// rather than one of our own
+	void setRing(Uring *ring)
+	{
+		ipstack.setRing(ring);
+		reader.setRing(ring);
+	}
+#endif
+
+private:
+	void setRelay(Relay relay, bool on);
+	// writes both relays in one pass, each as 1 or 0, or -1 to leave it as it is
+	void setRelays(int upper, int lower);
+	// sets the relays for a command, as setRelays, and notes the result for the next relays/state
+	void applyCommand(int upper, int lower);
+	// sets relay back to on after duration_ms, unless something else sets it first
+	void startTimer(Relay relay, bool on, int duration_ms);
+	// runs the rules for an event, straight away, whether or not the broker is there
+	void runRules(RuleEvent event, long value);
+	// runs a rule's or a schedule's command
+	void runCommand(RuleTarget target, const RelayCommand &command);
+	// adds, replaces or, with no text, removes a schedule, and saves them if they changed
+	void setSchedule(const char *name, int nameLength, const char *text, int textLength);
+	// works out when each schedule next runs, from now
+	void planSchedules(time_t now);
+	// runs the schedules which are due, and plans their next runs
+	void runSchedules(time_t now);
+	void loadSchedules();
+	void saveSchedules();
+	void onTopicMessage(Relay relay, char *payloadMessage, int payloadLength);
+	void onUpperTopicMessageReceived(MQTT::MessageData &md);
+	void onLowerTopicMessageReceived(MQTT::MessageData &md);
+	void onBatchMessageReceived(MQTT::MessageData &md);
+	void onScheduleMessageReceived(MQTT::MessageData &md);
+	// whether a command hasn't been applied already, by its id, which is kept for relays/state
+	bool isNewCommand(PayloadFormat format, PayloadReader &reader);
+	// remembers the id of the command isNewCommand let through, once it has been applied
+	void recordCommand();
+
+	// the commands and schedules are the only messages subscribed to, so they are routed when built,
+	// not at runtime
+	typedef MQTT::Router<WinkRelay,
+		MQTT::Route<UpperRelayCommand, WinkRelay, &WinkRelay::onUpperTopicMessageReceived>,
+		MQTT::Route<LowerRelayCommand, WinkRelay, &WinkRelay::onLowerTopicMessageReceived>,
+		MQTT::Route<RelayBatchCommand, WinkRelay, &WinkRelay::onBatchMessageReceived>,
+		MQTT::Route<ScheduleConfig, WinkRelay, &WinkRelay::onScheduleMessageReceived> > Routes;
+	// room for a batch command, or the state of both relays, with a command id and a long topic_prefix
+	typedef MQTT::Client<NetworkStack, Countdown, 256, 5, Routes> Client;
+
+	void prepareTopic(Topic topic, const char *name, PayloadFormat format);
+	void publishMessage(Topic topic, const char *payload, int payloadLength, bool retain);
+	void publishState(Topic topic, bool on, bool retain);
+	void publishNumber(Topic topic, const char *name, long value, int scale, bool retain);
+	void publishRelayStates();
+	int openFile(const char *path, int flags);
+	const char *sample(Sample file)
+	{
+		return samples[(int)file];
+	}
+	void parseBrokers();
+	int nextBroker(int skip);
+	int connectNetwork(int broker);
+	int connectStandby(int broker);
+	int connectMQTT();
+	int subscribe();
+	void retryLater(int broker, ConnectPhase phase);
+	void maintainStandby();
+	void closeStandby(bool retry);
+
+	Configuration config;
+	char root[256];
+
+	int upperSwitch, lowerSwitch, input, screen, upperRelay, lowerRelay, temp, humid, prox;
+	SampleReader reader;
+	char samples[(int)Sample::Count][SAMPLE_SIZE];
+	bool upperSwitchState;
+	bool lowerSwitchState;
+	char upperRelayState;
+	char lowerRelayState;
+	// what the relays were last read or set to, which commands such as TOGGLE are applied to
+	bool upperRelayOn;
+	bool lowerRelayOn;
+	RelayTimer timers[2];
+
+	// the buttons' rules and then the configured ones, and whether each one's test was last true
+	RuleTable rules;
+	bool ruleMatched[MAX_RULES];
+
+	// the schedules, and the soonest any of them runs, which is all poll() looks at until then
+	ScheduleTable schedules;
+	time_t nextScheduleAt;
+	// the time of day when poll() last looked, to notice the clock being set back
+	time_t scheduleCheckedAt;
+	int last_input;
+	char screenPower;
+	int last_temperature, last_humidity;
+	long last_proximity;
+	unsigned long publishCount;
+
+	Broker brokers[MAX_BROKERS];
+	int brokerCount;
+	int current;
+
+	// a TCP connection kept open to another broker, ready to take over
+	IPStack standby;
+	int standbyBroker;
+	Backoff standbyBackoff;
+	Countdown standbyRetry;
+	Countdown standbyStable;
+	Countdown failback;
+
+	Resolver ownResolver;
+	Resolver *resolver;
+
+	Countdown stable;
+	bool wasConnected;
+	unsigned long connectAttempts;
+
+	char upperTopic[1024], lowerTopic[1024], batchTopic[1024], scheduleTopic[1024];
+	MQTT::PreparedTopic topics[(int)Topic::Count];
+	PayloadFormat formats[(int)Topic::Count];
+
+	CommandId commandIds[COMMAND_IDS];
+	int nextCommandId;
+
+	// the id, if it had one, and result of the last command, until relays/state reports them
+	CommandId lastCommand;
+	const char *lastResult;
+
+#if defined(WINK_USE_IO_URING)
+	Uring ownRing;
+#endif
+#if defined(WINK_USE_TLS)
+	TLSContext tls;
+#endif
+	NetworkStack ipstack;
+	Routes routes;
+	Client client;
+	FileSessionStore sessionStore;
+	MQTTPacket_connectData data;
+};
+
+#endif
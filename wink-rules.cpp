@@ -0,0 +1,364 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "wink-rules.h"
+#include "wink-payload.h"
+
+// a time such as 500ms, 30s, 1.5m or 2h, which isn't too long for a relay timer
+static bool parseDuration(const char *text, int len, long &duration_ms)
+{
+	int digits = len;
+	int multiplier;
+
+	while (digits > 0 && (text[digits - 1] < '0' || text[digits - 1] > '9'))
+	{
+		digits--;
+	}
+
+	const char *unit = text + digits;
+	int unitLength = len - digits;
+	if (unitLength == 2 && memcmp(unit, "ms", 2) == 0)
+	{
+		multiplier = 1;
+	}
+	else if (unitLength == 1 && (*unit == 's' || *unit == 'm' || *unit == 'h'))
+	{
+		multiplier = *unit == 's' ? 1000 : *unit == 'm' ? 60000 : 3600000;
+	}
+	else
+	{
+		return false;
+	}
+
+	// in thousandths of the unit, so that 1.5s is 1500 ms
+	long thousandths;
+	if (!parseFixed(text, digits, multiplier == 1 ? 0 : 3, thousandths) || thousandths <= 0
+			|| thousandths > (multiplier == 1 ? MAX_RELAY_TIMER_MS : MAX_RELAY_TIMER_MS / multiplier * 1000))
+	{
+		return false;
+	}
+	duration_ms = multiplier == 1 ? thousandths : thousandths * multiplier / 1000;
+	return true;
+}
+
+bool parseRelayCommand(const char *text, int len, RelayCommand &command)
+{
+	command.condition = -1;
+	if (len > 6 && memcmp(text, "IF_ON:", 6) == 0)
+	{
+		command.condition = 1;
+		text += 6;
+		len -= 6;
+	}
+	else if (len > 7 && memcmp(text, "IF_OFF:", 7) == 0)
+	{
+		command.condition = 0;
+		text += 7;
+		len -= 7;
+	}
+
+	const char *colon = (const char *)memchr(text, ':', len);
+	command.duration_ms = 0;
+	if (colon != NULL)
+	{
+		if (!parseDuration(colon + 1, text + len - colon - 1, command.duration_ms))
+		{
+			return false;
+		}
+		len = colon - text;
+	}
+
+	if (len == 2 && memcmp(text, "ON", 2) == 0)
+	{
+		command.action = RelayCommand::On;
+	}
+	else if (len == 3 && memcmp(text, "OFF", 3) == 0)
+	{
+		command.action = RelayCommand::Off;
+	}
+	else if (len == 6 && memcmp(text, "TOGGLE", 6) == 0)
+	{
+		command.action = RelayCommand::Toggle;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+int RelayCommand::target(bool on) const
+{
+	if (condition != -1 && condition != on)
+	{
+		return -1;
+	}
+	return action == Toggle ? !on : action == On;
+}
+
+static bool parseEvent(const char *name, RuleEvent &event)
+{
+	static const struct
+	{
+		const char *name;
+		RuleEvent event;
+	} events[] =
+	{
+		{"upper_switch", RuleEvent::UpperSwitch},
+		{"lower_switch", RuleEvent::LowerSwitch},
+		{"upper_relay", RuleEvent::UpperRelay},
+		{"lower_relay", RuleEvent::LowerRelay},
+		{"temperature", RuleEvent::Temperature},
+		{"humidity", RuleEvent::Humidity},
+		{"proximity", RuleEvent::Proximity},
+	};
+
+	for (unsigned int i = 0; i < sizeof(events) / sizeof(events[0]); i++)
+	{
+		if (strcmp(name, events[i].name) == 0)
+		{
+			event = events[i].event;
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool parseTest(const char *op, RuleTest &test)
+{
+	if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+	{
+		test = RuleTest::Equal;
+	}
+	else if (strcmp(op, "<") == 0)
+	{
+		test = RuleTest::Less;
+	}
+	else if (strcmp(op, "<=") == 0)
+	{
+		test = RuleTest::LessOrEqual;
+	}
+	else if (strcmp(op, ">") == 0)
+	{
+		test = RuleTest::Greater;
+	}
+	else if (strcmp(op, ">=") == 0)
+	{
+		test = RuleTest::GreaterOrEqual;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+// the test after the event, up to the ->, such as "> 70", "ON" or "= OFF", or nothing
+static bool parseCondition(Rule &rule, char **words, int count)
+{
+	rule.test = RuleTest::Any;
+	rule.value = 0;
+	if (count == 0)
+	{
+		return true;
+	}
+
+	switch (rule.event)
+	{
+	case RuleEvent::UpperSwitch:
+	case RuleEvent::LowerSwitch:
+		// a press is all there is to a switch
+		return false;
+
+	case RuleEvent::UpperRelay:
+	case RuleEvent::LowerRelay:
+		if (count == 2 && (strcmp(words[0], "=") == 0 || strcmp(words[0], "==") == 0))
+		{
+			words++;
+			count--;
+		}
+		if (count != 1 || (strcmp(words[0], "ON") != 0 && strcmp(words[0], "OFF") != 0))
+		{
+			return false;
+		}
+		rule.test = RuleTest::Equal;
+		rule.value = strcmp(words[0], "ON") == 0;
+		return true;
+
+	default:
+		// temperature and humidity are read in thousandths, and proximity as it is
+		return count == 2 && parseTest(words[0], rule.test)
+				&& parseFixed(words[1], strlen(words[1]), rule.event == RuleEvent::Proximity ? 0 : 3, rule.value);
+	}
+}
+
+// splits line into words, in place, and finds the ->.  Returns the number of words, or -1 if there
+// are too many or no -> with the target and command after it
+static int splitWords(char *line, char **words, int &arrow)
+{
+	char *save;
+	int count = 0;
+
+	arrow = -1;
+	for (char *word = strtok_r(line, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save))
+	{
+		if (count == 8)
+		{
+			return -1;
+		}
+		if (strcmp(word, "->") == 0)
+		{
+			arrow = count;
+		}
+		words[count++] = word;
+	}
+	return arrow >= 1 && count == arrow + 3 ? count : -1;
+}
+
+// the "target command" after the ->
+static bool parseAction(char **words, RuleTarget &target, RelayCommand &command)
+{
+	if (strcmp(words[0], "upper") == 0)
+	{
+		target = RuleTarget::Upper;
+	}
+	else if (strcmp(words[0], "lower") == 0)
+	{
+		target = RuleTarget::Lower;
+	}
+	else if (strcmp(words[0], "screen") == 0)
+	{
+		target = RuleTarget::Screen;
+	}
+	else
+	{
+		return false;
+	}
+
+	// the screen's own timeout is all the timing it has
+	return parseRelayCommand(words[1], strlen(words[1]), command)
+			&& (target != RuleTarget::Screen || command.duration_ms == 0);
+}
+
+bool addRule(RuleTable &table, const char *text)
+{
+	char line[128];
+	char *words[8];
+	int arrow;
+	Rule rule;
+
+	if (table.count == MAX_RULES || strlen(text) >= sizeof(line))
+	{
+		return false;
+	}
+
+	// event [test] -> target command
+	snprintf(line, sizeof(line), "%s", text);
+	if (splitWords(line, words, arrow) == -1 || !parseEvent(words[0], rule.event)
+			|| !parseCondition(rule, words + 1, arrow - 1) || !parseAction(words + arrow + 1, rule.target, rule.command))
+	{
+		return false;
+	}
+
+	table.rules[table.count++] = rule;
+	return true;
+}
+
+// daily, weekdays, weekends, or days such as mon,wed,fri
+static bool parseDays(char *text, unsigned char &days)
+{
+	static const char *const names[] = {"sun", "mon", "tue", "wed", "thu", "fri", "sat"};
+	char *save;
+
+	if (strcmp(text, "daily") == 0)
+	{
+		days = 0x7f;
+		return true;
+	}
+	if (strcmp(text, "weekdays") == 0)
+	{
+		days = 0x3e;
+		return true;
+	}
+	if (strcmp(text, "weekends") == 0)
+	{
+		days = 0x41;
+		return true;
+	}
+
+	days = 0;
+	for (char *day = strtok_r(text, ",", &save); day != NULL; day = strtok_r(NULL, ",", &save))
+	{
+		int i = 0;
+		while (i < 7 && strcmp(day, names[i]) != 0)
+		{
+			i++;
+		}
+		if (i == 7)
+		{
+			return false;
+		}
+		days |= 1 << i;
+	}
+	return days != 0;
+}
+
+bool parseSchedule(const char *text, Schedule &schedule)
+{
+	char line[MAX_SCHEDULE_TEXT];
+	char *words[8];
+	int arrow, hour, minute, end = 0;
+
+	if (strlen(text) >= sizeof(line))
+	{
+		return false;
+	}
+
+	// HH:MM [days] -> target command
+	snprintf(line, sizeof(line), "%s", text);
+	if (splitWords(line, words, arrow) == -1 || arrow > 2
+			|| sscanf(words[0], "%2d:%2d%n", &hour, &minute, &end) != 2 || words[0][end] != '\0'
+			|| hour < 0 || hour > 23 || minute < 0 || minute > 59)
+	{
+		return false;
+	}
+
+	schedule.days = 0x7f;
+	if ((arrow == 2 && !parseDays(words[1], schedule.days)) || !parseAction(words + arrow + 1, schedule.target, schedule.command))
+	{
+		return false;
+	}
+	schedule.minute = hour * 60 + minute;
+	snprintf(schedule.text, sizeof(schedule.text), "%s", text);
+	return true;
+}
+
+time_t nextScheduleTime(const Schedule &schedule, time_t now)
+{
+	struct tm today;
+
+	localtime_r(&now, &today);
+
+	// mktime works out the date and the daylight saving time for each day, so a day is never taken
+	// to be 24 hours, and a time which a change to summer time skips runs an hour later.  Today is
+	// left out once the clock has reached the time, so the hour a change to winter time repeats
+	// doesn't run it twice
+	for (int day = today.tm_hour * 60 + today.tm_min < schedule.minute ? 0 : 1; day <= 7; day++)
+	{
+		struct tm when = today;
+		when.tm_mday += day;
+		when.tm_hour = schedule.minute / 60;
+		when.tm_min = schedule.minute % 60;
+		when.tm_sec = 0;
+		when.tm_isdst = -1;
+
+		time_t next = mktime(&when);
+		if (next > now && (schedule.days & (1 << when.tm_wday)) != 0)
+		{
+			return next;
+		}
+	}
+
+	// only when there are no days, which parseSchedule doesn't allow
+	return now + 7 * 24 * 60 * 60;
+}
@@ -0,0 +1,146 @@
+#ifndef WINK_RULES_H
+#define WINK_RULES_H
+
+#include <time.h>
+
+// the longest a timed command, such as ON:30s, can run for
+#define MAX_RELAY_TIMER_MS (24 * 60 * 60 * 1000)
+
+#define MAX_RULES 16
+
+#define MAX_SCHEDULES 16
+#define MAX_SCHEDULE_NAME 32
+#define MAX_SCHEDULE_TEXT 128
+// how late, in seconds, a schedule still runs, as after a slow reconnect.  Any later and the clock
+// has been set forward past it, as it is at boot, and it waits for its next time
+#define SCHEDULE_GRACE 300
+
+/**
+ * A relay command, such as ON, TOGGLE, IF_OFF:ON or ON:30s, as sent over MQTT or run by a rule.
+ */
+struct RelayCommand
+{
+	enum Action
+	{
+		Off,
+		On,
+		Toggle
+	};
+
+	// -1 to apply to the relay whatever it is, or 1 or 0 to apply only while it is on, or off
+	int condition;
+	Action action;
+	// to be undone after this long, or 0 to stay
+	long duration_ms;
+
+	// what a relay which is on now is to be set to, or -1 to leave it alone
+	int target(bool on) const;
+};
+
+// ON, OFF or TOGGLE, alone or after IF_ON: or IF_OFF:, and followed by :30s or the like to be undone
+// after that long, in ms, s, m or h
+bool parseRelayCommand(const char *text, int len, RelayCommand &command);
+
+/**
+ * What a rule runs on.  Switches are pressed, relays change, and the sensors change value.
+ */
+enum class RuleEvent
+{
+	UpperSwitch,
+	LowerSwitch,
+	UpperRelay,
+	LowerRelay,
+	Temperature,
+	Humidity,
+	Proximity
+};
+
+enum class RuleTest
+{
+	Any,
+	Equal,
+	Less,
+	LessOrEqual,
+	Greater,
+	GreaterOrEqual
+};
+
+enum class RuleTarget
+{
+	Upper,
+	Lower,
+	Screen
+};
+
+/**
+ * One rule, such as "humidity > 70 -> lower ON".  A rule with a test runs as the test becomes true,
+ * and not again until it has been false, and one without runs on every event.
+ */
+struct Rule
+{
+	RuleEvent event;
+	RuleTest test;
+	// relays are 1 or 0, and sensors are in thousandths, as they are read
+	long value;
+	RuleTarget target;
+	RelayCommand command;
+
+	bool matches(long eventValue) const
+	{
+		switch (test)
+		{
+		case RuleTest::Equal: return eventValue == value;
+		case RuleTest::Less: return eventValue < value;
+		case RuleTest::LessOrEqual: return eventValue <= value;
+		case RuleTest::Greater: return eventValue > value;
+		case RuleTest::GreaterOrEqual: return eventValue >= value;
+		default: return true;
+		}
+	}
+};
+
+/**
+ * The rules, compiled once when the configuration is read, in the order they are to run.
+ */
+struct RuleTable
+{
+	Rule rules[MAX_RULES];
+	int count;
+};
+
+// compiles a rule such as "lower_switch -> upper TOGGLE" onto the end of the table.  Returns false,
+// leaving the table alone, if it isn't a rule or the table is full
+bool addRule(RuleTable &table, const char *text);
+
+/**
+ * A command run at a time of day, in local time, such as "18:00 weekdays -> upper ON".  It keeps
+ * the text it was compiled from, and its name, so that it can be saved and replaced.
+ */
+struct Schedule
+{
+	char name[MAX_SCHEDULE_NAME];
+	char text[MAX_SCHEDULE_TEXT];
+	// minutes after midnight
+	int minute;
+	// a bit for each day it runs on, from Sunday as bit 0, as tm_wday counts
+	unsigned char days;
+	RuleTarget target;
+	RelayCommand command;
+	// when it next runs
+	time_t next;
+};
+
+struct ScheduleTable
+{
+	Schedule schedules[MAX_SCHEDULES];
+	int count;
+};
+
+// compiles "HH:MM [days] -> target command" into schedule, leaving its name alone.  The days are
+// daily, weekdays, weekends or a list such as mon,wed,fri, and daily if they are left out
+bool parseSchedule(const char *text, Schedule &schedule);
+
+// the first time after now that schedule runs, whatever the clocks have done in between
+time_t nextScheduleTime(const Schedule &schedule, time_t now);
+
+#endif
@@ -0,0 +1,130 @@
+/*
+ * Prints the messages on a topic filter, through a CoClient: a sample of the coroutine client,
+ * built for the host with C++20.
+ *
+ * One coroutine connects, subscribes and then watches the connection, connecting again a second
+ * after it is lost, and reads in order as if it blocked.  The executor runs it alongside the
+ * client's own reader and keepalive on the one thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "linux.cpp"
+#include "MQTTClient.h"
+#include "coroutine.cpp"
+
+#if !defined(__cpp_impl_coroutine)
+#error "wink-sub needs a compiler with C++20 coroutines"
+#endif
+
+struct Options
+{
+	const char *host;
+	int port;
+	const char *filter;
+	int qos;
+	const char *clientid;
+	int mqttVersion;
+};
+
+static Options options = {"localhost", 1883, "wink/#", 1, "wink-sub", 4};
+
+typedef CoClient<IPStack, 256> Client;
+
+static void onMessage(MQTT::MessageData &md)
+{
+	MQTT::Message &message = md.message;
+
+	printf("%.*s %.*s\n", md.topicName.lenstring.len, md.topicName.lenstring.data, (int)message.payloadlen, (char *)message.payload);
+	fflush(stdout);
+}
+
+static CoTask session(CoExecutor &executor, IPStack &ipstack, Client &client)
+{
+	MQTTPacket_connectData data = MQTTPacket_connectData_initializer;
+
+	data.clientID.cstring = (char *)options.clientid;
+	data.keepAliveInterval = 10;
+	data.MQTTVersion = options.mqttVersion;
+
+	while (true)
+	{
+		int rc = ipstack.connect(options.host, options.port);
+		if (rc == 0)
+		{
+			rc = co_await client.connect(data);
+		}
+		if (rc == MQTT::SUCCESS)
+		{
+			if (co_await client.subscribe(options.filter, (enum MQTT::QoS)options.qos, onMessage) == MQTT::SUCCESS)
+			{
+				fprintf(stderr, "Subscribed to %s on %s:%d\n", options.filter, options.host, options.port);
+
+				// the client closes the network itself when the broker goes away
+				while (client.isConnected())
+				{
+					co_await executor.sleep(1000);
+				}
+				fprintf(stderr, "Connection to %s:%d lost\n", options.host, options.port);
+			}
+			else
+			{
+				fprintf(stderr, "Can't subscribe to %s\n", options.filter);
+				co_await client.disconnect();
+			}
+		}
+		else
+		{
+			// whatever a failed connect left open, as a failed CONNECT has closed it already
+			ipstack.disconnect();
+		}
+
+		co_await executor.sleep(1000);
+	}
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: wink-sub [options]\n"
+			"  -h host      broker host (localhost)\n"
+			"  -p port      broker port (1883)\n"
+			"  -t filter    topic filter to subscribe to (wink/#)\n"
+			"  -q qos       QoS to subscribe at, 0, 1 or 2 (1)\n"
+			"  -i clientid  client id (wink-sub)\n"
+			"  -5           connect with MQTT 5\n");
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "h:p:t:q:i:5")) != -1)
+	{
+		switch (c)
+		{
+		case 'h': options.host = optarg; break;
+		case 'p': options.port = atoi(optarg); break;
+		case 't': options.filter = optarg; break;
+		case 'q': options.qos = atoi(optarg); break;
+		case 'i': options.clientid = optarg; break;
+		case '5': options.mqttVersion = 5; break;
+		default: usage(); return 1;
+		}
+	}
+	if (options.qos < 0 || options.qos > 2)
+	{
+		usage();
+		return 1;
+	}
+
+	CoExecutor executor;
+	IPStack ipstack;
+	Client client(executor, ipstack);
+
+	executor.spawn(session(executor, ipstack, client));
+	executor.run();
+	return 0;
+}